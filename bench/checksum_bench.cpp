@@ -0,0 +1,151 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+//
+// A program that checks each of the XOR checksum kernels that the processor
+// supports against a byte-at-a-time reference, over every length up to a
+// few blocks and every alignment of the source and destination, and then
+// times them on a Flash block and on a 4MB image.  The exit status is
+// non-zero if any kernel gives a wrong result.
+//
+
+/** include files **/
+#include "checksum.h"
+#include "esp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** local definitions **/
+#define CHECK_MAX_LEN				(3 * ESP_FLASH_BLK_SIZE)	// the longest block checked
+#define CHECK_MAX_OFST				64			// the alignments checked
+#define TIME_BYTES					(64UL << 20)	// the data processed by each timing
+#define IMAGE_SIZE					(4UL << 20)	// the size of a large image
+
+/** internal functions **/
+static uint8_t reference(const uint8_t *data, size_t len);
+static unsigned check(const XorKernel_t& kernel, const uint8_t *src, uint8_t *dst);
+static void timeKernel(const XorKernel_t& kernel, const uint8_t *src, uint8_t *dst, size_t len);
+
+/** private data **/
+
+// prevents the timed calls from being optimized away
+static volatile uint8_t sink;
+
+/** public functions **/
+
+int
+main()
+{
+	const XorKernel_t *kernel;
+	unsigned kernelCnt = XorKernels(&kernel);
+	unsigned errCnt = 0;
+	unsigned i;
+
+	// a fixed seed makes the results reproducible
+	uint8_t *src = new uint8_t[IMAGE_SIZE + CHECK_MAX_OFST];
+	uint8_t *dst = new uint8_t[IMAGE_SIZE + CHECK_MAX_OFST + 1];
+	srand(1);
+	for (i = 0; i < IMAGE_SIZE + CHECK_MAX_OFST; i++)
+		src[i] = (uint8_t)rand();
+
+	for (i = 0; i < kernelCnt; i++)
+	{
+		unsigned cnt = check(kernel[i], src, dst);
+		printf("%-8s %u mismatches\n", kernel[i].name, cnt);
+		errCnt += cnt;
+	}
+	printf("XorBytes() and XorCopy() use the %s kernel.\n\n", kernel[kernelCnt - 1].name);
+
+	for (i = 0; i < kernelCnt; i++)
+	{
+		timeKernel(kernel[i], src, dst, ESP_FLASH_BLK_SIZE);
+		timeKernel(kernel[i], src, dst, IMAGE_SIZE);
+	}
+
+	delete[] src;
+	delete[] dst;
+	return(errCnt ? 1 : 0);
+}
+
+/** internal functions **/
+
+//
+// Compute the XOR of a block of bytes one byte at a time.
+//
+static uint8_t
+reference(const uint8_t *data, size_t len)
+{
+	uint8_t cksum = 0;
+	while (len--)
+		cksum ^= *data++;
+	return(cksum);
+}
+
+//
+// Check a kernel against the reference for each length and alignment,
+// also checking that the copy is exact and writes nothing beyond the end
+// of the destination.  The return value is the number of mismatches.
+//
+static unsigned
+check(const XorKernel_t& kernel, const uint8_t *src, uint8_t *dst)
+{
+	unsigned errCnt = 0;
+
+	for (size_t ofst = 0; ofst < CHECK_MAX_OFST; ofst++)
+	{
+		// the destination is misaligned differently from the source
+		size_t dstOfst = ofst ^ 5;
+		for (size_t len = 0; len <= CHECK_MAX_LEN; len++)
+		{
+			uint8_t expect = reference(src + ofst, len);
+			if (kernel.xorBytes(src + ofst, len) != expect)
+				errCnt++;
+
+			memset(dst + dstOfst, 0, len + 1);
+			if ((kernel.xorCopy(dst + dstOfst, src + ofst, len) != expect) ||
+					(memcmp(dst + dstOfst, src + ofst, len) != 0) || (dst[dstOfst + len] != 0))
+				errCnt++;
+		}
+	}
+	return(errCnt);
+}
+
+//
+// Report the throughput of a kernel for blocks of a given size.
+//
+static void
+timeKernel(const XorKernel_t& kernel, const uint8_t *src, uint8_t *dst, size_t len)
+{
+	unsigned reps = (unsigned)(TIME_BYTES / len);
+	unsigned tick;
+	unsigned i;
+
+	tick = getTickCount();
+	for (i = 0; i < reps; i++)
+		sink = kernel.xorBytes(src, len);
+	unsigned msXor = getTickCount() - tick;
+
+	tick = getTickCount();
+	for (i = 0; i < reps; i++)
+		sink = kernel.xorCopy(dst, src, len);
+	unsigned msCopy = getTickCount() - tick;
+
+	printf("%-8s %7lu bytes: XorBytes %7.0f MB/s, XorCopy %7.0f MB/s\n", kernel.name, (unsigned long)len,
+			msXor ? (TIME_BYTES / 1000.0 / msXor) : 0.0, msCopy ? (TIME_BYTES / 1000.0 / msCopy) : 0.0);
+}
@@ -0,0 +1,197 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+//
+// A program that times building a 4MB combined image in a virtual file,
+// both padded and sparse, from 16K images, and writing 4MB to a virtual
+// file a byte and a block at a time, with and without reserving the space
+// first.  The exit status is non-zero if any of the files has the wrong
+// size or content.
+//
+
+/** include files **/
+#include "esp.h"
+#include "elf.h"
+#include <stdio.h>
+#include <string.h>
+
+/** local definitions **/
+#define IMAGE_SIZE					0x4000		// the size of each image added
+#define IMAGE_CNT					256			// the images in the combined image
+#define FILE_SIZE					(IMAGE_SIZE * IMAGE_CNT)
+#define TIME_REPS					8			// the times each file is built
+
+/** internal functions **/
+static bool buildCombined(ESP& esp, const uint8_t *image, bool padded, uint32_t& size);
+static bool writeBytes(bool reserve);
+static bool writeBlocks(const uint8_t *image, bool reserve);
+static bool report(const char *what, unsigned tick, bool ok);
+
+/** private data **/
+
+static uint8_t image[IMAGE_SIZE];
+
+/** public functions **/
+
+int
+main()
+{
+	ESP esp;
+	unsigned errCnt = 0;
+	unsigned tick;
+	uint32_t size;
+	unsigned i;
+	bool ok;
+
+	esp.SetFlags(ESP_QUIET);
+
+	for (i = 0; i < sizeof(image); i++)
+		image[i] = (uint8_t)(i * 7);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = buildCombined(esp, image, true, size) && (size == FILE_SIZE);
+	errCnt += !report("padded combined image", tick, ok);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = buildCombined(esp, image, false, size) && (size > FILE_SIZE);
+	errCnt += !report("sparse combined image", tick, ok);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = writeBytes(false);
+	errCnt += !report("bytes", tick, ok);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = writeBytes(true);
+	errCnt += !report("bytes, reserved", tick, ok);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = writeBlocks(image, false);
+	errCnt += !report("1K blocks", tick, ok);
+
+	tick = getTickCount();
+	for (i = 0, ok = true; ok && (i < TIME_REPS); i++)
+		ok = writeBlocks(image, true);
+	errCnt += !report("1K blocks, reserved", tick, ok);
+
+	return(errCnt ? 1 : 0);
+}
+
+/** internal functions **/
+
+//
+// Build a combined image in a virtual file from copies of an image at
+// successive addresses, checking the content of a padded one.  The return
+// value is true if it was built correctly, its size being returned
+// indirectly.
+//
+static bool
+buildCombined(ESP& esp, const uint8_t *image, bool padded, uint32_t& size)
+{
+	VFile vfOut;
+	unsigned i;
+
+	if (vfOut.Open("combined") != 0)
+		return(false);
+	for (i = 0; i < IMAGE_CNT; i++)
+	{
+		VFile vfImage;
+		if ((vfImage.Open(image, IMAGE_SIZE, "image") != 0) ||
+				(esp.AddImage(vfOut, vfImage, i * IMAGE_SIZE, padded) != 0))
+			return(false);
+	}
+	size = (uint32_t)vfOut.Size();
+	if (padded)
+	{
+		const uint8_t *data = vfOut.Data();
+		for (i = 0; i < IMAGE_CNT; i++)
+		{
+			if (memcmp(data + i * IMAGE_SIZE, image, IMAGE_SIZE) != 0)
+				return(false);
+		}
+	}
+	return(true);
+}
+
+//
+// Write a virtual file a byte at a time, optionally reserving the space
+// first.  The return value is true if its content is correct.
+//
+static bool
+writeBytes(bool reserve)
+{
+	VFile vf;
+	uint32_t i;
+
+	if ((vf.Open("bytes") != 0) || (reserve && (vf.Reserve(FILE_SIZE) != 0)))
+		return(false);
+	for (i = 0; i < FILE_SIZE; i++)
+	{
+		uint8_t c = (uint8_t)i;
+		if (vf.Write(&c, 1) != 1)
+			return(false);
+	}
+	const uint8_t *data = vf.Data();
+	for (i = 0; i < FILE_SIZE; i++)
+	{
+		if (data[i] != (uint8_t)i)
+			return(false);
+	}
+	return(vf.Size() == FILE_SIZE);
+}
+
+//
+// Write a virtual file a Flash block at a time, optionally reserving the
+// space first.  The return value is true if its content is correct.
+//
+static bool
+writeBlocks(const uint8_t *image, bool reserve)
+{
+	VFile vf;
+	uint32_t ofst;
+
+	if ((vf.Open("blocks") != 0) || (reserve && (vf.Reserve(FILE_SIZE) != 0)))
+		return(false);
+	for (ofst = 0; ofst < FILE_SIZE; ofst += ESP_FLASH_BLK_SIZE)
+	{
+		if (vf.Write(image + ofst % IMAGE_SIZE, ESP_FLASH_BLK_SIZE) != ESP_FLASH_BLK_SIZE)
+			return(false);
+	}
+	const uint8_t *data = vf.Data();
+	for (ofst = 0; ofst < FILE_SIZE; ofst += IMAGE_SIZE)
+	{
+		if (memcmp(data + ofst, image, IMAGE_SIZE) != 0)
+			return(false);
+	}
+	return(vf.Size() == FILE_SIZE);
+}
+
+//
+// Output the average time taken to build a file since a given time.  The
+// return value is the result of the checks, which is also output.
+//
+static bool
+report(const char *what, unsigned tick, bool ok)
+{
+	printf("%-24s %7.1f ms%s\n", what, (double)(getTickCount() - tick) / TIME_REPS, ok ? "" : "  FAILED");
+	return(ok);
+}
@@ -0,0 +1,383 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+/** include files **/
+#include "checksum.h"
+#include <string.h>
+
+/** local definitions **/
+
+// the number of bytes processed by each step of the word-wise loops
+#define XOR_STEP					(4 * sizeof(uint32_t))
+
+//
+// The vector kernels that may be built depend on the compiler and the
+// target.  On x86 the SSE2 and AVX2 kernels are compiled for those
+// instruction sets regardless of the options for the rest of the program
+// and one is selected at run time if the processor supports it.  NEON is
+// selected whenever the target has it.
+//
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+		((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)) || defined(__clang__))
+  #define XOR_SSE2
+  #define XOR_AVX2
+  #define XOR_TARGET(isa)			__attribute__((target(isa)))
+  #include <immintrin.h>
+#elif defined(_MSC_VER) && (_MSC_VER >= 1400) && (defined(_M_IX86) || defined(_M_X64))
+  #define XOR_SSE2
+  #if (_MSC_VER >= 1700)
+	#define XOR_AVX2
+	#include <immintrin.h>
+  #else
+	#include <emmintrin.h>
+  #endif
+  #define XOR_TARGET(isa)
+  #include <intrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+  #define XOR_NEON
+  #include <arm_neon.h>
+#endif
+
+/** internal functions **/
+static unsigned supportedKernels();
+static uint8_t fold(uint32_t acc);
+static uint8_t xorScalar(const uint8_t *data, size_t len);
+static uint8_t copyScalar(uint8_t *dst, const uint8_t *src, size_t len);
+#if defined(XOR_SSE2)
+XOR_TARGET("sse2") static uint8_t xorSSE2(const uint8_t *data, size_t len);
+XOR_TARGET("sse2") static uint8_t copySSE2(uint8_t *dst, const uint8_t *src, size_t len);
+#endif
+#if defined(XOR_AVX2)
+XOR_TARGET("avx2") static uint8_t xorAVX2(const uint8_t *data, size_t len);
+XOR_TARGET("avx2") static uint8_t copyAVX2(uint8_t *dst, const uint8_t *src, size_t len);
+#endif
+#if defined(XOR_NEON)
+static uint8_t xorNEON(const uint8_t *data, size_t len);
+static uint8_t copyNEON(uint8_t *dst, const uint8_t *src, size_t len);
+#endif
+
+/** private data **/
+
+// the kernels in order of preference, each requiring the instruction sets
+// of those before it
+static const XorKernel_t kernelTab[] =
+{
+	{ "scalar", xorScalar, copyScalar },
+#if defined(XOR_SSE2)
+	{ "sse2", xorSSE2, copySSE2 },
+#endif
+#if defined(XOR_AVX2)
+	{ "avx2", xorAVX2, copyAVX2 },
+#endif
+#if defined(XOR_NEON)
+	{ "neon", xorNEON, copyNEON },
+#endif
+};
+
+// The number of kernels that the processor supports and the one in use,
+// chosen during static initialization so that no thread sees them change.
+static const unsigned kernelCnt = supportedKernels();
+static const XorKernel_t *kernel = &kernelTab[kernelCnt - 1];
+
+/** public functions **/
+
+//
+// Compute the XOR of a block of bytes, combined with an initial value.
+//
+uint8_t
+XorBytes(const uint8_t *data, size_t len, uint8_t cksum)
+{
+	return(cksum ^ kernel->xorBytes(data, len));
+}
+
+//
+// Copy a block of bytes, returning their XOR combined with an initial
+// value.  The blocks must not overlap.
+//
+uint8_t
+XorCopy(uint8_t *dst, const uint8_t *src, size_t len, uint8_t cksum)
+{
+	return(cksum ^ kernel->xorCopy(dst, src, len));
+}
+
+//
+// Get the kernels that the processor supports, the last being the one
+// used by XorBytes() and XorCopy().  The return value is their number.
+//
+unsigned
+XorKernels(const XorKernel_t **kernels)
+{
+	if (kernels != NULL)
+		*kernels = kernelTab;
+	return(kernelCnt);
+}
+
+/** internal functions **/
+
+//
+// Determine how many of the kernels the processor supports.
+//
+static unsigned
+supportedKernels()
+{
+	unsigned cnt = 1;
+
+#if defined(XOR_SSE2) && defined(__GNUC__)
+	// this may run before the constructor that initializes the CPU model
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		cnt++;
+		if (__builtin_cpu_supports("avx2"))
+			cnt++;
+	}
+#elif defined(XOR_SSE2)
+	int info[4];
+	__cpuid(info, 1);
+	if (info[3] & (1 << 26))
+	{
+		cnt++;
+  #if defined(XOR_AVX2)
+		// AVX2 also requires that the system save the upper halves of the registers
+		bool osSave = ((info[2] & (1 << 27)) != 0) && ((_xgetbv(0) & 0x06) == 0x06);
+		__cpuid(info, 0);
+		if (osSave && (info[0] >= 7))
+		{
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5))
+				cnt++;
+		}
+  #endif
+	}
+#elif defined(XOR_NEON)
+	cnt++;
+#endif
+	return(cnt);
+}
+
+//
+// Reduce a word of XORed bytes to the XOR of its bytes.
+//
+static uint8_t
+fold(uint32_t acc)
+{
+	acc ^= acc >> 16;
+	acc ^= acc >> 8;
+	return((uint8_t)acc);
+}
+
+//
+// Compute the XOR of a block of bytes a word at a time.
+//
+static uint8_t
+xorScalar(const uint8_t *data, size_t len)
+{
+	uint32_t acc = 0;
+	uint32_t w[4];
+	uint8_t cksum = 0;
+
+	// the words are loaded with memcpy() as the data may be unaligned
+	for ( ; len >= XOR_STEP; data += XOR_STEP, len -= XOR_STEP)
+	{
+		memcpy(w, data, XOR_STEP);
+		acc ^= w[0] ^ w[1] ^ w[2] ^ w[3];
+	}
+	while (len--)
+		cksum ^= *data++;
+	return(cksum ^ fold(acc));
+}
+
+//
+// Copy a block of bytes a word at a time, returning their XOR.
+//
+static uint8_t
+copyScalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint32_t acc = 0;
+	uint32_t w[4];
+	uint8_t cksum = 0;
+
+	for ( ; len >= XOR_STEP; src += XOR_STEP, dst += XOR_STEP, len -= XOR_STEP)
+	{
+		memcpy(w, src, XOR_STEP);
+		memcpy(dst, w, XOR_STEP);
+		acc ^= w[0] ^ w[1] ^ w[2] ^ w[3];
+	}
+	while (len--)
+		cksum ^= (*dst++ = *src++);
+	return(cksum ^ fold(acc));
+}
+
+#if defined(XOR_SSE2)
+//
+// Compute the XOR of a block of bytes using SSE2.  Four accumulators keep
+// successive loads independent; the remainder is left to xorScalar().
+//
+XOR_TARGET("sse2") static uint8_t
+xorSSE2(const uint8_t *data, size_t len)
+{
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	__m128i acc2 = _mm_setzero_si128();
+	__m128i acc3 = _mm_setzero_si128();
+	for ( ; len >= 64; data += 64, len -= 64)
+	{
+		acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i *)data));
+		acc1 = _mm_xor_si128(acc1, _mm_loadu_si128((const __m128i *)(data + 16)));
+		acc2 = _mm_xor_si128(acc2, _mm_loadu_si128((const __m128i *)(data + 32)));
+		acc3 = _mm_xor_si128(acc3, _mm_loadu_si128((const __m128i *)(data + 48)));
+	}
+	for ( ; len >= 16; data += 16, len -= 16)
+		acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i *)data));
+	acc0 = _mm_xor_si128(_mm_xor_si128(acc0, acc1), _mm_xor_si128(acc2, acc3));
+
+	uint32_t w[4];
+	_mm_storeu_si128((__m128i *)w, acc0);
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3]) ^ xorScalar(data, len));
+}
+
+//
+// Copy a block of bytes using SSE2, returning their XOR.
+//
+XOR_TARGET("sse2") static uint8_t
+copySSE2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	for ( ; len >= 32; src += 32, dst += 32, len -= 32)
+	{
+		__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)dst, v0);
+		_mm_storeu_si128((__m128i *)(dst + 16), v1);
+		acc0 = _mm_xor_si128(acc0, v0);
+		acc1 = _mm_xor_si128(acc1, v1);
+	}
+	acc0 = _mm_xor_si128(acc0, acc1);
+
+	uint32_t w[4];
+	_mm_storeu_si128((__m128i *)w, acc0);
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3]) ^ copyScalar(dst, src, len));
+}
+#endif
+
+#if defined(XOR_AVX2)
+//
+// Compute the XOR of a block of bytes using AVX2.
+//
+XOR_TARGET("avx2") static uint8_t
+xorAVX2(const uint8_t *data, size_t len)
+{
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	__m256i acc2 = _mm256_setzero_si256();
+	__m256i acc3 = _mm256_setzero_si256();
+	for ( ; len >= 128; data += 128, len -= 128)
+	{
+		acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i *)data));
+		acc1 = _mm256_xor_si256(acc1, _mm256_loadu_si256((const __m256i *)(data + 32)));
+		acc2 = _mm256_xor_si256(acc2, _mm256_loadu_si256((const __m256i *)(data + 64)));
+		acc3 = _mm256_xor_si256(acc3, _mm256_loadu_si256((const __m256i *)(data + 96)));
+	}
+	for ( ; len >= 32; data += 32, len -= 32)
+		acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i *)data));
+	acc0 = _mm256_xor_si256(_mm256_xor_si256(acc0, acc1), _mm256_xor_si256(acc2, acc3));
+
+	uint32_t w[8];
+	_mm256_storeu_si256((__m256i *)w, acc0);
+	_mm256_zeroupper();
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3] ^ w[4] ^ w[5] ^ w[6] ^ w[7]) ^ xorScalar(data, len));
+}
+
+//
+// Copy a block of bytes using AVX2, returning their XOR.
+//
+XOR_TARGET("avx2") static uint8_t
+copyAVX2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	for ( ; len >= 64; src += 64, dst += 64, len -= 64)
+	{
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_si256((__m256i *)dst, v0);
+		_mm256_storeu_si256((__m256i *)(dst + 32), v1);
+		acc0 = _mm256_xor_si256(acc0, v0);
+		acc1 = _mm256_xor_si256(acc1, v1);
+	}
+	acc0 = _mm256_xor_si256(acc0, acc1);
+
+	uint32_t w[8];
+	_mm256_storeu_si256((__m256i *)w, acc0);
+	_mm256_zeroupper();
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3] ^ w[4] ^ w[5] ^ w[6] ^ w[7]) ^ copyScalar(dst, src, len));
+}
+#endif
+
+#if defined(XOR_NEON)
+//
+// Compute the XOR of a block of bytes using NEON.
+//
+static uint8_t
+xorNEON(const uint8_t *data, size_t len)
+{
+	uint8x16_t acc0 = vdupq_n_u8(0);
+	uint8x16_t acc1 = vdupq_n_u8(0);
+	uint8x16_t acc2 = vdupq_n_u8(0);
+	uint8x16_t acc3 = vdupq_n_u8(0);
+	for ( ; len >= 64; data += 64, len -= 64)
+	{
+		acc0 = veorq_u8(acc0, vld1q_u8(data));
+		acc1 = veorq_u8(acc1, vld1q_u8(data + 16));
+		acc2 = veorq_u8(acc2, vld1q_u8(data + 32));
+		acc3 = veorq_u8(acc3, vld1q_u8(data + 48));
+	}
+	for ( ; len >= 16; data += 16, len -= 16)
+		acc0 = veorq_u8(acc0, vld1q_u8(data));
+	acc0 = veorq_u8(veorq_u8(acc0, acc1), veorq_u8(acc2, acc3));
+
+	uint32_t w[4];
+	vst1q_u32(w, vreinterpretq_u32_u8(acc0));
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3]) ^ xorScalar(data, len));
+}
+
+//
+// Copy a block of bytes using NEON, returning their XOR.
+//
+static uint8_t
+copyNEON(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8x16_t acc0 = vdupq_n_u8(0);
+	uint8x16_t acc1 = vdupq_n_u8(0);
+	for ( ; len >= 32; src += 32, dst += 32, len -= 32)
+	{
+		uint8x16_t v0 = vld1q_u8(src);
+		uint8x16_t v1 = vld1q_u8(src + 16);
+		vst1q_u8(dst, v0);
+		vst1q_u8(dst + 16, v1);
+		acc0 = veorq_u8(acc0, v0);
+		acc1 = veorq_u8(acc1, v1);
+	}
+	acc0 = veorq_u8(acc0, acc1);
+
+	uint32_t w[4];
+	vst1q_u32(w, vreinterpretq_u32_u8(acc0));
+	return(fold(w[0] ^ w[1] ^ w[2] ^ w[3]) ^ copyScalar(dst, src, len));
+}
+#endif
@@ -0,0 +1,51 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(CHECKSUM_H__)
+#define CHECKSUM_H__
+
+#include "sysdep.h"
+#include <stddef.h>
+
+#if defined(HAVE_STDINT_H)
+  #include <stdint.h>
+#endif
+
+//
+// Functions that compute the 8-bit XOR checksum used by the ESP8266 ROM
+// over a block of data.  The data is processed a word at a time rather
+// than a byte at a time.  XorCopy() also copies the data in the same pass
+// so that data being written need be read only once.
+//
+// The functions use the fastest of several kernels that the processor
+// supports.  XorKernels() lists them so that each may be tested and timed.
+//
+uint8_t XorBytes(const uint8_t *data, size_t len, uint8_t cksum = 0);
+uint8_t XorCopy(uint8_t *dst, const uint8_t *src, size_t len, uint8_t cksum = 0);
+
+// an implementation of XorBytes() and XorCopy()
+typedef struct
+{
+	const char *name;			// the instruction set used
+	uint8_t (*xorBytes)(const uint8_t *data, size_t len);
+	uint8_t (*xorCopy)(uint8_t *dst, const uint8_t *src, size_t len);
+} XorKernel_t;
+
+unsigned XorKernels(const XorKernel_t **kernels);
+
+#endif	// defined(CHECKSUM_H__)
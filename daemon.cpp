@@ -0,0 +1,677 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "daemon.h"
+#include <string.h>
+
+#if !defined(WIN32)
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#endif
+
+/** local definitions **/
+#define REPLY_TRAILER				20			// room after the reply text for "ERROR <code>"
+#define REPLY_TEXT					60			// room for the text around a name in a reply
+
+/** internal functions **/
+static char *dupString(const char *s);
+static char *nextWord(char *& p);
+static char *restOfLine(char *& p);
+static bool getNum(char *& p, uint32_t& val);
+static bool endSession(int stat);
+#if !defined(WIN32)
+static int connectSocket(const char *sockName);
+#endif
+
+/** class implementations **/
+
+Daemon::
+Daemon()
+{
+	m_portCnt = 0;
+	for (unsigned i = 0; i < DAEMON_MAX_CLIENTS; i++)
+	{
+		m_client[i].daemon = this;
+		m_client[i].fd = -1;
+		m_client[i].done = false;
+	}
+	m_secIdle = DAEMON_DEF_IDLE;
+	m_tickActive = 0;
+	m_stop = false;
+	m_parm.dlSpeed = 0;
+	m_parm.highSpeed = 0;
+	m_parm.resetMode = ResetNone;
+	m_parm.flags = 0;
+	m_parm.profile = NULL;
+}
+
+Daemon::
+~Daemon()
+{
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		m_port[i]->esp.CloseComm();
+		delete[] m_port[i]->name;
+		delete m_port[i];
+	}
+}
+
+//
+// Accept and serve requests on a Unix domain socket until a shutdown is
+// requested or the daemon has been idle for the idle time.  Each client is
+// served by its own thread.  The return value is zero on success, non-zero
+// otherwise (an error message having been output).
+//
+int Daemon::
+Run(const char *sockName)
+{
+#if defined(WIN32)
+	fprintf(stderr, "The daemon is not supported on this platform.\n");
+	return(ESP_ERROR_PARAM);
+#else
+	struct sockaddr_un addr;
+	bool quiet = ((m_parm.flags & ESP_QUIET) != 0);
+	int fd;
+	unsigned i;
+
+	if (strlen(sockName) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "The socket name \"%s\" is too long.\n", sockName);
+		return(ESP_ERROR_FILENAME_LENGTH);
+	}
+
+	// refuse to replace the socket of a running daemon
+	if ((fd = connectSocket(sockName)) >= 0)
+	{
+		close(fd);
+		fprintf(stderr, "A daemon is already listening on \"%s\".\n", sockName);
+		return(ESP_ERROR_COMM_OPEN);
+	}
+	unlink(sockName);
+
+	// only the owner may connect
+	int listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockName);
+	mode_t oldMask = umask(077);
+	int stat = (listenFD < 0) ? -1 : bind(listenFD, (struct sockaddr *)&addr, sizeof(addr));
+	umask(oldMask);
+	if ((stat != 0) || (listen(listenFD, DAEMON_MAX_CLIENTS) != 0))
+	{
+		fprintf(stderr, "Can't listen on \"%s\".\n", sockName);
+		if (listenFD >= 0)
+			close(listenFD);
+		return(ESP_ERROR_COMM_OPEN);
+	}
+
+	// a client that disconnects early must not terminate the daemon
+	signal(SIGPIPE, SIG_IGN);
+	if (!quiet)
+	{
+		fprintf(stdout, "Listening on \"%s\".\n", sockName);
+		fflush(stdout);
+	}
+
+	m_tickActive = getTickCount();
+	for ( ; ; )
+	{
+		fd_set readSet;
+		struct timeval tv;
+
+		FD_ZERO(&readSet);
+		FD_SET(listenFD, &readSet);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		int cnt = select(listenFD + 1, &readSet, NULL, NULL, &tv);
+
+		// collect the threads of the clients that have been served
+		{
+			MutexLock lock(m_mutex);
+			for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+			{
+				DaemonClient_t& client = m_client[i];
+				if (client.done)
+				{
+					client.thread.Join();
+					client.fd = -1;
+					client.done = false;
+				}
+			}
+			if (m_stop)
+				break;
+		}
+
+		if ((cnt > 0) && FD_ISSET(listenFD, &readSet) && ((fd = accept(listenFD, NULL, NULL)) >= 0))
+		{
+			MutexLock lock(m_mutex);
+			for (i = 0; (i < DAEMON_MAX_CLIENTS) && (m_client[i].fd >= 0); i++)
+				;
+			if (i >= DAEMON_MAX_CLIENTS)
+			{
+				static const char busy[] = "Too many clients.\nERROR -1\n";
+				write(fd, busy, sizeof(busy) - 1);
+				close(fd);
+			}
+			else
+			{
+				m_client[i].fd = fd;
+				m_tickActive = getTickCount();
+				if (m_client[i].thread.Start(serve, &m_client[i]) != 0)
+				{
+					close(fd);
+					m_client[i].fd = -1;
+				}
+			}
+		}
+		if (expire())
+			break;
+	}
+
+	// let the clients being served finish
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+		m_client[i].thread.Join();
+	for (i = 0; i < m_portCnt; i++)
+		m_port[i]->esp.CloseComm();
+	close(listenFD);
+	unlink(sockName);
+	if (!quiet)
+	{
+		fprintf(stdout, "Daemon exiting.\n");
+		fflush(stdout);
+	}
+	return(0);
+#endif
+}
+
+/** private functions **/
+
+//
+// Serve the requests of one client.
+//
+void Daemon::
+serve(void *arg)
+{
+	DaemonClient_t *client = (DaemonClient_t *)arg;
+	Daemon *daemon = client->daemon;
+
+#if !defined(WIN32)
+	char line[DAEMON_MAX_LINE];
+	char reply[DAEMON_MAX_REPLY + REPLY_TRAILER];
+	FILE *fp = fdopen(dup(client->fd), "r");
+
+	while ((fp != NULL) && (fgets(line, sizeof(line), fp) != NULL))
+	{
+		size_t len = strlen(line);
+		while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+			line[--len] = '\0';
+
+		int stat = daemon->perform(line, reply, DAEMON_MAX_REPLY);
+		len = strlen(reply);
+		if (stat == 0)
+			strcpy(reply + len, "OK\n");
+		else
+			sprintf(reply + len, "ERROR %d\n", stat);
+		len = strlen(reply);
+		if (write(client->fd, reply, len) != (ssize_t)len)
+			break;
+	}
+	if (fp != NULL)
+		fclose(fp);
+	close(client->fd);
+#endif
+
+	MutexLock lock(daemon->m_mutex);
+	client->done = true;
+}
+
+//
+// Perform a request, composing the reply text in the buffer.  The return
+// value is zero on success, non-zero otherwise.
+//
+int Daemon::
+perform(char *line, char *reply, size_t replySize)
+{
+	// the names quoted in the reply are shortened to fit
+	const int nameMax = (int)(replySize - REPLY_TEXT);
+	char *p = line;
+	const char *op = nextWord(p);
+	uint32_t addr = 0;
+	uint32_t size = 0;
+	uint32_t parmVal = 0;
+	uint32_t parmMask = 0;
+	const char *file = NULL;
+
+	reply[0] = '\0';
+	{
+		MutexLock lock(m_mutex);
+		m_tickActive = getTickCount();
+		if (strcmp(op, "shutdown") == 0)
+		{
+			m_stop = true;
+			return(0);
+		}
+		if (strcmp(op, "status") == 0)
+		{
+			status(reply, replySize);
+			return(0);
+		}
+	}
+
+	// validate the request before waiting for the port
+	const char *portName = nextWord(p);
+	bool valid = (*portName != '\0');
+	if (strcmp(op, "write") == 0)
+		valid = valid && getNum(p, addr) && getNum(p, parmVal) && getNum(p, parmMask) && (*(file = restOfLine(p)) != '\0');
+	else if (strcmp(op, "read") == 0)
+		valid = valid && getNum(p, addr) && getNum(p, size) && (size != 0) && (*(file = restOfLine(p)) != '\0');
+	else if (strcmp(op, "erase") == 0)
+		valid = valid && getNum(p, addr) && getNum(p, size);
+	else if ((strcmp(op, "mac") != 0) && (strcmp(op, "flash-id") != 0) &&
+			(strcmp(op, "run") != 0) && (strcmp(op, "release") != 0))
+		valid = false;
+	if (!valid)
+	{
+		sprintf(reply, "Invalid request \"%.*s\".\n", nameMax, op);
+		return(ESP_ERROR_PARAM);
+	}
+
+	DaemonPort_t *port = acquire(portName);
+	if (port == NULL)
+	{
+		sprintf(reply, "Too many ports (max %u).\n", DAEMON_MAX_PORTS);
+		return(ESP_ERROR_PARAM);
+	}
+
+	ESP& esp = port->esp;
+	int stat = 0;
+	bool reused = esp.IsConnected();
+	bool end = false;
+	if (strcmp(op, "release") == 0)
+		end = true;
+	else if (!reused)
+	{
+		if ((stat = GangConnect(esp, port->name, m_parm)) == 0)
+			port->connects++;
+		else
+			sprintf(reply, "Can't connect to the device on \"%.*s\" (%d).\n", nameMax, port->name, stat);
+	}
+
+	if ((stat == 0) && !end)
+	{
+		if (strcmp(op, "write") == 0)
+		{
+			VFile vf;
+			if (vf.Open(file, VFileOpenMap) != 0)
+				stat = ESP_ERROR_FILE_OPEN;
+			else
+				stat = esp.FlashWrite(vf, addr, (uint16_t)parmVal, (uint16_t)parmMask);
+		}
+		else if (strcmp(op, "read") == 0)
+		{
+			VFile vf;
+			if (vf.Open(file, "wb") != 0)
+				stat = ESP_ERROR_FILE_CREATE;
+			else
+				stat = esp.FlashRead(vf, addr, size);
+		}
+		else if (strcmp(op, "erase") == 0)
+			stat = size ? esp.FlashErase(addr, size) : esp.FlashErase();
+		else if (strcmp(op, "mac") == 0)
+		{
+			uint8_t mac[12];
+			if ((stat = esp.ReadMAC(mac, sizeof(mac))) == 0)
+			{
+				sprintf(reply, "Station MAC is %2x:%2x:%2x:%2x:%2x:%2x\n     AP MAC is %2x:%2x:%2x:%2x:%2x:%2x\n",
+						mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+						mac[6], mac[7], mac[8], mac[9], mac[10], mac[11]);
+			}
+		}
+		else if (strcmp(op, "flash-id") == 0)
+		{
+			uint32_t flashID;
+			if ((stat = esp.GetFlashID(flashID)) == 0)
+				sprintf(reply, "Manufacturer: %02x, Device: %02x%02x.\n", flashID & 0xff,
+						(flashID >> 8) & 0xff, (flashID >> 16) & 0xff);
+		}
+		else if (strcmp(op, "run") == 0)
+		{
+			// the device leaves the bootloader so the session ends
+			GangParm_t parm = m_parm;
+			parm.flags |= ESP_AUTO_RUN;
+			stat = GangFinish(esp, parm);
+			end = true;
+		}
+		if ((stat != 0) && (reply[0] == '\0'))
+		{
+			if (file != NULL)
+				sprintf(reply, "The %s of \"%.*s\" failed (%d).\n", op, nameMax, file, stat);
+			else
+				sprintf(reply, "The %s request failed (%d).\n", op, stat);
+		}
+	}
+
+	// after a communication error the device is reset and synced again
+	if (endSession(stat))
+		end = true;
+	release(port, end);
+
+	if ((m_parm.flags & ESP_QUIET) == 0)
+	{
+		MutexLock lock(m_mutex);
+		fprintf(stdout, "%s: %s%s %s", port->name, op, reused ? "" : " (connected)", stat ? "failed" : "OK");
+		if (stat)
+			fprintf(stdout, " (%d)", stat);
+		fputc('\n', stdout);
+		fflush(stdout);
+	}
+	return(stat);
+}
+
+//
+// Get exclusive use of the session for a port, adding the port if it is
+// new.  The return value is NULL if there are too many ports.
+//
+Daemon::DaemonPort_t *Daemon::
+acquire(const char *name)
+{
+	DaemonPort_t *port = NULL;
+	{
+		MutexLock lock(m_mutex);
+		for (unsigned i = 0; (port == NULL) && (i < m_portCnt); i++)
+		{
+			if (strcmp(m_port[i]->name, name) == 0)
+				port = m_port[i];
+		}
+		if (port == NULL)
+		{
+			if (m_portCnt >= DAEMON_MAX_PORTS)
+				return(NULL);
+			port = new DaemonPort_t;
+			port->name = dupString(name);
+			port->users = 0;
+			port->requests = 0;
+			port->connects = 0;
+			port->tickUsed = getTickCount();
+			m_port[m_portCnt++] = port;
+		}
+
+		// a port in use is not closed for being idle
+		port->users++;
+	}
+	port->mutex.Lock();
+	return(port);
+}
+
+//
+// Relinquish the use of a port, optionally ending its session.
+//
+void Daemon::
+release(DaemonPort_t *port, bool endSession)
+{
+	if (endSession && port->esp.IsCommOpen())
+		port->esp.CloseComm();
+	port->mutex.Unlock();
+
+	MutexLock lock(m_mutex);
+	port->users--;
+	port->requests++;
+	port->tickUsed = getTickCount();
+	m_tickActive = port->tickUsed;
+}
+
+//
+// Close the sessions that have been unused for the idle time.  The return
+// value is true if the daemon itself has been idle for that long.
+//
+bool Daemon::
+expire()
+{
+	MutexLock lock(m_mutex);
+	unsigned now = getTickCount();
+	unsigned msIdle = m_secIdle * 1000;
+	bool active = false;
+	unsigned i;
+
+	if (m_secIdle == 0)
+		return(false);
+	for (i = 0; i < m_portCnt; i++)
+	{
+		DaemonPort_t *port = m_port[i];
+		if (port->users)
+			active = true;
+		else if (port->esp.IsCommOpen())
+		{
+			if (now - port->tickUsed < msIdle)
+				active = true;
+			else
+			{
+				// no request holds the port so its mutex need not be taken
+				port->esp.CloseComm();
+				if ((m_parm.flags & ESP_QUIET) == 0)
+				{
+					fprintf(stdout, "%s: session closed after %u seconds idle\n", port->name, m_secIdle);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+	{
+		if (m_client[i].fd >= 0)
+			active = true;
+	}
+	return(!active && (now - m_tickActive >= msIdle));
+}
+
+//
+// Describe the state of each port.  The caller holds m_mutex.
+//
+void Daemon::
+status(char *reply, size_t replySize)
+{
+	unsigned now = getTickCount();
+	size_t len;
+
+	sprintf(reply, "%-20s %-9s %8s %8s %6s\n", "Port", "Session", "Requests", "Connects", "Idle");
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		DaemonPort_t *port = m_port[i];
+		if ((len = strlen(reply)) + 80 >= replySize)
+			break;
+		sprintf(reply + len, "%-20.20s %-9s %8u %8u %5us\n", port->name,
+				port->users ? "busy" : (port->esp.IsCommOpen() ? "open" : "closed"),
+				port->requests, port->connects, (now - port->tickUsed) / 1000);
+	}
+}
+
+/** public functions **/
+
+//
+// Send a request to the daemon listening on a socket and output the reply,
+// the text going to stdout if the request succeeded or stderr otherwise.
+// The return value is zero on success, non-zero otherwise.
+//
+int
+DaemonRequest(const char *sockName, const char *request)
+{
+#if defined(WIN32)
+	fprintf(stderr, "The daemon is not supported on this platform.\n");
+	return(ESP_ERROR_PARAM);
+#else
+	char line[DAEMON_MAX_LINE];
+	char reply[DAEMON_MAX_REPLY];
+	size_t replyLen = 0;
+	int stat = ESP_ERROR_COMM_READ;
+	int fd;
+
+	if ((fd = connectSocket(sockName)) < 0)
+	{
+		fprintf(stderr, "Can't connect to the daemon at \"%s\".\n", sockName);
+		return(ESP_ERROR_COMM_OPEN);
+	}
+	size_t len = strlen(request);
+	if ((len >= sizeof(line)) || (write(fd, request, len) != (ssize_t)len) || (write(fd, "\n", 1) != 1))
+	{
+		close(fd);
+		fprintf(stderr, "Can't send the request to the daemon at \"%s\".\n", sockName);
+		return(ESP_ERROR_COMM_WRITE);
+	}
+
+	FILE *fp = fdopen(fd, "r");
+	reply[0] = '\0';
+	while ((fp != NULL) && (fgets(line, sizeof(line), fp) != NULL))
+	{
+		if ((strcmp(line, "OK\n") == 0) || (strncmp(line, "ERROR ", 6) == 0))
+		{
+			stat = (line[0] == 'O') ? 0 : atoi(line + 6);
+			break;
+		}
+		len = strlen(line);
+		if (replyLen + len < sizeof(reply))
+		{
+			strcpy(reply + replyLen, line);
+			replyLen += len;
+		}
+	}
+	if (fp != NULL)
+		fclose(fp);
+	else
+		close(fd);
+
+	if (stat == ESP_ERROR_COMM_READ)
+		fprintf(stderr, "The daemon at \"%s\" did not reply.\n", sockName);
+	fputs(reply, (stat == 0) ? stdout : stderr);
+	return(stat);
+#endif
+}
+
+/** internal functions **/
+
+//
+// Make a copy of a string.
+//
+static char *
+dupString(const char *s)
+{
+	char *copy = new char[strlen(s) + 1];
+	strcpy(copy, s);
+	return(copy);
+}
+
+//
+// Extract the next whitespace-delimited word of a request, advancing the
+// pointer past it.
+//
+static char *
+nextWord(char *& p)
+{
+	while ((*p == ' ') || (*p == '\t'))
+		p++;
+	char *word = p;
+	while ((*p != '\0') && (*p != ' ') && (*p != '\t'))
+		p++;
+	if (*p != '\0')
+		*p++ = '\0';
+	return(word);
+}
+
+//
+// Extract the remainder of a request, e.g. a file name that may contain
+// spaces.
+//
+static char *
+restOfLine(char *& p)
+{
+	while ((*p == ' ') || (*p == '\t'))
+		p++;
+	char *rest = p;
+	p += strlen(p);
+	return(rest);
+}
+
+//
+// Extract a numeric value from a request.
+//
+static bool
+getNum(char *& p, uint32_t& val)
+{
+	char *word = nextWord(p);
+	char *end;
+
+	if (*word == '\0')
+		return(false);
+	val = (uint32_t)strtoul(word, &end, 0);
+	return(*end == '\0');
+}
+
+//
+// Determine if the session should end after a request fails so that the
+// next request resets and syncs the device again.  Errors in the request
+// itself or with local files leave the session intact.
+//
+static bool
+endSession(int stat)
+{
+	switch (stat)
+	{
+	case ESP_SUCCESS:
+	case ESP_ERROR_PARAM:
+	case ESP_ERROR_FILE_OPEN:
+	case ESP_ERROR_FILE_CREATE:
+	case ESP_ERROR_FILE_READ:
+	case ESP_ERROR_FILE_WRITE:
+	case ESP_ERROR_FILE_SEEK:
+	case ESP_ERROR_FILE_SIZE:
+	case ESP_ERROR_FILE_STAT:
+		return(false);
+	}
+	return(true);
+}
+
+#if !defined(WIN32)
+//
+// Connect to the daemon's socket.  The return value is the descriptor or
+// -1 if no daemon is listening.
+//
+static int
+connectSocket(const char *sockName)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((strlen(sockName) >= sizeof(addr.sun_path)) || ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0))
+		return(-1);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockName);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+#endif
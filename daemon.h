@@ -0,0 +1,111 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(DAEMON_H__)
+#define DAEMON_H__
+
+#include "esp.h"
+#include "gang.h"
+#include "thread.h"
+
+#define DAEMON_DEF_SOCKET			"/tmp/esp_tool.sock"
+#define DAEMON_DEF_IDLE				300			// seconds before an unused session is closed
+#define DAEMON_MAX_PORTS			GANG_MAX_PORTS	// the most ports with sessions
+#define DAEMON_MAX_CLIENTS			16			// the most clients served concurrently
+#define DAEMON_MAX_LINE				(FILENAME_MAX + 100)	// the longest request line
+#define DAEMON_MAX_REPLY			4096		// the longest reply
+
+//
+// A class that keeps sessions with the devices on several ports open
+// between invocations of the program.  Requests arrive as lines of text on
+// a Unix domain socket, one client per connection:
+//   write <port> <addr> <flashParmVal> <flashParmMask> <file>
+//   read <port> <addr> <size> <file>
+//   erase <port> <addr> <size>     a zero size erases the entire chip
+//   mac <port>
+//   flash-id <port>
+//   run <port>                     run the application, ending the session
+//   release <port>                 end the session, leaving the device as is
+//   status
+//   shutdown
+// Each reply comprises lines of output followed by "OK" or "ERROR <code>".
+//
+// A port's session is established by the first request for it and reused
+// by later ones so that they need not reset and sync the device again.
+// Requests for the same port are performed in turn while those for
+// different ports proceed concurrently.  A session that is unused for the
+// idle time is closed and the daemon exits when it has had no sessions and
+// no requests for that long.
+//
+class Daemon
+{
+public:
+	Daemon();
+	~Daemon();
+
+	void SetSpeed(uint32_t dlSpeed, uint32_t highSpeed) { m_parm.dlSpeed = dlSpeed; m_parm.highSpeed = highSpeed; }
+	void SetReset(ResetMode_t resetMode) { m_parm.resetMode = resetMode; }
+	void SetFlags(unsigned flags) { m_parm.flags = flags; }
+	void SetProfile(Profile *profile) { m_parm.profile = profile; }
+	void SetIdle(unsigned secIdle) { m_secIdle = secIdle; }
+
+	int Run(const char *sockName);
+
+private:
+	Daemon(const Daemon&);
+	Daemon& operator=(const Daemon&);
+
+	typedef struct
+	{
+		char *name;					// the serial port designator
+		ESP esp;					// the session with the device
+		Mutex mutex;				// serializes the requests for the port
+		unsigned users;				// requests holding or awaiting the port
+		unsigned requests;			// requests performed
+		unsigned connects;			// times that the device was reset and synced
+		unsigned tickUsed;			// the time at which the port was last used
+	} DaemonPort_t;
+
+	typedef struct
+	{
+		Daemon *daemon;
+		int fd;						// the connection with the client
+		bool done;					// if the client has been served
+		Thread thread;
+	} DaemonClient_t;
+
+	static void serve(void *arg);
+	int perform(char *line, char *reply, size_t replySize);
+	DaemonPort_t *acquire(const char *name);
+	void release(DaemonPort_t *port, bool endSession);
+	bool expire();
+	void status(char *reply, size_t replySize);
+
+	DaemonPort_t *m_port[DAEMON_MAX_PORTS];
+	unsigned m_portCnt;
+	DaemonClient_t m_client[DAEMON_MAX_CLIENTS];
+	unsigned m_secIdle;
+	unsigned m_tickActive;			// the time of the last request
+	bool m_stop;					// if a shutdown was requested
+	GangParm_t m_parm;
+	Mutex m_mutex;					// serializes access to the port list and output
+};
+
+int DaemonRequest(const char *sockName, const char *request);
+
+#endif	// defined(DAEMON_H__)
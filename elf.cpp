@@ -21,9 +21,25 @@
  */
 
 #include "elf.h"
+#include "checksum.h"
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#if defined(WIN32)
+  #include <windows.h>
+  #include <io.h>
+  #include <fcntl.h>
+#elif defined(__linux__)
+  #include <sys/mman.h>
+  #include <unistd.h>
+  #if !defined(__APPLE__)
+	#include <sys/sendfile.h>
+	#define HAVE_SENDFILE
+	#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 27)))
+	  #define HAVE_COPY_FILE_RANGE
+	#endif
+  #endif
+#endif
 
 //
 // Initialize the class members.
@@ -31,11 +47,15 @@
 void ELF::
 init()
 {
-	m_fp = NULL;
+	m_fileSize = 0;
 	m_fname = NULL;
 	memset(&m_header, 0, sizeof(m_header));
 	m_strings = NULL;
+	m_stringsSize = 0;
+	m_stringsAlloc = NULL;
 	m_sections = NULL;
+	m_index = NULL;
+	m_indexSize = 0;
 }
 
 //
@@ -44,16 +64,18 @@ init()
 void ELF::
 deinit()
 {
-	if (m_fp != NULL)
-		fclose(m_fp);
+	m_vf.Close();
 	delete[] m_fname;
-	delete[] m_strings;
+	delete[] m_stringsAlloc;
 	delete[] m_sections;
+	delete[] m_index;
 	init();
 }
 
 //
-// Open an ELF file and collection information about its content.
+// Open an ELF file and collection information about its content.  The
+// return value is zero on success, non-zero if the file can't be read or
+// its headers are malformed.
 //
 int ELF::
 Open(const char *file)
@@ -64,28 +86,41 @@ Open(const char *file)
 	int len;
 	if ((file == NULL) || ((len = strlen(file)) == 0))
 		return(-1);
-	if ((m_fp = fopen(file, "rb")) == NULL)
+	if ((m_vf.Open(file, VFileOpenMap) != 0) || (m_vf.IsStream() && (m_vf.Load() != 0)))
+	{
+		deinit();
 		return(-1);
+	}
+	m_fileSize = (uint32_t)m_vf.Size();
 
 	// validate the ELF header
-   	if ((fread((char *)&m_header, 1, sizeof(m_header), m_fp) == sizeof(m_header)) &&
+	uint8_t *alloc;
+	const uint8_t *hdr;
+	if ((hdr = region(0, sizeof(m_header), alloc)) != NULL)
+	{
+		memcpy(&m_header, hdr, sizeof(m_header));
+		delete[] alloc;
+	}
+	if ((hdr != NULL) &&
 			(m_header.e_ident[EI_MAG0] == 0x7F) &&
 			(m_header.e_ident[EI_MAG1] == 'E')  &&
 			(m_header.e_ident[EI_MAG2] == 'L')  &&
 			(m_header.e_ident[EI_MAG3] == 'F'))
 	{
 		// extract information from the ELF file
-		getStrings();
-		collectSections();
+		if ((getStrings() == 0) && (collectSections() == 0))
+		{
+			indexSections();
 
-		// save the filename for later use
-		m_fname = new char[len + 1];
-		strcpy(m_fname, file);
-		stat = 0;
+			// save the filename for later use
+			m_fname = new char[len + 1];
+			strcpy(m_fname, file);
+			stat = 0;
+		}
 	}
 	if (stat != 0)
 		deinit();
-	return(0);
+	return(stat);
 }
 
 //
@@ -96,32 +131,32 @@ Open(const char *file)
 int ELF::
 WriteSection(int sectIdx, VFile& vf, uint8_t& cksum, uint32_t paddedSize) const
 {
-	if ((m_sections == NULL) || !vf.IsOpen())
+	if ((m_sections == NULL) || !vf.IsOpen() || (sectIdx < 0) || (sectIdx >= m_header.e_shnum))
 		return(-1);
 
-	uint32_t sectSize = m_sections[sectIdx].size;
-	if (sectSize && (fseek(m_fp, m_sections[sectIdx].offset, SEEK_SET) == 0))
+	const ELF_section& sect = m_sections[sectIdx];
+	uint32_t sectSize = sect.size;
+	if (sectSize)
 	{
 		uint32_t len = sectSize;
 		if (len < paddedSize)
 			len = paddedSize;
-		vf.NeedSpace(len);
-		char b;
-		for (len = 0; len < sectSize; len++)
-		{
-			if ((fread(&b, 1, 1, m_fp) != 1) || (vf.Write(&b, 1) != 1))
-				return(-1);
-			cksum ^= b;
-		}
+		if (vf.NeedSpace(len) != 0)
+			return(-1);
+
+		// write the section data from the mapping or, failing that, a buffer
+		uint8_t *alloc;
+		const uint8_t *data;
+		if ((data = region(sect.offset, sectSize, alloc)) == NULL)
+			return(-1);
+		bool ok = (vf.WriteSum(data, sectSize, cksum) == sectSize);
+		delete[] alloc;
+		if (!ok)
+			return(-1);
 
 		// pad the file to the desired length
-		b = 0;
-		while (len < paddedSize)
-		{
-			if (vf.Write(&b, 1) != 1)
-				return(-1);
-			len++;
-		}
+		if ((len > sectSize) && (vf.Fill(0, len - sectSize) != 0))
+			return(-1);
 		sectSize = len;
 	}
 	return(sectSize);
@@ -134,7 +169,7 @@ int ELF::
 SectionInfo(FILE *fp)
 {
 	int stat = -1;
-	if ((fp != NULL) && (m_fp != NULL))
+	if ((fp != NULL) && IsOpen())
 	{
 		fprintf(fp, "Address     Size        Name\n");
 		for (unsigned cnt = 1; cnt < m_header.e_shnum; cnt++)
@@ -154,12 +189,14 @@ SectionInfo(FILE *fp)
 int ELF::
 GetSectionNum(const char *sectName) const
 {
-	if ((sectName != NULL) && (*sectName != '\0'))
+	if ((sectName != NULL) && (*sectName != '\0') && (m_index != NULL))
 	{
-		for (unsigned cnt = 1; cnt < m_header.e_shnum; cnt++)
+		// probe the index until the name or an unused entry is found
+		unsigned mask = m_indexSize - 1;
+		for (unsigned i = hashName(sectName) & mask; m_index[i] != 0; i = (i + 1) & mask)
 		{
-			if (strcmp(m_sections[cnt - 1].name, sectName) == 0)
-				return(cnt);
+			if (strcmp(m_sections[m_index[i] - 1].name, sectName) == 0)
+				return(m_index[i]);
 		}
 	}
 	return(0);
@@ -188,69 +225,154 @@ GetSectionAddress(Elf32_Half sectIdx) const
 }
 
 //
-// Get the string table from the ELF file.
+// Get a pointer to a region of the ELF file after checking that it lies
+// within the file.  The region is used in place if the file is mapped.
+// Otherwise, it is read into a buffer that the caller must delete, given
+// by 'alloc' (NULL if none).  The return value is NULL if the region is
+// outside the file or can't be read.
 //
-void ELF::
+const uint8_t *ELF::
+region(uint32_t ofst, uint32_t size, uint8_t *& alloc) const
+{
+	alloc = NULL;
+	if ((ofst > m_fileSize) || (size > m_fileSize - ofst))
+		return(NULL);
+	const uint8_t *data;
+	if ((data = m_vf.Data()) != NULL)
+		return(data + ofst);
+
+	alloc = new uint8_t[size ? size : 1];
+	if ((m_vf.Position(ofst) != 0) || (m_vf.Read(alloc, 1, size) != size))
+	{
+		delete[] alloc;
+		alloc = NULL;
+		return(NULL);
+	}
+	return(alloc);
+}
+
+//
+// Get the string table from the ELF file.  The return value is zero on
+// success, non-zero otherwise.
+//
+int ELF::
 getStrings()
 {
 	if (m_header.e_shstrndx)
 	{
-		if (fseek(m_fp, m_header.e_shoff + (m_header.e_shstrndx * m_header.e_shentsize), SEEK_SET) != 0)
-			return;
+		if ((m_header.e_shentsize < sizeof(Elf32_Shdr)) || (m_header.e_shstrndx >= m_header.e_shnum))
+			return(-1);
+		uint32_t ofst = (uint32_t)m_header.e_shstrndx * m_header.e_shentsize;
+		if ((m_header.e_shoff > m_fileSize) || (ofst > m_fileSize - m_header.e_shoff))
+			return(-1);
 
-	    Elf32_Shdr m_section;
-		if (fread((char *)&m_section, 1, sizeof(m_section), m_fp) != sizeof(m_section) )
-			return;
+		uint8_t *alloc;
+		const uint8_t *p;
+		if ((p = region(m_header.e_shoff + ofst, sizeof(Elf32_Shdr), alloc)) == NULL)
+			return(-1);
+		Elf32_Shdr section;
+		memcpy(&section, p, sizeof(section));
+		delete[] alloc;
 
-		if (m_section.sh_size)
+		if (section.sh_size)
 		{
-			m_strings = new char[m_section.sh_size];
-			if (m_strings == NULL)
-				return;
-
-			if (fseek(m_fp, m_section.sh_offset, SEEK_SET) != 0)
-				return;
-
-			if (fread(m_strings, 1, m_section.sh_size, m_fp) != m_section.sh_size)
-				return;
+			if ((p = region(section.sh_offset, section.sh_size, m_stringsAlloc)) == NULL)
+				return(-1);
+			m_strings = (const char *)p;
+			m_stringsSize = section.sh_size;
 		}
 	}
+	return(0);
 }
 
 //
-// Get section information from the ELF file.
+// Get section information from the ELF file.  The return value is zero on
+// success, non-zero if the section headers lie outside the file.
 //
-void ELF::
+int ELF::
 collectSections()
 {
 	if (m_header.e_shnum)
 	{
+		// the section headers are parsed in place if the file is mapped
+		uint8_t *alloc;
+		const uint8_t *hdrs;
+		if ((m_header.e_shentsize < sizeof(Elf32_Shdr)) ||
+				((hdrs = region(m_header.e_shoff, (uint32_t)m_header.e_shnum * m_header.e_shentsize, alloc)) == NULL))
+			return(-1);
+
 		// allocate space for the section information table
 		m_sections = new ELF_section[m_header.e_shnum];
+		memset(m_sections, 0, m_header.e_shnum * sizeof(m_sections[0]));
 
 		// populate the table
 		for (unsigned cnt = 1; cnt < m_header.e_shnum; cnt++)
 		{
-			if (fseek(m_fp, m_header.e_shoff + (cnt * m_header.e_shentsize), SEEK_SET) != 0)
-				return;
-
-		    Elf32_Shdr m_section;
-			if (fread((char *)&m_section, 1, sizeof(m_section), m_fp) != sizeof(m_section))
-				return;
+			Elf32_Shdr section;
+			memcpy(&section, hdrs + (cnt * m_header.e_shentsize), sizeof(section));
 
+			// a name must be terminated within the string table
 			unsigned idx = cnt - 1;
-			if (m_section.sh_name)
-				m_sections[idx].name = m_strings + m_section.sh_name;
-			else
-				m_sections[idx].name = 0;
-
-			m_sections[idx].offset = m_section.sh_offset;
-			m_sections[idx].address = m_section.sh_addr;
-			m_sections[idx].size = m_section.sh_size;
+			const char *name = "";
+			if ((m_strings != NULL) && (section.sh_name < m_stringsSize) &&
+					(memchr(m_strings + section.sh_name, '\0', m_stringsSize - section.sh_name) != NULL))
+				name = m_strings + section.sh_name;
+			m_sections[idx].name = name;
+			m_sections[idx].offset = section.sh_offset;
+			m_sections[idx].address = section.sh_addr;
+			m_sections[idx].size = section.sh_size;
+		}
+		delete[] alloc;
+	}
+	return(0);
+}
+
+//
+// Build the index of the section names, a hash table with room for at
+// least twice as many entries as there are sections.  Where sections have
+// the same name, the first is found.
+//
+void ELF::
+indexSections()
+{
+	unsigned sectCnt = (m_header.e_shnum > 1) ? (m_header.e_shnum - 1) : 0;
+	for (m_indexSize = 16; m_indexSize < 2 * sectCnt; m_indexSize <<= 1)
+		;
+	m_index = new uint16_t[m_indexSize];
+	memset(m_index, 0, m_indexSize * sizeof(m_index[0]));
+
+	unsigned mask = m_indexSize - 1;
+	for (unsigned cnt = 1; cnt < m_header.e_shnum; cnt++)
+	{
+		const char *name = m_sections[cnt - 1].name;
+		if (*name == '\0')
+			continue;
+		unsigned i;
+		for (i = hashName(name) & mask; m_index[i] != 0; i = (i + 1) & mask)
+		{
+			if (strcmp(m_sections[m_index[i] - 1].name, name) == 0)
+				break;
 		}
+		if (m_index[i] == 0)
+			m_index[i] = (uint16_t)cnt;
 	}
 }
 
+//
+// Compute the hash of a section name (FNV-1a).
+//
+uint32_t ELF::
+hashName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while (*name != '\0')
+	{
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
 //-----------------------------------------------------------------------------
 
 //
@@ -264,8 +386,12 @@ init()
 	m_size = 0;
 	m_pos = 0;
 	m_increment = 100;
+	m_shared = false;
+	m_mapped = false;
+	m_mapFD = -1;
 	m_fp = NULL;
 	m_fpClose = false;
+	m_stream = false;
 	m_name = NULL;
 }
 
@@ -275,7 +401,17 @@ init()
 void VFile::
 deinit()
 {
-	if (m_buf != NULL)
+	if (m_mapped)
+	{
+#if defined(WIN32)
+		UnmapViewOfFile(m_buf);
+#elif defined(__linux__)
+		munmap(m_buf, m_bufSize);
+		if (m_mapFD >= 0)
+			close(m_mapFD);
+#endif
+	}
+	else if ((m_buf != NULL) && !m_shared)
 		free(m_buf);
 	if ((m_fp != NULL) && m_fpClose)
 		fclose(m_fp);
@@ -285,8 +421,10 @@ deinit()
 
 //
 // Prepare a virtual file for operations.  If the mode is "v", the file is
-// operated in virtual mode.  Otherwise, it is operated in physical mode.
-// The return value is zero on success, non-zero otherwise.
+// operated in virtual mode.  If the mode is "rm", the file is mapped and
+// operated in virtual mode, read only, or read as a stream if it can't be
+// mapped (e.g. a pipe or an empty file).  Otherwise, it is operated in
+// physical mode.  The return value is zero on success, non-zero otherwise.
 //
 int VFile::
 Open(const char *name, const char *mode)
@@ -297,12 +435,27 @@ Open(const char *name, const char *mode)
 		if (strcmp(mode, VFileOpenVirt) == 0)
 		{
 			// make the initial allocation for the virtual file
-			m_buf = (char *)malloc(m_bufSize = m_increment);
-			if (m_buf == NULL)
+			if ((m_buf = (char *)malloc(m_increment)) == NULL)
+				return(-1);
+			m_bufSize = m_increment;
+		}
+		else if (strcmp(mode, VFileOpenMap) == 0)
+		{
+			if (strcmp(name, VFileStdin) == 0)
+			{
+#if defined(WIN32)
+				_setmode(_fileno(stdin), _O_BINARY);
+#endif
+				m_fp = stdin;
+			}
+			else if (map(name) != 0)
 			{
-				fprintf(stderr, "Can't allocate block of %u bytes\n", m_bufSize);
-				exit(1);
+				m_fpClose = true;
+				m_fp = fopen(name, "rb");
 			}
+			struct stat fs;
+			if (m_fp != NULL)
+				m_stream = ((fstat(FILENO(m_fp), &fs) != 0) || ((fs.st_mode & S_IFMT) != S_IFREG));
 		}
 		else
 		{
@@ -330,6 +483,98 @@ Open(FILE *fp, const char *name)
 	return(0);
 }
 
+//
+// Prepare a virtual file to read data in a buffer supplied by the caller.
+// The buffer is not copied so it may be shared by several virtual files
+// (e.g. one per thread) and it must remain valid until the file is closed.
+// The return value is zero on success, non-zero otherwise.
+//
+int VFile::
+Open(const void *data, uint32_t size, const char *name)
+{
+	Close();
+	if (data == NULL)
+		return(-1);
+	m_buf = (char *)data;
+	m_bufSize = size;
+	m_size = size;
+	m_shared = true;
+	Name(name);
+	return(0);
+}
+
+//
+// Read the remainder of a stream into memory so that the file may then be
+// operated in virtual mode, e.g. when its size must be known.  A file that
+// is already in memory is unchanged.  The return value is zero on success,
+// non-zero otherwise.
+//
+int VFile::
+Load()
+{
+	if (m_fp == NULL)
+		return(IsOpen() ? 0 : -1);
+
+	// read until the end of the stream, enlarging the buffer as needed
+	char *buf = NULL;
+	uint32_t bufSize = 0;
+	uint32_t size = 0;
+	for ( ; ; )
+	{
+		if (size == bufSize)
+		{
+			uint32_t newSize = bufSize ? (bufSize * 2) : 0x10000;
+			char *newBuf;
+			if ((newSize < bufSize) || ((newBuf = (char *)realloc(buf, newSize)) == NULL))
+			{
+				free(buf);
+				return(-1);
+			}
+			buf = newBuf;
+			bufSize = newSize;
+		}
+		size_t cnt = fread(buf + size, 1, bufSize - size, m_fp);
+		if (cnt == 0)
+			break;
+		size += (uint32_t)cnt;
+	}
+	if (ferror(m_fp))
+	{
+		free(buf);
+		return(-1);
+	}
+
+	// continue as a virtual file
+	if (m_fpClose)
+		fclose(m_fp);
+	m_fp = NULL;
+	m_fpClose = false;
+	m_stream = false;
+	m_buf = buf;
+	m_bufSize = bufSize;
+	m_size = size;
+	m_pos = 0;
+	return(0);
+}
+
+//
+// Get a pointer to the data at the current position of a virtual file and
+// advance the position past it so that the data may be used without being
+// copied.  The count is reduced to the number of bytes available, if fewer.
+// The return value is NULL for a physical file, which must be read instead.
+//
+const uint8_t *VFile::
+Span(size_t& count)
+{
+	if ((m_fp != NULL) || (m_buf == NULL))
+		return(NULL);
+	if (count > m_size - m_pos)
+		count = m_size - m_pos;
+	const uint8_t *p = (const uint8_t *)m_buf + m_pos;
+	m_pos += count;
+	return(p);
+}
+
 //
 // Set the name associated with the virtual file.
 //
@@ -419,11 +664,12 @@ Write(const void *buf, size_t size, size_t count)
 
 	if (m_fp != NULL)
 		return(fwrite(buf, size, count, m_fp));
-	else if (m_buf == NULL)
+	else if ((m_buf == NULL) || m_shared)
 		return(-1);
 
 	// copy the data, update the position and size
-	NeedSpace(total);
+	if (NeedSpace(total) != 0)
+		return(0);
 	memcpy(m_buf + m_pos, buf, total);
 	m_pos += total;
 	if (m_size < m_pos)
@@ -433,7 +679,39 @@ Write(const void *buf, size_t size, size_t count)
 }
 
 //
-// Write a filler to a virtual file.  Return zero on success.
+// Write a number of bytes to a virtual file, combining their XOR with a
+// checksum.  For a file in memory, the checksum is computed as the data is
+// copied.  Return the number of bytes written or <0 on error.
+//
+size_t VFile::
+WriteSum(const void *buf, size_t count, uint8_t& cksum)
+{
+	if ((m_fp != NULL) || (count == 0))
+	{
+		if ((count = Write(buf, 1, count)) == (size_t)-1)
+			return(count);
+		cksum = XorBytes((const uint8_t *)buf, count, cksum);
+		return(count);
+	}
+	else if ((m_buf == NULL) || m_shared)
+		return(-1);
+
+	// copy the data, update the position and size
+	if (NeedSpace(count) != 0)
+		return(0);
+	cksum = XorCopy((uint8_t *)m_buf + m_pos, (const uint8_t *)buf, count, cksum);
+	m_pos += count;
+	if (m_size < m_pos)
+		m_size = m_pos;
+	return(count);
+}
+
+//
+// Write a filler to a virtual file.  A physical file is filled a block at
+// a time.  A large zero fill at the end of a physical file is made by
+// seeking past it so that, where the file system supports it, the file
+// has a hole that reads as zeroes rather than occupying space.  Return
+// zero on success.
 //
 int VFile::
 Fill(uint8_t c, uint32_t count)
@@ -442,13 +720,27 @@ Fill(uint8_t c, uint32_t count)
 	{
 		if (m_fp != NULL)
 		{
-			while (count--)
-				if (fputc((int)c, m_fp) < 0)
+			if ((c == 0) && (count >= VFileHoleSize) && (fflush(m_fp) == 0) && (Position() == Size()) &&
+					(fseek(m_fp, count - 1, SEEK_CUR) == 0))
+				// the last byte sets the size of the file
+				return((fputc(0, m_fp) < 0) ? -1 : 0);
+
+			uint8_t buf[VFileFillSize];
+			memset(buf, c, (count < sizeof(buf)) ? count : sizeof(buf));
+			while (count)
+			{
+				uint32_t part = (count < sizeof(buf)) ? count : sizeof(buf);
+				if (fwrite(buf, 1, part, m_fp) != part)
 					return(-1);
+				count -= part;
+			}
 		}
+		else if ((m_buf == NULL) || m_shared)
+			return(-1);
 		else
 		{
-			NeedSpace(count);
+			if (NeedSpace(count) != 0)
+				return(-1);
 			memset(m_buf + m_pos, c, count);
 			m_pos += count;
 			if (m_size < m_pos)
@@ -459,29 +751,92 @@ Fill(uint8_t c, uint32_t count)
 }
 
 //
-// Request additional space for future writes.
+// Copy a number of bytes from the current position of another file to the
+// current position of this one, advancing both.  Where both are files on
+// disk, the kernel copies the data without it passing through the process
+// (sharing the storage, if the file system supports it).  Otherwise, the
+// data of a file in memory is written in place or the data is copied
+// through a buffer.  The return value is the number of bytes copied, fewer
+// than requested if an error occurs or the end of the source is reached.
 //
-void VFile::
+size_t VFile::
+Copy(VFile& src, size_t count)
+{
+	size_t done = kernelCopy(src, count);
+	if (done == count)
+		return(done);
+
+	// write the data of a file in memory in place
+	size_t span = count - done;
+	const uint8_t *data;
+	if ((data = src.Span(span)) != NULL)
+		return(done + ((Write(data, 1, span) == span) ? span : 0));
+
+	// copy the data through a buffer
+	uint8_t *buf = new uint8_t[VFileCopySize];
+	while (done < count)
+	{
+		size_t part = count - done;
+		if (part > VFileCopySize)
+			part = VFileCopySize;
+		if (((part = src.Read(buf, 1, part)) == 0) || (Write(buf, 1, part) != part))
+			break;
+		done += part;
+	}
+	delete[] buf;
+	return(done);
+}
+
+//
+// Request additional space for future writes.  The buffer is enlarged by at
+// least half of its size each time so that a file built by many small
+// writes is copied only a few times in all.  The return value is zero on
+// success, non-zero if the memory can't be allocated (the file being
+// unchanged).
+//
+int VFile::
 NeedSpace(uint32_t space)
 {
 	if ((m_fp != NULL) || (space == 0))
-		return;
+		return(0);
 	if ((m_pos + space) <= m_bufSize)
-		return;
+		return(0);
+	if (m_shared)
+		return(-1);
 
-	// use the minimum increment
+	// use the minimum increment, growing geometrically
 	if (space < m_increment)
 		space = m_increment;
-
-	// not enough space in the buffer, enlarge it
 	uint32_t newSize = m_pos + space;
-	m_buf = (char *)realloc(m_buf, newSize);
-	if (m_buf == NULL)
-	{
-		fprintf(stderr, "Can't reallocate memory from %u to %u bytes\n", m_bufSize, newSize);
-		exit(1);
-	}
-	m_bufSize = newSize;
+	uint32_t growSize = m_bufSize + (m_bufSize / 2);
+	if ((newSize < growSize) && (growSize > m_bufSize))
+		newSize = growSize;
+	if (Reserve(newSize) == 0)
+		return(0);
+
+	// try again without the extra growth
+	return(Reserve(m_pos + space));
+}
+
+//
+// Make the buffer of a virtual file large enough to hold the given number
+// of bytes without further allocation, e.g. when the final size of a file
+// is known before it is written.  The return value is zero on success,
+// non-zero if the memory can't be allocated (the file being unchanged).
+//
+int VFile::
+Reserve(uint32_t size)
+{
+	if ((m_fp != NULL) || (size <= m_bufSize))
+		return(0);
+	if (m_shared)
+		return(-1);
+	char *newBuf = (char *)realloc(m_buf, size);
+	if (newBuf == NULL)
+		return(-1);
+	m_buf = newBuf;
+	m_bufSize = size;
+	return(0);
 }
 
 //
@@ -536,11 +891,15 @@ Seek(long offset, int whence)
 
 //
 // Get the current size of a virtual file.  If successful, the return value
-// will be zero or greater.
+// will be zero or greater.  The size of a stream that can't be repositioned
+// isn't known.
 //
 size_t VFile::
 Size() const
 {
+	if (m_stream)
+		// the size isn't known until the stream has been read
+		return(-1);
 	if (m_fp != NULL)
 	{
 		struct stat fs;
@@ -552,3 +911,111 @@ Size() const
 	return(-1);
 }
 
+//
+// Map a physical file into memory for reading.  Only a non-empty regular
+// file is mapped.  The return value is zero on success, non-zero otherwise.
+//
+int VFile::
+map(const char *name)
+{
+	FILE *fp;
+	if ((fp = fopen(name, "rb")) == NULL)
+		return(-1);
+
+	struct stat fs;
+	void *p = NULL;
+	if ((fstat(FILENO(fp), &fs) == 0) && ((fs.st_mode & S_IFMT) == S_IFREG) &&
+			(fs.st_size > 0) && (fs.st_size <= 0x7fffffff))
+	{
+#if defined(WIN32)
+		HANDLE hMap = CreateFileMapping((HANDLE)_get_osfhandle(FILENO(fp)), NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMap != NULL)
+		{
+			p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(hMap);
+		}
+#elif defined(__linux__)
+		if ((p = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, FILENO(fp), 0)) == MAP_FAILED)
+			p = NULL;
+		else
+			// the file is normally read from start to end
+			madvise(p, fs.st_size, MADV_SEQUENTIAL);
+#endif
+	}
+	if (p == NULL)
+	{
+		fclose(fp);
+		return(-1);
+	}
+
+#if defined(HAVE_SENDFILE)
+	// keep a descriptor so that the kernel can copy the file
+	m_mapFD = dup(FILENO(fp));
+#endif
+	fclose(fp);
+
+	// the mapping remains valid after the file is closed
+	m_buf = (char *)p;
+	m_bufSize = (uint32_t)fs.st_size;
+	m_size = m_bufSize;
+	m_shared = true;
+	m_mapped = true;
+	return(0);
+}
+
+//
+// Get the descriptor of a file on disk, -1 if it has none.
+//
+int VFile::
+descriptor() const
+{
+	if (m_mapped)
+		return(m_mapFD);
+	if ((m_fp != NULL) && !m_stream)
+		return(FILENO(m_fp));
+	return(-1);
+}
+
+//
+// Have the kernel copy data between two files on disk, using
+// copy_file_range() where available and sendfile() otherwise.  The return
+// value is the number of bytes copied, zero if the files can't be copied
+// this way.
+//
+size_t VFile::
+kernelCopy(VFile& src, size_t count)
+{
+	size_t done = 0;
+#if defined(HAVE_SENDFILE)
+	int fdIn = src.descriptor();
+	int fdOut = m_mapped ? -1 : descriptor();
+	if ((fdIn < 0) || (fdOut < 0) || (count == 0))
+		return(0);
+
+	// the copy begins at the logical positions of the streams
+	long posIn = (long)src.Position();
+	long posOut = (long)Position();
+	if ((posIn < 0) || (posOut < 0) || (fflush(m_fp) != 0) || (lseek(fdOut, posOut, SEEK_SET) != posOut))
+		return(0);
+	off_t ofstIn = posIn;
+	while (done < count)
+	{
+		ssize_t cnt = -1;
+  #if defined(HAVE_COPY_FILE_RANGE)
+		loff_t rangeIn = ofstIn;
+		if ((cnt = copy_file_range(fdIn, &rangeIn, fdOut, NULL, count - done, 0)) >= 0)
+			ofstIn = rangeIn;
+		else
+  #endif
+		cnt = sendfile(fdOut, fdIn, &ofstIn, count - done);
+		if (cnt <= 0)
+			break;
+		done += cnt;
+	}
+
+	// bring the streams up to date with the descriptors
+	if (done && ((fseek(m_fp, posOut + done, SEEK_SET) != 0) || (src.Position(posIn + done) != 0)))
+		done = 0;
+#endif
+	return(done);
+}
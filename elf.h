@@ -92,10 +92,20 @@ typedef struct {
 
 
 #define VFileOpenVirt			"v"
+#define VFileOpenMap			"rm"
+#define VFileStdin				"-"			// the name for the standard input
+#define VFileFillSize			4096		// the size of the block written when filling
+#define VFileHoleSize			0x10000		// the smallest zero fill left as a hole
+#define VFileCopySize			0x10000		// the size of the buffer used for copying
 
 //
 // A class representing a file which may be physical (i.e. existing on a
-// storage medium) or virtual (i.e. existing on memory only).
+// storage medium) or virtual (i.e. existing on memory only).  A physical
+// file opened with the mode "rm" is mapped into memory, if possible, and is
+// then read as a virtual file whose data may be used in place via Data()
+// and Span().  The name "-" opened with that mode reads the standard input.
+// A pipe or other stream that can't be repositioned has no known size; it
+// may be read in order or loaded into memory with Load().
 //
 class VFile
 {
@@ -107,15 +117,20 @@ public:
 
 	int Open(const char *name, const char *mode = VFileOpenVirt);
 	int Open(FILE *fp, const char *name = NULL);
+	int Open(const void *data, uint32_t size, const char *name = NULL);
 
 	size_t Peek(void *buf, size_t count);
 	size_t Read(void *buf, size_t size, size_t count);
 	size_t Write(const void *buf, size_t size, size_t count);
 	size_t Read(void *buf, size_t count) { return(Read(buf, 1, count)); }
 	size_t Write(const void *buf, size_t count) { return(Write(buf, 1, count)); }
+	size_t WriteSum(const void *buf, size_t count, uint8_t& cksum);
+	const uint8_t *Data() const { return((m_fp == NULL) ? (const uint8_t *)m_buf : NULL); }
+	const uint8_t *Span(size_t& count);
 	int GetChar() { char c; return((Read(&c, 1, 1) == 1) ? (int)(uint8_t)c : -1); }
 	int PutChar(char c) { return((Write(&c, 1, 1) == 1) ? c : -1); }
 	int Fill(uint8_t c, uint32_t count);
+	size_t Copy(VFile& src, size_t count);
 
 	size_t Size() const;
 	size_t Position() const;
@@ -123,11 +138,17 @@ public:
 	int Seek(long offset, int whence);
 	void Flush() { if (m_fp != NULL) fflush(m_fp); }
 
+	int Load();
 	int Close() { deinit(); return(0); }
 	bool IsOpen() const { return((m_fp != NULL) || (m_buf != NULL)); }
+	bool IsReadOnly() const { return(m_shared); }
+	bool IsVirtual() const { return(m_fp == NULL); }
+	bool IsMapped() const { return(m_mapped); }
+	bool IsStream() const { return(m_stream); }
 	bool EndOfFile() const { return((m_fp != NULL) ? !!feof(m_fp) : (m_pos >= m_size)); }
 
-	void NeedSpace(uint32_t space);
+	int NeedSpace(uint32_t space);
+	int Reserve(uint32_t size);
 	void Increment(size_t incr) { m_increment = incr; }
 	size_t Increment() const { return(m_increment); }
 	void Name(const char *name);
@@ -138,23 +159,33 @@ private:
 	VFile& operator=(const VFile&);
 	void init();
 	void deinit();
+	int map(const char *name);
+	int descriptor() const;
+	size_t kernelCopy(VFile& src, size_t count);
 
 	// for a virtual file
 	char *m_buf;			// the buffer holding the file data
 	uint32_t m_bufSize;		// the current size of m_buf
 	uint32_t m_size;		// the current size of the file
 	uint32_t m_pos;			// the current position of the file pointer
-	uint32_t m_increment;	// the minimum increment for growing m_buf
+	uint32_t m_increment;	// the initial size of m_buf and the minimum increment
+	bool m_shared;			// if m_buf is supplied by the caller (read only)
+	bool m_mapped;			// if m_buf is a mapping of a physical file (read only)
+	int m_mapFD;			// the descriptor of the mapped file, -1 if none
 
 	// for a real file
 	FILE *m_fp;				// the stream
 	bool m_fpClose;			// if the stream should be closed
+	bool m_stream;			// if the stream can't be repositioned (e.g. a pipe)
 
 	char *m_name;			// the associated name
 };
 
 //
-// A class representing information in an ELF file.
+// A class representing information in an ELF file.  The file is mapped
+// into memory, if possible, so that the headers are parsed in place and
+// the section data is written without being read first.  The section
+// names are indexed so that a section is found without a search.
 //
 class ELF
 {
@@ -162,7 +193,7 @@ public:
 	ELF() { init(); }
 	~ELF() { deinit(); }
 
-	bool IsOpen() const { return(m_fp != NULL); }
+	bool IsOpen() const { return(m_vf.IsOpen()); }
 	int Open(const char *file);
 	void Close() { deinit(); }
 
@@ -182,14 +213,22 @@ private:
 	ELF& operator=(const ELF&);
 	void init();
 	void deinit();
-	void getStrings();
-	void collectSections();
-
-	FILE *m_fp;					// file handle for the ELF file
+	const uint8_t *region(uint32_t ofst, uint32_t size, uint8_t *& alloc) const;
+	int getStrings();
+	int collectSections();
+	void indexSections();
+	static uint32_t hashName(const char *name);
+
+	mutable VFile m_vf;			// the ELF file, read when it isn't mapped
+	uint32_t m_fileSize;
 	char *m_fname;				// name of the ELF file
 	Elf32_Ehdr m_header;
 	ELF_section *m_sections;
-	char *m_strings;
+	const char *m_strings;		// the section names
+	uint32_t m_stringsSize;
+	uint8_t *m_stringsAlloc;	// the section names if read from the file
+	uint16_t *m_index;			// section numbers (1-based) hashed by name, 0 if unused
+	unsigned m_indexSize;		// a power of two
 };
 
 #endif	// !defined(ELF_H__)
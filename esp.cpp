@@ -19,9 +19,15 @@
 
 /** include files **/
 #include "esp.h"
+#include "packet.h"
+#include "reader.h"
+#include "checksum.h"
+#include <stdarg.h>
 
 /** local definitions **/
 
+#define WAIT_INTERVAL				20			// the longest wait for serial data between checks (ms)
+
 typedef struct FileData_tag
 {
 	char name[MAX_FILENAME];
@@ -30,6 +36,23 @@ typedef struct FileData_tag
 	FileData_tag() { name[0] = '\0'; addr = 0; }
 } FileData_t;
 
+// classes of errors, each having its own retry policy
+typedef enum
+{
+	ErrorClassLink,				// no reply, the command or the reply may have been lost
+	ErrorClassFrame,			// the reply was malformed
+	ErrorClassData,				// the command was corrupted and rejected by the ROM
+	ErrorClassDevice,			// the ROM failed to perform the command
+	ErrorClassOther				// not a communication error
+} ErrorClass_t;
+
+typedef struct
+{
+	ErrorClass_t errClass;		// the class of error
+	uint8_t retries;			// the number of times to re-send the command
+	uint8_t msDelay;			// the delay before re-sending
+} RetryPolicy_t;
+
 /** private data **/
 
 //
@@ -37,11 +60,11 @@ typedef struct FileData_tag
 // to read out the contents of Flash.  Note that the first section comprises
 // data elements used by the code and it has two parts.  The first twelve bytes
 // are the parameters that control which part and how much of Flash is read
-// while the remainder is constant data.
+// while the remainder is constant data.  The parameters are set in a copy.
 //
-static uint8_t flashReadStub[] =
+static const uint8_t flashReadStub[] =
 {
-	// variable data modified on each use
+	// variable data set in a copy on each use
 									// data:
 	LE_BYTES(0),					// 0 - start address
 	LE_BYTES(0),					// 4 - block size
@@ -74,6 +97,9 @@ static uint8_t flashReadStub[] =
 	0x00, 0x00, 0x00
 };
 
+// a compile-time check that ESP_READ_STUB_MAX is sufficient
+typedef char flashReadStubSizeCheck[(sizeof(flashReadStub) <= ESP_READ_STUB_MAX) ? 1 : -1];
+
 // designators for Flash mode
 static const NameValue_t flashModeList[] =
 {
@@ -108,52 +134,156 @@ static const NameValue_t flashFreqList[] =
 	{ NULL,			0 }
 };
 
+// designators for the reset mode
+static const NameValue_t resetModeList[] =
+{
+	{ "none",		ResetNone },	// default
+	{ "auto",		ResetAuto },
+	{ "dtronly",	ResetDTROnly },
+	{ "ck",			ResetCK },
+	{ "wifio",		ResetWifio },
+	{ "nodemcu",	ResetNodeMCU },
+	{ NULL,			0 }
+};
+
+// default reset timing, indexed by the reset mode (unused values are zero)
+static const ResetTiming_t resetTimingList[] =
+{
+	{ 0,	0 },		// ResetNone
+	{ 1,	100 },		// ResetAuto
+	{ 100,	0 },		// ResetDTROnly
+	{ 5,	75 },		// ResetCK
+	{ 5,	250 },		// ResetWifio
+	{ 5,	75 },		// ResetNodeMCU
+};
+
+// link speeds tried when probing for the highest reliable speed, fastest first
+static const uint32_t probeSpeedList[] =
+{
+	1500000, 921600, 460800, 230400, 0
+};
+
+// retry policies for the error classes
+static const RetryPolicy_t retryPolicyList[] =
+{
+	{ ErrorClassLink,		3,	10 },
+	{ ErrorClassFrame,		4,	5 },
+	{ ErrorClassData,		4,	0 },
+	{ ErrorClassDevice,		1,	50 },
+	{ ErrorClassOther,		0,	0 },
+};
+
 /** internal functions **/
-static void putData(uint32_t val, unsigned byteCnt, uint8_t *buf, int ofst = 0);
-static uint32_t getData(unsigned byteCnt, const uint8_t *buf, int ofst = 0);
+static int romError(uint8_t code);
+static ErrorClass_t errorClass(int stat);
+static bool canRetry(uint8_t op);
+static void releaseBlock(void *arg, int ticket, int stat, uint32_t val);
 static const NameValue_t *findNameValueEntry(const NameValue_t *tbl, const char *name, bool ignCase = true);
 static const NameValue_t *findNameValueEntry(const NameValue_t *tbl, uint32_t val);
 
 /** public functions **/
 
+//
+// Extract 1-4 bytes of a value in little endian order from a buffer
+// beginning at a specified offset.
+//
+uint32_t
+getLE(unsigned byteCnt, const uint8_t *buf, int ofst)
+{
+	uint32_t val = 0;
+
+	if (buf && byteCnt)
+	{
+		int shiftCnt = 0;
+		if (byteCnt > 4)
+			byteCnt = 4;
+		do
+		{
+			val |= (uint32_t)buf[ofst++] << shiftCnt;
+			shiftCnt += 8;
+		} while (--byteCnt);
+	}
+	return(val);
+}
+
+//
+// Put 1-4 bytes of a value in little endian order into a buffer
+// beginning at a specified offset.
+//
+void
+putLE(uint32_t val, unsigned byteCnt, uint8_t *buf, int ofst)
+{
+	if (buf && byteCnt)
+	{
+		if (byteCnt > 4)
+			byteCnt = 4;
+		do
+		{
+			buf[ofst++] = (uint8_t)(val & 0xff);
+			val >>= 8;
+		} while (--byteCnt);
+	}
+}
+
 /** class implementations **/
 
 ESP::
 ESP()
 {
 	m_connected = false;
+	m_baud = 0;
 	m_flags = ESP_AUTO_RUN;
 	m_address = ESP_NO_ADDRESS;
 	m_size = 0;
 	m_imageSize = 0;
+	m_resetTiming.msReset = 0;
+	m_resetTiming.msBoot = 0;
+	m_profile = NULL;
+	m_flashID = 0;
+	m_flashIDValid = false;
+	m_eraseTime = 0;
+	ClearStats();
+	memset(m_req, 0, sizeof(m_req));
+	m_reqHead = 0;
+	m_reqCnt = 0;
+	m_window = 1;
+	m_nextTicket = 0;
+	for (unsigned i = 0; i < ESP_RESULT_HISTORY; i++)
+		m_result[i].ticket = -1;
+	m_logFunc = NULL;
+	m_logArg = NULL;
+	m_progressFunc = NULL;
+	m_progressArg = NULL;
 }
 
 ESP::
 ~ESP()
 {
+	for (unsigned i = 0; i < ESP_MAX_INFLIGHT; i++)
+		delete[] m_req[i].data;
 }
 
 /*
  ** OpenComm
  *
- * Open a serial port if not already opened.  If the port can't be opened
- * an error message is output and the app is exited.
+ * Open a serial port if not already opened.  The return value is zero on
+ * success, ESP_ERROR_COMM_OPEN if the port can't be opened.
  *
  * For Windows systems, the serial channel descriptor should be in the
  * form "//./COMn" where n is a numeric value greater than zero.
  *
  */
-void ESP::
+int ESP::
 OpenComm(const char *portStr, unsigned speed, unsigned flags)
 {
 	if (!m_serial.IsOpen())
 	{
 		if (m_serial.Open(portStr, speed, flags) != 0)
-		{
-			fprintf(stderr, "Can't open port %s.\n", portStr);
-			exit(1);
-		}
+			return(ESP_ERROR_COMM_OPEN);
+		m_baud = speed;
+		m_connected = false;
 	}
+	return(ESP_SUCCESS);
 }
 
 //
@@ -182,7 +312,7 @@ Sync(uint16_t timeout)
 	else
 	{
 		// read and discard additional replies
-		while (readPacket(ESP_SYNC) == 2)
+		while (readPacket(ESP_SYNC, NULL, NULL, 0, cmdTimeout(0)) == 2)
 			;
 	}
 	return(stat);
@@ -202,7 +332,7 @@ Connect(ResetMode_t resetMode)
 
 	if ((m_flags & ESP_QUIET) == 0)
 	{
-		fprintf(stdout, "Connecting ");
+		report(stdout, "Connecting ");
 		fflush(stdout);
 	}
 	for (i = 0; i < 4; i++)
@@ -213,19 +343,29 @@ Connect(ResetMode_t resetMode)
 		{
 			if (Sync(500) == ESP_SUCCESS)
 			{
-				fprintf(stdout, "%sconnection established\n", sep);
-				fflush(stdout);
+				if ((m_flags & ESP_QUIET) == 0)
+				{
+					report(stdout, "%sconnection established\n", sep);
+					fflush(stdout);
+				}
 				m_connected = true;
+				m_flashIDValid = false;
+				m_eraseTime = 0;
 				return(0);
 			}
-			fputc('.', stdout);
-			fflush(stdout);
+			if ((m_flags & ESP_QUIET) == 0)
+			{
+				report(stdout, ".");
+				fflush(stdout);
+			}
 			sep = " ";
 		}
 	}
 	if ((m_flags & ESP_QUIET) == 0)
-		fprintf(stdout, "%sconnection attempt failed\n", sep);
-	fflush(stdout);
+	{
+		report(stdout, "%sconnection attempt failed\n", sep);
+		fflush(stdout);
+	}
 	return(ESP_ERROR_CONNECT);
 }
 
@@ -242,6 +382,112 @@ Run(bool reboot)
 	return(stat);
 }
 
+//
+// Change the speed of the serial link with a connected device.  The ROM
+// bootloader has no command for this so the UART divider is written
+// directly.  The UART clock is derived from the current divider (set by the
+// bootloader's auto-baud) and the current speed so the new divider can be
+// computed without knowing the clock configuration.  The new speed is
+// confirmed with a sync exchange.  If that fails, an attempt is made to
+// return to the previous speed and, if that also fails, the device is
+// marked as not connected so that the next connection attempt resets it.
+//
+int ESP::
+ChangeBaud(uint32_t baud)
+{
+	int stat;
+	uint32_t clkDiv;
+	uint32_t oldBaud = m_baud;
+
+	if (!m_connected)
+		return(ESP_ERROR_CONNECT);
+	if ((baud == 0) || (oldBaud == 0))
+		return(ESP_ERROR_PARAM);
+	if (baud == oldBaud)
+		return(ESP_SUCCESS);
+
+	// compute the divider for the new speed
+	if ((stat = ReadReg(UART0_CLKDIV_REG, clkDiv)) != 0)
+		return(stat);
+	clkDiv &= UART_CLKDIV_MASK;
+	uint32_t newDiv = (uint32_t)(((double)clkDiv * oldBaud / baud) + 0.5);
+	if ((clkDiv == 0) || (newDiv == 0) || (newDiv > UART_CLKDIV_MASK))
+		return(ESP_ERROR_PARAM);
+
+	// confirm that the speed is supported on this end before changing the device
+	if (m_serial.SetSpeed(baud) != 0)
+	{
+		m_serial.SetSpeed(oldBaud);
+		return(ESP_ERROR_PARAM);
+	}
+	m_serial.SetSpeed(oldBaud);
+
+	if ((stat = setDivider(newDiv, baud)) == 0)
+	{
+		if ((m_flags & ESP_QUIET) == 0)
+		{
+			report(stdout, "Link speed changed to %u baud.\n", baud);
+			fflush(stdout);
+		}
+		return(ESP_SUCCESS);
+	}
+
+	// the new speed doesn't work, attempt to return to the previous speed
+	if (setDivider(clkDiv, oldBaud) != 0)
+	{
+		m_connected = false;
+		SetCommSpeed(oldBaud);
+	}
+	return(ESP_ERROR_BAUD);
+}
+
+//
+// Determine the highest speed at which the link with the device is reliable,
+// trying the speeds in probeSpeedList in turn.  The device is left connected
+// at the speed found, which is returned indirectly.  If none of the higher
+// speeds work, the current speed is returned.
+//
+int ESP::
+ProbeBaud(ResetMode_t resetMode, uint32_t& baud)
+{
+	int stat;
+	uint32_t baseBaud = m_baud;
+
+	for (unsigned i = 0; probeSpeedList[i] != 0; i++)
+	{
+		if (probeSpeedList[i] <= baseBaud)
+			continue;
+
+		// make sure the device is connected at the base speed
+		if (!m_connected)
+		{
+			SetCommSpeed(baseBaud);
+			if ((stat = Connect(resetMode)) != 0)
+				return(stat);
+		}
+
+		// try the speed, then confirm that it is reliable
+		uint32_t clkDiv;
+		if ((ChangeBaud(probeSpeedList[i]) == 0) && (ReadReg(UART0_CLKDIV_REG, clkDiv) == 0) &&
+				linkCheck(clkDiv & UART_CLKDIV_MASK, 16))
+		{
+			baud = probeSpeedList[i];
+			return(ESP_SUCCESS);
+		}
+		if (m_connected && (m_baud != baseBaud) && (ChangeBaud(baseBaud) != 0))
+			m_connected = false;
+	}
+
+	if (!m_connected)
+	{
+		SetCommSpeed(baseBaud);
+		if ((stat = Connect(resetMode)) != 0)
+			return(stat);
+	}
+	baud = baseBaud;
+	return(ESP_SUCCESS);
+}
+
 //
 // Read the ID of the Flash chip on the device.
 //
@@ -257,6 +503,11 @@ GetFlashID(uint32_t& flashID)
 	if ((stat = WriteReg(0x60000200, 0x10000000)) != 0)
 		return(stat);
 	stat = ReadReg(0x60000240, flashID);
+	if (stat == 0)
+	{
+		m_flashID = flashID & 0x00ffffff;
+		m_flashIDValid = true;
+	}
 	return(stat);
 }
 
@@ -290,7 +541,7 @@ FlashErase(uint32_t addr, uint32_t size)
 		addr &= ~(blkSize - 1);
 		if ((m_flags & ESP_QUIET) == 0)
 		{
-			fprintf(stdout, "Erasing %u bytes at 0x%06x ...\n", size, addr);
+			report(stdout, "Erasing %u bytes at 0x%06x ...\n", size, addr);
 			fflush(stdout);
 		}
 		stat = flashBegin(addr, blkCnt * blkSize);
@@ -312,8 +563,6 @@ FlashRead(VFile& vf, uint32_t address, uint32_t length)
 	if (!vf.IsOpen() || (length == 0))
 		return(ESP_ERROR_PARAM);
 
-	uint32_t stubLen = sizeof(flashReadStub) & 0xfffffffc;		// truncated to a multiple of 4 bytes
-
 	// compute the block size to use
 	uint32_t blkSize;
 	uint32_t blkCnt;
@@ -330,15 +579,14 @@ FlashRead(VFile& vf, uint32_t address, uint32_t length)
 	 	blkCnt = (length + blkSize - 1) / blkSize;
 	}
 
-	// set the parameters in the stub code
-	putData(address, 4, flashReadStub, 0);
-	putData(blkSize, 4, flashReadStub, 4);
-	putData(blkCnt, 4, flashReadStub, 8);
+	// set the parameters in a copy of the stub code
+	uint8_t stub[ESP_READ_STUB_MAX];
+	uint32_t stubLen = FlashReadStub(stub, address, blkSize, blkCnt);
 
 	// download the stub
 	if (((stat = flashBegin(0, 0)) == 0) &&
 			((stat = ramBegin(IRAM_ADDR, stubLen, stubLen)) == 0) &&
-			((stat = ramData(flashReadStub, stubLen)) == 0) &&
+			((stat = ramData(stub, stubLen)) == 0) &&
 			((stat = ramFinish(FLASH_READ_STUB_BEGIN)) == 0))
 	{
 		// read back the data
@@ -376,10 +624,11 @@ FlashRead(VFile& vf, uint32_t address, uint32_t length)
 				stat = ESP_ERROR_SLIP_END;
 				break;
 			}
+			progress((dataLen < length) ? dataLen : length, length);
 		}
 	}
 	if ((stat == 0) && !(m_flags & ESP_QUIET))
-		fprintf(stdout, "%u bytes written to \"%s\".\n", length, vf.Name());
+		report(stdout, "%u bytes written to \"%s\".\n", length, vf.Name());
 	return(stat);
 }
 
@@ -391,152 +640,284 @@ FlashRead(VFile& vf, uint32_t address, uint32_t length)
 int ESP::
 FlashWrite(VFile& vf, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
 {
-	int stat = -1;
+	ImageSeg_t seg[COMPOSITE_MAX_IMAGES];
+	unsigned segCnt;
+	bool combined;
+	int stat;
+
 	if (!vf.IsOpen())
 		return(ESP_ERROR_PARAM);
+	if (vf.IsStream())
+		return(flashStream(vf, addr, flashParmVal, flashParmMask));
 
-	// determine the length of the file and the number of blocks
-	size_t fileSize = vf.Size();
-	if (fileSize < 0)
+	// determine the regions to be written, then write each in turn
+	if ((stat = ImageSegments(vf, addr, seg, segCnt, combined)) != 0)
+		return(stat);
+	for (unsigned i = 0; i < segCnt; i++)
 	{
-		fprintf(stderr, "Can't determine the size of the download file \"%s\".\n", vf.Name());
-		return(ESP_ERROR_FILE_SIZE);
+		if ((stat = flashWrite(vf, seg[i], flashParmVal, flashParmMask)) != 0)
+			break;
 	}
-	if (fileSize == 0)
+	return(stat);
+}
+
+//
+// Send the content of a stream of unknown size (e.g. a pipe) to the device.
+// A combined image file gives the size of each of its images in a header
+// that precedes it.  Otherwise, the stream is read until its end.  Each
+// part of the stream is erased and written as it arrives so that the
+// content needn't be held in its entirety.
+//
+int ESP::
+flashStream(VFile& vf, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	int stat = 0;
+	uint8_t *buf = new uint8_t[ESP_STREAM_CHUNK];
+	uint32_t written = 0;
+
+	// read in the header of the stream, check for a combined image file
+	uint8_t hdr[8];
+	if (vf.Read(hdr, 1, 4) != 4)
 	{
-		fprintf(stderr, "The download file \"%s\" is zero length.\n", vf.Name());
-		return(ESP_ERROR_FILE_SEEK);
+		report(stderr, "Can't read the download file \"%s\".\n", vf.Name());
+		stat = ESP_ERROR_FILE_READ;
 	}
-
-	// read in the header of the file, check for a combined image file
-	uint8_t buf[4];
-	if ((vf.Position(0) != 0) || (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf)))
+	else if (memcmp(hdr, COMPOSITE_SIG, 3) != 0)
 	{
-		fprintf(stderr, "Can't read the download file \"%s\".\n", vf.Name());
-		return(ESP_ERROR_FILE_READ);
+		// not a combined image file - write the entire stream
+		memcpy(buf, hdr, 4);
+		stat = streamImage(vf, buf, 4, 0, addr, flashParmVal, flashParmMask, written);
 	}
-	if (memcmp(buf, COMPOSITE_SIG, 3) != 0)
-		// not a combined image file - write the entire image
-		stat = flashWrite(vf, 0, fileSize, addr, flashParmVal, flashParmMask);
 	else
 	{
 		// download the individual images
-		uint16_t imageCnt = buf[3];
-		for (uint16_t i = 0; i < imageCnt; i++)
+		uint16_t imageCnt = hdr[3];
+		for (uint16_t i = 0; (stat == 0) && (i < imageCnt); i++)
 		{
-			// read the segment descriptor
-			uint8_t hdrBuf[8];
-			if (vf.Read(hdrBuf, 1, sizeof(hdrBuf)) != sizeof(hdrBuf))
+			if (vf.Read(hdr, 1, sizeof(hdr)) != sizeof(hdr))
 			{
-				fprintf(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
-				return(ESP_ERROR_FILE_READ);
+				report(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
+				stat = ESP_ERROR_FILE_READ;
+			}
+			else if (getLE(4, hdr, 4) != 0)
+				stat = streamImage(vf, buf, 0, getLE(4, hdr, 4), getLE(4, hdr, 0),
+						flashParmVal, flashParmMask, written);
+		}
+	}
+	delete[] buf;
+
+	if ((m_flags & ESP_QUIET) == 0)
+	{
+		if (written)
+			report(stdout, "\n");
+		if (stat == 0)
+			report(stdout, "%u bytes written successfully.\n", written);
+		fflush(stdout);
+	}
+	return(stat);
+}
+
+//
+// Write an image read from a stream, a part at a time.  The buffer holds
+// the data of the image that has already been read.  A size of zero
+// indicates that the image extends to the end of the stream.  Each part
+// after the first begins on a sector boundary so that erasing it doesn't
+// destroy the end of the part before it.  The return value is zero on
+// success, non-zero otherwise.
+//
+int ESP::
+streamImage(VFile& vf, uint8_t *buf, uint32_t have, uint32_t size, uint32_t addr,
+		uint16_t flashParmVal, uint16_t flashParmMask, uint32_t& written)
+{
+	uint32_t done = 0;
+	bool atEnd = false;
+	int stat;
+
+	while (!atEnd)
+	{
+		// fill the buffer with the next part of the image, up to the end of a chunk
+		uint32_t limit = ESP_STREAM_CHUNK - ((addr + done) & (ESP_FLASH_SECTOR_SIZE - 1));
+		while (have < limit)
+		{
+			uint32_t part = limit - have;
+			if (size && (part > size - done - have))
+				part = size - done - have;
+			size_t cnt;
+			if ((part == 0) || ((cnt = vf.Read(buf + have, 1, part)) == 0))
+				break;
+			have += (uint32_t)cnt;
+		}
+		if (size ? (done + have >= size) : (have < limit))
+			atEnd = true;
+		if (size && (done + have < size) && (have < limit))
+		{
+			report(stderr, "The download file \"%s\" ended unexpectedly.\n", vf.Name());
+			return(ESP_ERROR_FILE_READ);
+		}
+		if (have == 0)
+			break;
+
+		// erase and write the part, reporting only the progress of the whole
+		VFile vfPart;
+		ImageSeg_t seg;
+		seg.ofst = 0;
+		seg.size = have;
+		seg.addr = addr + done;
+		if (vfPart.Open(buf, have, vf.Name()) != 0)
+			return(ESP_ERROR_PARAM);
+		unsigned flags = m_flags;
+		m_flags |= ESP_QUIET;
+		stat = flashWrite(vfPart, seg, flashParmVal, flashParmMask);
+		m_flags = flags;
+		if (stat != 0)
+			return(stat);
+		done += have;
+		written += have;
+		have = 0;
+		if ((m_flags & ESP_QUIET) == 0)
+		{
+			report(stdout, "\rWrote %u bytes of the stream, up to 0x%06x", written, addr + done);
+			fflush(stdout);
+		}
+	}
+	return(0);
+}
+
+//
+// Send images to the device using the frames prepared in a packet cache.
+// The frames are sent as they are, so the work of preparing each block is
+// done only once however many devices receive the images.  The frames of
+// a patch, if given, replace the corresponding frames of the cache.
+//
+int ESP::
+FlashWrite(const PacketCache& cache, const PacketPatch *patch)
+{
+	int stat = 0;
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+
+	for (unsigned segIdx = 0; (stat == 0) && (segIdx < cache.SegmentCount()); segIdx++)
+	{
+		const PacketSeg_t& seg = cache.Segment(segIdx);
+		uint32_t retries = m_stats.retries;
+
+		if ((m_flags & ESP_QUIET) == 0)
+		{
+			report(stdout, "Erasing %u bytes...\n", seg.size);
+			fflush(stdout);
+		}
+		if ((stat = flashBegin(seg.addr, seg.blkCnt * blkSize)) != 0)
+			break;
+		for (uint32_t blkIdx = 0; blkIdx < seg.blkCnt; blkIdx++)
+		{
+			unsigned frameLen;
+			const uint8_t *frame = (patch != NULL) ? patch->Frame(cache, seg.frameIdx + blkIdx, frameLen) :
+					cache.Frame(seg.frameIdx + blkIdx, frameLen);
+
+			progress(blkIdx * blkSize, seg.blkCnt * blkSize);
+			if ((m_flags & ESP_QUIET) == 0)
+			{
+				report(stdout, "\rWriting block %u of %u at 0x%06x", blkIdx + 1, seg.blkCnt, seg.addr + (blkIdx * blkSize));
+				fflush(stdout);
 			}
-			uint32_t addr = getData(4, hdrBuf, 0);
-			uint32_t len = getData(4, hdrBuf, 4);
-			uint32_t pos = vf.Position();
-			if ((stat = flashWrite(vf, pos, len, addr, flashParmVal, flashParmMask)) != 0)
+			if ((stat = SubmitFrame(ESP_FLASH_DATA, frame, frameLen, 16 + blkSize)) < 0)
 				break;
-			if (vf.Position(pos + len) < 0)
+			stat = 0;
+		}
+		if ((stat == 0) && ((stat = Drain()) == 0))
+			progress(seg.blkCnt * blkSize, seg.blkCnt * blkSize);
+		if ((m_flags & ESP_QUIET) == 0)
+		{
+			if (stat == 0)
 			{
-				fprintf(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
-				return(ESP_ERROR_FILE_SEEK);
+				report(stdout, "\n%u bytes written successfully", seg.size);
+				if ((retries = m_stats.retries - retries) != 0)
+					report(stdout, " (%u block%s re-sent)", retries, (retries == 1) ? "" : "s");
+				report(stdout, ".\n");
 			}
+			else
+				report(stdout, "\n");
+			fflush(stdout);
 		}
 	}
 	return(stat);
 }
 
 //
-// Send the content of a file (with the given size at the given offset in the file)
-// to the device.
+// Send a region of a file to the device, writing it at the Flash address of
+// the region.
 //
 int ESP::
-flashWrite(VFile& vf, uint32_t ofst, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+flashWrite(VFile& vf, const ImageSeg_t& seg, uint16_t flashParmVal, uint16_t flashParmMask)
 {
 	int stat;
+	const uint32_t size = seg.size;
+	const uint32_t addr = seg.addr;
 	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
 	uint32_t blkCnt = (size + blkSize - 1) / blkSize;
+	BlockReader reader;
 
 	// move the file pointer to the start of the image
-	if (vf.Position(ofst) < 0)
+	if (vf.Position(seg.ofst) < 0)
 		return(ESP_ERROR_FILE_SEEK);
 
+	// begin reading the blocks, the reading overlaps the erasure
+	if ((stat = reader.Start(vf, blkCnt, addr, flashParmVal, flashParmMask)) != 0)
+		return(stat);
+
 	// attempt to enter download mode
 	if ((m_flags & ESP_QUIET) == 0)
 	{
-		fprintf(stdout, "Erasing %u bytes...\n", size);
+		report(stdout, "Erasing %u bytes...\n", size);
 		fflush(stdout);
 	}
 	bool needEOL = false;
+	uint32_t retries = m_stats.retries;
 	if ((stat = flashBegin(addr, blkCnt * blkSize)) == 0)
 	{
-		// allocate a data buffer for the combined header and block data
-		const uint16_t hdrOfst = 0;
-		const uint16_t dataOfst = 16;
-		const uint16_t blkBufSize = dataOfst + blkSize;
-		uint8_t blkBuf[blkBufSize];
-
 		// send the blocks of the file
 		for (uint32_t blkIdx = 0; blkIdx < blkCnt; blkIdx++)
 		{
-			// prepare the header for the block
-			putData(blkSize, 4, blkBuf, hdrOfst + 0);
-			putData(blkIdx, 4, blkBuf, hdrOfst + 4);
-			putData(0, 4, blkBuf, hdrOfst + 8);
-			putData(0, 4, blkBuf, hdrOfst + 12);
-
-			// read the data for the block
-			size_t cnt = vf.Read(blkBuf + dataOfst, 1, blkSize);
-			if (cnt != ESP_FLASH_BLK_SIZE)
-			{
-				if (vf.EndOfFile())
-					// partial last block, fill the remainder
-					memset(blkBuf + dataOfst + cnt, 0xff, blkSize - cnt);
-				else
-				{
-					// read error
-					stat = ESP_ERROR_FILE_READ;
-					goto done;
-				}
-			}
-
-			// patch the flash parameters into the first block if it is loaded at address 0
-			if ((blkIdx == 0) && (addr == 0) && (blkBuf[dataOfst] == ESP_IMAGE_MAGIC) && flashParmMask)
-			{
-				// update the Flash parameters
-				uint32_t flashParm = getData(2, blkBuf + dataOfst + 2) & ~(uint32_t)flashParmMask;
-				putData(flashParm | flashParmVal, 2, blkBuf + dataOfst + 2);
-			}
-
-			// calculate the block checksum
-			uint16_t cksum = checksum(blkBuf + dataOfst, blkSize);
+			// get the block with its header, read and checksummed
+			DataBlock_t blk[2];
+			uint16_t cksum;
+			if ((stat = reader.Next(blk, cksum)) != 0)
+				goto done;
+			progress(blkIdx * blkSize, blkCnt * blkSize);
 
 			if ((m_flags & ESP_QUIET) == 0)
 			{
-				fprintf(stdout, "\rWriting block %u of %u at 0x%06x", blkIdx + 1, blkCnt, addr + (blkIdx * blkSize));
+				report(stdout, "\rWriting block %u of %u at 0x%06x", blkIdx + 1, blkCnt, addr + (blkIdx * blkSize));
 				fflush(stdout);
 				needEOL = true;
 			}
-			for (int i = 0; i < 3; i++)
-			{
-				if ((stat = doCommand(ESP_FLASH_DATA, blkBuf, blkBufSize, cksum)) == 0)
-					break;
-			}
-			if (stat != 0)
+			// the block is sent in place, released when its command completes
+			if ((stat = SubmitBlocks(ESP_FLASH_DATA, blk, 2, cksum, releaseBlock, &reader)) < 0)
 				goto done;
 		}
+		if ((stat = Drain()) != 0)
+			goto done;
+		progress(blkCnt * blkSize, blkCnt * blkSize);
 		if ((m_flags & ESP_QUIET) == 0)
 		{
-			fprintf(stdout, "\n%u bytes written successfully.\n", size);
+			report(stdout, "\n%u bytes written successfully", size);
+			if ((retries = m_stats.retries - retries) != 0)
+				report(stdout, " (%u block%s re-sent)", retries, (retries == 1) ? "" : "s");
+			report(stdout, ".\n");
 			fflush(stdout);
 			needEOL = false;
 		}
 	}
 
 done:
+	// the commands still in flight refer to the reader's blocks
+	if (m_reqCnt != 0)
+		Drain();
+	reader.Stop();
+	m_stats.readStalls += reader.Stalls();
+	m_stats.msReadStall += reader.StallTime();
 	if (needEOL && !(m_flags & ESP_QUIET))
 	{
-		fputs("\n", stdout);
+		report(stdout, "\n");
 		fflush(stdout);
 	}
 	return(stat);
@@ -617,11 +998,11 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 		uint8_t buf[8];
 		buf[0] = ESP_IMAGE_MAGIC;
 		buf[1] = (uint8_t)sectCnt;
-		putData(flashParm, 2, buf, 2);
-		putData(m_elf.GetEntry(), 4, buf, 4);
+		putLE(flashParm, 2, buf, 2);
+		putLE(m_elf.GetEntry(), 4, buf, 4);
 		if (vf.Write(buf, 1, sizeof(buf)) != sizeof(buf))
 		{
-			fprintf(stderr, "An error occurred writing the image header from \"%s\".\n", vf.Name());
+			report(stderr, "An error occurred writing the image header from \"%s\".\n", vf.Name());
 			return(ESP_ERROR_FILE_WRITE);
 		}
 		imageSize += sizeof(buf);
@@ -635,7 +1016,7 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 			// get the section number
 			if ((sectNum = m_elf.GetSectionNum(p)) == 0)
 			{
-				fprintf(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", p, m_elf.Filename());
+				report(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", p, m_elf.Filename());
 				return(ESP_ERROR_PARAM);
 			}
 			int sectIdx = sectNum - 1;
@@ -646,11 +1027,11 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 			uint32_t paddedSize = (segSize + 3) & 0xfffffffc;
 
 			// write the segment header
-			putData(m_elf.GetSectionAddress(sectIdx), 4, buf, 0);
-			putData(paddedSize, 4, buf, 4);
+			putLE(m_elf.GetSectionAddress(sectIdx), 4, buf, 0);
+			putLE(paddedSize, 4, buf, 4);
 			if (vf.Write(buf, sizeof(buf)) != sizeof(buf))
 			{
-				fprintf(stderr, "An error occurred writing a section header to \"%s\".\n", vf.Name());
+				report(stderr, "An error occurred writing a section header to \"%s\".\n", vf.Name());
 				return(ESP_ERROR_FILE_WRITE);
 			}
 			imageSize += sizeof(buf);
@@ -658,7 +1039,7 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 			// write the section data to the file
 			if ((stat = m_elf.WriteSection(sectIdx, vf, cksum, paddedSize)) < 0)
 			{
-				fprintf(stderr, "An error occurred writing a section data to \"%s\".\n", vf.Name());
+				report(stderr, "An error occurred writing a section data to \"%s\".\n", vf.Name());
 				return(stat);
 			}
 			imageSize += paddedSize;
@@ -673,7 +1054,7 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 				padBuf[padSize - 1] = cksum;
 				if (vf.Write(padBuf, padSize) != padSize)
 				{
-					fprintf(stderr, "An error occurred writing the image padding to \"%s\".\n", vf.Name());
+					report(stderr, "An error occurred writing the image padding to \"%s\".\n", vf.Name());
 					return(ESP_ERROR_FILE_WRITE);
 				}
 			}
@@ -682,11 +1063,11 @@ WriteSections(VFile& vf, const char *sectName, uint16_t flashParm, bool forceESP
 	}
 	else if ((sectNum = m_elf.GetSectionNum(sectName)) == 0)
 	{
-		fprintf(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", sectName, m_elf.Filename());
+		report(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", sectName, m_elf.Filename());
 		return(ESP_ERROR_PARAM);
 	}
 	else if ((stat = m_elf.WriteSection(sectNum - 1, vf, cksum)) < 0)
-		fprintf(stderr, "An error occurred writing the image file \"%s\".\n", vf.Name());
+		report(stderr, "An error occurred writing the image file \"%s\".\n", vf.Name());
 	vf.Flush();
 	return(stat);
 }
@@ -737,14 +1118,14 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 	const char *fmode = vfCombine.IsOpen() ? VFileOpenVirt : "wb";
 	if (imageData[imageCnt].vfile.Open(file, fmode) != 0)
 	{
-		fprintf(stderr, "Can't create image file \"%s\".\n", file);
+		report(stderr, "Can't create image file \"%s\".\n", file);
 		return(-1);
 	}
 	stat = WriteSections(imageData[imageCnt].vfile, ".text,.data,.rodata", flashParm);
 	if (stat != 0)
 		return(stat);
 	if ((m_flags & ESP_QUIET) == 0)
-		fprintf(stdout, "Created image file \"%s\".\n", file);
+		report(stdout, "Created image file \"%s\".\n", file);
 	imageCnt++;
 
 	// create the image for .irom0.text
@@ -755,7 +1136,7 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 
 		if ((sectNum = m_elf.GetSectionNum(sectName)) == 0)
 		{
-			fprintf(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", sectName, m_elf.Filename());
+			report(stderr, "Can't find section \"%s\" in the ELF file \"%s\".\n", sectName, m_elf.Filename());
 			return(-1);
 		}
 		int sectIdx = sectNum - 1;
@@ -764,7 +1145,7 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 		uint32_t sectAddr = m_elf.GetSectionAddress(sectIdx);
 		if (sectAddr <= FLASH_ADDR)
 		{
-			fprintf(stderr, "Invalid start address for section %s - 0x%08x\n", sectName, sectAddr);
+			report(stderr, "Invalid start address for section %s - 0x%08x\n", sectName, sectAddr);
 			return(-1);
 		}
 		sectAddr -= FLASH_ADDR;
@@ -783,18 +1164,18 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 		imageData[imageCnt].addr = sectAddr;
 		if (imageData[imageCnt].vfile.Open(file, fmode) != 0)
 		{
-			fprintf(stderr, "Can't create image file \"%s\".\n", file);
+			report(stderr, "Can't create image file \"%s\".\n", file);
 			return(-1);
 		}
 		stat = m_elf.WriteSection(sectIdx, imageData[imageCnt].vfile);
 		imageCnt++;
 		if (stat < 0)
 		{
-			fprintf(stderr, "An error occurred writing the image file \"%s\".\n", file);
+			report(stderr, "An error occurred writing the image file \"%s\".\n", file);
 			return(-1);
 		}
 		if ((m_flags & ESP_QUIET) == 0)
-			fprintf(stdout, "Created image file \"%s\".\n", file);
+			report(stdout, "Created image file \"%s\".\n", file);
 
 		if (vfCombine.IsOpen())
 		{
@@ -809,14 +1190,14 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 			{
 				file = imageData[i].name;
 				VFile& vf = imageData[i].vfile;
-				if (!vf.IsOpen() && (vf.Open(file, "rb") != 0))
+				if (!vf.IsOpen() && (vf.Open(file, VFileOpenMap) != 0))
 				{
-					fprintf(stderr, "Can't open the image file \"%s\".\n", file);
+					report(stderr, "Can't open the image file \"%s\".\n", file);
 					stat = ESP_ERROR_FILE_OPEN;
 				}
 				else if (vf.Position(0) != 0)
 				{
-					fprintf(stderr, "Can't reposition the image file \"%s\".\n", file);
+					report(stderr, "Can't reposition the image file \"%s\".\n", file);
 					stat = ESP_ERROR_FILE_SEEK;
 				}
 				else
@@ -826,12 +1207,12 @@ AutoExtract(VFile& vfCombine, uint16_t flashParm, bool padded, const char *image
 			}
 			if ((stat == 0) && ((m_flags & ESP_QUIET) == 0))
 			{
-				fprintf(stdout, "Combined \"%s\"", imageData[0].name);
+				report(stdout, "Combined \"%s\"", imageData[0].name);
 				if (imageCnt == 2)
-					fprintf(stdout, " and \"%s\"", imageData[1].name);
+					report(stdout, " and \"%s\"", imageData[1].name);
 				else
-					fprintf(stdout, ", \"%s\" and \"%s\"", imageData[1].name, imageData[2].name);
-				fprintf(stdout, " %s.\n", padded ? "with padding" : "sparsely");
+					report(stdout, ", \"%s\" and \"%s\"", imageData[1].name, imageData[2].name);
+				report(stdout, " %s.\n", padded ? "with padding" : "sparsely");
 			}
 		}
 		else
@@ -857,19 +1238,24 @@ DumpMem(VFile& vf, uint32_t address, uint32_t size, FILE *fpProgress)
 		// read from memory
 		if ((stat = ReadReg(address + ofst, val)) != 0)
 		{
-			fprintf(stderr, "%sAn error occurred while reading memory at 0x%08x (%d).\n",
+			report(stderr, "%sAn error occurred while reading memory at 0x%08x (%d).\n",
 					dotCnt ? "\n" : "", address + ofst, stat);
-			exit(1);
+			dotCnt = 0;
+			break;
 		}
 
 		// write to the file
 		if (vf.Write(&val, sizeof(val), 1) != 1)
 		{
-			fprintf(stderr, "%sAn error occurred while writing to \"%s\".\n", dotCnt ? "\n" : "", vf.Name());
-			exit(1);
+			report(stderr, "%sAn error occurred while writing to \"%s\".\n", dotCnt ? "\n" : "", vf.Name());
+			dotCnt = 0;
+			stat = ESP_ERROR_FILE_WRITE;
+			break;
 		}
 
 		// output a progress indicator
+		if (ofst && !(ofst & 0x00ff))
+			progress(ofst, size);
 		if (ofst && !(ofst & 0x00ff) && !(m_flags & ESP_QUIET) && (fpProgress != NULL))
 		{
 			if (++dotCnt >= 70)
@@ -888,7 +1274,7 @@ DumpMem(VFile& vf, uint32_t address, uint32_t size, FILE *fpProgress)
 		fflush(fpProgress);
 	}
 	if ((stat == 0) && !(m_flags & ESP_QUIET))
-		fprintf(stdout, "%u bytes written to \"%s\".\n", ofst, vf.Name());
+		report(stdout, "%u bytes written to \"%s\".\n", ofst, vf.Name());
 	return(stat);
 }
 
@@ -902,78 +1288,139 @@ int ESP::
 ReadMAC(uint8_t *mac, int len)
 {
 	int stat;
-	uint32_t mac0;
-	uint32_t mac1;
-	uint32_t mac2;
-	uint32_t mac3;
+	uint32_t reg[4];
 
 	if ((mac == NULL) || (len < 6))
 		return(ESP_ERROR_PARAM);
-	bool apAlso = (len >= 12);
-
-	if (((stat = ReadReg(ESP_OTP_MAC0, mac0)) == 0) &&
-			((stat = ReadReg(ESP_OTP_MAC1, mac1)) == 0) &&
-			((stat = ReadReg(ESP_OTP_MAC2, mac2)) == 0) &&
-			((stat = ReadReg(ESP_OTP_MAC3, mac3)) == 0))
-	{
-		if ((mac2 & 0x00008000) == 0)
-			return(ESP_ERROR_DEVICE);
-
-		// determine the OUI
-		uint8_t id = (uint8_t)(mac1 >> 16);
-		if (id == 0)
-		{
-			memcpy(mac + 0, "\x18\xfe\x34", 3);
-			if (apAlso)
-				memcpy(mac + 6, "\x1a\xfe\x34", 3);
-		}
-		else if (id == 1)
-		{
-			memcpy(mac + 0, "\xac\xd0\x74", 3);
-			if (apAlso)
-				memcpy(mac + 6, "\xac\xd0\x74", 3);
-		}
-		else
-		{
-			mac[0] = id;
-			return(ESP_ERROR_UNKNOWN_OUI);
-		}
-
-		// fill in the remainder of the MAC
-		mac[3] = (uint8_t)(mac1 >> 8);
-		mac[4] = (uint8_t)(mac1 >> 0);
-		mac[5] = (uint8_t)(mac0 >> 24);
-		if (apAlso)
-			memcpy(mac + 9, mac + 3, 3);
-	}
+	if (((stat = ReadReg(ESP_OTP_MAC0, reg[0])) == 0) &&
+			((stat = ReadReg(ESP_OTP_MAC1, reg[1])) == 0) &&
+			((stat = ReadReg(ESP_OTP_MAC2, reg[2])) == 0) &&
+			((stat = ReadReg(ESP_OTP_MAC3, reg[3])) == 0))
+		stat = DecodeMAC(reg, mac, len);
 	return(stat);
 }
 
 //
-// Send a command to the device to read a register.
+// Form the station and, optionally, the AP MAC from the values of the four
+// OTP MAC registers.  The buffer sizes are as for ReadMAC().
 //
 int ESP::
-ReadReg(uint32_t addr, uint32_t& val)
+DecodeMAC(const uint32_t *reg, uint8_t *mac, int len)
 {
-	uint8_t buf[4];
+	uint32_t mac0 = reg[0];
+	uint32_t mac1 = reg[1];
+	uint32_t mac2 = reg[2];
 
-	putData(addr, 4, buf);
-	return(doCommand(ESP_READ_REG, buf, sizeof(buf), 0, &val));
-}
+	if ((mac == NULL) || (len < 6))
+		return(ESP_ERROR_PARAM);
+	bool apAlso = (len >= 12);
 
-//
-// Send a command to the device to write a register.
-//
+	if ((mac2 & 0x00008000) == 0)
+		return(ESP_ERROR_DEVICE);
+
+	// determine the OUI
+	uint8_t id = (uint8_t)(mac1 >> 16);
+	if (id == 0)
+	{
+		memcpy(mac + 0, "\x18\xfe\x34", 3);
+		if (apAlso)
+			memcpy(mac + 6, "\x1a\xfe\x34", 3);
+	}
+	else if (id == 1)
+	{
+		memcpy(mac + 0, "\xac\xd0\x74", 3);
+		if (apAlso)
+			memcpy(mac + 6, "\xac\xd0\x74", 3);
+	}
+	else
+	{
+		mac[0] = id;
+		return(ESP_ERROR_UNKNOWN_OUI);
+	}
+
+	// fill in the remainder of the MAC
+	mac[3] = (uint8_t)(mac1 >> 8);
+	mac[4] = (uint8_t)(mac1 >> 0);
+	mac[5] = (uint8_t)(mac0 >> 24);
+	if (apAlso)
+		memcpy(mac + 9, mac + 3, 3);
+	return(0);
+}
+
+//
+// Prepare a copy of the Flash read stub with its parameters set.  The
+// buffer must have space for ESP_READ_STUB_MAX bytes.  The return value is
+// the length to download.
+//
+unsigned ESP::
+FlashReadStub(uint8_t *buf, uint32_t addr, uint32_t blkSize, uint32_t blkCnt)
+{
+	memcpy(buf, flashReadStub, sizeof(flashReadStub));
+	putLE(addr, 4, buf, 0);
+	putLE(blkSize, 4, buf, 4);
+	putLE(blkCnt, 4, buf, 8);
+	return(sizeof(flashReadStub) & 0xfffffffc);
+}
+
+//
+// Apply the retry policy for the class of an error that occurred while
+// performing a command that has already been re-sent the given number of
+// times.  The return value is the delay in milliseconds to observe before
+// re-sending the command or -1 if it should not be re-sent.
+//
+int ESP::
+RetryDelay(uint8_t op, int stat, unsigned retries)
+{
+	ErrorClass_t errClass = errorClass(stat);
+	const RetryPolicy_t *policy;
+	for (policy = retryPolicyList; policy->errClass != ErrorClassOther; policy++)
+	{
+		if (policy->errClass == errClass)
+			break;
+	}
+	if (!canRetry(op) || (retries >= policy->retries))
+		return(-1);
+	return(policy->msDelay);
+}
+
+//
+// Determine the result of a command from the body of its reply.
+//
+int ESP::
+ReplyStatus(const uint8_t *body, unsigned bodyLen)
+{
+	if ((bodyLen == 2) && (body[0] == 0x01))
+		return(romError(body[1]));
+	if ((bodyLen != 2) || body[0] || body[1])
+		return(ESP_ERROR_REPLY);
+	return(ESP_SUCCESS);
+}
+
+//
+// Send a command to the device to read a register.
+//
+int ESP::
+ReadReg(uint32_t addr, uint32_t& val)
+{
+	uint8_t buf[4];
+
+	putLE(addr, 4, buf);
+	return(doCommand(ESP_READ_REG, buf, sizeof(buf), 0, &val));
+}
+
+//
+// Send a command to the device to write a register.
+//
 int ESP::
 WriteReg(uint32_t addr, uint32_t value, uint32_t mask, uint32_t delay)
 {
 	uint8_t buf[16];
 
 	addr &= 0xfffffffc;
-	putData(addr, 4, buf, 0);
-	putData(value, 4, buf, 4);
-	putData(mask, 4, buf, 8);
-	putData(delay, 4, buf, 12);
+	putLE(addr, 4, buf, 0);
+	putLE(value, 4, buf, 4);
+	putLE(mask, 4, buf, 8);
+	putLE(delay, 4, buf, 12);
 	return(doCommand(ESP_WRITE_REG, buf, sizeof(buf)));
 }
 
@@ -991,7 +1438,7 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 	size_t sizeOut = vfOut.Size();
 	if (sizeOut < 0)
 	{
-		fprintf(stderr, "Can't determine the size of the combined file \"%s\".\n", vfOut.Name());
+		report(stderr, "Can't determine the size of the combined file \"%s\".\n", vfOut.Name());
 		return(ESP_ERROR_FILE_SIZE);
 	}
 	if (sizeOut == 0)
@@ -1000,19 +1447,19 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 	size_t sizeIn = vfImage.Size();
 	if (sizeIn < 0)
 	{
-		fprintf(stderr, "Can't determine the size of the image file \"%s\".\n", vfImage.Name());
+		report(stderr, "Can't determine the size of the image file \"%s\".\n", vfImage.Name());
 		return(ESP_ERROR_FILE_SIZE);
 	}
 	if (sizeIn == 0)
 	{
-		fprintf(stderr, "The image file \"%s\" is zero length.\n", vfImage.Name());
+		report(stderr, "The image file \"%s\" is zero length.\n", vfImage.Name());
 		return(ESP_ERROR_IMAGE_SIZE);
 	}
 
 	// confirm that the address for the image to be added is not below the current size
 	if (addr < m_imageSize)
 	{
-		fprintf(stderr, "The address specified for the image file \"%s\" is less than the current image size.\n", vfImage.Name());
+		report(stderr, "The address specified for the image file \"%s\" is less than the current image size.\n", vfImage.Name());
 		return(ESP_ERROR_FILE_READ);
 	}
 
@@ -1022,7 +1469,11 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 		// creating a padded image, pad up to the address for the image to be added
 		if (imageSize < addr)
 		{
-			vfOut.Fill(0xff, addr - imageSize);
+			// make room for the padding and the image together
+			if (vfOut.NeedSpace(addr - imageSize + sizeIn) != 0)
+				goto combinedWriteErr;
+			if (vfOut.Fill(0xff, addr - imageSize) != 0)
+				goto combinedWriteErr;
 			imageSize = addr;
 		}
 	}
@@ -1041,7 +1492,7 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 		else if (sizeOut & 0x03)
 		{
 			// this shouldn't happen
-			fprintf(stderr, "The combined file \"%s\" is not a multiple of 4 bytes in size.\n", vfOut.Name());
+			report(stderr, "The combined file \"%s\" is not a multiple of 4 bytes in size.\n", vfOut.Name());
 			return(ESP_ERROR_FILE_READ);
 		}
 		else
@@ -1049,12 +1500,12 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 			// update the "combined image" header for the additional image
 			if ((vfOut.Position(0) < 0) || (vfOut.Peek(buf, sizeof(buf)) != sizeof(buf)))
 			{
-				fprintf(stderr, "An error occurred while reading the combined file \"%s\".\n", vfOut.Name());
+				report(stderr, "An error occurred while reading the combined file \"%s\".\n", vfOut.Name());
 				return(ESP_ERROR_FILE_READ);
 			}
 			if (memcmp(buf, COMPOSITE_SIG, 3) != 0)
 			{
-				fprintf(stderr, "The combined file \"%s\" does not have the correct header.\n", vfOut.Name());
+				report(stderr, "The combined file \"%s\" does not have the correct header.\n", vfOut.Name());
 				return(ESP_ERROR_PARAM);
 			}
 			buf[3]++;
@@ -1065,35 +1516,28 @@ AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded)
 		if ((vfOut.Write(buf, sizeof(buf)) != sizeof(buf)) || (vfOut.Position(pos) < 0))
 		{
 combinedWriteErr:
-			fprintf(stderr, "An error occurred while writing the combined file \"%s\".\n", vfOut.Name());
+			report(stderr, "An error occurred while writing the combined file \"%s\".\n", vfOut.Name());
 			return(ESP_ERROR_FILE_WRITE);
 		}
 
 		// append a header for the new image consisting of the load address and size
 		uint8_t hdrBuf[8];
-		putData(addr, 4, hdrBuf, 0);
-		putData((sizeIn + 3) & 0xfffffffc, 4, hdrBuf, 4);
+		putLE(addr, 4, hdrBuf, 0);
+		putLE((sizeIn + 3) & 0xfffffffc, 4, hdrBuf, 4);
 		if (vfOut.Write(hdrBuf, 1, sizeof(hdrBuf)) != sizeof(hdrBuf))
 			goto combinedWriteErr;
 	}
 
 	// append the new image to the combined image
 	uint32_t bytesAdded;
-	vfOut.NeedSpace(sizeIn);
-	for (bytesAdded = 0; bytesAdded < sizeIn; )
+	if (vfOut.NeedSpace(sizeIn) != 0)
+		goto combinedWriteErr;
+	if ((bytesAdded = (uint32_t)vfOut.Copy(vfImage, sizeIn)) != sizeIn)
 	{
-		uint8_t tbuf[1024];
-		uint32_t part = sizeIn - bytesAdded;
-		if (part > sizeof(tbuf))
-			part = sizeof(tbuf);
-		if (vfImage.Read(tbuf, 1, part) != part)
-		{
-			fprintf(stderr, "An error occurred while reading the image file \"%s\".\n", vfImage.Name());
-			return(ESP_ERROR_FILE_READ);
-		}
-		if (vfOut.Write(tbuf, 1, part) != part)
+		if (!vfImage.EndOfFile())
 			goto combinedWriteErr;
-		bytesAdded += part;
+		report(stderr, "An error occurred while reading the image file \"%s\".\n", vfImage.Name());
+		return(ESP_ERROR_FILE_READ);
 	}
 
 	if (padded)
@@ -1117,7 +1561,7 @@ combinedWriteErr:
 
 	if ((m_flags & ESP_QUIET) == 0)
 	{
-		fprintf(stdout, "Added \"%s\" at 0x%08x, %u bytes.\n", vfImage.Name(), addr, bytesAdded);
+		report(stdout, "Added \"%s\" at 0x%08x, %u bytes.\n", vfImage.Name(), addr, bytesAdded);
 		fflush(stdout);
 	}
 	return(0);
@@ -1135,60 +1579,106 @@ ImageInfo(VFile& vf, FILE *fpOut)
 	if (!vf.IsOpen() || (fpOut == NULL))
 		return(ESP_ERROR_PARAM);
 
+	// read in the header of the file, check for the magic number
+	uint8_t buf[4];
+	if ((vf.Position(0) != 0) || (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf)))
+		return(ESP_ERROR_FILE_READ);
+	if ((buf[0] != ESP_IMAGE_MAGIC) && (memcmp(buf, COMPOSITE_SIG, 3) != 0))
+	{
+		report(stderr, "The file \"%s\" is neither a standard ESP image nor a combined image.\n", vf.Name());
+		return(ESP_ERROR_GENERAL);
+	}
+
+	ImageSeg_t seg[COMPOSITE_MAX_IMAGES];
+	unsigned segCnt;
+	bool combined;
+	if ((stat = ImageSegments(vf, 0, seg, segCnt, combined)) != 0)
+		return(stat);
+	fprintf(fpOut, "%s:\n", vf.Name());
+	if (!combined)
+		return(stdImageInfo(vf, seg[0], "", fpOut));
+
+	// output information about the images in a combined image file
+	fprintf(fpOut, "Combined image file containing %u images:\n", segCnt);
+	for (unsigned i = 0; i < segCnt; i++)
+	{
+		// output the segment information
+		fprintf(fpOut, "  Image %2u: Flash address 0x%06x, size 0x%06x\n", i, seg[i].addr, seg[i].size);
+
+		if ((vf.Position(seg[i].ofst) < 0) || (vf.Peek(buf, sizeof(buf)) != sizeof(buf)))
+			return(ESP_ERROR_FILE_READ);
+		if ((buf[0] == ESP_IMAGE_MAGIC) && ((stat = stdImageInfo(vf, seg[i], "    ", fpOut)) != 0))
+			return(stat);
+	}
+	return(0);
+}
+
+//
+// Determine the regions of an image file to be written to Flash.  A
+// combined image file has a region for each of its component images, each
+// with its own address.  Any other file is a single region written at the
+// given address.  The table is built by one pass over the descriptors so
+// that the regions may then be processed without parsing the file again.
+// The seg array must have room for COMPOSITE_MAX_IMAGES entries.  The
+// return value is zero on success, non-zero otherwise.
+//
+int ESP::
+ImageSegments(VFile& vf, uint32_t addr, ImageSeg_t *seg, unsigned& segCnt, bool& combined)
+{
+	segCnt = 0;
+	combined = false;
+
 	size_t fileSize = vf.Size();
 	if (fileSize < 0)
 	{
-		fprintf(stderr, "Can't determine the size of the image file \"%s\".\n", vf.Name());
+		report(stderr, "Can't determine the size of the image file \"%s\".\n", vf.Name());
 		return(ESP_ERROR_FILE_SIZE);
 	}
+	if (fileSize == 0)
+	{
+		report(stderr, "The image file \"%s\" is zero length.\n", vf.Name());
+		return(ESP_ERROR_FILE_SEEK);
+	}
 
-	// read in the header of the file, check for the magic number
-	uint8_t buf[4];
-	if ((vf.Position(0) != 0) || (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf)))
-		return(ESP_ERROR_FILE_READ);
-	if (buf[0] == ESP_IMAGE_MAGIC)
+	// read in the header of the file, check for a combined image file
+	uint8_t buf[8];
+	if ((vf.Position(0) != 0) || (vf.Peek(buf, 4) != 4))
 	{
-		fprintf(fpOut, "%s:\n", vf.Name());
-		stat = stdImageInfo(vf, 0, fileSize, "", fpOut);
-		return(stat);
+		report(stderr, "Can't read the image file \"%s\".\n", vf.Name());
+		return(ESP_ERROR_FILE_READ);
 	}
 	if (memcmp(buf, COMPOSITE_SIG, 3) != 0)
 	{
-		fprintf(stderr, "The file \"%s\" is neither a standard ESP image nor a combined image.\n", vf.Name());
-		return(ESP_ERROR_GENERAL);
+		seg[0].ofst = 0;
+		seg[0].size = (uint32_t)fileSize;
+		seg[0].addr = addr;
+		segCnt = 1;
+		return(0);
 	}
 
-	// output information about the images in a combined image file
-	uint16_t imageCnt = buf[3];
-	fprintf(fpOut, "%s:\n", vf.Name());
-	fprintf(fpOut, "Combined image file containing %u images:\n", imageCnt);
-	for (uint16_t i = 0; i < imageCnt; i++)
+	// each component image is preceded by its address and size
+	unsigned imageCnt = buf[3];
+	uint32_t pos = 4;
+	combined = true;
+	for (unsigned i = 0; i < imageCnt; i++)
 	{
-		uint8_t hdrBuf[8];
-
-		// read the segment descriptor
-		if (vf.Read(hdrBuf, 1, sizeof(hdrBuf)) != sizeof(hdrBuf))
+		if ((pos + sizeof(buf) > fileSize) || (vf.Position(pos) != 0) || (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf)))
 		{
-			fprintf(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
+			report(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
 			return(ESP_ERROR_FILE_READ);
 		}
-		uint32_t addr = getData(4, hdrBuf, 0);
-		uint32_t len = getData(4, hdrBuf, 4);
-		uint32_t pos = vf.Position();
-
-		// output the segment information
-		fprintf(fpOut, "  Image %2u: Flash address 0x%06x, size 0x%06x\n", i, addr, len);
-
-		if (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf))
-			return(ESP_ERROR_FILE_READ);
-		if ((buf[0] == ESP_IMAGE_MAGIC) && ((stat = stdImageInfo(vf, pos, len, "    ", fpOut)) != 0))
-			return(stat);
-		if (vf.Position(pos + len) < 0)
+		pos += sizeof(buf);
+		seg[i].addr = getLE(4, buf, 0);
+		seg[i].size = getLE(4, buf, 4);
+		seg[i].ofst = pos;
+		if (seg[i].size > fileSize - pos)
 		{
-			fprintf(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
-			return(ESP_ERROR_FILE_SEEK);
+			report(stderr, "Image %u of the file \"%s\" extends past the end of the file.\n", i, vf.Name());
+			return(ESP_ERROR_IMAGE_SIZE);
 		}
+		pos += seg[i].size;
 	}
+	segCnt = imageCnt;
 	return(0);
 }
 
@@ -1196,15 +1686,17 @@ ImageInfo(VFile& vf, FILE *fpOut)
 // Output information about a standard ESP8266 load image.
 //
 int ESP::
-stdImageInfo(VFile& vf, uint32_t ofst, uint32_t size, const char *prefix, FILE *fpOut)
+stdImageInfo(VFile& vf, const ImageSeg_t& seg, const char *prefix, FILE *fpOut)
 {
+	const uint32_t ofst = seg.ofst;
+	const uint32_t size = seg.size;
 	if (!vf.IsOpen() || (fpOut == NULL) || (size == 0))
 		return(ESP_ERROR_PARAM);
 
 	// seek to the offset of the file
 	if (vf.Position(ofst) < 0)
 	{
-		fprintf(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
+		report(stderr, "An error occurred while reading the image file \"%s\".\n", vf.Name());
 		return(ESP_ERROR_FILE_SEEK);
 	}
 
@@ -1214,12 +1706,12 @@ stdImageInfo(VFile& vf, uint32_t ofst, uint32_t size, const char *prefix, FILE *
 		return(ESP_ERROR_FILE_READ);
 	if (buf[0] != ESP_IMAGE_MAGIC)
 	{
-		fprintf(stderr, "The file \"%s\" is not a valid ESP image.\n", vf.Name());
+		report(stderr, "The file \"%s\" is not a valid ESP image.\n", vf.Name());
 		return(ESP_ERROR_GENERAL);
 	}
 
 	// get the Flash parameters
-	uint16_t flashParm = (uint16_t)getData(2, buf, 2);
+	uint16_t flashParm = (uint16_t)getLE(2, buf, 2);
 	fprintf(fpOut, "%sFlash parameters: ", prefix);
 	const NameValue_t *nvp;
 	char valStr[20];
@@ -1241,47 +1733,58 @@ stdImageInfo(VFile& vf, uint32_t ofst, uint32_t size, const char *prefix, FILE *
 
 	// display segment information, while calculating the checksum
 	uint8_t cksum = ESP_CHECKSUM_MAGIC;
-	uint8_t b;
+	uint8_t blk[4096];				// the data is read in blocks if not in memory
 	uint16_t segCnt = buf[1];
 	for (uint16_t i = 0; i < segCnt; i++)
 	{
 		// read the segment descriptor
 		if (vf.Read(buf, 1, sizeof(buf)) != sizeof(buf))
 		{
-			fprintf(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
+			report(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
 			return(ESP_ERROR_FILE_READ);
 		}
-		uint32_t addr = getData(4, buf, 0);
-		uint32_t len = getData(4, buf, 4);
+		uint32_t addr = getLE(4, buf, 0);
+		uint32_t len = getLE(4, buf, 4);
 
 		// output the segment information
 		fprintf(fpOut, "%ssegment %2u: address 0x%08x, size 0x%06x\n", prefix, i, addr, len);
 
-		// process the segment data
-		while (len--)
+		// process the segment data, in place if the image is in memory
+		size_t span = len;
+		const uint8_t *data;
+		if ((data = vf.Span(span)) != NULL)
+		{
+			if (span != len)
+			{
+				report(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
+				return(ESP_ERROR_FILE_READ);
+			}
+			cksum = XorBytes(data, span, cksum);
+			len = 0;
+		}
+		while (len)
 		{
-			if (vf.Read(&b, 1, 1) != 1)
+			uint32_t cnt = (len < sizeof(blk)) ? len : (uint32_t)sizeof(blk);
+			if (vf.Read(blk, 1, cnt) != cnt)
 			{
-				fprintf(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
+				report(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
 				return(ESP_ERROR_FILE_READ);
 			}
-			cksum ^= b;
+			cksum = XorBytes(blk, cnt, cksum);
+			len -= cnt;
 		}
 	}
 
 	// read the padding and the checksum byte
 	uint32_t pos = vf.Position() - ofst;
 	uint32_t cnt = 16 - (pos & 0x0f);
-	uint8_t lastByte = cksum;
-	while (cnt--)
+	if (vf.Read(blk, 1, cnt) != cnt)
 	{
-		if (vf.Read(&lastByte, 1, 1) != 1)
-		{
-			fprintf(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
-			return(ESP_ERROR_FILE_READ);
-		}
-		cksum ^= lastByte;
+		report(stderr, "An error occurred reading the image file \"%s\".\n", vf.Name());
+		return(ESP_ERROR_FILE_READ);
 	}
+	uint8_t lastByte = blk[cnt - 1];
+	cksum = XorBytes(blk, cnt, cksum);
 	fprintf(fpOut, "%sThe checksum is %scorrect: 0x%02x\n", prefix, (cksum == 0) ? "" : "in", lastByte);
 
 	pos = vf.Position() - ofst;
@@ -1303,209 +1806,568 @@ ResetDevice(ResetMode_t resetMode, bool forApp)
 {
 	if (IsCommOpen())
 	{
-		switch (resetMode)
-		{
-		case ResetAuto:		// DTR controls RST via a capacitor, RTS pulls down GPIO0
-			if (forApp)
-			{
-				m_serial.Control(SERIAL_DTR_HIGH);
-				msDelay(5);
-				m_serial.Control(SERIAL_DTR_LOW);
-			}
-			else
-			{
-				// reset into the bootloader by holding RTS low during bootup
-				m_serial.Control(SERIAL_DTR_LOW | SERIAL_RTS_HIGH);
-				msDelay(1);
-				m_serial.Control(SERIAL_DTR_HIGH);
-				msDelay(1);
-				m_serial.Control(SERIAL_DTR_LOW);
-				msDelay(100);
-				m_serial.Control(SERIAL_RTS_LOW);
-			}
-			break;
-
-		case ResetCK:		// RTS pulls down reset, DTR pulls down GPIO0
-			if (forApp)
-			{
-				// pulse the RTS line with DTR held inactive
-				m_serial.Control(SERIAL_RTS_HIGH | SERIAL_DTR_LOW);
-				msDelay(5);
-				m_serial.Control(SERIAL_RTS_LOW);
-			}
-			else
-			{
-				m_serial.Control(SERIAL_DTR_HIGH | SERIAL_RTS_HIGH);	// set RST and GPIO0 to zero
-				msDelay(5);
-				m_serial.Control(SERIAL_RTS_LOW);						// release RST
-				msDelay(75);
-				m_serial.Control(SERIAL_DTR_LOW);						// release GPIO0
-			}
-			break;
+		ResetStep_t step[RESET_MAX_STEPS];
+		unsigned stepCnt = ResetSteps(resetMode, forApp, step);
 
-		case ResetWifio:	// DTR controls RST via a capacitor, TxD controls GPIO0 via a diode (or PNP) 
-			// ensure that DTR is high
-			m_serial.Control(SERIAL_DTR_LOW);
-
-			// send a reset pulse
-			m_serial.Control(SERIAL_DTR_HIGH);
-			msDelay(5);
-			m_serial.Control(SERIAL_DTR_LOW);
-			if (!forApp)
-			{
-				// send a break and wait for it to complete
-				m_serial.Break(250);
-				msDelay(250);
-			}
-			break;
-
-		case ResetNodeMCU:	// DTR and RTS control GPIO0 and RST via NPN transistors
-			if (forApp)
-			{
-				// make DTR high, RTS low thus asserting reset
-				m_serial.Control(SERIAL_DTR_LOW | SERIAL_RTS_HIGH);
-				msDelay(5);
-				m_serial.Control(SERIAL_DTR_LOW | SERIAL_RTS_LOW);
-			}
-			else
-			{
-				// make DTR high, RTS low thus asserting reset
-				m_serial.Control(SERIAL_DTR_LOW | SERIAL_RTS_HIGH);
-				msDelay(5);
-
-				// switch both DTR and RTS to the opposite states, releasing RST and making GPIO0 low
-				m_serial.Control(SERIAL_DTR_HIGH | SERIAL_RTS_LOW);
-				msDelay(75);
-
-				// release GPIO0
-				m_serial.Control(SERIAL_RTS_HIGH);
-			}
-			break;
-
-		case ResetDTROnly:	// DTR controls RST via a capacitor and controls GPIO0 via a diode
-			m_serial.Control(SERIAL_DTR_HIGH);
-			if (forApp)
-				usDelay(10);
-			else
-				msDelay(100);
-			m_serial.Control(SERIAL_DTR_LOW);
-			break;
-
-		default:			// manual reset, nothing to do
-			break;
+		for (unsigned i = 0; i < stepCnt; i++)
+		{
+			if (step[i].control)
+				m_serial.Control(step[i].control);
+			if (step[i].msBreak)
+				m_serial.Break(step[i].msBreak);
+			if (step[i].usDelay >= 1000)
+				msDelay(step[i].usDelay / 1000);
+			else if (step[i].usDelay)
+				usDelay(step[i].usDelay);
 		}
 	}
 }
 
 //
-// Send a command to the device to begin the Flash process.
+// Get the sequence of steps that effects a device reset using the given
+// reset mode.  The 'step' parameter must have space for RESET_MAX_STEPS
+// entries.  The return value is the number of steps.
 //
-int ESP::
-flashBegin(uint32_t addr, uint32_t size)
+unsigned ESP::
+ResetSteps(ResetMode_t resetMode, bool forApp, ResetStep_t *step) const
 {
-	int stat;
+	ResetTiming_t timing;
+	unsigned cnt = 0;
 
-	// determine the number of blocks represented by the size
-	uint32_t blkCnt;
-	blkCnt = (size + ESP_FLASH_BLK_SIZE - 1) / ESP_FLASH_BLK_SIZE;
+	GetResetTiming(resetMode, timing);
+	#define ADD_STEP(c, b, us)	{ step[cnt].control = (c); step[cnt].msBreak = (b); step[cnt].usDelay = (us); cnt++; }
+	switch (resetMode)
+	{
+	case ResetAuto:		// DTR controls RST via a capacitor, RTS pulls down GPIO0
+		if (forApp)
+		{
+			ADD_STEP(SERIAL_DTR_HIGH, 0, 5000);
+			ADD_STEP(SERIAL_DTR_LOW, 0, 0);
+		}
+		else
+		{
+			// reset into the bootloader by holding RTS low during bootup
+			ADD_STEP(SERIAL_DTR_LOW | SERIAL_RTS_HIGH, 0, 1000);
+			ADD_STEP(SERIAL_DTR_HIGH, 0, timing.msReset * 1000);
+			ADD_STEP(SERIAL_DTR_LOW, 0, timing.msBoot * 1000);
+			ADD_STEP(SERIAL_RTS_LOW, 0, 0);
+		}
+		break;
 
-	// ensure that the address is on a block boundary
-	addr &= ~(ESP_FLASH_BLK_SIZE - 1);
+	case ResetCK:		// RTS pulls down reset, DTR pulls down GPIO0
+		if (forApp)
+		{
+			// pulse the RTS line with DTR held inactive
+			ADD_STEP(SERIAL_RTS_HIGH | SERIAL_DTR_LOW, 0, 5000);
+			ADD_STEP(SERIAL_RTS_LOW, 0, 0);
+		}
+		else
+		{
+			ADD_STEP(SERIAL_DTR_HIGH | SERIAL_RTS_HIGH, 0, timing.msReset * 1000);	// set RST and GPIO0 to zero
+			ADD_STEP(SERIAL_RTS_LOW, 0, timing.msBoot * 1000);						// release RST
+			ADD_STEP(SERIAL_DTR_LOW, 0, 0);											// release GPIO0
+		}
+		break;
+
+	case ResetWifio:	// DTR controls RST via a capacitor, TxD controls GPIO0 via a diode (or PNP) 
+		// ensure that DTR is high, then send a reset pulse
+		ADD_STEP(SERIAL_DTR_LOW, 0, 0);
+		ADD_STEP(SERIAL_DTR_HIGH, 0, timing.msReset * 1000);
+		ADD_STEP(SERIAL_DTR_LOW, 0, 0);
+		if (!forApp)
+		{
+			// send a break and wait for it to complete
+			ADD_STEP(0, timing.msBoot, timing.msBoot * 1000);
+		}
+		break;
 
-	// begin the Flash process
-	uint8_t buf[16];
-	putData(size, 4, buf, 0);
-	putData(blkCnt, 4, buf, 4);
-	putData(ESP_FLASH_BLK_SIZE, 4, buf, 8);
-	putData(addr, 4, buf, 12);
+	case ResetNodeMCU:	// DTR and RTS control GPIO0 and RST via NPN transistors
+		if (forApp)
+		{
+			// make DTR high, RTS low thus asserting reset
+			ADD_STEP(SERIAL_DTR_LOW | SERIAL_RTS_HIGH, 0, 5000);
+			ADD_STEP(SERIAL_DTR_LOW | SERIAL_RTS_LOW, 0, 0);
+		}
+		else
+		{
+			// make DTR high, RTS low thus asserting reset
+			ADD_STEP(SERIAL_DTR_LOW | SERIAL_RTS_HIGH, 0, timing.msReset * 1000);
 
-	unsigned timeout = size ? 10000 : DEF_TIMEOUT;
-	stat = doCommand(ESP_FLASH_BEGIN, buf, sizeof(buf), 0, NULL, timeout);
-	return(stat);
+			// switch both DTR and RTS to the opposite states, releasing RST and making GPIO0 low
+			ADD_STEP(SERIAL_DTR_HIGH | SERIAL_RTS_LOW, 0, timing.msBoot * 1000);
+
+			// release GPIO0
+			ADD_STEP(SERIAL_RTS_HIGH, 0, 0);
+		}
+		break;
+
+	case ResetDTROnly:	// DTR controls RST via a capacitor and controls GPIO0 via a diode
+		ADD_STEP(SERIAL_DTR_HIGH, 0, forApp ? 10 : timing.msReset * 1000);
+		ADD_STEP(SERIAL_DTR_LOW, 0, 0);
+		break;
+
+	default:			// manual reset, nothing to do
+		break;
+	}
+	#undef ADD_STEP
+	return(cnt);
 }
 
 //
-// Send a command to the device to terminate the Flash process.
+// Get the effective timing for the reset sequence of the given reset mode,
+// i.e. the values set by SetResetTiming() with the defaults for the mode
+// substituted for zero values.
 //
-int ESP::
-flashFinish(bool reboot)
+void ESP::
+GetResetTiming(ResetMode_t resetMode, ResetTiming_t& timing) const
 {
-	uint8_t buf[4];
-
-	putData(reboot ? 0 : 1, 4, buf);
-	return(doCommand(ESP_FLASH_END, buf, sizeof(buf)));
+	timing.msReset = 0;
+	timing.msBoot = 0;
+	if ((unsigned)resetMode < sizeof(resetTimingList) / sizeof(resetTimingList[0]))
+	{
+		timing = resetTimingList[resetMode];
+		if (m_resetTiming.msReset && timing.msReset)
+			timing.msReset = m_resetTiming.msReset;
+		if (m_resetTiming.msBoot && timing.msBoot)
+			timing.msBoot = m_resetTiming.msBoot;
+	}
 }
 
 //
-// Send a command to the device to begin writing to RAM.
+// Determine a reset mode and the shortest reset timing that reliably causes
+// the device to enter the bootloader.  If the 'resetMode' parameter is not
+// ResetNone only that mode is tried, otherwise each of the automatic modes
+// is tried in turn.  Each timing value is reduced in steps for as long as
+// RESET_TUNE_TRIALS consecutive attempts succeed and a small margin is then
+// added back.  If successful, the mode and timing are returned indirectly
+// and the device is left connected.
 //
 int ESP::
-ramBegin(uint32_t addr, uint32_t size, uint32_t blkSize, uint32_t blkCnt)
+TuneReset(ResetMode_t& resetMode, ResetTiming_t& timing)
 {
-	uint8_t buf[16];
+	static const ResetMode_t modeList[] = { ResetAuto, ResetNodeMCU, ResetCK, ResetDTROnly, ResetWifio };
+	static const uint16_t delayList[] = { 200, 150, 100, 75, 50, 35, 25, 15, 10, 5, 2, 1 };
+	const unsigned modeCnt = sizeof(modeList) / sizeof(modeList[0]);
+	const unsigned delayCnt = sizeof(delayList) / sizeof(delayList[0]);
+	bool quiet = ((m_flags & ESP_QUIET) != 0);
+
+	// find a reset mode that works using the default timing
+	ResetMode_t mode = ResetNone;
+	m_connected = false;
+	m_resetTiming.msReset = 0;
+	m_resetTiming.msBoot = 0;
+	for (unsigned i = 0; i < modeCnt; i++)
+	{
+		if ((resetMode != ResetNone) && (modeList[i] != resetMode))
+			continue;
+		if (!quiet)
+		{
+			report(stdout, "Trying reset mode \"%s\" ... ", ResetModeName(modeList[i]));
+			fflush(stdout);
+		}
+		bool ok = tryReset(modeList[i], 2);
+		if (!quiet)
+			report(stdout, "%s\n", ok ? "ok" : "failed");
+		if (ok)
+		{
+			mode = modeList[i];
+			break;
+		}
+	}
+	if (mode == ResetNone)
+	{
+		if (!quiet)
+			report(stdout, "No working reset mode was found.\n");
+		return(ESP_ERROR_CONNECT);
+	}
 
-	// populate the header
-	putData(size, 4, buf, 0);
-	putData(blkCnt, 4, buf, 4);
-	putData(blkSize, 4, buf, 8);
-	putData(addr, 4, buf, 12);
-	return(doCommand(ESP_MEM_BEGIN, buf, sizeof(buf)));
+	// reduce each of the delays, the boot time first since it is usually the longest
+	ResetTiming_t tuned;
+	GetResetTiming(mode, tuned);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		uint16_t& val = (pass == 0) ? tuned.msBoot : tuned.msReset;
+		if (val == 0)
+			// not used by this reset mode
+			continue;
+
+		uint16_t defVal = val;
+		uint16_t best = val;
+		for (unsigned i = 0; i < delayCnt; i++)
+		{
+			if (delayList[i] >= best)
+				continue;
+			val = delayList[i];
+			m_resetTiming = tuned;
+			if (!tryReset(mode, RESET_TUNE_TRIALS))
+				break;
+			best = delayList[i];
+		}
+
+		// add a margin of about 25% but don't exceed the default
+		val = best + (best / 4) + 1;
+		if (val > defVal)
+			val = defVal;
+	}
+	m_resetTiming = tuned;
+
+	// leave the device connected using the tuned values
+	if (!tryReset(mode, 1))
+	{
+		m_resetTiming.msReset = 0;
+		m_resetTiming.msBoot = 0;
+		return(ESP_ERROR_CONNECT);
+	}
+	m_connected = true;
+	resetMode = mode;
+	timing = tuned;
+	if (!quiet)
+	{
+		report(stdout, "Reset tuned: mode \"%s\", reset %ums, boot %ums\n",
+				ResetModeName(mode), tuned.msReset, tuned.msBoot);
+		fflush(stdout);
+	}
+	return(ESP_SUCCESS);
 }
 
 //
-// Send a block of data to the device to be stored in RAM.
+// Write a new UART divider to the device, switch to the corresponding speed
+// and confirm with a sync exchange.  The reply to the register write is
+// sent using the new divider so it is discarded.
 //
 int ESP::
-ramData(const uint8_t *data, unsigned dataLen, unsigned seq)
+setDivider(uint32_t clkDiv, uint32_t baud)
 {
-	// populate the data header
+	int stat;
 	uint8_t buf[16];
-	putData(dataLen, 4, buf, 0);
-	putData(seq, 4, buf, 4);
-	putData(0, 4, buf, 8);
-	putData(0, 4, buf, 12);
 
-	// populate the block list
-	DataBlock_t blockList[2];
-	blockList[0].dataLen = sizeof(buf);
-	blockList[0].data = buf;
-	blockList[1].dataLen = dataLen;
-	blockList[1].data = data;
+	putLE(UART0_CLKDIV_REG, 4, buf, 0);
+	putLE(clkDiv, 4, buf, 4);
+	putLE(UART_CLKDIV_MASK, 4, buf, 8);
+	putLE(0, 4, buf, 12);
+	if ((stat = sendCommand(ESP_WRITE_REG, 0, buf, sizeof(buf))) != 0)
+		return(stat);
 
-	// calculate the block checksum
-	unsigned cksum = checksum(data, dataLen);
+	// let the reply arrive, then switch speeds
+	msDelay(10);
+	if (SetCommSpeed(baud) != 0)
+		return(ESP_ERROR_PARAM);
+	msDelay(5);
+	FlushComm();
 
-	// execute the command
-	return(doCommand(ESP_MEM_DATA, blockList, 2, cksum));
+	for (int i = 0; i < 3; i++)
+	{
+		if ((stat = Sync(DEF_TIMEOUT)) == 0)
+			break;
+	}
+	return(stat);
 }
 
 //
-// Send a command to the device to finish writing to RAM.
+// Confirm that the link is reliable by repeatedly reading back the UART divider.
 //
-int ESP::
-ramFinish(uint32_t entryPoint)
+bool ESP::
+linkCheck(uint32_t clkDiv, unsigned count)
 {
-	uint8_t buf[8];
-
-	putData((entryPoint == 0), 4, buf, 0);
-	putData(entryPoint, 4, buf, 4);
-	return(doCommand(ESP_MEM_END, buf, sizeof(buf)));
+	while (count--)
+	{
+		uint32_t val;
+		if ((ReadReg(UART0_CLKDIV_REG, val) != 0) || ((val & UART_CLKDIV_MASK) != clkDiv))
+			return(false);
+	}
+	return(true);
 }
 
 //
-// Compute the checksum of a block of data.
+// Attempt to reset the device into the bootloader and synchronize with it
+// the given number of times in succession.  Return true if all attempts
+// were successful.
 //
-uint16_t ESP::
-checksum(const uint8_t *data, uint16_t dataLen, uint16_t cksum) const
+bool ESP::
+tryReset(ResetMode_t resetMode, unsigned trials)
 {
-	if (data != NULL)
+	while (trials--)
 	{
-		while (dataLen--)
-			cksum ^= (uint16_t)*data++;
+		bool synced = false;
+		ResetDevice(resetMode);
+		for (int i = 0; (i < 2) && !synced; i++)
+			synced = (Sync(DEF_TIMEOUT) == ESP_SUCCESS);
+		if (!synced)
+			return(false);
 	}
+	return(true);
+}
+
+//
+// Get the reset mode corresponding to a designator.
+//
+bool ESP::
+GetResetMode(const char *desc, ResetMode_t& resetMode) const
+{
+	if ((desc == NULL) || (*desc == '\0'))
+		return(false);
+	const NameValue_t *nvp;
+	if ((nvp = findNameValueEntry(resetModeList, desc)) == NULL)
+		return(false);
+	resetMode = (ResetMode_t)nvp->value;
+	return(true);
+}
+
+//
+// Get the initial states of the serial control signals for a reset mode.
+//
+unsigned ESP::
+ResetFlags(ResetMode_t resetMode) const
+{
+	switch (resetMode)
+	{
+	case ResetAuto:
+	case ResetNodeMCU:
+	case ResetCK:		return(SERIAL_DTR_LOW | SERIAL_RTS_LOW);
+	case ResetDTROnly:
+	case ResetWifio:	return(SERIAL_DTR_LOW);
+	default:			break;
+	}
+	return(0);
+}
+
+//
+// Get the designator for a reset mode.
+//
+const char *ESP::
+ResetModeName(ResetMode_t resetMode) const
+{
+	const NameValue_t *nvp;
+	if ((nvp = findNameValueEntry(resetModeList, (uint32_t)resetMode)) == NULL)
+		return("<unknown>");
+	return(nvp->name);
+}
+
+//
+// Send a command to the device to begin the Flash process.
+//
+int ESP::
+flashBegin(uint32_t addr, uint32_t size)
+{
+	int stat;
+
+	// determine the number of blocks represented by the size
+	uint32_t blkCnt;
+	blkCnt = (size + ESP_FLASH_BLK_SIZE - 1) / ESP_FLASH_BLK_SIZE;
+
+	// ensure that the address is on a block boundary
+	addr &= ~(ESP_FLASH_BLK_SIZE - 1);
+
+	// identify the Flash chip so that its learned erase time can be used
+	if (size && (m_profile != NULL) && !m_flashIDValid)
+	{
+		uint32_t flashID;
+		char section[20];
+		if (GetFlashID(flashID) == 0)
+		{
+			sprintf(section, "flash:%06x", m_flashID);
+			if (!m_profile->GetVal(section, "erase-ms-mb", m_eraseTime))
+				m_eraseTime = 0;
+		}
+	}
+
+	// begin the Flash process
+	uint8_t buf[16];
+	putLE(size, 4, buf, 0);
+	putLE(blkCnt, 4, buf, 4);
+	putLE(ESP_FLASH_BLK_SIZE, 4, buf, 8);
+	putLE(addr, 4, buf, 12);
+
+	unsigned tickStart = getTickCount();
+	stat = doCommand(ESP_FLASH_BEGIN, buf, sizeof(buf), 0, NULL, cmdTimeout(sizeof(buf), size));
+	if ((stat == 0) && (size >= ERASE_LEARN_MIN))
+		learnEraseTime(size, getTickCount() - tickStart);
+	return(stat);
+}
+
+//
+// Compute the time allowed for a command to complete.  This comprises a
+// fixed allowance for latency, the time to transmit the command and reply
+// at the current speed assuming worst-case SLIP expansion and, if the
+// command erases Flash, the expected erase time.  The erase time is based
+// on the rate learned for the Flash chip with a generous margin or, if
+// not yet known, on a conservative default rate.
+//
+unsigned ESP::
+cmdTimeout(unsigned dataLen, uint32_t eraseSize)
+{
+	return(CmdTimeout(m_baud, dataLen, eraseSize, m_eraseTime));
+}
+
+//
+// Compute the time allowed for a command at a given speed, the erase time
+// in ms per MB being zero if not known.
+//
+unsigned ESP::
+CmdTimeout(unsigned long baud, unsigned dataLen, uint32_t eraseSize, uint32_t eraseTime)
+{
+	if (baud == 0)
+		baud = 115200;
+	unsigned long bits = ((unsigned long)dataLen * 2 + (2 * (8 + 2)) + 4) * 10;
+	unsigned timeout = CMD_LATENCY + (unsigned)((bits * 1000 + baud - 1) / baud);
+
+	if (eraseSize)
+	{
+		double mb = (double)eraseSize / (1024.0 * 1024.0);
+		if (eraseTime)
+			timeout += 500 + (unsigned)(2.0 * eraseTime * mb);
+		else
+		{
+			unsigned msErase = (unsigned)(ERASE_MS_PER_MB * mb);
+			timeout += (msErase < ERASE_MIN_TIMEOUT) ? ERASE_MIN_TIMEOUT : msErase;
+		}
+	}
+	return(timeout);
+}
+
+//
+// Update the erase time for the Flash chip based on the time taken by an
+// erase operation.  The learned value follows increases immediately but
+// decreases only gradually so that an unusually fast erase doesn't lead to
+// a spurious timeout later.  The value is recorded in the profile in a
+// section for the Flash ID.
+//
+void ESP::
+learnEraseTime(uint32_t eraseSize, unsigned msElapsed)
+{
+	char section[20];
+	uint32_t msPerMB = (uint32_t)((double)msElapsed * (1024.0 * 1024.0) / eraseSize);
+
+	if ((m_profile == NULL) || !m_flashIDValid || (msPerMB == 0))
+		return;
+	sprintf(section, "flash:%06x", m_flashID);
+	if (msPerMB < m_eraseTime)
+		msPerMB = ((m_eraseTime * 3) + msPerMB) / 4;
+	m_eraseTime = msPerMB;
+	m_profile->SetVal(section, "erase-ms-mb", m_eraseTime);
+}
+
+//
+// Send a command to the device to terminate the Flash process.
+//
+int ESP::
+flashFinish(bool reboot)
+{
+	uint8_t buf[4];
+
+	putLE(reboot ? 0 : 1, 4, buf);
+	return(doCommand(ESP_FLASH_END, buf, sizeof(buf)));
+}
+
+//
+// Send a command to the device to begin writing to RAM.
+//
+int ESP::
+ramBegin(uint32_t addr, uint32_t size, uint32_t blkSize, uint32_t blkCnt)
+{
+	uint8_t buf[16];
+
+	// populate the header
+	putLE(size, 4, buf, 0);
+	putLE(blkCnt, 4, buf, 4);
+	putLE(blkSize, 4, buf, 8);
+	putLE(addr, 4, buf, 12);
+	return(doCommand(ESP_MEM_BEGIN, buf, sizeof(buf)));
+}
+
+//
+// Send a block of data to the device to be stored in RAM.
+//
+int ESP::
+ramData(const uint8_t *data, unsigned dataLen, unsigned seq)
+{
+	// populate the data header
+	uint8_t buf[16];
+	putLE(dataLen, 4, buf, 0);
+	putLE(seq, 4, buf, 4);
+	putLE(0, 4, buf, 8);
+	putLE(0, 4, buf, 12);
+
+	// populate the block list
+	DataBlock_t blockList[2];
+	blockList[0].dataLen = sizeof(buf);
+	blockList[0].data = buf;
+	blockList[1].dataLen = dataLen;
+	blockList[1].data = data;
+
+	// calculate the block checksum
+	unsigned cksum = Checksum(data, dataLen);
+
+	// execute the command
+	return(doCommand(ESP_MEM_DATA, blockList, 2, cksum));
+}
+
+//
+// Send a command to the device to finish writing to RAM.
+//
+int ESP::
+ramFinish(uint32_t entryPoint)
+{
+	uint8_t buf[8];
+
+	putLE((entryPoint == 0), 4, buf, 0);
+	putLE(entryPoint, 4, buf, 4);
+	return(doCommand(ESP_MEM_END, buf, sizeof(buf)));
+}
+
+//
+// Compute the checksum of a block of data.
+//
+uint16_t ESP::
+Checksum(const uint8_t *data, unsigned dataLen, uint16_t cksum)
+{
+	if (data != NULL)
+		cksum ^= XorBytes(data, dataLen);
 	return(cksum);
 }
 
+//
+// Prepare a block of an image as the data of a FLASH_DATA command.  The
+// buffer receives the 16-byte command header followed, unless the data
+// can be sent as it is, by the content of the block padded with 0xff and
+// with the Flash parameters patched into the first block of an image
+// loaded at address 0.  The data may already be in the buffer.  The return
+// value is a pointer to the block content, its checksum being returned
+// indirectly.
+//
+const uint8_t *ESP::
+FlashBlock(uint8_t *blk, uint32_t blkIdx, const uint8_t *data, uint32_t cnt,
+		uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask, uint16_t& cksum)
+{
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+	uint8_t *blkData = blk + 16;
+	bool patch = ((blkIdx == 0) && (addr == 0) && flashParmMask && cnt && (data[0] == ESP_IMAGE_MAGIC));
+
+	putLE(blkSize, 4, blk, 0);
+	putLE(blkIdx, 4, blk, 4);
+	putLE(0, 4, blk, 8);
+	putLE(0, 4, blk, 12);
+
+	// a whole block that needn't be changed is used in place
+	if ((cnt == blkSize) && !patch)
+	{
+		cksum = Checksum(data, blkSize);
+		return(data);
+	}
+
+	if (data != blkData)
+		memcpy(blkData, data, cnt);
+	if (cnt < blkSize)
+		memset(blkData + cnt, 0xff, blkSize - cnt);
+	if (patch)
+	{
+		uint32_t flashParm = getLE(2, blkData + 2) & ~(uint32_t)flashParmMask;
+		putLE(flashParm | flashParmVal, 2, blkData + 2);
+	}
+	cksum = Checksum(blkData, blkSize);
+	return(blkData);
+}
+
 //
 // Send a block of data performing SLIP encoding of the content.
 //
@@ -1607,16 +2469,23 @@ readByte(uint8_t& data, bool slipDecode, unsigned msTimeout)
 			stat = ESP_ERROR_TIMEOUT;
 			break;
 		}
+		m_serial.Wait(WAIT_INTERVAL);
 	}
 	return(stat);
 }
 
 //
-// Wait for a data packet to be returned.  If the body of the packet is
-// non-zero length, return an allocated buffer indirectly containing the
-// data and return the data length.  Note that if the pointer for returning
-// the data buffer is NULL, the response is expected to be two bytes of
-// zero.
+// Wait for a data packet to be returned.  If a buffer is supplied, the body
+// of the packet is stored there and the body length is returned; a body
+// that doesn't fit in the buffer is an error.  Otherwise, the body is stored
+// in the reply buffer of the object and is expected to be two bytes of zero.
+// In that case, an error status reported by the ROM is returned as the
+// corresponding ESP_ERROR_ROM_* value.  No memory is allocated.
+//
+// Data preceding the start of a frame is skipped, as are complete frames
+// that aren't a response to the command (e.g. a late reply to a previous
+// attempt).  A frame that is cut short by the start of another frame is
+// abandoned in favor of the new frame.
 //
 // If an error occurs, return a negative value.  Otherwise, return the number
 // of bytes in the response (or zero if the response was not the standard
@@ -1626,14 +2495,15 @@ readByte(uint8_t& data, bool slipDecode, unsigned msTimeout)
 // time out.
 //
 int ESP::
-readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
+readPacket(uint8_t op, uint32_t *valp, uint8_t *buf, unsigned bufSize, unsigned msTimeout)
 {
 	// these values are the states for the state machine
 	#define PKT_BEGIN		0
 	#define PKT_HEADER		1
 	#define PKT_BODY		2
 	#define PKT_END			3
-	#define PKT_DONE		4
+	#define PKT_SKIP		4
+	#define PKT_DONE		5
 
 	#define HDR_LEN			8
 
@@ -1642,12 +2512,15 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 	uint16_t hdrIdx = 0;
 	uint16_t bodyLen = 0;
 	uint16_t bodyIdx = 0;
-	uint8_t *dbuf = NULL;
-	uint8_t respBuf[2];
-	uint8_t *body = NULL;
+	bool skipping = false;
+	int frameErr = 0;
 
-	if (bufpp != NULL)
-		*bufpp = NULL;
+	// use the reply buffer if the caller didn't supply one
+	if (buf == NULL)
+	{
+		buf = m_reply;
+		bufSize = sizeof(m_reply);
+	}
 
 	// wait for the response
 	uint16_t needBytes = 1;
@@ -1662,10 +2535,8 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 
 		if (BytesAvailable() < needBytes)
 		{
-			// insufficient data available
-#if defined(WIN32)
-			Yield();
-#endif
+			// insufficient data available, wait for more without spinning
+			m_serial.Wait(WAIT_INTERVAL);
 			continue;
 		}
 
@@ -1673,35 +2544,69 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 		switch(state)
 		{
 		case PKT_BEGIN:		// expecting frame start
-		case PKT_END:		// expecting frame end
 			c = m_serial.ReadByte();
-			if (c != 0xc0)
-			{
-				delete[] dbuf;
-				return(ESP_ERROR_SLIP_FRAME);
-			}
-			if (state == PKT_BEGIN)
+			if (c == 0xc0)
 			{
 				state = PKT_HEADER;
 				needBytes = 2;
+				hdrIdx = 0;
+				skipping = false;
 			}
-			else
+			else if (!skipping)
+			{
+				// skip extraneous data up to the next frame
+				m_stats.resyncs++;
+				skipping = true;
+			}
+			break;
+
+		case PKT_END:		// expecting frame end
+			c = m_serial.ReadByte();
+			if (c == 0xc0)
 				state = PKT_DONE;
+			else
+			{
+				// the frame is longer than indicated, discard it
+				m_stats.framingErrors++;
+				frameErr = ESP_ERROR_SLIP_FRAME;
+				state = PKT_SKIP;
+			}
+			break;
+
+		case PKT_SKIP:		// discarding the remainder of a frame
+			c = m_serial.ReadByte();
+			if (c == 0xc0)
+			{
+				if (frameErr)
+					return(frameErr);
+				state = PKT_BEGIN;
+			}
 			break;
 
 		case PKT_HEADER:	// reading an 8-byte header
 		case PKT_BODY:		// reading the response body
 			// retrieve a byte with SLIP decoding
 			stat = m_serial.ReadByte(c, true);
-			if ((stat != 1) && (stat != 2))
+			if (stat == -1)
 			{
-				// some error occurred
-				if ((stat == 0) || (stat == -2))
-					stat = ESP_ERROR_SLIP_DATA;
-				else
-					stat = ESP_ERROR_SLIP_FRAME;
-				delete[] dbuf;
-				return(stat);
+				// a frame delimiter, the start of a new frame
+				if ((state == PKT_BODY) || (hdrIdx != 0))
+				{
+					// the current frame was cut short, abandon it
+					m_stats.framingErrors++;
+					m_stats.resyncs++;
+				}
+				state = PKT_HEADER;
+				hdrIdx = 0;
+				bodyIdx = 0;
+			}
+			else if ((stat != 1) && (stat != 2))
+			{
+				// invalid SLIP data, discard the remainder of the frame
+				m_stats.framingErrors++;
+				frameErr = ESP_ERROR_SLIP_DATA;
+				needBytes = 1;
+				state = PKT_SKIP;
 			}
 			else if (state == PKT_HEADER)
 			{
@@ -1713,23 +2618,23 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 					uint8_t opRet;
 
 					// the header has been read, extract elements from it
-					resp = (uint8_t)getData(1, hdr, 0);
-					opRet = (uint8_t)getData(1, hdr, 1);
+					resp = (uint8_t)getLE(1, hdr, 0);
+					opRet = (uint8_t)getLE(1, hdr, 1);
 					if ((resp != 0x01) || (op && (opRet != op)))
-						return(ESP_ERROR_RESP_HDR);
+					{
+						// not the expected reply, discard it and continue waiting
+						m_stats.staleReplies++;
+						needBytes = 1;
+						state = PKT_SKIP;
+						break;
+					}
 
-					// get the body length, prepare a buffer for it
-					bodyLen = (uint16_t)getData(2, hdr, 2);
-					if ((bufpp == NULL) && (bodyLen <= sizeof(respBuf)))
-						// use a local buffer
-						body = respBuf;
-					else
-						// allocate space for the data
-						body = dbuf = new uint8_t[needBytes];
+					// get the body length
+					bodyLen = (uint16_t)getLE(2, hdr, 2);
 
 					// extract the value, if requested
 					if (valp != NULL)
-						*valp = getData(4, hdr, 4);
+						*valp = getLE(4, hdr, 4);
 
 					if (bodyLen)
 						state = PKT_BODY;
@@ -1743,7 +2648,9 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 			else
 			{
 				//store the response body byte, check for completion
-				body[bodyIdx++] = c;
+				if (bodyIdx < bufSize)
+					buf[bodyIdx] = c;
+				bodyIdx++;
 				if (bodyIdx >= bodyLen)
 				{
 					needBytes = 1;
@@ -1753,20 +2660,27 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 			break;
 
 		default:		// this shouldn't happen
-			delete[] dbuf;
 			return(ESP_ERROR_SLIP_STATE);
 			break;
 		}
 	}
 
-	if (bufpp != NULL)
-		*bufpp = dbuf;
-	else
+	if (bodyLen > bufSize)
 	{
-		// return of the data buffer isn't requested, just check size and content
-		if ((body == NULL) || (bodyLen != 2) || body[0] || body[1])
+		m_stats.framingErrors++;
+		return(ESP_ERROR_REPLY);
+	}
+	if (buf == m_reply)
+	{
+		// return of the body isn't requested, just check size and content
+		if ((bodyLen == 2) && (buf[0] == 0x01))
+		{
+			// the ROM reported an error
+			m_stats.romErrors++;
+			return(romError(buf[1]));
+		}
+		if ((bodyLen != 2) || buf[0] || buf[1])
 			bodyLen = 0;
-		delete[] dbuf;
 	}
 	return(bodyLen);
 
@@ -1775,6 +2689,7 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 	#undef PKT_HEADER
 	#undef PKT_BODY
 	#undef PKT_END
+	#undef PKT_SKIP
 	#undef PKT_DONE
 }
 
@@ -1783,7 +2698,7 @@ readPacket(uint8_t op, uint32_t *valp, uint8_t **bufpp, unsigned msTimeout)
 // The data is supplied via a list of one or more seqments.
 //
 int ESP::
-sendCommand(uint8_t op, uint32_t checkVal, const DataBlock_t *blockList, unsigned dataBlockCnt)
+sendCommand(uint8_t op, uint32_t checkVal, const DataBlock_t *blockList, unsigned dataBlockCnt, bool flush)
 {
 	int stat = 0;
 
@@ -1802,27 +2717,28 @@ sendCommand(uint8_t op, uint32_t checkVal, const DataBlock_t *blockList, unsigne
 
 		// populate the header
 		uint8_t hdr[8];
-		putData(0, 1, hdr, 0);
-		putData(op, 1, hdr, 1);
-		putData(dataLen, 2, hdr, 2);
-		putData(checkVal, 4, hdr, 4);
-
-		// send the packet
-		FlushComm();
+		putLE(0, 1, hdr, 0);
+		putLE(op, 1, hdr, 1);
+		putLE(dataLen, 2, hdr, 2);
+		putLE(checkVal, 4, hdr, 4);
+
+		// send the packet, discarding stale input unless replies are outstanding
+		if (flush)
+			FlushComm();
 		stat = writePacket(hdr, sizeof(hdr), blockList, dataBlockCnt);
 	}
 	return(stat);
 }
 
 int ESP::
-sendCommand(uint8_t op, uint32_t checkVal, const uint8_t *data, unsigned dataLen)
+sendCommand(uint8_t op, uint32_t checkVal, const uint8_t *data, unsigned dataLen, bool flush)
 {
 	DataBlock_t dataBlock;
 
 	dataBlock.data = data;
 	dataBlock.dataLen = dataLen;
 
-	return(sendCommand(op, checkVal, &dataBlock, 1));
+	return(sendCommand(op, checkVal, &dataBlock, 1, flush));
 }
 
 //
@@ -1832,18 +2748,11 @@ sendCommand(uint8_t op, uint32_t checkVal, const uint8_t *data, unsigned dataLen
 int ESP::
 doCommand(uint8_t op, const DataBlock_t *blockList, unsigned blockCnt, uint32_t checkVal, uint32_t *valp, unsigned msTimeout)
 {
-	int stat;
+	int ticket;
 
-	if ((stat = sendCommand(op, checkVal, blockList, blockCnt)) == 0)
-	{
-		// command sent successfully, read the reply
-		stat = readPacket(op, valp, NULL, msTimeout);
-		if (stat == 2)
-			stat = ESP_SUCCESS;
-		else
-			stat = ESP_ERROR_REPLY;
-	}
-	return(stat);
+	if ((ticket = Submit(op, blockList, blockCnt, checkVal, NULL, NULL, msTimeout)) < 0)
+		return(ticket);
+	return(Wait(ticket, valp));
 }
 
 int ESP::
@@ -1858,48 +2767,489 @@ doCommand(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal,
 	return(stat);
 }
 
-/** private functions **/
-
 //
-// Extract 1-4 bytes of a value in little endian order from a buffer
-// beginning at a specified offset.
+// Read the reply to the oldest command in flight, re-sending it and those
+// sent after it according to the retry policy for the class of error.  If
+// the command fails, those sent after it are abandoned.  The return value
+// is the result of the command.
 //
-static uint32_t
-getData(unsigned byteCnt, const uint8_t *buf, int ofst)
+int ESP::
+completeRequest()
 {
+	Request_t& req = request(0);
 	uint32_t val = 0;
+	int stat;
 
-	if (buf && byteCnt)
+	if (m_reqCnt == 0)
+		return(ESP_ERROR_PARAM);
+	for (unsigned retries = 0; ; retries++)
 	{
-		int shiftCnt = 0;
-		if (byteCnt > 4)
-			byteCnt = 4;
-		do
+		if ((stat = req.sendStat) == 0)
 		{
-			val |= (uint32_t)buf[ofst++] << shiftCnt;
-			shiftCnt += 8;
-		} while (--byteCnt);
+			// command sent successfully, read the reply
+			stat = readPacket(req.op, &val, NULL, 0, req.msTimeout);
+			if (stat == 2)
+				stat = ESP_SUCCESS;
+			else if (stat >= 0)
+			{
+				m_stats.framingErrors++;
+				stat = ESP_ERROR_REPLY;
+			}
+		}
+		if (stat == ESP_SUCCESS)
+			break;
+		if (stat == ESP_ERROR_TIMEOUT)
+			m_stats.timeouts++;
+
+		// apply the retry policy for the class of error
+		int msRetryDelay = RetryDelay(req.op, stat, retries);
+		if (msRetryDelay < 0)
+			break;
+		m_stats.retries++;
+
+		// discard the replies to the later commands, they will be sent again
+		unsigned i;
+		for (i = 1; i < m_reqCnt; i++)
+		{
+			if (request(i).sendStat == 0)
+				readPacket(request(i).op, NULL, NULL, 0, request(i).msTimeout);
+		}
+		if (msRetryDelay)
+			msDelay(msRetryDelay);
+
+		// a slow reply may be late rather than lost, allow more time
+		if ((stat == ESP_ERROR_TIMEOUT) && req.msTimeout)
+			req.msTimeout += req.msTimeout / 2;
+
+		for (i = 0; i < m_reqCnt; i++)
+			request(i).sendStat = sendRequest(request(i), i == 0);
 	}
-	return(val);
+	finishRequest(stat, val);
+
+	if (stat != 0)
+	{
+		// abandon the commands sent after the failed one
+		while (m_reqCnt)
+		{
+			if (request(0).sendStat == 0)
+				readPacket(request(0).op, NULL, NULL, 0, request(0).msTimeout);
+			finishRequest(ESP_ERROR_ABORTED, 0);
+		}
+	}
+	return(stat);
 }
 
 //
-// Put 1-4 bytes of a value in little endian order into a buffer
-// beginning at a specified offset.
+// Complete the oldest commands in flight until the window has room for
+// another.  The return value is zero on success or the error of the
+// command that failed.
 //
-static void
-putData(uint32_t val, unsigned byteCnt, uint8_t *buf, int ofst)
+int ESP::
+makeRoom()
 {
-	if (buf && byteCnt)
+	int stat;
+
+	while (m_reqCnt >= m_window)
 	{
-		if (byteCnt > 4)
-			byteCnt = 4;
-		do
+		if ((stat = completeRequest()) != 0)
+			return(stat);
+	}
+	return(0);
+}
+
+//
+// Send a command whose data has been attached to the next request entry,
+// adding it to the commands in flight.  The return value is its ticket.
+//
+int ESP::
+queueRequest(Request_t& req, uint8_t op, uint32_t checkVal, unsigned dataLen,
+		ESPCallback_t callback, void *arg, unsigned msTimeout)
+{
+	req.op = op;
+	req.checkVal = checkVal;
+	req.msTimeout = (msTimeout == CMD_TIMEOUT_AUTO) ? cmdTimeout(dataLen) : msTimeout;
+	req.callback = callback;
+	req.arg = arg;
+	req.ticket = m_nextTicket;
+	m_nextTicket = (m_nextTicket + 1) & 0x7fffffff;
+
+	// a failure to send is handled when the reply is awaited
+	req.sendStat = sendRequest(req, m_reqCnt == 0);
+	m_reqCnt++;
+	m_stats.commands++;
+	return(req.ticket);
+}
+
+//
+// Send or re-send a command in flight, writing a pre-encoded frame in a
+// single operation.
+//
+int ESP::
+sendRequest(Request_t& req, bool flush)
+{
+	if (req.blockCnt != 0)
+		return(sendCommand(req.op, req.checkVal, req.block, req.blockCnt, flush));
+	if (req.frame == NULL)
+		return(sendCommand(req.op, req.checkVal, req.data, req.dataLen, flush));
+	if (flush)
+		FlushComm();
+	return((m_serial.Write(req.frame, req.frameLen) == req.frameLen) ? 0 : ESP_ERROR_COMM_WRITE);
+}
+
+//
+// Record the result of the oldest command in flight, remove it from the
+// window and invoke its callback.
+//
+void ESP::
+finishRequest(int stat, uint32_t val)
+{
+	Request_t& req = request(0);
+	Result_t& res = m_result[req.ticket % ESP_RESULT_HISTORY];
+	ESPCallback_t callback = req.callback;
+
+	res.ticket = req.ticket;
+	res.stat = stat;
+	res.val = val;
+	m_reqHead = (m_reqHead + 1) % ESP_MAX_INFLIGHT;
+	m_reqCnt--;
+	if (callback != NULL)
+		callback(req.arg, res.ticket, stat, val);
+}
+
+/*
+ ** Submit
+ *
+ * Send a command to the attached device without waiting for the reply.  The
+ * data is copied so the caller's buffer may be reused immediately.  If the
+ * number of commands in flight has reached the window size, the oldest is
+ * completed first.  The callback, if given, is invoked when the command
+ * completes.
+ *
+ * The return value is a non-negative ticket that may be passed to Wait()
+ * or, if completing an earlier command failed, that command's error code
+ * (the new command not having been sent).
+ *
+ * Replies are matched to commands in the order that the commands were sent.
+ * If a command fails but may be retried, it and the commands sent after it
+ * are re-sent in order.
+ *
+ */
+int ESP::
+Submit(uint8_t op, const DataBlock_t *blockList, unsigned blockCnt, uint32_t checkVal,
+		ESPCallback_t callback, void *arg, unsigned msTimeout)
+{
+	int stat;
+
+	if ((stat = makeRoom()) != 0)
+		return(stat);
+
+	// copy the command data
+	unsigned dataLen = 0;
+	unsigned i;
+	for (i = 0; blockList && (i < blockCnt); i++)
+	{
+		if (blockList[i].data)
+			dataLen += blockList[i].dataLen;
+	}
+	Request_t& req = request(m_reqCnt);
+	if (dataLen > req.dataSize)
+	{
+		delete[] req.data;
+		req.data = new uint8_t[dataLen];
+		req.dataSize = dataLen;
+	}
+	req.dataLen = 0;
+	for (i = 0; blockList && (i < blockCnt); i++)
+	{
+		if (blockList[i].data)
 		{
-			buf[ofst++] = (uint8_t)(val & 0xff);
-			val >>= 8;
-		} while (--byteCnt);
+			memcpy(req.data + req.dataLen, blockList[i].data, blockList[i].dataLen);
+			req.dataLen += blockList[i].dataLen;
+		}
+	}
+	req.frame = NULL;
+	req.frameLen = 0;
+	req.blockCnt = 0;
+	return(queueRequest(req, op, checkVal, dataLen, callback, arg, msTimeout));
+}
+
+//
+// Send a command that has already been SLIP encoded, e.g. from a packet
+// cache, without waiting for the reply.  The frame isn't copied and must
+// remain valid until the command completes.  The data length is that of
+// the command's data before encoding, used to compute the timeout.  In
+// other respects, this is the same as Submit().
+//
+int ESP::
+SubmitFrame(uint8_t op, const uint8_t *frame, unsigned frameLen, unsigned dataLen,
+		ESPCallback_t callback, void *arg, unsigned msTimeout)
+{
+	int stat;
+
+	if ((frame == NULL) || (frameLen == 0))
+		return(ESP_ERROR_PARAM);
+	if ((stat = makeRoom()) != 0)
+		return(stat);
+
+	Request_t& req = request(m_reqCnt);
+	req.dataLen = 0;
+	req.frame = frame;
+	req.frameLen = frameLen;
+	req.blockCnt = 0;
+	return(queueRequest(req, op, 0, dataLen, callback, arg, msTimeout));
+}
+
+//
+// Send a command without waiting for the reply or copying its data.  The
+// data blocks must remain valid until the command completes, which the
+// callback may be used to learn.  In other respects, this is the same as
+// Submit().
+//
+int ESP::
+SubmitBlocks(uint8_t op, const DataBlock_t *blockList, unsigned blockCnt, uint32_t checkVal,
+		ESPCallback_t callback, void *arg, unsigned msTimeout)
+{
+	int stat;
+
+	if ((blockList == NULL) || (blockCnt == 0) || (blockCnt > ESP_HELD_BLOCKS))
+		return(ESP_ERROR_PARAM);
+	if ((stat = makeRoom()) != 0)
+		return(stat);
+
+	Request_t& req = request(m_reqCnt);
+	unsigned dataLen = 0;
+	for (unsigned i = 0; i < blockCnt; i++)
+	{
+		req.block[i] = blockList[i];
+		if (blockList[i].data)
+			dataLen += blockList[i].dataLen;
+	}
+	req.blockCnt = blockCnt;
+	req.dataLen = 0;
+	req.frame = NULL;
+	req.frameLen = 0;
+	return(queueRequest(req, op, checkVal, dataLen, callback, arg, msTimeout));
+}
+
+int ESP::
+Submit(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal,
+		ESPCallback_t callback, void *arg, unsigned msTimeout)
+{
+	DataBlock_t dataBlock;
+
+	dataBlock.data = data;
+	dataBlock.dataLen = dataLen;
+	return(Submit(op, &dataBlock, 1, checkVal, callback, arg, msTimeout));
+}
+
+//
+// Wait for a submitted command to complete, completing those sent before it
+// as well.  The return value is the result of the command or ESP_ERROR_PARAM
+// if the ticket is unknown or its result is no longer retained.
+//
+int ESP::
+Wait(int ticket, uint32_t *valp)
+{
+	if (ticket < 0)
+		return(ESP_ERROR_PARAM);
+	while (1)
+	{
+		unsigned i;
+		for (i = 0; i < m_reqCnt; i++)
+		{
+			if (request(i).ticket == ticket)
+				break;
+		}
+		if (i >= m_reqCnt)
+			break;
+		completeRequest();
+	}
+
+	const Result_t& res = m_result[ticket % ESP_RESULT_HISTORY];
+	if (res.ticket != ticket)
+		return(ESP_ERROR_PARAM);
+	if (valp != NULL)
+		*valp = res.val;
+	return(res.stat);
+}
+
+//
+// Complete the commands whose replies have begun to arrive, without waiting
+// for others.  The return value is the number of commands completed or, if
+// one failed, its error code.
+//
+int ESP::
+Poll()
+{
+	int cnt = 0;
+	int stat;
+
+	while (m_reqCnt && m_serial.Available())
+	{
+		if ((stat = completeRequest()) != 0)
+			return(stat);
+		cnt++;
+	}
+	return(cnt);
+}
+
+//
+// Wait for all of the commands in flight to complete.  The return value is
+// zero if all succeeded, otherwise the error code of the first that failed.
+//
+int ESP::
+Drain()
+{
+	int stat = 0;
+
+	while (m_reqCnt)
+	{
+		int s = completeRequest();
+		if (stat == 0)
+			stat = s;
+	}
+	return(stat);
+}
+
+//
+// Set the most commands that may be in flight.  A window of one gives the
+// conventional exchange of a command and its reply.  Because a reply carries
+// no sequence number, a command lost while others are in flight can't be
+// identified reliably so a larger window should be used only on a link that
+// doesn't drop data.
+//
+void ESP::
+SetWindow(unsigned window)
+{
+	if (window < 1)
+		window = 1;
+	else if (window > ESP_MAX_INFLIGHT)
+		window = ESP_MAX_INFLIGHT;
+	m_window = window;
+}
+
+//
+// Reset the command and error counts.
+//
+void ESP::
+ClearStats()
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+//
+// Output the command and error counts.
+//
+void ESP::
+ShowStats(FILE *fp) const
+{
+	fprintf(fp, "Commands:        %lu\n", (unsigned long)m_stats.commands);
+	fprintf(fp, "Retries:         %lu\n", (unsigned long)m_stats.retries);
+	fprintf(fp, "Timeouts:        %lu\n", (unsigned long)m_stats.timeouts);
+	fprintf(fp, "Framing errors:  %lu\n", (unsigned long)m_stats.framingErrors);
+	fprintf(fp, "ROM errors:      %lu\n", (unsigned long)m_stats.romErrors);
+	fprintf(fp, "Resyncs:         %lu\n", (unsigned long)m_stats.resyncs);
+	fprintf(fp, "Stale replies:   %lu\n", (unsigned long)m_stats.staleReplies);
+	fprintf(fp, "Reader stalls:   %lu (%lu ms)\n", (unsigned long)m_stats.readStalls,
+			(unsigned long)m_stats.msReadStall);
+}
+
+//
+// Output a message to a standard stream or, if one has been set, pass it to
+// the log function.
+//
+void ESP::
+report(FILE *fp, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (m_logFunc == NULL)
+		vfprintf(fp, fmt, ap);
+	else
+	{
+		char msg[MAX_FILENAME + 200];
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		msg[sizeof(msg) - 1] = '\0';
+		m_logFunc(m_logArg, (fp == stderr) ? ESP_LOG_ERROR : ESP_LOG_INFO, msg);
 	}
+	va_end(ap);
+}
+
+/** private functions **/
+
+//
+// Convert an error code reported by the ROM to the corresponding status value.
+//
+static int
+romError(uint8_t code)
+{
+	switch (code)
+	{
+	case 0x05:	return(ESP_ERROR_ROM_MESSAGE);
+	case 0x06:	return(ESP_ERROR_ROM_FAILED);
+	case 0x07:	return(ESP_ERROR_ROM_CRC);
+	case 0x08:	return(ESP_ERROR_ROM_FLASH_WRITE);
+	case 0x09:	return(ESP_ERROR_ROM_FLASH_READ);
+	case 0x0a:	return(ESP_ERROR_ROM_READ_LENGTH);
+	case 0x0b:	return(ESP_ERROR_ROM_DEFLATE);
+	}
+	return(ESP_ERROR_ROM_STATUS);
+}
+
+//
+// Determine the class of an error for the purpose of choosing a retry policy.
+//
+static ErrorClass_t
+errorClass(int stat)
+{
+	switch (stat)
+	{
+	case ESP_ERROR_TIMEOUT:
+	case ESP_ERROR_COMM_READ:
+	case ESP_ERROR_COMM_WRITE:
+		return(ErrorClassLink);
+
+	case ESP_ERROR_REPLY:
+	case ESP_ERROR_RESP_HDR:
+	case ESP_ERROR_SLIP_START:
+	case ESP_ERROR_SLIP_FRAME:
+	case ESP_ERROR_SLIP_STATE:
+	case ESP_ERROR_SLIP_DATA:
+	case ESP_ERROR_SLIP_END:
+	case ESP_ERROR_ROM_STATUS:
+		return(ErrorClassFrame);
+
+	case ESP_ERROR_ROM_MESSAGE:
+	case ESP_ERROR_ROM_CRC:
+		return(ErrorClassData);
+
+	case ESP_ERROR_ROM_FAILED:
+	case ESP_ERROR_ROM_FLASH_WRITE:
+	case ESP_ERROR_ROM_FLASH_READ:
+		return(ErrorClassDevice);
+	}
+	return(ErrorClassOther);
+}
+
+//
+// Determine if a command may be re-sent after an error.  Sync attempts are
+// repeated by the caller while the commands that end a download may have
+// taken effect even if the reply was lost.
+//
+static bool
+canRetry(uint8_t op)
+{
+	return((op != ESP_SYNC) && (op != ESP_FLASH_END) && (op != ESP_MEM_END));
+}
+
+//
+// Release a block of a BlockReader once the command that sent it completes.
+//
+static void
+releaseBlock(void *arg, int, int, uint32_t)
+{
+	((BlockReader *)arg)->Release();
 }
 
 /*
@@ -36,13 +36,25 @@
 #endif
 #include "serial.h"
 #include "elf.h"
+#include "profile.h"
 
 #define MAX_FILENAME				1024		// the longest filename that can be handled
 
 #define DEF_TIMEOUT					500			// default timeout in milliseconds
+#define ESP_REPLY_SIZE				16			// the longest reply body retained
+#define ESP_READ_STUB_MAX			128			// space needed for the Flash read stub
+#define ESP_MAX_INFLIGHT			8			// the most commands that may await a reply
+#define ESP_HELD_BLOCKS				2			// the most data blocks held by a command in flight
+#define ESP_RESULT_HISTORY			16			// the number of completed command results retained
+#define CMD_TIMEOUT_AUTO			0xffffffff	// compute the timeout for the command
+#define CMD_LATENCY					100			// allowance for device and adapter latency (ms)
+#define ERASE_MS_PER_MB				30000		// assumed erase time when not yet learned
+#define ERASE_MIN_TIMEOUT			10000		// minimum erase timeout when not yet learned
+#define ERASE_LEARN_MIN				0x10000		// the smallest erase used to learn the erase rate
 
 // debugging code values
 #define DIAG_NO_TIME_LIMIT			0x0001
+#define DIAG_SHOW_STATS				0x0002
 
 // ESP8266 command codes
 #define ESP_FLASH_BEGIN				0x02
@@ -66,11 +78,14 @@
 #define FLASH_FREQ_MASK				0x0f00
 
 #define ESP_FLASH_BLK_SIZE			0x0400		// 1K byte blocks
+#define ESP_FLASH_SECTOR_SIZE		0x1000		// the unit of erasure
+#define ESP_STREAM_CHUNK			0x10000		// the part of a stream erased and written at once
 #define ESP_RAM_BLOCK_SIZE			0x0400		// 1K byte blocks
 
 #define ESP_NO_ADDRESS				(uint32_t)(~(ESP_FLASH_BLK_SIZE - 1))
 
 #define COMPOSITE_SIG				"esp"
+#define COMPOSITE_MAX_IMAGES		255			// the count of images is one byte
 #define ESP_IMAGE_MAGIC				0xe9
 #define ESP_CHECKSUM_MAGIC			0xef
 
@@ -82,6 +97,8 @@
 #define IRAM_ADDR					0x40100000	// instruction RAM
 #define FLASH_ADDR					0x40200000	// address of start of Flash
 #define FLASH_READ_STUB_BEGIN		IRAM_ADDR + 0x18
+#define UART0_CLKDIV_REG			0x60000014	// UART0 baud rate divider
+#define UART_CLKDIV_MASK			0x000fffff
 
 // this macro expands a value to four bytes in little-endian order
 #define LE_BYTES(v)					(((v) >> 0) & 0xff), (((v) >> 8) & 0xff), (((v) >> 16) & 0xff), (((v) >> 24) & 0xff)
@@ -118,6 +135,17 @@
 #define ESP_ERROR_IMAGE_SIZE		-24
 #define ESP_ERROR_DEVICE			-25
 #define ESP_ERROR_FILENAME_LENGTH	-26
+#define ESP_ERROR_BAUD				-27
+#define ESP_ERROR_ROM_MESSAGE		-28			// the ROM reported an invalid message
+#define ESP_ERROR_ROM_FAILED		-29			// the ROM failed to perform the command
+#define ESP_ERROR_ROM_CRC			-30			// the ROM reported a checksum mismatch
+#define ESP_ERROR_ROM_FLASH_WRITE	-31			// the ROM reported a Flash write error
+#define ESP_ERROR_ROM_FLASH_READ	-32			// the ROM reported a Flash read error
+#define ESP_ERROR_ROM_READ_LENGTH	-33			// the ROM reported a read length error
+#define ESP_ERROR_ROM_DEFLATE		-34			// the ROM reported a decompression error
+#define ESP_ERROR_ROM_STATUS		-35			// the ROM reported an unrecognized error
+#define ESP_ERROR_ABORTED			-36			// an earlier command in flight failed
+#define ESP_ERROR_VERIFY			-37			// the content of Flash differs from the image
 
 // structure for associating name-value pairs
 typedef struct
@@ -132,6 +160,14 @@ typedef struct
 	const uint8_t *data;		// the data block
 } DataBlock_t;
 
+// a region of an image file and the Flash address at which it is written
+typedef struct
+{
+	uint32_t ofst;				// the offset of the region in the file
+	uint32_t size;				// the size of the region
+	uint32_t addr;				// the Flash address of the region
+} ImageSeg_t;
+
 extern uint16_t diagCode;
 
 typedef enum
@@ -144,6 +180,54 @@ typedef enum
 	ResetNodeMCU,				// DTR and RTS control RST and GPIO0 via transistors
 } ResetMode_t;
 
+// timing of the reset sequence, a zero value selects the default for the reset mode
+typedef struct
+{
+	uint16_t msReset;			// the time that reset is asserted
+	uint16_t msBoot;			// the time that GPIO0 is held low after reset is released
+} ResetTiming_t;
+
+#define RESET_TUNE_TRIALS			3			// consecutive successes required when tuning
+#define RESET_MAX_STEPS				6			// the most steps in a reset sequence
+
+// one step of a reset sequence: set the control lines, send a break, then wait
+typedef struct
+{
+	uint16_t control;			// SERIAL_DTR_xxx | SERIAL_RTS_xxx, zero for no change
+	uint16_t msBreak;			// the length of a break to send, zero for none
+	uint32_t usDelay;			// the time to wait before the next step
+} ResetStep_t;
+
+// counts of the commands and errors on the serial link
+typedef struct
+{
+	uint32_t commands;			// commands issued
+	uint32_t retries;			// commands re-sent after an error
+	uint32_t timeouts;			// replies not received in time
+	uint32_t framingErrors;		// malformed or truncated reply frames
+	uint32_t romErrors;			// error status reported by the ROM
+	uint32_t resyncs;			// times that extraneous data was skipped
+	uint32_t staleReplies;		// replies discarded for not matching the command
+	uint32_t readStalls;		// times that an image block wasn't read when needed
+	uint32_t msReadStall;		// the time spent waiting for image blocks to be read
+} CommStats_t;
+
+// the function called when a submitted command completes
+typedef void (*ESPCallback_t)(void *arg, int ticket, int stat, uint32_t val);
+
+// the levels of the messages passed to a log function
+#define ESP_LOG_INFO				0			// progress and results (normally to stdout)
+#define ESP_LOG_ERROR				1			// errors (normally to stderr)
+
+// the function called to output a message, replacing the standard streams
+typedef void (*ESPLog_t)(void *arg, int level, const char *msg);
+
+// the function called as data is transferred to or from the device
+typedef void (*ESPProgress_t)(void *arg, uint32_t done, uint32_t total);
+
+class PacketCache;
+class PacketPatch;
+
 class ESP
 {
 public:
@@ -153,28 +237,62 @@ public:
 	int Sync(uint16_t timeout);
 	int Connect(ResetMode_t resetMode = ResetNone);
 	int Run(bool reboot = false);
+	int ChangeBaud(uint32_t baud);
+	int ProbeBaud(ResetMode_t resetMode, uint32_t& baud);
 	void ResetDevice(ResetMode_t resetMode, bool forApp = false);
+	int TuneReset(ResetMode_t& resetMode, ResetTiming_t& timing);
+	void SetResetTiming(const ResetTiming_t& timing) { m_resetTiming = timing; }
+	void GetResetTiming(ResetMode_t resetMode, ResetTiming_t& timing) const;
+	bool GetResetMode(const char *desc, ResetMode_t& resetMode) const;
+	const char *ResetModeName(ResetMode_t resetMode) const;
+	unsigned ResetFlags(ResetMode_t resetMode) const;
+	unsigned ResetSteps(ResetMode_t resetMode, bool forApp, ResetStep_t *step) const;
 	int GetFlashID(uint32_t& flashID);
+	void SetProfile(Profile *profile) { m_profile = profile; }
+	void SetLog(ESPLog_t func, void *arg) { m_logFunc = func; m_logArg = arg; }
+	void SetProgress(ESPProgress_t func, void *arg) { m_progressFunc = func; m_progressArg = arg; }
 	int FlashErase();
 	int FlashErase(uint32_t addr, uint32_t length);
 	int FlashRead(VFile& vf, uint32_t addr, uint32_t length);
 	int FlashWrite(VFile& vf, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int FlashWrite(const PacketCache& cache, const PacketPatch *patch = NULL);
 	int ReadMAC(uint8_t *macp, int len);
 	int ReadReg(uint32_t addr, uint32_t& valp);
 	int WriteReg(uint32_t addr, uint32_t value, uint32_t mask = 0xffffffff, uint32_t delay = 0);
 	int DumpMem(VFile& vf, uint32_t address, uint32_t size, FILE *fpProgress = stderr);
 	int ImageInfo(VFile& vf, FILE *fpOut = stdout);
 	int AddImage(VFile& vfOut, VFile& vfImage, uint32_t addr, bool padded);
+	int ImageSegments(VFile& vf, uint32_t addr, ImageSeg_t *seg, unsigned& segCnt, bool& combined);
 
 	bool IsCommOpen() { return(m_serial.IsOpen()); }
-	void OpenComm(const char *portStr, unsigned baud, unsigned flags = 0);
+	bool IsConnected() const { return(m_connected); }
+	int OpenComm(const char *portStr, unsigned baud, unsigned flags = 0);
 	void FlushComm() { m_serial.Flush(); }
-	int CloseComm() { return(m_serial.Close()); }
-	int SetCommSpeed(unsigned long speed) { return(m_serial.SetSpeed(speed)); }
+	int CloseComm() { m_connected = false; m_reqCnt = 0; return(m_serial.Close()); }
+	int SetCommSpeed(unsigned long speed) { m_baud = speed; return(m_serial.SetSpeed(speed)); }
+	unsigned long GetCommSpeed() const { return(m_baud); }
+	const CommStats_t& GetStats() const { return(m_stats); }
+	void ClearStats();
+	void ShowStats(FILE *fp = stdout) const;
 	unsigned BytesAvailable() { return(m_serial.Available()); }
 	void WriteByte(uint8_t b) { m_serial.WriteByte(b); }
 	uint8_t ReadByte() { uint8_t b; return((m_serial.ReadByte(b) == 1) ? b : 0); }
 
+	int Submit(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal = 0,
+			ESPCallback_t callback = NULL, void *arg = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+	int Submit(uint8_t op, const DataBlock_t *blockList, unsigned blockCnt, uint32_t checkVal = 0,
+			ESPCallback_t callback = NULL, void *arg = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+	int SubmitFrame(uint8_t op, const uint8_t *frame, unsigned frameLen, unsigned dataLen,
+			ESPCallback_t callback = NULL, void *arg = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+	int SubmitBlocks(uint8_t op, const DataBlock_t *blockList, unsigned blockCnt, uint32_t checkVal = 0,
+			ESPCallback_t callback = NULL, void *arg = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+	int Wait(int ticket, uint32_t *valp = NULL);
+	int Poll();
+	int Drain();
+	unsigned InFlight() const { return(m_reqCnt); }
+	void SetWindow(unsigned window);
+	unsigned GetWindow() const { return(m_window); }
+
 	bool FlashMode(const char *desc, uint16_t& flashMode) const;
 	bool FlashSize(const char *desc, uint16_t& flashSize) const;
 	bool FlashFreq(const char *desc, uint16_t& flashFreq) const;
@@ -194,41 +312,115 @@ public:
 	void SetSize(uint32_t size) { m_size = size; }
 	uint32_t GetSize() const { return(m_size); }
 
+	// protocol elements shared with other session implementations
+	static uint16_t Checksum(const uint8_t *data, unsigned dataLen, uint16_t cksum = ESP_CHECKSUM_MAGIC);
+	static const uint8_t *FlashBlock(uint8_t *blk, uint32_t blkIdx, const uint8_t *data, uint32_t cnt,
+			uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask, uint16_t& cksum);
+	static unsigned CmdTimeout(unsigned long baud, unsigned dataLen, uint32_t eraseSize = 0, uint32_t eraseTime = 0);
+	static int ReplyStatus(const uint8_t *body, unsigned bodyLen);
+	static int RetryDelay(uint8_t op, int stat, unsigned retries);
+	static int DecodeMAC(const uint32_t *reg, uint8_t *mac, int len);
+	static unsigned FlashReadStub(uint8_t *buf, uint32_t addr, uint32_t blkSize, uint32_t blkCnt);
+
 private:
 	ESP(const ESP&);
 	ESP& operator=(const ESP&);
-	uint16_t checksum(const uint8_t *data, uint16_t dataLen, uint16_t cksum = ESP_CHECKSUM_MAGIC) const;
+
+	// a command that has been submitted and awaits its reply
+	typedef struct
+	{
+		int ticket;					// identifies the command to the submitter
+		uint8_t op;					// the command
+		uint32_t checkVal;			// the checksum for the header
+		uint8_t *data;				// a copy of the command data
+		unsigned dataLen;			// the length of the command data
+		unsigned dataSize;			// the size of the data buffer
+		const uint8_t *frame;		// the encoded command, if supplied in place of the data
+		unsigned frameLen;
+		DataBlock_t block[ESP_HELD_BLOCKS];	// the data blocks, if held in place of a copy
+		unsigned blockCnt;
+		unsigned msTimeout;			// the time allowed for the reply
+		ESPCallback_t callback;		// the function to call on completion, may be NULL
+		void *arg;					// the parameter for the callback
+		int sendStat;				// the result of sending the command
+	} Request_t;
+
+	// the outcome of a completed command
+	typedef struct
+	{
+		int ticket;					// identifies the command
+		int stat;					// the result
+		uint32_t val;				// the value from the reply header
+	} Result_t;
+
+	bool tryReset(ResetMode_t resetMode, unsigned trials);
+	int setDivider(uint32_t clkDiv, uint32_t baud);
+	bool linkCheck(uint32_t clkDiv, unsigned count);
+	unsigned cmdTimeout(unsigned dataLen, uint32_t eraseSize = 0);
+	void learnEraseTime(uint32_t eraseSize, unsigned msElapsed);
 
 	int ramBegin(uint32_t addr, uint32_t size, uint32_t blkSize, uint32_t blkCnt = 1);
 	int ramData(const uint8_t *data, unsigned dataLen, unsigned seq = 0);
 	int ramFinish(uint32_t entryPoint = 0);
 	int flashBegin(uint32_t addr, uint32_t size);
 	int flashFinish(bool reboot = false);
-	int flashWrite(VFile& vf, uint32_t ofst, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int flashWrite(VFile& vf, const ImageSeg_t& seg, uint16_t flashParmVal, uint16_t flashParmMask);
+	int flashStream(VFile& vf, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int streamImage(VFile& vf, uint8_t *buf, uint32_t have, uint32_t size, uint32_t addr,
+			uint16_t flashParmVal, uint16_t flashParmMask, uint32_t& written);
 
 	int writePacket(const uint8_t *data, unsigned len);
 	int writePacket(const uint8_t *hdr, unsigned hdrLen, const DataBlock_t *blockList, unsigned dataBlockCnt);
 	int writePacket(const uint8_t *hdr, unsigned hdrLen, const uint8_t *data, unsigned dataLen);
-	int readPacket(uint8_t op, uint32_t *valp = NULL, uint8_t **bufpp = NULL, unsigned msTimeout = DEF_TIMEOUT);
+	int readPacket(uint8_t op, uint32_t *valp = NULL, uint8_t *buf = NULL, unsigned bufSize = 0, unsigned msTimeout = DEF_TIMEOUT);
 	int readByte(uint8_t& data, bool slipDecode = false, unsigned msTimeout = 0);
-	int sendCommand(uint8_t op, uint32_t checkVal, const DataBlock_t *blockList, unsigned dataBlockCnt);
-	int sendCommand(uint8_t op, uint32_t checkVal, const uint8_t *data, unsigned dataLen);
-	int doCommand(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal = 0, uint32_t *valp = NULL, unsigned msTimeout = DEF_TIMEOUT);
-	int doCommand(uint8_t op, const DataBlock_t *blockList, unsigned dataBlockCnt, uint32_t checkVal = 0, uint32_t *valp = NULL, unsigned msTimeout = DEF_TIMEOUT);
-
-	int stdImageInfo(VFile& vf, uint32_t ofst, uint32_t size, const char *prefix, FILE *fpOut = stdout);
+	int sendCommand(uint8_t op, uint32_t checkVal, const DataBlock_t *blockList, unsigned dataBlockCnt, bool flush = true);
+	int sendCommand(uint8_t op, uint32_t checkVal, const uint8_t *data, unsigned dataLen, bool flush = true);
+	int completeRequest();
+	int makeRoom();
+	int queueRequest(Request_t& req, uint8_t op, uint32_t checkVal, unsigned dataLen,
+			ESPCallback_t callback, void *arg, unsigned msTimeout);
+	int sendRequest(Request_t& req, bool flush);
+	void finishRequest(int stat, uint32_t val);
+	Request_t& request(unsigned idx) { return(m_req[(m_reqHead + idx) % ESP_MAX_INFLIGHT]); }
+	int doCommand(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal = 0, uint32_t *valp = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+	int doCommand(uint8_t op, const DataBlock_t *blockList, unsigned dataBlockCnt, uint32_t checkVal = 0, uint32_t *valp = NULL, unsigned msTimeout = CMD_TIMEOUT_AUTO);
+
+	int stdImageInfo(VFile& vf, const ImageSeg_t& seg, const char *prefix, FILE *fpOut = stdout);
+	void report(FILE *fp, const char *fmt, ...);
+	void progress(uint32_t done, uint32_t total) { if (m_progressFunc != NULL) m_progressFunc(m_progressArg, done, total); }
 
 	SerialChannel m_serial;
 	ELF m_elf;
 	bool m_connected;
+	unsigned long m_baud;
 	unsigned m_flags;
 	uint32_t m_address;
 	uint32_t m_size;
 	uint32_t m_imageSize;
+	ResetTiming_t m_resetTiming;
+	Profile *m_profile;			// learned values, may be NULL
+	uint32_t m_flashID;			// the Flash ID of the connected device
+	bool m_flashIDValid;		// if m_flashID has been read
+	uint32_t m_eraseTime;		// learned erase time in ms per MB for the Flash (0 if not known)
+	CommStats_t m_stats;		// command and error counts
+	uint8_t m_reply[ESP_REPLY_SIZE];	// the body of the most recent reply
+	Request_t m_req[ESP_MAX_INFLIGHT];	// the commands awaiting replies, oldest first
+	unsigned m_reqHead;			// the index of the oldest command in flight
+	unsigned m_reqCnt;			// the number of commands in flight
+	unsigned m_window;			// the most commands allowed in flight
+	int m_nextTicket;			// the ticket for the next command submitted
+	Result_t m_result[ESP_RESULT_HISTORY];	// the results of recently completed commands
+	ESPLog_t m_logFunc;			// the function to output messages, NULL for the standard streams
+	void *m_logArg;
+	ESPProgress_t m_progressFunc;	// the function to report transfer progress, may be NULL
+	void *m_progressArg;
 };
 
 void usDelay(uint32_t us);
 void msDelay(unsigned ms);
 unsigned getTickCount(void);
+uint32_t getLE(unsigned byteCnt, const uint8_t *buf, int ofst = 0);
+void putLE(uint32_t val, unsigned byteCnt, uint8_t *buf, int ofst = 0);
 
 #endif	// defined(ESP__H__)
@@ -52,9 +52,15 @@
 
 /** include files **/
 #include "esp.h"
+#include "profile.h"
+#include "gang.h"
+#include "scheduler.h"
+#include "daemon.h"
+#include "manifest.h"
 #if defined(__linux__)
   #include <time.h>
   #include <sys/ioctl.h>
+  #include <unistd.h>
 #endif
 
 /** local definitions **/
@@ -70,6 +76,13 @@
 
 #define DEF_MON_ESCAPE				0x04
 
+#define MAX_ADAPTER_ID				100
+
+// values for selecting the link speed after connecting
+#define SPEED_PROBE_NONE			0			// use the specified speed, if any
+#define SPEED_PROBE_AUTO			1			// use the learned speed, probe if none
+#define SPEED_PROBE_FORCE			2			// probe for the highest speed
+
 // operating modes
 typedef enum
 {
@@ -88,7 +101,20 @@ typedef enum
 {
 	OptionNone,
 	OptionSetPort,
+	OptionSetPorts,
+	OptionSetFarm,
+	OptionEventLoop,
+	OptionPacketCache,
+	OptionOverlay,
+	OptionSerial,
+	OptionDaemon,
+	OptionDaemonIdle,
+	OptionDaemonStatus,
+	OptionDaemonStop,
+	OptionVia,
+	OptionJob,
 	OptionSetSpeed,
+	OptionHighSpeed,
 	OptionSetAddress,
 	OptionSetSize,
 	OptionSetElf,
@@ -118,6 +144,7 @@ typedef enum
 	OptionSetRun,
 	OptionSetNoRun,
 	OptionResetMode,
+	OptionSetProfile,
 	OptionHelp,
 	OptionSetDiagCode,
 	OptionInvalid,
@@ -132,9 +159,13 @@ typedef struct Parameter_tag
 	const char *portStr;		// the serial port designator (e.g. COM2 or /dev/ttyS1)
 	uint32_t dlSpeed;			// the desired baud rate for downloading
 	uint32_t runSpeed;			// the desired baud rate for the monitor (0 implies dlSpeed)
+	uint32_t highSpeed;			// the baud rate to switch to after connecting (0 for none)
+	uint8_t speedProbe;			// how the baud rate after connecting is determined
 	uint8_t monExit;			// the monitor exit character code
 	Mode_t mode;				// the operating mode
 	ResetMode_t resetMode;		// the reset mode
+	bool resetSet;				// if the reset mode was specified explicitly
+	bool tuneReset;				// if the reset mode and timing should be tuned
 	uint32_t address;			// the target address
 	uint32_t size;				// the region size
 	uint16_t flashParmVal;		// combined Flash parameters (as it appears in an image header)
@@ -145,6 +176,15 @@ typedef struct Parameter_tag
 	bool padded;				// indicates padded (or sparse) mode
 	bool termMode;				// if monitor mode should be entered
 	const char *logFile;		// name of a file to which to log device output
+	const char *profileFile;	// name of the profile file (NULL for the default)
+	Profile profile;			// values learned about adapters
+	char adapterID[MAX_ADAPTER_ID];	// identifies the adapter for the current port
+	Gang gang;					// the ports to program concurrently, if any
+	const char *farmFile;		// the job file for the scheduler, "-" for stdin
+	const char *daemonSocket;	// the socket on which to serve requests, if any
+	uint32_t daemonIdle;		// seconds before an unused daemon session is closed
+	const char *viaSocket;		// the socket of the daemon to perform operations, if any
+	uint16_t viaCount;			// the number of operations performed by the daemon
 	bool longOpt;
 
 	Parameter_tag()
@@ -153,9 +193,13 @@ typedef struct Parameter_tag
 		portStr = DEF_COMM_CHANNEL;
 		dlSpeed = DEF_DL_SPEED;
 		runSpeed = DEF_RUN_SPEED;
+		highSpeed = 0;
+		speedProbe = SPEED_PROBE_NONE;
 		monExit = DEF_MON_ESCAPE;
 		mode = ModeWriteFlash;
 		resetMode = ResetNone;
+		resetSet = false;
+		tuneReset = false;
 		address = ESP_NO_ADDRESS;
 		size = 0;
 		flashParmVal = 0;
@@ -165,6 +209,13 @@ typedef struct Parameter_tag
 		padded = false;
 		termMode = false;
 		logFile = NULL;
+		profileFile = NULL;
+		farmFile = NULL;
+		daemonSocket = NULL;
+		daemonIdle = DAEMON_DEF_IDLE;
+		viaSocket = NULL;
+		viaCount = 0;
+		adapterID[0] = '\0';
 		longOpt = false;
 	}
 } Parameter_t;
@@ -176,9 +227,6 @@ typedef struct
 } OptWord_t;
 
 
-/** public data **/
-uint16_t diagCode = 0;
-
 /** private data **/
 static const unsigned verMajor = 0;
 static const unsigned verMinor = 1;
@@ -199,14 +247,19 @@ static OptWord_t optWords[] =
 {
 	{ "address=",		OptionSetAddress },
 	{ "baud=",			OptionSetSpeed },
+	{ "daemon-status",	OptionDaemonStatus },
+	{ "daemon-stop",	OptionDaemonStop },
+	{ "daemon",			OptionDaemon },
 	{ "diagCode=",		OptionSetDiagCode },
 	{ "dump-mem",		OptionDumpMem },
 	{ "elf-file=",		OptionSetElf },
 	{ "elf-info",		OptionElfSections },
 	{ "erase-flash",	OptionEraseFlash },
 	{ "erase",			OptionEraseFlash },
+	{ "event-loop",		OptionEventLoop },
 	{ "exit=",			OptionMonitorExit },
 	{ "extract",		OptionAutoExtract },
+	{ "farm=",			OptionSetFarm },
 	{ "file=",			OptionProcessFile },
 	{ "flash-freq=",	OptionFlashFreq },
 	{ "flash-id",		OptionGetFlashID },
@@ -214,11 +267,18 @@ static OptWord_t optWords[] =
 	{ "flash-parm=",	OptionFlashParm },
 	{ "flash-size=",	OptionFlashSize },
 	{ "help",			OptionHelp },
+	{ "high-baud=",		OptionHighSpeed },
+	{ "idle=",			OptionDaemonIdle },
 	{ "image-info",		OptionImageInfo },
+	{ "job=",			OptionJob },
 	{ "no-run",			OptionSetNoRun },
+	{ "overlay=",		OptionOverlay },
+	{ "packet-cache=",	OptionPacketCache },
 	{ "padded=",		OptionPaddedImage },
 	{ "padded+=",		OptionAppendPadded },
 	{ "port=",			OptionSetPort },
+	{ "ports=",			OptionSetPorts },
+	{ "profile=",		OptionSetProfile },
 	{ "quiet",			OptionSetQuiet },
 	{ "read-mac",		OptionReadMAC },
 	{ "read-flash",		OptionReadFlash },
@@ -227,9 +287,11 @@ static OptWord_t optWords[] =
 	{ "run",			OptionSetRun },
 	{ "section=",		OptionSections },
 	{ "sections=",		OptionSections },
+	{ "serial=",		OptionSerial },
 	{ "size=",			OptionSetSize },
 	{ "sparse=",		OptionSparseImage },
 	{ "sparse+=",		OptionAppendSparse },
+	{ "via=",			OptionVia },
 	{ "write-flash",	OptionWriteFlash },
 	{ "write",			OptionWriteFlash },
 	{ NULL,				OptionInvalid }
@@ -240,8 +302,17 @@ static void displayHelp(bool doExit = true);
 static char *skipWhite(char *p);
 static void processArgString(ESP& esp, Parameter_t& parm, char *argList, bool observeQuotes = true);
 static void processArg(ESP& esp, Parameter_t& parms, const char *argp);
-static void processFile(ESP& esp, Parameter_t& parm, const char *file);
+static int processFile(ESP& esp, Parameter_t& parm, const char *file);
+static bool checkGang(Parameter_t& parm, const char *argp);
+static unsigned runFarm(ESP& esp, Parameter_t& parm);
+static int runDaemon(ESP& esp, Parameter_t& parm);
+static int viaRequest(Parameter_t& parm, const char *op, const char *args = NULL);
+static const char *absPath(const char *file, char *buf, size_t bufSize);
 static int openComm(ESP& esp, Parameter_t& parms, bool forDownload = true);
+static const char *adapterSection(Parameter_t& parm);
+static void applyProfile(ESP& esp, Parameter_t& parm);
+static int tuneReset(ESP& esp, Parameter_t& parm);
+static int raiseSpeed(ESP& esp, Parameter_t& parm);
 static int getOptionVal(const char *& p, uint32_t& valp, bool suffixK = true);
 static int getVal(const char *& p, uint32_t& valp, int radix = 10);
 static bool extractAddress(const char *& file, uint32_t& addr);
@@ -276,8 +347,47 @@ main(int argc, char **argv)
 	while (--argc > 0)
 		processArg(esp, parms, *argv++);
 
+	if (diagCode & DIAG_SHOW_STATS)
+		esp.ShowStats();
+
+	// write the images to the devices on several ports, if requested
+	unsigned gangFailures = 0;
+	if (parms.gang.PortCount())
+	{
+		if (!parms.profile.IsLoaded())
+			parms.profile.Load(parms.profileFile);
+		parms.gang.SetProfile(parms.profile.IsLoaded() ? &parms.profile : NULL);
+		parms.gang.SetSpeed(parms.dlSpeed, parms.highSpeed);
+		parms.gang.SetReset(parms.resetMode);
+		parms.gang.SetFlags(esp.GetFlags());
+		gangFailures = parms.gang.Run();
+		parms.gang.Report();
+	}
+
+	// perform the jobs in a job file, if requested
+	unsigned farmFailures = 0;
+	if (parms.farmFile != NULL)
+		farmFailures = runFarm(esp, parms);
+
+	// serve requests from later invocations, if requested
+	int daemonStat = 0;
+	if (parms.daemonSocket != NULL)
+		daemonStat = runDaemon(esp, parms);
+
+	// retain values learned during the operations
+	if (parms.profile.IsModified() && (parms.profile.Save() != 0))
+		fprintf(stderr, "Can't write the profile file \"%s\".\n", parms.profile.Filename());
+
 	parms.vfCombine.Close();
-	if (esp.GetFlags() & ESP_AUTO_RUN)
+	if (parms.gang.PortCount() || (parms.farmFile != NULL) || (parms.daemonSocket != NULL))
+		exit((gangFailures || farmFailures || daemonStat) ? 1 : 0);
+	if (parms.viaSocket != NULL)
+	{
+		// the daemon's session ends when the application is run
+		if (parms.viaCount && (esp.GetFlags() & ESP_AUTO_RUN) && (viaRequest(parms, "run") != 0))
+			exit(1);
+	}
+	else if (esp.GetFlags() & ESP_AUTO_RUN)
 	{
 		if (parms.resetMode == ResetNone)
 			esp.Run(true);
@@ -348,139 +458,6 @@ main(int argc, char **argv)
 	return(0);
 }
 
-/*
- ** usDelay
- *
- * Delay for a specified number of microseconds.
- *
- */
-void
-usDelay(uint32_t us)
-{
-#if defined(WIN32)
-	__int64 end;
-
-	if (QueryPerformanceCounter((LARGE_INTEGER *)&end))
-	{
-		__int64 freq, tick;
-
-		// compute the number of counts to equal the requested delay
-		QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
-		end += ((__int64)us * freq / 1000000);
-
-		// implement the delay
-		do
-		{
-			QueryPerformanceCounter((LARGE_INTEGER *)&tick);
-		}
-		while (tick <= end);
-	}
-#elif defined(__linux__)
-	// perhaps nanosleep() should be used
-    usleep(us);
-#elif defined(ERROR_MISSING_IMPLEMENTATION)
-	#error missing implementation of isDelay()
-#endif
-}
-
-/*
- ** msDelay
- *
- * Delay for a specified number of milliseconds.
- *
- */
-void
-msDelay(unsigned ms)
-{
-#if defined(WIN32)
-	if (ms > 65)
-	{
-		for (unsigned tick = GetTickCount() + ms; GetTickCount() < tick; )
-			;
-	}
-	else
-		// for smaller values, to get better resolution
-		usDelay(ms * 1000);
-#elif defined(__linux__)
-    usleep(ms * 1000);
-#elif defined(ERROR_MISSING_IMPLEMENTATION)
-	#error missing implementation of msDelay()
-#endif
-}
-
-/*
- ** getTickCount
- *
- * Retrieve a tick count from the OS representing elapsed milliseconds.
- *
- */
-unsigned
-getTickCount(void)
-{
-	unsigned tick = 0;
-
-#if defined(WIN32)
-	tick = GetTickCount();
-#elif defined(__linux__)
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	tick = (ts.tv_sec * 1000) + ((ts.tv_nsec + 500000) / 1000000);
-#elif defined(ERROR_MISSING_IMPLEMENTATION)
-	#error missing implementation of getTickCount()
-#endif
-	return(tick);
-}
-
-#if defined(NEED_MEMICMP)
-//
-// Case-insensitive memory block comparison.
-//
-int
-_memicmp(const void *_p1, const void *_p2, unsigned len)
-{
-	const uint8_t *p1 = (const uint8_t *)_p1;
-	const uint8_t *p2 = (const uint8_t *)_p2;
-
-	while (len--)
-	{
-		unsigned char c1, c2;
-
-		// fetch the next byte, change to upper case if alphabetic
-		c1 = *p1++;
-		if (isalpha(c1) && islower(c1))
-			c1 = toupper(c1);
-		c2 = *p2++;
-		if (isalpha(c2) && islower(c2))
-			c2 = toupper(c2);
-		if (c1 != c2)
-			return((int)c1 - (int)c2);
-	}
-	return(0);
-}
-#endif
-
-#if defined(NEED_STRICMP)
-//
-// Case-insensitive string comparison.
-//
-int
-_stricmp(const char *s1, const char *s2)
-{
-	int len1, len2;
-
-	// guard against null pointers, compute string lengths (including the trailing null)
-	if (s1 == NULL)
-		s1 = "";
-	len1 = strlen(s1) + 1;
-	if (s2 == NULL)
-		s2 = "";
-	len2 = strlen(s2) + 1;
-
-	// do the comparison
-	return(_memicmp(s1, s2, (len1 < len2) ? len1 : len2));
-}
-#endif
-
 /** class implementations **/
 
 /** private functions **/
@@ -507,7 +484,23 @@ displayHelp(bool doExit)
 	fprintf(stdout, " where <options> are:\n");
 	fprintf(stdout, " -h          --help                 display this information\n");
 	fprintf(stdout, " -p<port>    --port=<port>          specify the COM port, e.g. COM1 or 1\n");
+	fprintf(stdout, "             --ports=<port>,...     write files to several ports concurrently\n");
+	fprintf(stdout, "             --event-loop           drive the --ports sessions from a single thread\n");
+	fprintf(stdout, "             --packet-cache=<file>  keep the --ports command frames in a file for reuse\n");
+	fprintf(stdout, "             --overlay=<file>       write a per-device template at the --ports address\n");
+	fprintf(stdout, "             --serial=<num>         the serial number for the first of the --ports\n");
+	fprintf(stdout, "             --farm=<file>          perform the jobs in a job file (- for stdin)\n");
+	fprintf(stdout, "             --job=<file>           perform the steps in a manifest over one connection\n");
+	fprintf(stdout, "             --daemon[=<socket>]    keep sessions open for requests made using --via\n");
+	fprintf(stdout, "             --idle=<seconds>       the time after which an unused daemon session closes\n");
+	fprintf(stdout, "             --via=<socket>         have the daemon perform the operations\n");
+	fprintf(stdout, "             --daemon-status        report the daemon's sessions (requires --via)\n");
+	fprintf(stdout, "             --daemon-stop          stop the daemon (requires --via)\n");
+	fprintf(stdout, " -P<file>    --profile=<file>       specify the adapter profile file\n");
 	fprintf(stdout, " -b<speed>   --baud=<speed>         specify the baud rate\n");
+	fprintf(stdout, " -B<speed>   --high-baud=<speed>    switch to a higher baud rate after connecting\n");
+	fprintf(stdout, " -Bprobe     --high-baud=probe      find and save the highest usable baud rate\n");
+	fprintf(stdout, " -Bauto      --high-baud=auto       use the saved baud rate, probing if none\n");
 	fprintf(stdout, " -a<addr>    --address=<addr>       specify the address for a later operation\n");
 	fprintf(stdout, " -s<size>    --size=<size>          specify the size for a later operation\n");
 	fprintf(stdout, " -e<elf>     --elf-file=<elf>       specify an ELF file to process\n");
@@ -518,6 +511,7 @@ displayHelp(bool doExit)
 	fprintf(stdout, " -l<file>    --log=<file>           log device output in monitor mode\n");
 	fprintf(stdout, " -m[<speed>] --monitor[=<speed>]    after operations, enter monitor mode\n");
 	fprintf(stdout, " -r<reset>   --reset=<reset>        set the reset mode (none, auto, ck, wifio)\n");
+	fprintf(stdout, " -rtune      --reset=tune           find the reset mode and timing for the adapter\n");
 	fprintf(stdout, " -r0         --no-run               do not run device after operations\n");
 	fprintf(stdout, " -r1         --run                  run device after operations (default)\n");
 	fprintf(stdout, " -q          --quiet                suppress progress reporting\n");
@@ -538,6 +532,7 @@ displayHelp(bool doExit)
 	fprintf(stdout, " -os<sect>   --section=<sect>       extract data from sections of ELF file\n");
 	fprintf(stdout, " -ow         --write-flash          write files to Flash memory (default)\n");
 	fprintf(stdout, " -ox[<file>] --extract[=<file>]     extract ELF file sections to create images\n");
+	fprintf(stdout, "\n A <file> of \"-\" reads an image from the standard input, e.g. from a pipe.\n");
 
 	if (doExit)
 		exit(0);
@@ -617,7 +612,7 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 	parm.longOpt = false;
 	if (((p = argp) == NULL) || ((c = *p++) == '\0'))
 		return;
-	if (c  == '-')
+	if ((c  == '-') && (*p != '\0'))
 	{
 		switch(*p++)
 		{
@@ -631,6 +626,8 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 
 		case 'b':			option = OptionSetSpeed;		break;
 
+		case 'B':			option = OptionHighSpeed;		break;
+
 		case 'c':			// specify a combined image file
 			switch (*p++)
 			{
@@ -683,6 +680,8 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 
 		case 'p':			option = OptionSetPort;			break;
 
+		case 'P':			option = OptionSetProfile;		break;
+
 		case 'q':			option = OptionSetQuiet;		break;
 
 		case 'r':
@@ -809,6 +808,103 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 		option = OptionBadForm;
 		break;
 
+	case OptionSetPorts:
+		if (parm.gang.AddPorts(p) != 0)
+		{
+			fprintf(stderr, "Invalid port list or too many ports (max %u): \"%s\".\n", GANG_MAX_PORTS, argp);
+			exit(1);
+		}
+		break;
+
+	case OptionSetFarm:
+		if ((*p == '\0') || parm.gang.PortCount())
+		{
+			fprintf(stderr, "The option \"%s\" requires a job file and can't be used with --ports.\n", argp);
+			exit(1);
+		}
+		parm.farmFile = p;
+		break;
+
+	case OptionEventLoop:
+		if (*p == '\0')
+			parm.gang.SetEventLoop(true);
+		else
+			option = OptionBadForm;
+		break;
+
+	case OptionOverlay:
+		if (*p == '\0')
+			option = OptionBadForm;
+		else if (parm.gang.PortCount() == 0)
+		{
+			fprintf(stderr, "The option \"%s\" requires --ports.\n", argp);
+			exit(1);
+		}
+		else if ((parm.address == ESP_NO_ADDRESS) || ((parm.address & (ESP_FLASH_BLK_SIZE - 1)) != 0))
+		{
+			fprintf(stderr, "The option \"%s\" requires an address that is a multiple of the block size (%u).\n",
+					argp, ESP_FLASH_BLK_SIZE);
+			exit(1);
+		}
+		else if ((stat = parm.gang.AddOverlay(p, parm.address)) != 0)
+		{
+			fprintf(stderr, "Can't prepare the overlay template \"%s\" (%d).\n", p, stat);
+			exit(1);
+		}
+		else
+			parm.address = ESP_NO_ADDRESS;
+		break;
+
+	case OptionSerial:
+		if (getOptionVal(p, val) == 0)
+			parm.gang.SetSerial(val);
+		else
+			option = OptionInvalidValue;
+		break;
+
+	case OptionPacketCache:
+		if (*p == '\0')
+			option = OptionBadForm;
+		else
+			parm.gang.SetPacketCache(p);
+		break;
+
+	case OptionDaemon:
+		if (*p == '\0')
+			parm.daemonSocket = DAEMON_DEF_SOCKET;
+		else if ((*p == '=') && (p[1] != '\0'))
+			parm.daemonSocket = p + 1;
+		else
+			option = OptionBadForm;
+		break;
+
+	case OptionDaemonIdle:
+		if (isdigit(*p) && (getVal(p, val) == 0) && (*p == '\0'))
+			parm.daemonIdle = val;
+		else
+			option = OptionInvalidValue;
+		break;
+
+	case OptionVia:
+		if (*p == '\0')
+			option = OptionBadForm;
+		else
+			parm.viaSocket = p;
+		break;
+
+	case OptionDaemonStatus:
+	case OptionDaemonStop:
+		if (*p != '\0')
+			option = OptionBadForm;
+		else if (parm.viaSocket == NULL)
+		{
+			fprintf(stderr, "The option \"%s\" requires --via.\n", argp);
+			exit(1);
+		}
+		else if (DaemonRequest(parm.viaSocket, (option == OptionDaemonStop) ? "shutdown" : "status") != 0)
+			exit(1);
+		break;
+
 	case OptionSetSpeed:
 		if (isdigit(*p) && (getOptionVal(p, val) == 0))
 		{
@@ -821,24 +917,30 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 		option = OptionInvalidValue;
 		break;
 
+	case OptionHighSpeed:
+		if (_stricmp(p, "probe") == 0)
+			parm.speedProbe = SPEED_PROBE_FORCE;
+		else if (_stricmp(p, "auto") == 0)
+			parm.speedProbe = SPEED_PROBE_AUTO;
+		else if (isdigit(*p) && (getOptionVal(p, val) == 0) && (*p == '\0'))
+		{
+			parm.speedProbe = SPEED_PROBE_NONE;
+			parm.highSpeed = val;
+		}
+		else
+			option = OptionInvalidValue;
+		break;
+
 	case OptionResetMode:
 		if (*p == '\0')
 		{
 			fprintf(stderr, "Missing reset mode designator: \"%s\".\n", argp);
 			exit(1);
 		}
-		if (_stricmp(p, "none") == 0)
-			parm.resetMode = ResetNone;
-		else if (_stricmp(p, "auto") == 0)
-			parm.resetMode = ResetAuto;
-		else if (_stricmp(p, "dtronly") == 0)
-			parm.resetMode = ResetDTROnly;
-		else if (_stricmp(p, "ck") == 0)
-			parm.resetMode = ResetCK;
-		else if (_stricmp(p, "wifio") == 0)
-			parm.resetMode = ResetWifio;
-		else if (_stricmp(p, "nodemcu") == 0)
-			parm.resetMode = ResetNodeMCU;
+		if (_stricmp(p, "tune") == 0)
+			parm.tuneReset = true;
+		else if (esp.GetResetMode(p, parm.resetMode))
+			parm.resetSet = true;
 		else
 		{
 			fprintf(stderr, "Unrecognized reset mode designator: \"%s\".\n", argp);
@@ -846,6 +948,16 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 		}
 		break;
 
+	case OptionSetProfile:
+		if (*p == '\0')
+		{
+			option = OptionBadForm;
+			break;
+		}
+		parm.profileFile = p;
+		parm.profile.Clear();
+		break;
+
 	case OptionFlashMode:
 		flashMask = FLASH_MODE_MASK;
 		if (esp.FlashMode(p, flashVal))
@@ -941,6 +1053,8 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 			}
 			parm.runSpeed = val;
 		}
+		if (checkGang(parm, argp))
+			exit(1);
 		parm.termMode = true;
 		break;
 
@@ -1042,8 +1156,14 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 	case OptionReadMAC:
 		if (*p == '\0')
 		{
-			if (openComm(esp, parm) != 0)
+			if (parm.viaSocket != NULL)
+			{
+				if (viaRequest(parm, "mac") != 0)
+					exit(1);
 				break;
+			}
+			if (checkGang(parm, argp) || (openComm(esp, parm) != 0))
+				exit(1);
 
 			uint8_t mac[12];
 			if ((stat = esp.ReadMAC(mac, sizeof(mac))) == 0)
@@ -1072,8 +1192,14 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 	case OptionGetFlashID:
 		if (*p == '\0')
 		{
-			if (openComm(esp, parm) != 0)
+			if (parm.viaSocket != NULL)
+			{
+				if (viaRequest(parm, "flash-id") != 0)
+					exit(1);
 				break;
+			}
+			if (checkGang(parm, argp) || (openComm(esp, parm) != 0))
+				exit(1);
 			uint32_t flashID;
 			if ((stat = esp.GetFlashID(flashID)) == 0)
 				fprintf(stdout, "Manufacturer: %02x, Device: %02x%02x.\n", flashID & 0xff,
@@ -1088,6 +1214,20 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 			option = OptionBadForm;
 		break;
 
+	case OptionJob:
+		if (*p == '\0')
+			option = OptionBadForm;
+		else
+		{
+			// check the entire manifest before connecting
+			Manifest manifest;
+			manifest.SetFlashParm(parm.flashParmVal, parm.flashParmMask);
+			if ((manifest.Load(p) != 0) || checkGang(parm, argp) || (openComm(esp, parm) != 0) ||
+					(manifest.Run(esp) != 0))
+				exit(1);
+		}
+		break;
+
 	case OptionEraseFlash:
 		{
 			uint32_t eraseSize = 0;
@@ -1121,10 +1261,17 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 				eraseSize = val;
 			}
 
-			if (option == OptionEraseFlash)
+			if ((option == OptionEraseFlash) && (parm.viaSocket != NULL))
 			{
-				if (openComm(esp, parm) != 0)
-					break;
+				char args[30];
+				sprintf(args, "0x%x 0x%x", eraseSize ? parm.address : 0, eraseSize);
+				if (viaRequest(parm, "erase", args) != 0)
+					exit(1);
+			}
+			else if (option == OptionEraseFlash)
+			{
+				if (checkGang(parm, argp) || (openComm(esp, parm) != 0))
+					exit(1);
 				if (eraseSize)
 					stat = esp.FlashErase(parm.address, eraseSize);
 				else
@@ -1239,7 +1386,8 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 							}
 
 							// process the matching file
-							processFile(esp, parm, file);
+							if (processFile(esp, parm, file) != 0)
+								exit(1);
 						}
 					} while(FindNextFile(hFind, &ffd));
 					FindClose(hFind);
@@ -1248,7 +1396,8 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 			}
 		}
 #endif
-		processFile(esp, parm, p);
+		if (processFile(esp, parm, p) != 0)
+			exit(1);
 		break;
 
 	default:
@@ -1279,21 +1428,25 @@ processArg(ESP& esp, Parameter_t& parm, const char *argp)
 }
 
 //
-// Process a file using the accumulated option values.
+// Process a file using the accumulated option values.  The return value is
+// zero on success, non-zero otherwise (an error message having been output).
 //
-static void
+static int
 processFile(ESP& esp, Parameter_t& parm, const char *file)
 {
 	int stat;
 
 	if ((file == NULL) || (*file == '\0'))
-		return;
+		return(0);
 
-	if ((parm.mode == ModeWriteFlash) || (parm.mode == ModeReadFlash) || (parm.mode == ModeDumpMem))
+	if ((parm.mode == ModeDumpMem) && checkGang(parm, file))
+		return(ESP_ERROR_PARAM);
+	if ((((parm.mode == ModeWriteFlash) || (parm.mode == ModeReadFlash)) &&
+			!parm.gang.PortCount() && (parm.viaSocket == NULL)) || (parm.mode == ModeDumpMem))
 	{
 		// prepare to communicate with the ESP8266
 		if ((stat = openComm(esp, parm)) != 0)
-			return;
+			return(stat);
 	}
 
 	// prepare the target file, if applicable
@@ -1312,15 +1465,25 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 		{
 			fprintf(stderr, "The address 0x%x is not an integral multiple of the block size (%u).\n",
 					parm.address, ESP_FLASH_BLK_SIZE);
-			exit(1);
+			return(ESP_ERROR_PARAM);
 		}
+		if ((parm.mode == ModeWriteFlash) && parm.gang.PortCount())
+			// the image is read when it is added to the gang
+			break;
 		// continue into the next case
 
 	case ModeImageInfo:
-		if (vf.Open(file, "rb") != 0)
+		if (vf.Open(file, VFileOpenMap) != 0)
 		{
 			fprintf(stderr, "Can't open file \"%s\" for reading.\n", file);
-			exit(1);
+			return(ESP_ERROR_FILE_OPEN);
+		}
+
+		// a stream is written as it is read, otherwise its size must be known
+		if (vf.IsStream() && (parm.mode != ModeWriteFlash) && (vf.Load() != 0))
+		{
+			fprintf(stderr, "Can't read file \"%s\".\n", file);
+			return(ESP_ERROR_FILE_READ);
 		}
 		break;
 
@@ -1331,15 +1494,18 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 		if (parm.size == 0)
 		{
 			fprintf(stderr, "The size to %s must be specified.\n", (parm.mode == ModeReadFlash) ? "read" : "dump");
-			exit(1);
+			return(ESP_ERROR_PARAM);
 		}
+		if ((parm.mode == ModeReadFlash) && (parm.gang.PortCount() || (parm.viaSocket != NULL)))
+			// the file is created for each port after writing or by the daemon
+			break;
 		// continue into the next case
 
 	case ModeElfSection:
 		if (vf.Open(file, "wb") != 0)
 		{
 			fprintf(stderr, "Can't open file \"%s\" for writing.\n", file);
-			exit(1);
+			return(ESP_ERROR_FILE_CREATE);
 		}
 		break;
 
@@ -1348,27 +1514,67 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 	}
 
 	// perform the operation
+	stat = 0;
 	switch (parm.mode)
 	{
 	case ModeWriteFlash:
-		// download the file
 		if (parm.address == ESP_NO_ADDRESS)
 			parm.address = 0;
-		if ((stat = esp.FlashWrite(vf, parm.address, parm.flashParmVal, parm.flashParmMask)) != 0)
+		if (parm.gang.PortCount())
 		{
-			fprintf(stderr, "Download of file \"%s\" failed (%d).\n", file, stat);
-			exit(1);
+			// prepare the file to be downloaded to each of the ports
+			if ((stat = parm.gang.AddImage(file, parm.address, parm.flashParmVal, parm.flashParmMask)) != 0)
+				fprintf(stderr, "Can't prepare file \"%s\" for downloading (%d).\n", file, stat);
+		}
+		else if ((parm.viaSocket != NULL) && (strcmp(file, VFileStdin) == 0))
+		{
+			fprintf(stderr, "The standard input can't be written by the daemon.\n");
+			stat = ESP_ERROR_PARAM;
+		}
+		else if (parm.viaSocket != NULL)
+		{
+			// have the daemon download the file
+			char path[FILENAME_MAX];
+			char args[FILENAME_MAX + 40];
+			sprintf(args, "0x%x 0x%x 0x%x %s", parm.address, parm.flashParmVal, parm.flashParmMask,
+					absPath(file, path, sizeof(path)));
+			stat = viaRequest(parm, "write", args);
 		}
+		else if ((stat = esp.FlashWrite(vf, parm.address, parm.flashParmVal, parm.flashParmMask)) != 0)
+			// download the file
+			fprintf(stderr, "Download of file \"%s\" failed (%d).\n", file, stat);
+		if (stat != 0)
+			break;
 		parm.dlCount++;
 		parm.address = ESP_NO_ADDRESS;
 		break;
 
 	case ModeReadFlash:
+		if (parm.gang.PortCount())
+		{
+			// read Flash from each of the ports
+			if ((stat = parm.gang.AddRead(parm.address, parm.size, file)) != 0)
+				fprintf(stderr, "Can't add the read to file \"%s\" (%d).\n", file, stat);
+			else
+				parm.address = ESP_NO_ADDRESS;
+			break;
+		}
+		if (parm.viaSocket != NULL)
+		{
+			// have the daemon read Flash
+			char path[FILENAME_MAX];
+			char args[FILENAME_MAX + 40];
+			sprintf(args, "0x%x 0x%x %s", parm.address, parm.size, absPath(file, path, sizeof(path)));
+			if ((stat = viaRequest(parm, "read", args)) == 0)
+				parm.address = ESP_NO_ADDRESS;
+			break;
+		}
+
 		// read Flash, write to file
 		if ((stat = esp.FlashRead(vf, parm.address, parm.size)) != 0)
 		{
 			fprintf(stderr, "An error occurred while reading Flash (%d).\n", stat);
-			exit(1);
+			break;
 		}
 		parm.address = ESP_NO_ADDRESS;
 		break;
@@ -1378,9 +1584,10 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 		if (parm.address == 0)
 		{
 			fprintf(stderr, "The starting address to dump must be non-zero.\n");
-			exit(1);
+			stat = ESP_ERROR_PARAM;
+			break;
 		}
-		esp.DumpMem(vf, parm.address, parm.size);
+		stat = esp.DumpMem(vf, parm.address, parm.size);
 		parm.address = ESP_NO_ADDRESS;
 		break;
 
@@ -1389,15 +1596,16 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 		if (!esp.HaveELF())
 		{
 			fprintf(stderr, "No ELF file was specified.\n");
-			exit(1);
+			stat = ESP_ERROR_PARAM;
+			break;
 		}
-		if ((stat = esp.WriteSections(vf, parm.sectName, parm.flashParmVal)) < 0)
-			exit(1);
+		if ((stat = esp.WriteSections(vf, parm.sectName, parm.flashParmVal)) > 0)
+			stat = 0;
 		break;
 
 	case ModeImageInfo:
 		// output information about a load image
-		stat = esp.ImageInfo(vf);
+		esp.ImageInfo(vf);
 		break;
 
 	case ModeImageCombine:
@@ -1409,7 +1617,8 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 			if (curSize < 0)
 			{
 				fprintf(stderr, "Can't determine the current size of the combined image file \"%s\".\n", parm.vfCombine.Name());
-				exit(1);
+				stat = ESP_ERROR_FILE_SIZE;
+				break;
 			}
 			if (curSize == 0)
 				// default to offset zero for the first file
@@ -1417,12 +1626,13 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 			else
 			{
 				fprintf(stderr, "No Flash address was specified for the image file \"%s\".\n", file);
-				exit(1);
+				stat = ESP_ERROR_PARAM;
+				break;
 			}
 		}
 
 		// add a load image to a combined image file
-		stat = esp.AddImage(parm.vfCombine, vf, parm.address, parm.padded);
+		esp.AddImage(parm.vfCombine, vf, parm.address, parm.padded);
 		parm.address = ESP_NO_ADDRESS;
 		break;
 
@@ -1430,6 +1640,109 @@ processFile(ESP& esp, Parameter_t& parm, const char *file)
 		break;
 	}
 	vf.Close();
+	return(stat);
+}
+
+//
+// Check for an operation that can't be performed when writing to several
+// ports concurrently, outputting an error message if so.
+//
+static bool
+checkGang(Parameter_t& parm, const char *argp)
+{
+	if (parm.gang.PortCount() == 0)
+		return(false);
+	fprintf(stderr, "The operation \"%s\" can't be used with --ports.\n", argp);
+	return(true);
+}
+
+//
+// Perform the jobs described in a job file, reading it as it is being
+// produced if it is a pipe.  The return value is the number of jobs that
+// failed plus the number of lines that couldn't be processed.
+//
+static unsigned
+runFarm(ESP& esp, Parameter_t& parm)
+{
+	Scheduler sched;
+	FILE *fp = stdin;
+
+	if ((strcmp(parm.farmFile, "-") != 0) && ((fp = fopen(parm.farmFile, "r")) == NULL))
+	{
+		fprintf(stderr, "Can't open job file \"%s\".\n", parm.farmFile);
+		return(1);
+	}
+	if (!parm.profile.IsLoaded())
+		parm.profile.Load(parm.profileFile);
+	sched.SetProfile(parm.profile.IsLoaded() ? &parm.profile : NULL);
+	sched.SetSpeed(parm.dlSpeed, parm.highSpeed);
+	sched.SetReset(parm.resetMode);
+	sched.SetFlags(esp.GetFlags());
+	sched.SetFlashParm(parm.flashParmVal, parm.flashParmMask);
+
+	unsigned errCnt = (unsigned)sched.ProcessFile(fp);
+	if (fp != stdin)
+		fclose(fp);
+	errCnt += sched.Finish();
+	sched.Report();
+	return(errCnt);
+}
+
+//
+// Serve requests for operations from later invocations until the daemon is
+// stopped or has been idle for the idle time.
+//
+static int
+runDaemon(ESP& esp, Parameter_t& parm)
+{
+	Daemon daemon;
+
+	if (!parm.profile.IsLoaded())
+		parm.profile.Load(parm.profileFile);
+	daemon.SetProfile(parm.profile.IsLoaded() ? &parm.profile : NULL);
+	daemon.SetSpeed(parm.dlSpeed, parm.highSpeed);
+	daemon.SetReset(parm.resetMode);
+	daemon.SetFlags(esp.GetFlags());
+	daemon.SetIdle(parm.daemonIdle);
+	return(daemon.Run(parm.daemonSocket));
+}
+
+//
+// Have the daemon perform an operation on the device attached to the
+// current port.  The return value is zero on success, non-zero otherwise
+// (an error message having been output).
+//
+static int
+viaRequest(Parameter_t& parm, const char *op, const char *args)
+{
+	char request[DAEMON_MAX_LINE];
+
+	if (strlen(parm.portStr) + ((args != NULL) ? strlen(args) : 0) + 20 > sizeof(request))
+	{
+		fprintf(stderr, "The request to the daemon is too long.\n");
+		return(ESP_ERROR_PARAM);
+	}
+	sprintf(request, "%s %s%s%s", op, parm.portStr, (args != NULL) ? " " : "", (args != NULL) ? args : "");
+	parm.viaCount++;
+	return(DaemonRequest(parm.viaSocket, request));
+}
+
+//
+// Form the full path of a file so that the daemon, having a different
+// working directory, can find it.
+//
+static const char *
+absPath(const char *file, char *buf, size_t bufSize)
+{
+#if defined(__linux__)
+	if ((*file != '/') && (getcwd(buf, bufSize) != NULL) && (strlen(buf) + strlen(file) + 2 <= bufSize))
+	{
+		strcat(buf, "/");
+		strcat(buf, file);
+		return(buf);
+	}
+#endif
+	return(file);
 }
 
 //
@@ -1441,34 +1754,170 @@ openComm(ESP& esp, Parameter_t& parm, bool forDownload)
 	int stat;
 	unsigned speed = parm.dlSpeed;
 
+	if (parm.viaSocket != NULL)
+	{
+		fprintf(stderr, "The operation can't be performed with --via.\n");
+		return(ESP_ERROR_PARAM);
+	}
+
 	if (!forDownload && parm.runSpeed)
 		speed = parm.runSpeed;
 
 	if (!esp.IsCommOpen())
 	{
-		unsigned flags;
-		switch (parm.resetMode)
+		// use the reset mode and timing learned previously for the adapter
+		applyProfile(esp, parm);
+
+		// allow the erase time of the Flash chip to be learned
+		if (!parm.profile.IsLoaded())
+			parm.profile.Load(parm.profileFile);
+		esp.SetProfile(parm.profile.IsLoaded() ? &parm.profile : NULL);
+
+		unsigned flags = esp.ResetFlags(parm.resetMode);
+		if (parm.tuneReset)
+			flags = SERIAL_DTR_LOW | SERIAL_RTS_LOW;
+		if ((stat = esp.OpenComm(parm.portStr, speed, flags)) != 0)
 		{
-		case ResetAuto:
-		case ResetNodeMCU:
-		case ResetCK:		flags = SERIAL_DTR_LOW | SERIAL_RTS_LOW;	break;
-		case ResetDTROnly:
-		case ResetWifio:	flags = SERIAL_DTR_LOW;						break;
-		default:			flags = 0;									break;
+			fprintf(stderr, "Can't open port %s.\n", parm.portStr);
+			return(stat);
 		}
-		esp.OpenComm(parm.portStr, speed, flags);
 	}
-	else
+	else if (!forDownload || !esp.IsConnected())
+		// N.B.: the speed of an existing connection may have been raised
 		esp.SetCommSpeed(speed);
 
 	// for download mode, make sure a connection is established
-	if (forDownload)
+	if (forDownload && parm.tuneReset)
+		stat = tuneReset(esp, parm);
+	else if (forDownload)
 		stat = esp.Connect(parm.resetMode);
 	else
 		stat = 0;
+	if ((stat == 0) && forDownload)
+		stat = raiseSpeed(esp, parm);
 	return(stat);
 }
 
+//
+// Switch a new connection to a higher speed, if requested.  The speed may be
+// given explicitly, learned previously for the adapter or found by probing.
+// If the higher speed can't be used, the connection continues at the
+// original speed.
+//
+static int
+raiseSpeed(ESP& esp, Parameter_t& parm)
+{
+	int stat;
+	uint32_t speed = parm.highSpeed;
+	const char *section = NULL;
+
+	if (parm.speedProbe != SPEED_PROBE_NONE)
+		section = adapterSection(parm);
+	if ((parm.speedProbe == SPEED_PROBE_AUTO) &&
+			((section == NULL) || !parm.profile.GetVal(section, "baud", speed)))
+		parm.speedProbe = SPEED_PROBE_FORCE;
+	if (parm.speedProbe == SPEED_PROBE_FORCE)
+	{
+		if ((stat = esp.ProbeBaud(parm.resetMode, speed)) != 0)
+			return(stat);
+		if (section != NULL)
+		{
+			parm.profile.SetVal(section, "baud", speed);
+			if (parm.profile.Save() != 0)
+				fprintf(stderr, "Can't write the profile file \"%s\".\n", parm.profile.Filename());
+		}
+		if (!(esp.GetFlags() & ESP_QUIET))
+			fprintf(stdout, "The highest usable speed is %u baud.\n", speed);
+	}
+	parm.speedProbe = SPEED_PROBE_NONE;
+	parm.highSpeed = speed;
+
+	if ((speed == 0) || (speed == esp.GetCommSpeed()))
+		return(0);
+	if ((stat = esp.ChangeBaud(speed)) != 0)
+	{
+		fprintf(stderr, "Unable to switch to %u baud (%d), continuing at %lu baud.\n",
+				speed, stat, esp.GetCommSpeed());
+		parm.highSpeed = 0;
+		if (!esp.IsConnected())
+			return(esp.Connect(parm.resetMode));
+	}
+	return(0);
+}
+
+//
+// Get the name of the profile section for the adapter of the current serial
+// port, loading the profile if necessary.  Return NULL if the profile is not
+// available.
+//
+static const char *
+adapterSection(Parameter_t& parm)
+{
+	if (!parm.profile.IsLoaded() && (parm.profile.Load(parm.profileFile) != 0))
+		return(NULL);
+	if (SerialAdapterID(parm.portStr, parm.adapterID, sizeof(parm.adapterID)) != 0)
+		return(NULL);
+	return(parm.adapterID);
+}
+
+//
+// Apply the reset mode and timing learned previously for the adapter, if
+// any.  An explicitly specified reset mode takes precedence over the learned
+// mode and the learned timing is applied only when the two modes agree.
+//
+static void
+applyProfile(ESP& esp, Parameter_t& parm)
+{
+	const char *section;
+	const char *modeStr;
+	ResetMode_t mode;
+
+	if (((section = adapterSection(parm)) == NULL) ||
+			((modeStr = parm.profile.Get(section, "reset")) == NULL) ||
+			!esp.GetResetMode(modeStr, mode))
+		return;
+	if (!parm.resetSet && !parm.tuneReset)
+		parm.resetMode = mode;
+	if (parm.resetMode == mode)
+	{
+		uint32_t val;
+		ResetTiming_t timing;
+		timing.msReset = parm.profile.GetVal(section, "reset-ms", val) ? (uint16_t)val : 0;
+		timing.msBoot = parm.profile.GetVal(section, "boot-ms", val) ? (uint16_t)val : 0;
+		esp.SetResetTiming(timing);
+	}
+}
+
+//
+// Find the reset mode and timing that work for the adapter and record them
+// in the profile for use on later connections.
+//
+static int
+tuneReset(ESP& esp, Parameter_t& parm)
+{
+	int stat;
+	ResetTiming_t timing;
+	ResetMode_t mode = parm.resetSet ? parm.resetMode : ResetNone;
+
+	parm.tuneReset = false;
+	if ((stat = esp.TuneReset(mode, timing)) != 0)
+		return(stat);
+	parm.resetMode = mode;
+
+	const char *section;
+	if ((section = adapterSection(parm)) != NULL)
+	{
+		parm.profile.Set(section, "reset", esp.ResetModeName(mode));
+		parm.profile.SetVal(section, "reset-ms", timing.msReset);
+		parm.profile.SetVal(section, "boot-ms", timing.msBoot);
+		if (parm.profile.Save() != 0)
+			fprintf(stderr, "Can't write the profile file \"%s\".\n", parm.profile.Filename());
+		else if (!(esp.GetFlags() & ESP_QUIET))
+			fprintf(stdout, "Reset settings for \"%s\" saved in \"%s\".\n", section, parm.profile.Filename());
+	}
+	return(0);
+}
+
 /*
  ** getOptionVal
  *
@@ -68,10 +68,12 @@ LFLAGS=$(LD_COM_OPTS) $(LD_DBG_OPTS) /debug
 OBJDIR=$(BLDDIR)
 
 TARG=esp_tool
+LIBTARG=libesptool
 
 # specify commands
 CC=cl.exe
 LD=link.exe
+LB=lib.exe
 RM=erase
 
 # specify the compile command line options
@@ -82,11 +84,12 @@ LIBS=kernel32.lib user32.lib gdi32.lib winspool.lib comdlg32.lib advapi32.lib sh
 LDFLAGS=/nologo $(LFLAGS) /machine:I386 /subsystem:console $(LIBS) /out:"$(BLDDIR)\$(TARG).exe"
 
 # specify the objects to be built
-OBJS="$(OBJDIR)\esp_tool.obj" "$(OBJDIR)\esp.obj" "$(OBJDIR)\elf.obj" "$(OBJDIR)\serial.obj"
+LIBOBJS="$(OBJDIR)\esp.obj" "$(OBJDIR)\elf.obj" "$(OBJDIR)\serial.obj" "$(OBJDIR)\profile.obj" "$(OBJDIR)\thread.obj" "$(OBJDIR)\sysdep.obj" "$(OBJDIR)\slip.obj" "$(OBJDIR)\packet.obj" "$(OBJDIR)\reader.obj" "$(OBJDIR)\checksum.obj" "$(OBJDIR)\libesptool.obj"
+OBJS="$(OBJDIR)\esp_tool.obj" "$(OBJDIR)\gang.obj" "$(OBJDIR)\scheduler.obj" "$(OBJDIR)\session.obj" "$(OBJDIR)\daemon.obj" "$(OBJDIR)\manifest.obj"
 
 first : all
 
-all : "$(BLDDIR)\$(TARG).exe"
+all : "$(BLDDIR)\$(LIBTARG).lib" "$(BLDDIR)\$(TARG).exe"
 
 clean :
 	-@if exist "$(BLDDIR)\*.obj"       $(RM) "$(BLDDIR)\*.obj"
@@ -95,6 +98,7 @@ clean :
 	-@if exist "$(BLDDIR)\*.pdb"       $(RM) "$(BLDDIR)\*.pdb"
 	-@if exist "$(BLDDIR)\*.idb"       $(RM) "$(BLDDIR)\*.idb"
 	-@if exist "$(BLDDIR)\$(TARG).exe" $(RM) "$(BLDDIR)\$(TARG).exe"
+	-@if exist "$(BLDDIR)\$(LIBTARG).lib" $(RM) "$(BLDDIR)\$(LIBTARG).lib"
 
 "$(BLDDIR)" :
     if not exist "$(BLDDIR)/$(NULL)" mkdir "$(BLDDIR)"
@@ -107,11 +111,27 @@ clean :
 .cpp{$(OBJDIR)}.obj::
    $(CC) $(CPPFLAGS) $<
 
-"$(BLDDIR)\$(TARG).exe" : "$(BLDDIR)" "$(OBJDIR)" $(OBJS)
-    $(LD) $(LDFLAGS) $(OBJS)
+"$(BLDDIR)\$(LIBTARG).lib" : "$(BLDDIR)" "$(OBJDIR)" $(LIBOBJS)
+    $(LB) /nologo /out:"$(BLDDIR)\$(LIBTARG).lib" $(LIBOBJS)
 
-$(OBJDIR)\esp_tool.obj : esp_tool.cpp esp.h elf.h serial.h sysdep.h
-$(OBJDIR)\esp.obj : esp.cpp esp.h elf.h serial.h sysdep.h
-$(OBJDIR)\elf.obj : elf.cpp elf.h sysdep.h
+"$(BLDDIR)\$(TARG).exe" : "$(BLDDIR)" "$(OBJDIR)" $(OBJS) "$(BLDDIR)\$(LIBTARG).lib"
+    $(LD) $(LDFLAGS) $(OBJS) "$(BLDDIR)\$(LIBTARG).lib"
+
+$(OBJDIR)\esp_tool.obj : esp_tool.cpp esp.h elf.h serial.h profile.h gang.h packet.h scheduler.h daemon.h manifest.h thread.h sysdep.h
+$(OBJDIR)\esp.obj : esp.cpp esp.h packet.h reader.h checksum.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\elf.obj : elf.cpp elf.h checksum.h sysdep.h
 $(OBJDIR)\serial.obj : serial.cpp serial.h
+$(OBJDIR)\profile.obj : profile.cpp profile.h thread.h sysdep.h
+$(OBJDIR)\thread.obj : thread.cpp thread.h sysdep.h
+$(OBJDIR)\sysdep.obj : sysdep.cpp esp.h elf.h serial.h profile.h sysdep.h
+$(OBJDIR)\libesptool.obj : libesptool.cpp libesptool.h esp.h elf.h serial.h profile.h sysdep.h
+$(OBJDIR)\gang.obj : gang.cpp gang.h packet.h session.h esp.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\scheduler.obj : scheduler.cpp scheduler.h gang.h packet.h esp.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\slip.obj : slip.cpp slip.h sysdep.h
+$(OBJDIR)\packet.obj : packet.cpp packet.h slip.h esp.h elf.h serial.h profile.h sysdep.h
+$(OBJDIR)\reader.obj : reader.cpp reader.h esp.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\checksum.obj : checksum.cpp checksum.h sysdep.h
+$(OBJDIR)\session.obj : session.cpp session.h slip.h packet.h gang.h esp.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\daemon.obj : daemon.cpp daemon.h gang.h packet.h esp.h elf.h serial.h profile.h thread.h sysdep.h
+$(OBJDIR)\manifest.obj : manifest.cpp manifest.h gang.h packet.h esp.h elf.h serial.h profile.h thread.h sysdep.h
 
@@ -0,0 +1,889 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "gang.h"
+#include "session.h"
+#include <string.h>
+
+/** local definitions **/
+
+// the fields that may appear in an overlay template as {{name}}
+typedef enum
+{
+	FieldMAC,					// the MAC address, 6 bytes
+	FieldMACStr,				// the MAC address, 12 hexadecimal digits
+	FieldSerial,				// the serial number, 4 bytes in little-endian order
+	FieldSerialStr,				// the serial number, 10 decimal digits
+	FieldNone
+} Field_t;
+
+static const struct
+{
+	const char *name;
+	uint32_t size;				// the size of the content replacing the field
+} overlayField[] =
+{
+	{ "MAC",		6 },
+	{ "MAC_STR",	12 },
+	{ "SERIAL",		4 },
+	{ "SERIAL_STR",	10 }
+};
+
+/** internal functions **/
+static char *dupString(const char *s, size_t len);
+static Field_t findField(const uint8_t *tmpl, uint32_t size, uint32_t pos, uint32_t& len);
+static bool sectorsOverlap(const PacketSeg_t& seg1, const PacketSeg_t& seg2);
+
+/** class implementations **/
+
+Gang::
+Gang()
+{
+	m_imageCnt = 0;
+	m_overlayCnt = 0;
+	m_serial = 1;
+	m_readCnt = 0;
+	m_portCnt = 0;
+	m_nextPort = 0;
+	m_msElapsed = 0;
+	m_msCPU = 0;
+	m_eventLoop = false;
+	m_cacheFile = NULL;
+	m_prepared = false;
+	m_prepStat = 0;
+	m_msPrep = 0;
+	m_parm.dlSpeed = 115200;
+	m_parm.highSpeed = 0;
+	m_parm.resetMode = ResetNone;
+	m_parm.flags = 0;
+	m_parm.profile = NULL;
+}
+
+Gang::
+~Gang()
+{
+	unsigned i;
+	for (i = 0; i < m_imageCnt; i++)
+		GangFreeImage(m_image[i]);
+	for (i = 0; i < m_overlayCnt; i++)
+		GangFreeOverlay(m_overlay[i]);
+	for (i = 0; i < m_readCnt; i++)
+		delete[] m_read[i].file;
+	for (i = 0; i < m_portCnt; i++)
+		delete[] m_port[i].name;
+}
+
+//
+// Add the ports in a comma-separated list.  The return value is zero on
+// success, non-zero if the list is empty or has too many entries.
+//
+int Gang::
+AddPorts(const char *portList)
+{
+	const char *p;
+	const char *end;
+
+	if ((portList == NULL) || (*portList == '\0'))
+		return(-1);
+	for (p = portList; *p != '\0'; p = end)
+	{
+		if ((end = strchr(p, ',')) == NULL)
+			end = p + strlen(p);
+		if (end != p)
+		{
+			if (m_portCnt >= GANG_MAX_PORTS)
+				return(-1);
+			GangPort_t& port = m_port[m_portCnt++];
+			memset(&port, 0, sizeof(port));
+			port.name = dupString(p, end - p);
+		}
+		if (*end == ',')
+			end++;
+	}
+	return((m_portCnt == 0) ? -1 : 0);
+}
+
+//
+// Add an image file to be written to each device.  The file is read when
+// the sessions start; the name "-" reads the standard input.  The return
+// value is zero on success, non-zero otherwise.
+//
+int Gang::
+AddImage(const char *file, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	if (m_imageCnt >= GANG_MAX_IMAGES)
+		return(ESP_ERROR_PARAM);
+
+	FILE *fp;
+	if (strcmp(file, VFileStdin) != 0)
+	{
+		if ((fp = fopen(file, "rb")) == NULL)
+			return(ESP_ERROR_FILE_OPEN);
+		fclose(fp);
+	}
+	GangImage_t& image = m_image[m_imageCnt++];
+	image.name = dupString(file, strlen(file));
+	image.addr = addr;
+	image.flashParmVal = flashParmVal;
+	image.flashParmMask = flashParmMask;
+	image.data = NULL;
+	image.size = 0;
+	return(0);
+}
+
+//
+// Add a region of Flash to be read from each device after the images are
+// written.  In the file name, %p is replaced by the base name of the port.
+// The return value is zero on success, non-zero otherwise.
+//
+int Gang::
+AddRead(uint32_t addr, uint32_t size, const char *file)
+{
+	if ((m_readCnt >= GANG_MAX_IMAGES) || (size == 0) || (file == NULL) || (*file == '\0'))
+		return(ESP_ERROR_PARAM);
+	GangRead_t& read = m_read[m_readCnt++];
+	read.addr = addr;
+	read.size = size;
+	read.file = dupString(file, strlen(file));
+	return(0);
+}
+
+//
+// Read a template for a region of Flash whose content is produced for
+// each device.  The return value is zero on success, non-zero otherwise.
+//
+int Gang::
+AddOverlay(const char *file, uint32_t addr)
+{
+	if (m_overlayCnt >= GANG_MAX_OVERLAYS)
+		return(ESP_ERROR_PARAM);
+
+	int stat;
+	if ((stat = GangLoadOverlay(m_overlay[m_overlayCnt], file, addr)) == 0)
+		m_overlayCnt++;
+	return(stat);
+}
+
+//
+// Write the images to the device on each port, using a pool of worker
+// threads or the event loop.  The return value is the number of ports for
+// which the process failed.
+//
+unsigned Gang::
+Run()
+{
+	unsigned tickStart = getTickCount();
+	unsigned i;
+
+	for (i = 0; i < m_portCnt; i++)
+		m_port[i].serial = m_serial + i;
+
+	// prepare the images while the sessions connect
+	Thread prepThread;
+	m_prepared = false;
+	if (prepThread.Start(preparer, this) != 0)
+		preparer(this);
+
+	if (m_eventLoop)
+	{
+		SessionLoop loop(m_parm);
+		loop.SetReady(workReady, this);
+		loop.SetDone(reportDone, this);
+		for (i = 0; i < m_portCnt; i++)
+			loop.Add(m_port[i]);
+		loop.Run();
+		m_msCPU = loop.CPUTime();
+	}
+	else
+	{
+		Thread thread[GANG_MAX_THREADS];
+		unsigned threadCnt = (m_portCnt < GANG_MAX_THREADS) ? m_portCnt : GANG_MAX_THREADS;
+
+		m_nextPort = 0;
+		for (i = 0; i < threadCnt; i++)
+		{
+			if (thread[i].Start(worker, this) != 0)
+				break;
+		}
+
+		// if no thread could be started, do the work on this one
+		if (i == 0)
+			worker(this);
+		for (i = 0; i < threadCnt; i++)
+			thread[i].Join();
+	}
+	prepThread.Join();
+	m_msElapsed = getTickCount() - tickStart;
+
+	unsigned failCnt = 0;
+	for (i = 0; i < m_portCnt; i++)
+	{
+		if (m_port[i].stat != 0)
+			failCnt++;
+	}
+	return(failCnt);
+}
+
+//
+// Output a table giving the result for each port.
+//
+void Gang::
+Report(FILE *fp) const
+{
+	unsigned failCnt = 0;
+
+	fprintf(fp, "\n%-20s %-7s %8s %8s %8s  %s\n", "Port", "Result", "Time", "Speed", "Retries", "MAC");
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		const GangPort_t& port = m_port[i];
+		char mac[20];
+
+		if (port.haveMAC)
+			sprintf(mac, "%02x:%02x:%02x:%02x:%02x:%02x", port.mac[0], port.mac[1],
+					port.mac[2], port.mac[3], port.mac[4], port.mac[5]);
+		else
+			strcpy(mac, "-");
+		fprintf(fp, "%-20s %-7s %7.1fs %8lu %8lu  %s", port.name, (port.stat == 0) ? "OK" : "FAILED",
+				port.msElapsed / 1000.0, (unsigned long)port.baud, (unsigned long)port.retries, mac);
+		if (m_overlayCnt != 0)
+			fprintf(fp, "  serial %lu", (unsigned long)port.serial);
+		if (port.stat != 0)
+		{
+			fprintf(fp, "  %s (%d)", port.stage, port.stat);
+			failCnt++;
+		}
+		fputs("\n", fp);
+	}
+	fprintf(fp, "%u of %u ports programmed successfully in %.1f seconds.\n",
+			m_portCnt - failCnt, m_portCnt, m_msElapsed / 1000.0);
+	if (m_prepared && m_portCnt)
+	{
+		// the preparation was hidden except while a session awaited it
+		unsigned msWait = 0;
+		for (unsigned i = 0; i < m_portCnt; i++)
+		{
+			if (m_port[i].msPrepWait > msWait)
+				msWait = m_port[i].msPrepWait;
+		}
+		if (msWait > m_msPrep)
+			msWait = m_msPrep;
+		fprintf(fp, "Preparing the images took %.2f seconds, %.2f seconds of it while connecting.\n",
+				m_msPrep / 1000.0, (m_msPrep - msWait) / 1000.0);
+	}
+	if (m_eventLoop && m_portCnt)
+		fprintf(fp, "Event loop processor time %.2f seconds, %.1f ms per device.\n",
+				m_msCPU / 1000.0, (double)m_msCPU / m_portCnt);
+	fflush(fp);
+}
+
+/** public functions **/
+
+//
+// Read an image file into memory.  The return value is zero on success,
+// non-zero otherwise.
+//
+int
+GangLoadImage(GangImage_t& image, const char *file, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	int stat;
+
+	image.name = dupString(file, strlen(file));
+	image.addr = addr;
+	image.flashParmVal = flashParmVal;
+	image.flashParmMask = flashParmMask;
+	image.data = NULL;
+	image.size = 0;
+	if ((stat = GangReadImage(image)) != 0)
+	{
+		delete[] image.name;
+		image.name = NULL;
+	}
+	return(stat);
+}
+
+//
+// Read the content of an image from the file named by it.  The return
+// value is zero on success, non-zero otherwise.
+//
+int
+GangReadImage(GangImage_t& image)
+{
+	VFile vf;
+	if (vf.Open(image.name, VFileOpenMap) != 0)
+		return(ESP_ERROR_FILE_OPEN);
+	if (vf.IsStream() && (vf.Load() != 0))
+		return(ESP_ERROR_FILE_READ);
+	long size = (long)vf.Size();
+	if (size < 0)
+		return(ESP_ERROR_FILE_STAT);
+
+	image.data = new uint8_t[size ? size : 1];
+	if ((size_t)size && (vf.Read(image.data, 1, size) != (size_t)size))
+	{
+		delete[] image.data;
+		image.data = NULL;
+		return(ESP_ERROR_FILE_READ);
+	}
+	image.size = (uint32_t)size;
+	return(0);
+}
+
+//
+// Read an overlay template into memory, determining the size of the
+// content that it produces.  The return value is zero on success,
+// non-zero otherwise.
+//
+int
+GangLoadOverlay(GangOverlay_t& overlay, const char *file, uint32_t addr)
+{
+	GangImage_t image;
+	int stat;
+
+	if ((stat = GangLoadImage(image, file, addr, 0, 0)) != 0)
+		return(stat);
+	overlay.name = image.name;
+	overlay.addr = addr;
+	overlay.tmpl = image.data;
+	overlay.tmplSize = image.size;
+	overlay.size = 0;
+	overlay.useMAC = false;
+	for (uint32_t pos = 0; pos < overlay.tmplSize; )
+	{
+		uint32_t len;
+		Field_t field = findField(overlay.tmpl, overlay.tmplSize, pos, len);
+		overlay.size += (field == FieldNone) ? len : overlayField[field].size;
+		if ((field == FieldMAC) || (field == FieldMACStr))
+			overlay.useMAC = true;
+		pos += len;
+	}
+	if (overlay.size == 0)
+	{
+		GangFreeOverlay(overlay);
+		return(ESP_ERROR_FILE_SIZE);
+	}
+	return(0);
+}
+
+//
+// Release the memory used by an overlay.
+//
+void
+GangFreeOverlay(GangOverlay_t& overlay)
+{
+	delete[] overlay.name;
+	delete[] overlay.tmpl;
+	overlay.name = NULL;
+	overlay.tmpl = NULL;
+}
+
+//
+// Produce the content of an overlay for a device.  The buffer must hold
+// the number of bytes given by the size of the overlay.
+//
+void
+GangRenderOverlay(const GangOverlay_t& overlay, const uint8_t *mac, uint32_t serial, uint8_t *buf)
+{
+	static const char hexDigit[] = "0123456789abcdef";
+
+	for (uint32_t pos = 0; pos < overlay.tmplSize; )
+	{
+		uint32_t len;
+		unsigned i;
+		char num[12];
+
+		Field_t field = findField(overlay.tmpl, overlay.tmplSize, pos, len);
+		switch (field)
+		{
+		case FieldMAC:
+			memcpy(buf, mac, 6);
+			break;
+
+		case FieldMACStr:
+			for (i = 0; i < 6; i++)
+			{
+				buf[2 * i] = hexDigit[mac[i] >> 4];
+				buf[2 * i + 1] = hexDigit[mac[i] & 0x0f];
+			}
+			break;
+
+		case FieldSerial:
+			for (i = 0; i < 4; i++)
+				buf[i] = (uint8_t)(serial >> (8 * i));
+			break;
+
+		case FieldSerialStr:
+			sprintf(num, "%010lu", (unsigned long)serial);
+			memcpy(buf, num, 10);
+			break;
+
+		default:
+			memcpy(buf, overlay.tmpl + pos, len);
+			break;
+		}
+		buf += (field == FieldNone) ? len : overlayField[field].size;
+		pos += len;
+	}
+}
+
+//
+// Prepare the frames for the overlays that differ for a device from those
+// in the cache.  The return value is zero on success, non-zero otherwise,
+// e.g. if the MAC address is needed but wasn't read.
+//
+int
+GangPatch(PacketPatch& patch, const PacketCache& cache, const GangOverlay_t *overlay, unsigned overlayCnt,
+		const GangPort_t& port)
+{
+	int stat = 0;
+
+	patch.Clear();
+	for (unsigned i = 0; (stat == 0) && (i < overlayCnt); i++)
+	{
+		if (overlay[i].useMAC && !port.haveMAC)
+			return(ESP_ERROR_PARAM);
+		uint8_t *buf = new uint8_t[overlay[i].size];
+		GangRenderOverlay(overlay[i], port.mac, port.serial, buf);
+		stat = patch.Apply(cache, overlay[i].addr, buf, overlay[i].size);
+		delete[] buf;
+	}
+	return(stat);
+}
+
+//
+// Release the memory used by an image.
+//
+void
+GangFreeImage(GangImage_t& image)
+{
+	delete[] image.name;
+	delete[] image.data;
+	image.name = NULL;
+	image.data = NULL;
+}
+
+//
+// Open a port and connect to the attached device, switching to a higher
+// speed if requested.  If the higher speed can't be used, the session
+// continues at the original speed.  The return value is zero on success,
+// non-zero otherwise.
+//
+int
+GangConnect(ESP& esp, const char *portName, const GangParm_t& parm)
+{
+	int stat;
+
+	esp.SetFlags(ESP_QUIET);
+	esp.SetProfile(parm.profile);
+	if ((stat = esp.OpenComm(portName, parm.dlSpeed, esp.ResetFlags(parm.resetMode))) != 0)
+		return(stat);
+	if ((stat = esp.Connect(parm.resetMode)) != 0)
+		return(stat);
+	if (parm.highSpeed && (esp.ChangeBaud(parm.highSpeed) != 0) && !esp.IsConnected())
+		stat = esp.Connect(parm.resetMode);
+	return(stat);
+}
+
+//
+// Write an image held in memory to the device.
+//
+int
+GangWriteImage(ESP& esp, const GangImage_t& image)
+{
+	int stat;
+	VFile vf;
+	if ((stat = vf.Open(image.data, image.size, image.name)) == 0)
+		stat = esp.FlashWrite(vf, image.addr, image.flashParmVal, image.flashParmMask);
+	return(stat);
+}
+
+//
+// Read a region of Flash into a file named for the port.
+//
+int
+GangReadFlash(ESP& esp, const GangRead_t& read, const char *portName, unsigned id)
+{
+	char file[FILENAME_MAX];
+	VFile vf;
+	int stat;
+
+	GangFileName(file, sizeof(file), read.file, portName, id);
+	if (vf.Open(file, "wb") != 0)
+		return(ESP_ERROR_FILE_CREATE);
+	stat = esp.FlashRead(vf, read.addr, read.size);
+	vf.Close();
+	return(stat);
+}
+
+//
+// Compose a file name from a pattern, replacing %p with the base name of
+// a port and %j with a number.
+//
+void
+GangFileName(char *buf, size_t bufSize, const char *pattern, const char *portName, unsigned id)
+{
+	const char *base = portName;
+	const char *p;
+	size_t len = 0;
+
+	for (p = portName; *p != '\0'; p++)
+	{
+		if ((*p == '/') || (*p == '\\') || (*p == ':'))
+			base = p + 1;
+	}
+	for (p = pattern; (*p != '\0') && (len + 1 < bufSize); p++)
+	{
+		char num[12];
+		const char *s = NULL;
+
+		if ((*p == '%') && (p[1] == 'p'))
+			s = base;
+		else if ((*p == '%') && (p[1] == 'j'))
+		{
+			sprintf(num, "%u", id);
+			s = num;
+		}
+		if (s == NULL)
+			buf[len++] = *p;
+		else
+		{
+			for ( ; (*s != '\0') && (len + 1 < bufSize); s++)
+				buf[len++] = *s;
+			p++;
+		}
+	}
+	buf[len] = '\0';
+}
+
+//
+// Conclude a session, running the application if requested.
+//
+int
+GangFinish(ESP& esp, const GangParm_t& parm)
+{
+	if ((parm.flags & ESP_AUTO_RUN) == 0)
+		return(0);
+	if (parm.resetMode == ResetNone)
+		return(esp.Run(true));
+	esp.ResetDevice(parm.resetMode, true);
+	return(0);
+}
+
+/** private functions **/
+
+//
+// Report the completion of a session driven by the event loop.
+//
+void Gang::
+reportDone(void *arg, GangPort_t& port)
+{
+	Gang *gang = (Gang *)arg;
+
+	if ((gang->m_parm.flags & ESP_QUIET) == 0)
+	{
+		if (port.stat == 0)
+			fprintf(stdout, "%s: completed in %.1f seconds.\n", port.name, port.msElapsed / 1000.0);
+		else
+			fprintf(stdout, "%s: failed at %s (%d).\n", port.name, port.stage, port.stat);
+		fflush(stdout);
+	}
+}
+
+//
+// The function executed by each worker thread, programming ports until
+// none remain.
+//
+void Gang::
+worker(void *arg)
+{
+	Gang *gang = (Gang *)arg;
+
+	while (1)
+	{
+		unsigned idx;
+		{
+			MutexLock lock(gang->m_mutex);
+			if ((idx = gang->m_nextPort) >= gang->m_portCnt)
+				break;
+			gang->m_nextPort++;
+		}
+		gang->program(gang->m_port[idx]);
+	}
+}
+
+//
+// Connect to the device on a port and write the images to it.
+//
+void Gang::
+program(GangPort_t& port)
+{
+	ESP esp;
+	unsigned tickStart = getTickCount();
+	int stat;
+
+	port.stage = "connect";
+	if ((stat = GangConnect(esp, port.name, m_parm)) == 0)
+	{
+		uint8_t mac[12];
+		if (esp.ReadMAC(mac, sizeof(mac)) == 0)
+		{
+			memcpy(port.mac, mac, sizeof(port.mac));
+			port.haveMAC = true;
+		}
+		port.baud = esp.GetCommSpeed();
+
+		unsigned tickWait = getTickCount();
+		port.stage = "prepare";
+		stat = awaitPrepared();
+		port.msPrepWait = getTickCount() - tickWait;
+
+		if ((stat == 0) && (m_cache.SegmentCount() != 0))
+		{
+			PacketPatch patch;
+			port.stage = "overlay";
+			if ((stat = GangPatch(patch, m_cache, m_overlay, m_overlayCnt, port)) == 0)
+			{
+				port.stage = "write";
+				stat = esp.FlashWrite(m_cache, &patch);
+			}
+		}
+		else if (stat == 0)
+		{
+			port.stage = "write";
+			for (unsigned i = 0; (stat == 0) && (i < m_imageCnt); i++)
+				stat = GangWriteImage(esp, m_image[i]);
+		}
+
+		if (stat == 0)
+			port.stage = "read";
+		for (unsigned i = 0; (stat == 0) && (i < m_readCnt); i++)
+			stat = GangReadFlash(esp, m_read[i], port.name, i + 1);
+
+		if (stat == 0)
+		{
+			port.stage = "run";
+			stat = GangFinish(esp, m_parm);
+		}
+	}
+	esp.CloseComm();
+	port.stat = stat;
+	port.retries = esp.GetStats().retries;
+	port.msElapsed = getTickCount() - tickStart;
+
+	// report the completion of each port as it occurs
+	MutexLock lock(m_mutex);
+	reportDone(this, port);
+}
+
+//
+// The function executed by the preparation thread, reading the images and
+// preparing their frames.
+//
+void Gang::
+preparer(void *arg)
+{
+	Gang *gang = (Gang *)arg;
+	unsigned tickStart = getTickCount();
+	int stat = 0;
+
+	for (unsigned i = 0; (stat == 0) && (i < gang->m_imageCnt); i++)
+	{
+		GangImage_t& image = gang->m_image[i];
+		if ((image.data == NULL) && ((stat = GangReadImage(image)) != 0))
+		{
+			MutexLock lock(gang->m_mutex);
+			fprintf(stderr, "Can't read the image file \"%s\" (%d).\n", image.name, stat);
+		}
+	}
+
+	// without the cache, each session prepares the blocks itself
+	if ((stat == 0) && ((stat = gang->prepare()) != 0))
+	{
+		gang->m_cache.Close();
+
+		// the overlays are written only by way of the cache
+		if (gang->m_overlayCnt == 0)
+			stat = 0;
+	}
+
+	MutexLock lock(gang->m_mutex);
+	gang->m_prepStat = stat;
+	gang->m_msPrep = getTickCount() - tickStart;
+	gang->m_prepared = true;
+}
+
+//
+// Supply the work to the event loop once the images have been prepared.
+// The return value is true when the preparation is complete, its result
+// being returned indirectly.
+//
+bool Gang::
+workReady(void *arg, SessionLoop& loop, int& stat)
+{
+	Gang *gang = (Gang *)arg;
+	{
+		MutexLock lock(gang->m_mutex);
+		if (!gang->m_prepared)
+			return(false);
+	}
+	if (((stat = gang->m_prepStat) == 0) &&
+			((stat = loop.SetWork(gang->m_image, gang->m_imageCnt, gang->m_read, gang->m_readCnt,
+				(gang->m_cache.SegmentCount() != 0) ? &gang->m_cache : NULL)) == 0))
+		loop.SetOverlays(gang->m_overlay, gang->m_overlayCnt);
+	return(true);
+}
+
+//
+// Wait for the images to be prepared.  The return value is the result of
+// the preparation.
+//
+int Gang::
+awaitPrepared()
+{
+	for ( ; ; )
+	{
+		{
+			MutexLock lock(m_mutex);
+			if (m_prepared)
+				return(m_prepStat);
+		}
+		msDelay(GANG_PREP_POLL_MS);
+	}
+}
+
+//
+// Prepare the command frames for the images and for the overlays, the
+// latter with the content for a device having a MAC address and serial
+// number of zero.  If a cache file is given and it holds the frames for
+// the current images, it is mapped; otherwise, the frames are prepared and
+// saved to the file for later runs.  The return value is zero on success,
+// non-zero otherwise.
+//
+int Gang::
+prepare()
+{
+	static const uint8_t noMAC[6] = { 0 };
+	uint8_t *base[GANG_MAX_OVERLAYS];
+	uint32_t key = PACKET_KEY_INIT;
+	unsigned i;
+	int stat = 0;
+
+	for (i = 0; i < m_imageCnt; i++)
+	{
+		const GangImage_t& img = m_image[i];
+		key = PacketCache::KeyOf(img.data, img.size, img.addr, img.flashParmVal, img.flashParmMask, key);
+	}
+	for (i = 0; i < m_overlayCnt; i++)
+	{
+		base[i] = new uint8_t[m_overlay[i].size];
+		GangRenderOverlay(m_overlay[i], noMAC, 0, base[i]);
+		key = PacketCache::KeyOf(base[i], m_overlay[i].size, m_overlay[i].addr, 0, 0, key);
+	}
+	if ((m_cacheFile == NULL) || (m_cache.Map(m_cacheFile) != 0) || (m_cache.Key() != key))
+	{
+		m_cache.Close();
+		for (i = 0; (stat == 0) && (i < m_imageCnt); i++)
+		{
+			const GangImage_t& img = m_image[i];
+			stat = m_cache.Add(img.data, img.size, img.addr, img.flashParmVal, img.flashParmMask);
+		}
+		for (i = 0; (stat == 0) && (i < m_overlayCnt); i++)
+			stat = m_cache.Add(base[i], m_overlay[i].size, m_overlay[i].addr, 0, 0);
+		if ((stat == 0) && (m_cacheFile != NULL) && (m_cache.Save(m_cacheFile) != 0))
+			fprintf(stderr, "Warning: the packet cache could not be saved to \"%s\".\n", m_cacheFile);
+	}
+	for (i = 0; i < m_overlayCnt; i++)
+		delete[] base[i];
+
+	// the overlays are the last segments, none may share a sector with other data
+	unsigned segCnt = m_cache.SegmentCount();
+	for (i = segCnt - m_overlayCnt; (stat == 0) && (i < segCnt); i++)
+	{
+		for (unsigned j = 0; j < segCnt; j++)
+		{
+			if ((j != i) && sectorsOverlap(m_cache.Segment(i), m_cache.Segment(j)))
+			{
+				const GangOverlay_t& overlay = m_overlay[i - (segCnt - m_overlayCnt)];
+				fprintf(stderr, "The overlay \"%s\" at 0x%x shares a Flash sector with other data.\n",
+						overlay.name, overlay.addr);
+				stat = ESP_ERROR_PARAM;
+				break;
+			}
+		}
+	}
+	return(stat);
+}
+
+//
+// Make an allocated copy of part of a string.
+//
+static char *
+dupString(const char *s, size_t len)
+{
+	char *p = new char[len + 1];
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return(p);
+}
+
+//
+// Find the field, if any, at a position in an overlay template.  The
+// length of the field, or of the text preceding the next field, is
+// returned indirectly.
+//
+static Field_t
+findField(const uint8_t *tmpl, uint32_t size, uint32_t pos, uint32_t& len)
+{
+	uint32_t end;
+	for (end = pos; end + 1 < size; end++)
+	{
+		if ((tmpl[end] != '{') || (tmpl[end + 1] != '{'))
+			continue;
+		for (unsigned field = 0; field < FieldNone; field++)
+		{
+			uint32_t nameLen = (uint32_t)strlen(overlayField[field].name);
+			if ((end + nameLen + 4 <= size) && (memcmp(tmpl + end + 2, overlayField[field].name, nameLen) == 0) &&
+					(tmpl[end + nameLen + 2] == '}') && (tmpl[end + nameLen + 3] == '}'))
+			{
+				if (end > pos)
+				{
+					len = end - pos;
+					return(FieldNone);
+				}
+				len = nameLen + 4;
+				return((Field_t)field);
+			}
+		}
+	}
+	len = size - pos;
+	return(FieldNone);
+}
+
+//
+// Determine if the Flash sectors written by two segments overlap.
+//
+static bool
+sectorsOverlap(const PacketSeg_t& seg1, const PacketSeg_t& seg2)
+{
+	uint32_t start1 = seg1.addr & ~(GANG_SECT_SIZE - 1);
+	uint32_t end1 = seg1.addr + seg1.size;
+	uint32_t start2 = seg2.addr & ~(GANG_SECT_SIZE - 1);
+	uint32_t end2 = seg2.addr + seg2.size;
+	return((start1 < end2) && (start2 < end1));
+}
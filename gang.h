@@ -0,0 +1,183 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(GANG_H__)
+#define GANG_H__
+
+#include "esp.h"
+#include "packet.h"
+#include "thread.h"
+
+#define GANG_MAX_PORTS				64			// the most ports that may be programmed together
+#define GANG_MAX_THREADS			32			// the most worker threads used
+#define GANG_MAX_IMAGES				16			// the most images that may be written
+#define GANG_MAX_OVERLAYS			8			// the most per-device regions that may be written
+#define GANG_SECT_SIZE				4096		// the size of a Flash sector
+#define GANG_PREP_POLL_MS			2			// the interval at which a session checks for prepared images
+
+class SessionLoop;
+
+// an image read into memory to be shared by several sessions
+typedef struct
+{
+	char *name;					// the file from which the image was read
+	uint32_t addr;				// the Flash address of the image
+	uint16_t flashParmVal;		// Flash parameters to apply
+	uint16_t flashParmMask;		// mask bits indicating which parameters to apply
+	uint8_t *data;				// the content of the image
+	uint32_t size;				// the size of the image
+} GangImage_t;
+
+// a region of Flash whose content is produced for each device from a template
+typedef struct
+{
+	char *name;					// the file from which the template was read
+	uint32_t addr;				// the Flash address of the region
+	uint8_t *tmpl;				// the content of the template
+	uint32_t tmplSize;
+	uint32_t size;				// the size of the content produced
+	bool useMAC;				// if the content depends on the MAC address
+} GangOverlay_t;
+
+// a region of Flash to be read into a file
+typedef struct
+{
+	uint32_t addr;				// the Flash address
+	uint32_t size;				// the number of bytes to read
+	char *file;					// the output file name, %p being replaced by the port name
+} GangRead_t;
+
+// the progress and result of the session on one port
+typedef struct
+{
+	char *name;					// the serial port designator
+	int stat;					// the result
+	const char *stage;			// the stage of the process at which an error occurred
+	uint8_t mac[6];				// the station MAC address of the device
+	bool haveMAC;				// if the MAC address was read
+	uint32_t baud;				// the speed at which the images were written
+	unsigned msElapsed;			// the time taken
+	uint32_t retries;			// commands re-sent due to errors
+	uint32_t serial;			// the serial number assigned to the device
+	unsigned msPrepWait;		// the time spent waiting for the images to be prepared
+} GangPort_t;
+
+// the settings used by each session
+typedef struct
+{
+	uint32_t dlSpeed;			// the speed at which to connect
+	uint32_t highSpeed;			// the speed to switch to after connecting (0 for none)
+	ResetMode_t resetMode;		// the reset mode
+	unsigned flags;				// ESP_xxx flags
+	Profile *profile;			// learned values, may be NULL
+} GangParm_t;
+
+int GangLoadImage(GangImage_t& image, const char *file, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+int GangReadImage(GangImage_t& image);
+void GangFreeImage(GangImage_t& image);
+int GangConnect(ESP& esp, const char *portName, const GangParm_t& parm);
+int GangWriteImage(ESP& esp, const GangImage_t& image);
+int GangFinish(ESP& esp, const GangParm_t& parm);
+int GangLoadOverlay(GangOverlay_t& overlay, const char *file, uint32_t addr);
+void GangFreeOverlay(GangOverlay_t& overlay);
+void GangRenderOverlay(const GangOverlay_t& overlay, const uint8_t *mac, uint32_t serial, uint8_t *buf);
+int GangPatch(PacketPatch& patch, const PacketCache& cache, const GangOverlay_t *overlay, unsigned overlayCnt,
+		const GangPort_t& port);
+int GangReadFlash(ESP& esp, const GangRead_t& read, const char *portName, unsigned id = 0);
+void GangFileName(char *buf, size_t bufSize, const char *pattern, const char *portName, unsigned id);
+
+//
+// A class for writing the same set of images to the devices attached to
+// several serial ports concurrently and, optionally, reading back regions
+// of Flash.  The images are read into memory once and shared by the
+// sessions, each of which uses its own ESP object on a pool of worker
+// threads or, alternatively, a state machine driven by a single event loop.
+//
+// The images are read and their frames prepared on a separate thread while
+// the sessions reset and connect to the devices, so that the preparation
+// delays writing only if it takes longer than connecting.
+//
+// An overlay is a region of Flash whose content differs for each device,
+// e.g. a configuration sector holding a serial number.  It is produced
+// from a template in which {{MAC}}, {{MAC_STR}}, {{SERIAL}} and
+// {{SERIAL_STR}} are replaced by the device's MAC address and serial
+// number in binary or text form.  The frames for the overlays are
+// prepared along with those for the images and only the blocks whose
+// content differs are prepared again for each device.
+//
+class Gang
+{
+public:
+	Gang();
+	~Gang();
+
+	int AddPorts(const char *portList);
+	unsigned PortCount() const { return(m_portCnt); }
+	int AddImage(const char *file, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	unsigned ImageCount() const { return(m_imageCnt); }
+	int AddRead(uint32_t addr, uint32_t size, const char *file);
+	int AddOverlay(const char *file, uint32_t addr);
+	unsigned OverlayCount() const { return(m_overlayCnt); }
+	void SetSerial(uint32_t serial) { m_serial = serial; }
+
+	void SetSpeed(uint32_t dlSpeed, uint32_t highSpeed) { m_parm.dlSpeed = dlSpeed; m_parm.highSpeed = highSpeed; }
+	void SetReset(ResetMode_t resetMode) { m_parm.resetMode = resetMode; }
+	void SetFlags(unsigned flags) { m_parm.flags = flags; }
+	void SetProfile(Profile *profile) { m_parm.profile = profile; }
+	void SetEventLoop(bool eventLoop) { m_eventLoop = eventLoop; }
+	void SetPacketCache(const char *file) { m_cacheFile = file; }
+
+	unsigned Run();
+	void Report(FILE *fp = stdout) const;
+
+private:
+	Gang(const Gang&);
+	Gang& operator=(const Gang&);
+
+	static void worker(void *arg);
+	static void reportDone(void *arg, GangPort_t& port);
+	static void preparer(void *arg);
+	static bool workReady(void *arg, SessionLoop& loop, int& stat);
+	void program(GangPort_t& port);
+	int prepare();
+	int awaitPrepared();
+
+	GangImage_t m_image[GANG_MAX_IMAGES];
+	unsigned m_imageCnt;
+	GangOverlay_t m_overlay[GANG_MAX_OVERLAYS];
+	unsigned m_overlayCnt;
+	uint32_t m_serial;				// the serial number for the first port
+	GangRead_t m_read[GANG_MAX_IMAGES];
+	unsigned m_readCnt;
+	GangPort_t m_port[GANG_MAX_PORTS];
+	unsigned m_portCnt;
+	unsigned m_nextPort;			// the next port to be programmed by a worker
+	unsigned m_msElapsed;			// the total time taken
+	unsigned m_msCPU;				// the processor time used by the event loop
+	bool m_eventLoop;				// if a single event loop drives the sessions
+	PacketCache m_cache;			// the prepared frames for the images
+	const char *m_cacheFile;		// the file holding the cache, NULL if none
+	bool m_prepared;				// if the preparation of the images is complete
+	int m_prepStat;					// the result of the preparation
+	unsigned m_msPrep;				// the time taken by the preparation
+
+	GangParm_t m_parm;
+	Mutex m_mutex;					// serializes access to shared data and output
+};
+
+#endif	// defined(GANG_H__)
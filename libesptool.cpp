@@ -0,0 +1,341 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+/** include files **/
+#define ESPTOOL_BUILD
+#include "libesptool.h"
+#include "esp.h"
+
+/** local definitions **/
+
+struct EspTool_tag
+{
+	ESP esp;					// the session with the device
+	ResetMode_t resetMode;		// the means of resetting the device
+	EspToolLog_t logFunc;		// the caller's log function, NULL for the standard streams
+	void *logArg;
+};
+
+/** internal functions **/
+static void logMessage(void *arg, int level, const char *msg);
+
+/** public functions **/
+
+//
+// Get the version of the interface.
+//
+unsigned
+EspToolVersion(void)
+{
+	return(ESPTOOL_API_VERSION);
+}
+
+//
+// Get a description of a status value.
+//
+const char *
+EspToolErrorText(int stat)
+{
+	switch (stat)
+	{
+	case ESP_SUCCESS:				return("success");
+	case ESP_ERROR_TIMEOUT:			return("timed out waiting for the device");
+	case ESP_ERROR_ALLOC:			return("memory allocation failed");
+	case ESP_ERROR_PARAM:			return("invalid parameter");
+	case ESP_ERROR_COMM_OPEN:		return("can't open the serial port");
+	case ESP_ERROR_COMM_READ:		return("error reading the serial port");
+	case ESP_ERROR_COMM_WRITE:		return("error writing the serial port");
+	case ESP_ERROR_CONNECT:			return("can't connect to the device");
+	case ESP_ERROR_REPLY:			return("invalid reply from the device");
+	case ESP_ERROR_FILE_OPEN:		return("can't open the file");
+	case ESP_ERROR_FILE_CREATE:		return("can't create the file");
+	case ESP_ERROR_FILE_READ:		return("error reading the file");
+	case ESP_ERROR_FILE_WRITE:		return("error writing the file");
+	case ESP_ERROR_FILE_SEEK:		return("error positioning the file");
+	case ESP_ERROR_FILE_SIZE:		return("invalid file size");
+	case ESP_ERROR_FILE_STAT:		return("can't determine the file size");
+	case ESP_ERROR_RESP_HDR:		return("invalid reply header");
+	case ESP_ERROR_SLIP_START:
+	case ESP_ERROR_SLIP_FRAME:
+	case ESP_ERROR_SLIP_STATE:
+	case ESP_ERROR_SLIP_DATA:
+	case ESP_ERROR_SLIP_END:		return("SLIP framing error");
+	case ESP_ERROR_UNKNOWN_OUI:		return("unknown MAC address OUI");
+	case ESP_ERROR_IMAGE_SIZE:		return("invalid image size");
+	case ESP_ERROR_DEVICE:			return("the device reported an error");
+	case ESP_ERROR_FILENAME_LENGTH:	return("the file name is too long");
+	case ESP_ERROR_BAUD:			return("the speed can't be used");
+	case ESP_ERROR_ROM_MESSAGE:		return("the ROM reported an invalid message");
+	case ESP_ERROR_ROM_FAILED:		return("the ROM failed to perform the command");
+	case ESP_ERROR_ROM_CRC:			return("the ROM reported a checksum mismatch");
+	case ESP_ERROR_ROM_FLASH_WRITE:	return("the ROM reported a Flash write error");
+	case ESP_ERROR_ROM_FLASH_READ:	return("the ROM reported a Flash read error");
+	case ESP_ERROR_ROM_READ_LENGTH:	return("the ROM reported a read length error");
+	case ESP_ERROR_ROM_DEFLATE:		return("the ROM reported a decompression error");
+	case ESP_ERROR_ROM_STATUS:		return("the ROM reported an unrecognized error");
+	case ESP_ERROR_ABORTED:			return("an earlier command failed");
+	case ESP_ERROR_VERIFY:			return("the content of Flash differs from the image");
+	}
+	return("unspecified error");
+}
+
+//
+// Create a handle for a session with a device.  The return value is NULL
+// if memory can't be allocated.
+//
+EspTool_t *
+EspToolCreate(void)
+{
+	EspTool_t *tool = new EspTool_t;
+	if (tool != NULL)
+	{
+		tool->resetMode = ResetNone;
+		tool->logFunc = NULL;
+		tool->logArg = NULL;
+	}
+	return(tool);
+}
+
+//
+// Close the session, if any, and release the handle.
+//
+void
+EspToolDestroy(EspTool_t *tool)
+{
+	if (tool != NULL)
+	{
+		tool->esp.CloseComm();
+		delete tool;
+	}
+}
+
+//
+// Set the function to receive the messages otherwise written to stdout and
+// stderr.  A NULL function restores the standard streams.
+//
+void
+EspToolSetLog(EspTool_t *tool, EspToolLog_t func, void *arg)
+{
+	tool->logFunc = func;
+	tool->logArg = arg;
+	tool->esp.SetLog((func != NULL) ? logMessage : NULL, tool);
+}
+
+//
+// Set the function called as data is written to or read from the device.
+//
+void
+EspToolSetProgress(EspTool_t *tool, EspToolProgress_t func, void *arg)
+{
+	tool->esp.SetProgress(func, arg);
+}
+
+//
+// Suppress or enable the progress and result messages.
+//
+void
+EspToolSetQuiet(EspTool_t *tool, int quiet)
+{
+	if (quiet)
+		tool->esp.SetFlags(ESP_QUIET);
+	else
+		tool->esp.ClearFlags(ESP_QUIET);
+}
+
+//
+// Set the means of resetting the device, e.g. "ck" or "nodemcu".
+//
+int
+EspToolSetReset(EspTool_t *tool, const char *resetMode)
+{
+	return(tool->esp.GetResetMode(resetMode, tool->resetMode) ? 0 : ESP_ERROR_PARAM);
+}
+
+//
+// Open a serial port and connect to the attached device.
+//
+int
+EspToolOpen(EspTool_t *tool, const char *port, uint32_t baud)
+{
+	int stat;
+
+	if ((port == NULL) || (baud == 0))
+		return(ESP_ERROR_PARAM);
+	if ((stat = tool->esp.OpenComm(port, baud, tool->esp.ResetFlags(tool->resetMode))) == 0)
+		stat = tool->esp.Connect(tool->resetMode);
+	return(stat);
+}
+
+//
+// Switch the connected device and the serial port to another speed.
+//
+int
+EspToolChangeBaud(EspTool_t *tool, uint32_t baud)
+{
+	return(tool->esp.ChangeBaud(baud));
+}
+
+//
+// Close the serial port, leaving the device as is.
+//
+int
+EspToolClose(EspTool_t *tool)
+{
+	return(tool->esp.CloseComm());
+}
+
+//
+// Write an image file or a combined image file to Flash.
+//
+int
+EspToolWriteFile(EspTool_t *tool, const char *file, uint32_t addr)
+{
+	VFile vf;
+
+	if ((file == NULL) || (vf.Open(file, VFileOpenMap) != 0))
+		return(ESP_ERROR_FILE_OPEN);
+	return(tool->esp.FlashWrite(vf, addr, 0, 0));
+}
+
+//
+// Write an image held in memory to Flash.
+//
+int
+EspToolWriteData(EspTool_t *tool, const void *data, uint32_t size, uint32_t addr)
+{
+	VFile vf;
+
+	if ((data == NULL) || (vf.Open(data, size, "memory") != 0))
+		return(ESP_ERROR_PARAM);
+	return(tool->esp.FlashWrite(vf, addr, 0, 0));
+}
+
+//
+// Read a region of Flash into a file.
+//
+int
+EspToolReadFile(EspTool_t *tool, uint32_t addr, uint32_t size, const char *file)
+{
+	VFile vf;
+
+	if ((file == NULL) || (vf.Open(file, "wb") != 0))
+		return(ESP_ERROR_FILE_CREATE);
+	return(tool->esp.FlashRead(vf, addr, size));
+}
+
+//
+// Read a region of Flash into a buffer.
+//
+int
+EspToolReadData(EspTool_t *tool, uint32_t addr, void *buf, uint32_t size)
+{
+	VFile vf;
+	int stat;
+
+	if ((buf == NULL) || (size == 0))
+		return(ESP_ERROR_PARAM);
+	vf.Increment(size);
+	if (vf.Open("memory") != 0)
+		return(ESP_ERROR_ALLOC);
+	if (((stat = tool->esp.FlashRead(vf, addr, size)) == 0) &&
+			((vf.Position(0) != 0) || (vf.Read(buf, size) != size)))
+		stat = ESP_ERROR_ALLOC;
+	return(stat);
+}
+
+//
+// Erase a region of Flash or, if the size is zero, the entire chip.
+//
+int
+EspToolErase(EspTool_t *tool, uint32_t addr, uint32_t size)
+{
+	return(size ? tool->esp.FlashErase(addr, size) : tool->esp.FlashErase());
+}
+
+//
+// Read the station MAC address and, given 12 bytes of space, the AP MAC
+// address.
+//
+int
+EspToolReadMAC(EspTool_t *tool, uint8_t *mac, int len)
+{
+	if ((mac == NULL) || (len < 6))
+		return(ESP_ERROR_PARAM);
+	return(tool->esp.ReadMAC(mac, len));
+}
+
+//
+// Read the manufacturer and device ID of the Flash chip.
+//
+int
+EspToolFlashID(EspTool_t *tool, uint32_t *flashID)
+{
+	if (flashID == NULL)
+		return(ESP_ERROR_PARAM);
+	return(tool->esp.GetFlashID(*flashID));
+}
+
+//
+// Read a register or a word of memory.
+//
+int
+EspToolReadReg(EspTool_t *tool, uint32_t addr, uint32_t *val)
+{
+	if (val == NULL)
+		return(ESP_ERROR_PARAM);
+	return(tool->esp.ReadReg(addr, *val));
+}
+
+//
+// Change the bits of a register given by a mask.
+//
+int
+EspToolWriteReg(EspTool_t *tool, uint32_t addr, uint32_t val, uint32_t mask)
+{
+	return(tool->esp.WriteReg(addr, val, mask));
+}
+
+//
+// Run the application in Flash, ending the session.  With a reset mode
+// that controls the device, it is reset; otherwise, the ROM is asked to
+// run the application, optionally rebooting.
+//
+int
+EspToolRun(EspTool_t *tool, int reboot)
+{
+	int stat = 0;
+
+	if (tool->resetMode == ResetNone)
+		stat = tool->esp.Run(reboot != 0);
+	else
+		tool->esp.ResetDevice(tool->resetMode, true);
+	tool->esp.CloseComm();
+	return(stat);
+}
+
+/** private functions **/
+
+//
+// Pass a message from the ESP object to the caller's log function.
+//
+static void
+logMessage(void *arg, int level, const char *msg)
+{
+	EspTool_t *tool = (EspTool_t *)arg;
+	tool->logFunc(tool->logArg, (level == ESP_LOG_ERROR) ? ESPTOOL_LOG_ERROR : ESPTOOL_LOG_INFO, msg);
+}
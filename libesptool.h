@@ -0,0 +1,94 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(LIBESPTOOL_H__)
+#define LIBESPTOOL_H__
+
+//
+// The C interface of the esp_tool library, allowing other programs to
+// perform operations on ESP8266 devices without running esp_tool.  A handle
+// represents the session with one device; handles may be used on different
+// threads concurrently.  Each function returning int returns zero on
+// success or a negative ESP_ERROR_xxx code that EspToolErrorText() describes.
+// No library function exits the process.
+//
+
+#include "sysdep.h"
+#include <stddef.h>
+#if defined(HAVE_STDINT_H)
+  #include <stdint.h>
+#endif
+
+#if defined(WIN32) && defined(ESPTOOL_DLL)
+  #if defined(ESPTOOL_BUILD)
+	#define ESPTOOL_API				__declspec(dllexport)
+  #else
+	#define ESPTOOL_API				__declspec(dllimport)
+  #endif
+#else
+  #define ESPTOOL_API
+#endif
+
+#define ESPTOOL_API_VERSION			1			// changed when the interface changes incompatibly
+
+// the levels of the messages passed to a log function
+#define ESPTOOL_LOG_INFO			0
+#define ESPTOOL_LOG_ERROR			1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct EspTool_tag EspTool_t;
+
+// the function called to output a message, the message ending with a newline when complete
+typedef void (*EspToolLog_t)(void *arg, int level, const char *msg);
+
+// the function called as data is transferred, giving the bytes done of the total
+typedef void (*EspToolProgress_t)(void *arg, uint32_t done, uint32_t total);
+
+ESPTOOL_API unsigned EspToolVersion(void);
+ESPTOOL_API const char *EspToolErrorText(int stat);
+
+ESPTOOL_API EspTool_t *EspToolCreate(void);
+ESPTOOL_API void EspToolDestroy(EspTool_t *tool);
+ESPTOOL_API void EspToolSetLog(EspTool_t *tool, EspToolLog_t func, void *arg);
+ESPTOOL_API void EspToolSetProgress(EspTool_t *tool, EspToolProgress_t func, void *arg);
+ESPTOOL_API void EspToolSetQuiet(EspTool_t *tool, int quiet);
+ESPTOOL_API int EspToolSetReset(EspTool_t *tool, const char *resetMode);
+
+ESPTOOL_API int EspToolOpen(EspTool_t *tool, const char *port, uint32_t baud);
+ESPTOOL_API int EspToolChangeBaud(EspTool_t *tool, uint32_t baud);
+ESPTOOL_API int EspToolClose(EspTool_t *tool);
+
+ESPTOOL_API int EspToolWriteFile(EspTool_t *tool, const char *file, uint32_t addr);
+ESPTOOL_API int EspToolWriteData(EspTool_t *tool, const void *data, uint32_t size, uint32_t addr);
+ESPTOOL_API int EspToolReadFile(EspTool_t *tool, uint32_t addr, uint32_t size, const char *file);
+ESPTOOL_API int EspToolReadData(EspTool_t *tool, uint32_t addr, void *buf, uint32_t size);
+ESPTOOL_API int EspToolErase(EspTool_t *tool, uint32_t addr, uint32_t size);
+ESPTOOL_API int EspToolReadMAC(EspTool_t *tool, uint8_t *mac, int len);
+ESPTOOL_API int EspToolFlashID(EspTool_t *tool, uint32_t *flashID);
+ESPTOOL_API int EspToolReadReg(EspTool_t *tool, uint32_t addr, uint32_t *val);
+ESPTOOL_API int EspToolWriteReg(EspTool_t *tool, uint32_t addr, uint32_t val, uint32_t mask);
+ESPTOOL_API int EspToolRun(EspTool_t *tool, int reboot);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	// defined(LIBESPTOOL_H__)
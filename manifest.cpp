@@ -0,0 +1,565 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+/** include files **/
+#include "manifest.h"
+#include <string.h>
+#include <ctype.h>
+
+/** local definitions **/
+
+#define MAX_TOKENS					6
+
+// the names of the operations, indexed by StepOp_t
+static const char *opName[] = { "write", "verify", "read", "erase", "mac", "flash-id", "read-reg", "write-reg" };
+
+/** internal functions **/
+static char *dupString(const char *s);
+static int splitLine(char *line, char **token, unsigned maxTokens);
+static int getNum(const char *s, uint32_t& val);
+static bool overlaps(uint32_t addr1, uint32_t size1, uint32_t addr2, uint32_t size2);
+
+/** class implementations **/
+
+Manifest::
+Manifest()
+{
+	m_stepCnt = 0;
+	m_imageCnt = 0;
+	m_lineNum = 0;
+	m_flashParmVal = 0;
+	m_flashParmMask = 0;
+}
+
+Manifest::
+~Manifest()
+{
+	unsigned i;
+	for (i = 0; i < m_stepCnt; i++)
+		delete[] m_step[i].file;
+	for (i = 0; i < m_imageCnt; i++)
+		GangFreeImage(m_image[i]);
+}
+
+//
+// Read a manifest, read the images that it refers to and check that the
+// steps may be performed as given.  The return value is zero on success,
+// non-zero otherwise (error messages having been output).
+//
+int Manifest::
+Load(const char *file)
+{
+	char line[MANIFEST_MAX_LINE];
+	int errCnt = 0;
+
+	FILE *fp = (strcmp(file, "-") == 0) ? stdin : fopen(file, "r");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Can't open the manifest \"%s\".\n", file);
+		return(ESP_ERROR_FILE_OPEN);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		m_lineNum++;
+		if (parseLine(line) != 0)
+			errCnt++;
+	}
+	if (fp != stdin)
+		fclose(fp);
+	if (errCnt == 0)
+		errCnt = validate();
+	else
+		fprintf(stderr, "The manifest \"%s\" has %d invalid line%s.\n", file, errCnt, (errCnt == 1) ? "" : "s");
+	return(errCnt ? ESP_ERROR_PARAM : 0);
+}
+
+//
+// Perform the steps in turn, stopping at the first that fails.  The device
+// must already be connected.  The return value is zero on success, non-zero
+// otherwise (an error message having been output).
+//
+int Manifest::
+Run(ESP& esp)
+{
+	unsigned tickStart = getTickCount();
+	int stat = 0;
+
+	for (unsigned i = 0; (stat == 0) && (i < m_stepCnt); i++)
+	{
+		if ((stat = perform(esp, m_step[i])) != 0)
+			fprintf(stderr, "Manifest line %u: the %s step failed (%d).\n",
+					m_step[i].line, opName[m_step[i].op], stat);
+	}
+	if ((stat == 0) && !(esp.GetFlags() & ESP_QUIET))
+		fprintf(stdout, "%u steps performed in %.1f seconds.\n", m_stepCnt,
+				(getTickCount() - tickStart) / 1000.0);
+	return(stat);
+}
+
+/** private functions **/
+
+//
+// Parse one line of a manifest, adding a step.  The return value is zero
+// on success, non-zero otherwise (an error message having been output).
+//
+int Manifest::
+parseLine(char *line)
+{
+	char *token[MAX_TOKENS + 1];
+	int cnt;
+
+	if ((cnt = splitLine(line, token, MAX_TOKENS + 1)) == 0)
+		return(0);
+	if (m_stepCnt >= MANIFEST_MAX_STEPS)
+	{
+		fprintf(stderr, "Manifest line %u: too many steps.\n", m_lineNum);
+		return(ESP_ERROR_PARAM);
+	}
+
+	Step_t& step = m_step[m_stepCnt];
+	memset(&step, 0, sizeof(step));
+	step.line = m_lineNum;
+	step.mask = 0xffffffff;
+
+	const char *cmd = token[0];
+	unsigned i;
+	for (i = 0; i < sizeof(opName) / sizeof(opName[0]); i++)
+	{
+		if (strcmp(cmd, opName[i]) == 0)
+			break;
+	}
+	if (i >= sizeof(opName) / sizeof(opName[0]))
+	{
+		fprintf(stderr, "Manifest line %u: unknown step \"%s\".\n", m_lineNum, cmd);
+		return(ESP_ERROR_PARAM);
+	}
+	step.op = (StepOp_t)i;
+
+	bool valid = false;
+	switch (step.op)
+	{
+	case StepWrite:
+	case StepVerify:
+		valid = ((cnt == 3) && (getNum(token[1], step.addr) == 0));
+		if (valid && ((step.image = loadImage(token[2], step.addr)) == NULL))
+		{
+			fprintf(stderr, "Manifest line %u: can't read file \"%s\".\n", m_lineNum, token[2]);
+			return(ESP_ERROR_FILE_READ);
+		}
+		break;
+
+	case StepRead:
+		valid = ((cnt == 4) && (getNum(token[1], step.addr) == 0) && (getNum(token[2], step.size) == 0));
+		if (valid)
+			step.file = dupString(token[3]);
+		break;
+
+	case StepErase:
+		valid = ((cnt == 3) && (getNum(token[1], step.addr) == 0) && (getNum(token[2], step.size) == 0));
+		break;
+
+	case StepMAC:
+	case StepFlashID:
+		valid = (cnt == 1);
+		break;
+
+	case StepReadReg:
+		valid = ((cnt == 2) && (getNum(token[1], step.addr) == 0));
+		break;
+
+	case StepWriteReg:
+		valid = (((cnt == 3) || (cnt == 4)) && (getNum(token[1], step.addr) == 0) &&
+				(getNum(token[2], step.value) == 0) && ((cnt == 3) || (getNum(token[3], step.mask) == 0)));
+		break;
+	}
+	if (!valid)
+	{
+		fprintf(stderr, "Manifest line %u: invalid %s step.\n", m_lineNum, cmd);
+		return(ESP_ERROR_PARAM);
+	}
+	m_stepCnt++;
+	return(0);
+}
+
+//
+// Check the alignment of the addresses and that no step destroys data
+// written by an earlier one.  Since Flash is erased a sector at a time,
+// two images sharing a sector can't both be written.  The return value is
+// the number of errors found.
+//
+int Manifest::
+validate()
+{
+	Span_t *written = new Span_t[m_stepCnt * MANIFEST_MAX_SEGS];
+	unsigned *writtenLine = new unsigned[m_stepCnt * MANIFEST_MAX_SEGS];
+	unsigned writtenCnt = 0;
+	int errCnt = 0;
+
+	for (unsigned i = 0; i < m_stepCnt; i++)
+	{
+		const Step_t& step = m_step[i];
+		Span_t span[MANIFEST_MAX_SEGS];
+		unsigned spanCnt = 0;
+		const char *problem = NULL;
+
+		switch (step.op)
+		{
+		case StepWrite:
+		case StepVerify:
+			if ((spanCnt = imageSpans(*step.image, span, MANIFEST_MAX_SEGS)) == 0)
+				problem = "the image file is malformed";
+			for (unsigned j = 0; (problem == NULL) && (j < spanCnt); j++)
+			{
+				if ((span[j].addr & (ESP_FLASH_BLK_SIZE - 1)) != 0)
+					problem = "the address isn't a multiple of 1K";
+			}
+			break;
+
+		case StepErase:
+			if (((step.addr | step.size) & (MANIFEST_SECT_SIZE - 1)) != 0)
+				problem = "the address and size must be multiples of 4K";
+			else if (step.size == 0)
+			{
+				// the entire chip
+				span[0].addr = 0;
+				span[0].size = 0xffffffff;
+			}
+			else
+			{
+				span[0].addr = step.addr;
+				span[0].size = step.size;
+			}
+			spanCnt = 1;
+			break;
+
+		case StepRead:
+			if (step.size == 0)
+				problem = "the size is zero";
+			break;
+
+		case StepReadReg:
+		case StepWriteReg:
+			if ((step.addr & 0x03) != 0)
+				problem = "the register address isn't a multiple of 4";
+			break;
+
+		default:
+			break;
+		}
+		if (problem != NULL)
+		{
+			fprintf(stderr, "Manifest line %u: %s.\n", step.line, problem);
+			errCnt++;
+			continue;
+		}
+		if ((step.op != StepWrite) && (step.op != StepErase))
+			continue;
+
+		// check that the sectors to be erased hold no data written earlier
+		for (unsigned j = 0; j < spanCnt; j++)
+		{
+			uint32_t eraseAddr = span[j].addr & ~(MANIFEST_SECT_SIZE - 1);
+			uint32_t eraseSize = span[j].size;
+			if (eraseSize != 0xffffffff)
+				eraseSize = ((span[j].addr + span[j].size + MANIFEST_SECT_SIZE - 1) & ~(MANIFEST_SECT_SIZE - 1)) - eraseAddr;
+			for (unsigned k = 0; k < writtenCnt; k++)
+			{
+				if (overlaps(eraseAddr, eraseSize, written[k].addr, written[k].size))
+				{
+					fprintf(stderr, "Manifest line %u: the %s would erase data written by line %u.\n",
+							step.line, opName[step.op], writtenLine[k]);
+					errCnt++;
+					break;
+				}
+			}
+			if (step.op == StepWrite)
+			{
+				written[writtenCnt] = span[j];
+				writtenLine[writtenCnt++] = step.line;
+			}
+		}
+	}
+	delete[] written;
+	delete[] writtenLine;
+	return(errCnt);
+}
+
+//
+// Perform one step.
+//
+int Manifest::
+perform(ESP& esp, const Step_t& step)
+{
+	int stat = 0;
+
+	switch (step.op)
+	{
+	case StepWrite:
+		stat = GangWriteImage(esp, *step.image);
+		break;
+
+	case StepVerify:
+		if (((stat = verify(esp, *step.image)) == 0) && !(esp.GetFlags() & ESP_QUIET))
+			fprintf(stdout, "The content of Flash matches \"%s\".\n", step.image->name);
+		break;
+
+	case StepRead:
+		{
+			VFile vf;
+			if (vf.Open(step.file, "wb") != 0)
+			{
+				fprintf(stderr, "Can't create the file \"%s\".\n", step.file);
+				stat = ESP_ERROR_FILE_CREATE;
+			}
+			else
+				stat = esp.FlashRead(vf, step.addr, step.size);
+		}
+		break;
+
+	case StepErase:
+		stat = step.size ? esp.FlashErase(step.addr, step.size) : esp.FlashErase();
+		break;
+
+	case StepMAC:
+		{
+			uint8_t mac[12];
+			if ((stat = esp.ReadMAC(mac, sizeof(mac))) == 0)
+			{
+				int i;
+				fprintf(stdout, "Station MAC is");
+				for (i = 0; i < 6; i++)
+					fprintf(stdout, "%c%2x", (i ? ':' : ' '), mac[i + 0]);
+				fputs("\n", stdout);
+				fprintf(stdout, "     AP MAC is");
+				for (i = 0; i < 6; i++)
+					fprintf(stdout, "%c%2x", (i ? ':' : ' '), mac[i + 6]);
+				fputs("\n", stdout);
+			}
+		}
+		break;
+
+	case StepFlashID:
+		{
+			uint32_t flashID;
+			if ((stat = esp.GetFlashID(flashID)) == 0)
+				fprintf(stdout, "Manufacturer: %02x, Device: %02x%02x.\n", flashID & 0xff,
+						(flashID >> 8) & 0xff, (flashID >> 16) & 0xff);
+		}
+		break;
+
+	case StepReadReg:
+		{
+			uint32_t val;
+			if ((stat = esp.ReadReg(step.addr, val)) == 0)
+				fprintf(stdout, "Register 0x%08x is 0x%08x.\n", step.addr, val);
+		}
+		break;
+
+	case StepWriteReg:
+		stat = esp.WriteReg(step.addr, step.value, step.mask);
+		break;
+	}
+	fflush(stdout);
+	return(stat);
+}
+
+//
+// Read back the regions of Flash holding an image and compare them with it.
+//
+int Manifest::
+verify(ESP& esp, const GangImage_t& image)
+{
+	Span_t span[MANIFEST_MAX_SEGS];
+	unsigned spanCnt = imageSpans(image, span, MANIFEST_MAX_SEGS);
+	int stat = 0;
+
+	for (unsigned i = 0; (stat == 0) && (i < spanCnt); i++)
+	{
+		VFile vf;
+		vf.Increment(span[i].size);
+		if (vf.Open(image.name) != 0)
+			return(ESP_ERROR_ALLOC);
+		if ((stat = esp.FlashRead(vf, span[i].addr, span[i].size)) != 0)
+			break;
+
+		// the expected content is prepared as it was written, i.e. with the
+		// Flash parameters patched into an image loaded at address 0
+		uint8_t buf[ESP_FLASH_BLK_SIZE];
+		uint8_t blk[16 + ESP_FLASH_BLK_SIZE];
+		uint32_t ofst;
+		vf.Position(0);
+		for (ofst = 0; ofst < span[i].size; ofst += sizeof(buf))
+		{
+			uint32_t len = span[i].size - ofst;
+			if (len > sizeof(buf))
+				len = sizeof(buf);
+			if (vf.Read(buf, len) != len)
+			{
+				stat = ESP_ERROR_FILE_READ;
+				break;
+			}
+			uint16_t cksum;
+			const uint8_t *expect = ESP::FlashBlock(blk, ofst / ESP_FLASH_BLK_SIZE, image.data + span[i].ofst + ofst,
+					len, span[i].addr, image.flashParmVal, image.flashParmMask, cksum);
+			if (memcmp(buf, expect, len) != 0)
+			{
+				uint32_t j;
+				for (j = 0; buf[j] == expect[j]; j++)
+					;
+				fprintf(stderr, "Flash at 0x%06x differs from \"%s\".\n", span[i].addr + ofst + j, image.name);
+				stat = ESP_ERROR_VERIFY;
+				break;
+			}
+		}
+	}
+	return(stat);
+}
+
+//
+// Get an image to be written or verified, reading the file only once for
+// all of the steps that use it.  The return value is NULL if the file
+// can't be read.
+//
+const GangImage_t *Manifest::
+loadImage(const char *file, uint32_t addr)
+{
+	unsigned i;
+	for (i = 0; i < m_imageCnt; i++)
+	{
+		if ((m_image[i].addr == addr) && (strcmp(m_image[i].name, file) == 0))
+			return(&m_image[i]);
+	}
+	if (m_imageCnt >= MANIFEST_MAX_IMAGES)
+		return(NULL);
+	if (GangLoadImage(m_image[m_imageCnt], file, addr, m_flashParmVal, m_flashParmMask) != 0)
+		return(NULL);
+	return(&m_image[m_imageCnt++]);
+}
+
+//
+// Determine the regions of Flash occupied by an image.  A combined image
+// file comprises segments, each with its own address.  The return value is
+// the number of regions, zero if the image is malformed.
+//
+unsigned Manifest::
+imageSpans(const GangImage_t& image, Span_t *span, unsigned maxSpans)
+{
+	if (image.size == 0)
+		return(0);
+	if ((image.size < 4) || (memcmp(image.data, COMPOSITE_SIG, 3) != 0))
+	{
+		span[0].addr = image.addr;
+		span[0].size = image.size;
+		span[0].ofst = 0;
+		return(1);
+	}
+
+	unsigned cnt = image.data[3];
+	uint32_t ofst = 4;
+	if (cnt > maxSpans)
+		return(0);
+	for (unsigned i = 0; i < cnt; i++)
+	{
+		const uint8_t *p = image.data + ofst;
+		if (ofst + 8 > image.size)
+			return(0);
+		span[i].addr = getLE(4, p, 0);
+		span[i].size = getLE(4, p, 4);
+		span[i].ofst = ofst + 8;
+		if ((span[i].size == 0) || (span[i].size > image.size - span[i].ofst))
+			return(0);
+		ofst = span[i].ofst + span[i].size;
+	}
+	return(cnt);
+}
+
+/** internal functions **/
+
+//
+// Make an allocated copy of a string.
+//
+static char *
+dupString(const char *s)
+{
+	char *p = new char[strlen(s) + 1];
+	strcpy(p, s);
+	return(p);
+}
+
+//
+// Split a line into whitespace-separated tokens, ignoring anything
+// following a '#'.  The return value is the number of tokens found, at
+// most maxTokens.
+//
+static int
+splitLine(char *line, char **token, unsigned maxTokens)
+{
+	unsigned cnt = 0;
+	char *p = line;
+
+	while (cnt < maxTokens)
+	{
+		while (isspace((unsigned char)*p))
+			p++;
+		if ((*p == '\0') || (*p == '#'))
+			break;
+		token[cnt++] = p;
+		while ((*p != '\0') && !isspace((unsigned char)*p))
+			p++;
+		if (*p != '\0')
+			*p++ = '\0';
+	}
+	return((int)cnt);
+}
+
+//
+// Convert a number, decimal or hexadecimal with a 0x prefix, optionally
+// followed by K or M.  The return value is zero on success, non-zero
+// otherwise.
+//
+static int
+getNum(const char *s, uint32_t& val)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return(-1);
+	val = (uint32_t)strtoul(s, &end, 0);
+	switch (toupper((unsigned char)*end))
+	{
+	case 'K':
+		val *= 1024;
+		end++;
+		break;
+
+	case 'M':
+		val *= 1024 * 1024;
+		end++;
+		break;
+	}
+	return((*end == '\0') ? 0 : -1);
+}
+
+//
+// Determine if two regions have any address in common.
+//
+static bool
+overlaps(uint32_t addr1, uint32_t size1, uint32_t addr2, uint32_t size2)
+{
+	return((addr1 - addr2 < size2) || (addr2 - addr1 < size1));
+}
@@ -0,0 +1,113 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(MANIFEST_H__)
+#define MANIFEST_H__
+
+#include "esp.h"
+#include "gang.h"
+
+#define MANIFEST_MAX_STEPS			256			// the most steps in a manifest
+#define MANIFEST_MAX_IMAGES			GANG_MAX_IMAGES	// the most distinct images
+#define MANIFEST_MAX_SEGS			16			// the most segments of a combined image
+#define MANIFEST_SECT_SIZE			0x1000		// the Flash erase granularity
+#define MANIFEST_MAX_LINE			1024		// the longest manifest line
+
+// the operations that a step may perform
+typedef enum
+{
+	StepWrite,					// write an image to Flash
+	StepVerify,					// compare Flash with an image
+	StepRead,					// read Flash to a file
+	StepErase,					// erase a region of Flash or the entire chip
+	StepMAC,					// read the MAC address
+	StepFlashID,				// read the Flash ID
+	StepReadReg,				// read a register
+	StepWriteReg				// write a register
+} StepOp_t;
+
+//
+// A class that performs a sequence of operations described by a manifest
+// over a single connection with the device.  The steps are given by lines
+// of text:
+//   write <addr> <file>
+//   verify <addr> <file>
+//   read <addr> <size> <file>
+//   erase <addr> <size>           a zero size erases the entire chip
+//   mac
+//   flash-id
+//   read-reg <addr>
+//   write-reg <addr> <value> [<mask>]
+// The entire file is checked before anything is sent to the device: the
+// addresses must be suitably aligned, no write or erase may destroy data
+// written by an earlier step and every image is read into memory.  For a
+// combined image file, the addresses of the segments are used.
+//
+class Manifest
+{
+public:
+	Manifest();
+	~Manifest();
+
+	void SetFlashParm(uint16_t flashParmVal, uint16_t flashParmMask) { m_flashParmVal = flashParmVal; m_flashParmMask = flashParmMask; }
+
+	int Load(const char *file);
+	unsigned StepCount() const { return(m_stepCnt); }
+	int Run(ESP& esp);
+
+private:
+	Manifest(const Manifest&);
+	Manifest& operator=(const Manifest&);
+
+	// a region of Flash
+	typedef struct
+	{
+		uint32_t addr;				// the Flash address
+		uint32_t size;				// the number of bytes
+		uint32_t ofst;				// the offset of the data in the image
+	} Span_t;
+
+	typedef struct
+	{
+		StepOp_t op;				// the operation to perform
+		unsigned line;				// the line of the manifest
+		uint32_t addr;				// the address to write, read or erase
+		uint32_t size;				// the number of bytes to read or erase
+		uint32_t value;				// the value to write to a register
+		uint32_t mask;				// the bits of the register to change
+		char *file;					// the file to which to write data read
+		const GangImage_t *image;	// the image to write or verify
+	} Step_t;
+
+	int parseLine(char *line);
+	int validate();
+	int perform(ESP& esp, const Step_t& step);
+	int verify(ESP& esp, const GangImage_t& image);
+	const GangImage_t *loadImage(const char *file, uint32_t addr);
+	static unsigned imageSpans(const GangImage_t& image, Span_t *span, unsigned maxSpans);
+
+	Step_t m_step[MANIFEST_MAX_STEPS];
+	unsigned m_stepCnt;
+	GangImage_t m_image[MANIFEST_MAX_IMAGES];
+	unsigned m_imageCnt;
+	unsigned m_lineNum;				// the current manifest line
+	uint16_t m_flashParmVal;
+	uint16_t m_flashParmMask;
+};
+
+#endif	// defined(MANIFEST_H__)
@@ -0,0 +1,482 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+/** include files **/
+#include "packet.h"
+#include "slip.h"
+#include <string.h>
+#if defined(__linux__)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+#endif
+
+/** local definitions **/
+
+#define PACKET_MAGIC				"ESPPKT\0\1"	// identifies a cache file and its format
+
+// the header of a cache file, followed by the segments, the frame offsets and the frames
+typedef struct
+{
+	char magic[8];
+	uint32_t key;				// identifies the content of the source images
+	uint32_t segCnt;
+	uint32_t frameCnt;
+	uint32_t dataLen;
+} PacketHeader_t;
+
+/** internal functions **/
+static uint32_t hashBytes(const uint8_t *data, uint32_t size, uint32_t key);
+
+/** class implementations **/
+
+PacketCache::
+PacketCache()
+{
+	m_seg = NULL;
+	m_segCnt = 0;
+	m_ofst = NULL;
+	m_frameCnt = 0;
+	m_frames = NULL;
+	m_dataLen = 0;
+	m_segSize = 0;
+	m_ofstSize = 0;
+	m_frameSize = 0;
+	m_key = PACKET_KEY_INIT;
+	m_map = NULL;
+	m_mapSize = 0;
+}
+
+//
+// Add the frames for an image.  A combined image file contributes a
+// segment for each of its component images.  The return value is zero on
+// success, non-zero otherwise.
+//
+int PacketCache::
+Add(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	int stat = 0;
+
+	if ((m_map != NULL) || (data == NULL) || (size == 0))
+		return(ESP_ERROR_PARAM);
+	m_key = KeyOf(data, size, addr, flashParmVal, flashParmMask, m_key);
+	if ((size < 4) || (memcmp(data, COMPOSITE_SIG, 3) != 0))
+		return(addSegment(data, size, addr, flashParmVal, flashParmMask));
+
+	// a combined image file, each component has an 8-byte header
+	uint32_t pos = 4;
+	for (unsigned i = 0; (stat == 0) && (i < data[3]); i++)
+	{
+		if (pos + 8 > size)
+			return(ESP_ERROR_IMAGE_SIZE);
+		uint32_t segAddr = getLE(4, data, pos);
+		uint32_t len = getLE(4, data, pos + 4);
+		pos += 8;
+		if (len > size - pos)
+			return(ESP_ERROR_IMAGE_SIZE);
+		if (len)
+			stat = addSegment(data + pos, len, segAddr, flashParmVal, flashParmMask);
+		pos += len;
+	}
+	return(stat);
+}
+
+//
+// Write the cache to a file.  The return value is zero on success, non-zero
+// otherwise.
+//
+int PacketCache::
+Save(const char *file) const
+{
+	PacketHeader_t hdr;
+	FILE *fp;
+
+	if ((m_segCnt == 0) || ((fp = fopen(file, "wb")) == NULL))
+		return(ESP_ERROR_FILE_CREATE);
+	memcpy(hdr.magic, PACKET_MAGIC, sizeof(hdr.magic));
+	hdr.key = m_key;
+	hdr.segCnt = m_segCnt;
+	hdr.frameCnt = m_frameCnt;
+	hdr.dataLen = m_dataLen;
+	bool ok = ((fwrite(&hdr, sizeof(hdr), 1, fp) == 1) &&
+			(fwrite(m_seg, sizeof(m_seg[0]), m_segCnt, fp) == m_segCnt) &&
+			(fwrite(m_ofst, sizeof(m_ofst[0]), m_frameCnt + 1, fp) == m_frameCnt + 1) &&
+			(fwrite(m_frames, 1, m_dataLen, fp) == m_dataLen));
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		remove(file);
+	return(ok ? 0 : ESP_ERROR_FILE_WRITE);
+}
+
+//
+// Replace the content of the cache with that of a file saved earlier.  On
+// Linux the file is mapped so that processes using it share the memory.
+// The content is checked so that a damaged file can't cause data outside
+// of it to be sent.  The return value is zero on success, non-zero
+// otherwise.
+//
+int PacketCache::
+Map(const char *file)
+{
+	Close();
+
+	FILE *fp;
+	if ((fp = fopen(file, "rb")) == NULL)
+		return(ESP_ERROR_FILE_OPEN);
+	long size = -1;
+	if (fseek(fp, 0, SEEK_END) == 0)
+		size = ftell(fp);
+	if ((size < (long)sizeof(PacketHeader_t)) || (fseek(fp, 0, SEEK_SET) != 0))
+	{
+		fclose(fp);
+		return(ESP_ERROR_FILE_SIZE);
+	}
+	m_mapSize = (size_t)size;
+#if defined(__linux__)
+	m_map = mmap(NULL, m_mapSize, PROT_READ, MAP_SHARED, FILENO(fp), 0);
+	if (m_map == MAP_FAILED)
+		m_map = NULL;
+#else
+	if (((m_map = malloc(m_mapSize)) != NULL) && (fread(m_map, 1, m_mapSize, fp) != m_mapSize))
+	{
+		free(m_map);
+		m_map = NULL;
+	}
+#endif
+	fclose(fp);
+	if (m_map == NULL)
+		return(ESP_ERROR_FILE_READ);
+
+	// validate the header and the tables
+	const uint8_t *base = (const uint8_t *)m_map;
+	PacketHeader_t hdr;
+	memcpy(&hdr, base, sizeof(hdr));
+	size_t segOfst = sizeof(hdr);
+	size_t ofstOfst = segOfst + (size_t)hdr.segCnt * sizeof(PacketSeg_t);
+	size_t frameOfst = ofstOfst + ((size_t)hdr.frameCnt + 1) * sizeof(uint32_t);
+	bool ok = ((memcmp(hdr.magic, PACKET_MAGIC, sizeof(hdr.magic)) == 0) && hdr.segCnt &&
+			(hdr.segCnt <= m_mapSize / sizeof(PacketSeg_t)) && (hdr.frameCnt < m_mapSize / sizeof(uint32_t)) &&
+			(frameOfst <= m_mapSize) && (hdr.dataLen == m_mapSize - frameOfst));
+	if (ok)
+	{
+		m_seg = (PacketSeg_t *)(base + segOfst);
+		m_ofst = (uint32_t *)(base + ofstOfst);
+		m_frames = (uint8_t *)(base + frameOfst);
+		m_segCnt = hdr.segCnt;
+		m_frameCnt = hdr.frameCnt;
+		m_dataLen = hdr.dataLen;
+		m_key = hdr.key;
+		ok = ((m_ofst[0] == 0) && (m_ofst[m_frameCnt] == m_dataLen));
+		for (uint32_t i = 0; ok && (i < m_frameCnt); i++)
+			ok = ((m_ofst[i] < m_ofst[i + 1]) && (m_ofst[i + 1] - m_ofst[i] <= PACKET_FRAME_MAX));
+		for (uint32_t i = 0; ok && (i < m_segCnt); i++)
+			ok = ((m_seg[i].frameIdx <= m_frameCnt) && (m_seg[i].blkCnt <= m_frameCnt - m_seg[i].frameIdx) &&
+					(m_seg[i].blkCnt == (m_seg[i].size + ESP_FLASH_BLK_SIZE - 1) / ESP_FLASH_BLK_SIZE));
+	}
+	if (!ok)
+	{
+		Close();
+		return(ESP_ERROR_FILE_READ);
+	}
+	return(0);
+}
+
+//
+// Discard the content of the cache.
+//
+void PacketCache::
+Close()
+{
+	if (m_map != NULL)
+	{
+#if defined(__linux__)
+		munmap(m_map, m_mapSize);
+#else
+		free(m_map);
+#endif
+		m_map = NULL;
+		m_mapSize = 0;
+	}
+	else
+	{
+		free(m_seg);
+		free(m_ofst);
+		free(m_frames);
+	}
+	m_seg = NULL;
+	m_ofst = NULL;
+	m_frames = NULL;
+	m_segCnt = 0;
+	m_frameCnt = 0;
+	m_dataLen = 0;
+	m_segSize = 0;
+	m_ofstSize = 0;
+	m_frameSize = 0;
+	m_key = PACKET_KEY_INIT;
+}
+
+//
+// Compute the key identifying an image, continuing from the key for the
+// images preceding it.
+//
+uint32_t PacketCache::
+KeyOf(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask, uint32_t key)
+{
+	uint8_t buf[12];
+
+	putLE(addr, 4, buf, 0);
+	putLE(size, 4, buf, 4);
+	putLE(flashParmVal, 2, buf, 8);
+	putLE(flashParmMask, 2, buf, 10);
+	key = hashBytes(buf, sizeof(buf), key);
+	return(hashBytes(data, size, key));
+}
+
+/** private functions **/
+
+//
+// Encode the frames for a contiguous region of Flash.
+//
+int PacketCache::
+addSegment(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+	uint32_t blkCnt = (size + blkSize - 1) / blkSize;
+
+	if (grow(m_segCnt + 1, m_frameCnt + blkCnt, m_dataLen + blkCnt * PACKET_FRAME_MAX) != 0)
+		return(ESP_ERROR_ALLOC);
+
+	PacketSeg_t& seg = m_seg[m_segCnt++];
+	seg.addr = addr;
+	seg.size = size;
+	seg.blkCnt = blkCnt;
+	seg.frameIdx = m_frameCnt;
+
+	uint8_t blk[16 + ESP_FLASH_BLK_SIZE];
+	for (uint32_t blkIdx = 0; blkIdx < blkCnt; blkIdx++)
+	{
+		uint32_t ofst = blkIdx * blkSize;
+		uint32_t cnt = (size - ofst < blkSize) ? size - ofst : blkSize;
+		uint16_t cksum;
+		const uint8_t *blkData = ESP::FlashBlock(blk, blkIdx, data + ofst, cnt, addr, flashParmVal, flashParmMask, cksum);
+
+		// encode the command, the header and the block data forming its body
+		uint8_t hdr[8];
+		hdr[0] = 0;
+		hdr[1] = ESP_FLASH_DATA;
+		putLE(sizeof(blk), 2, hdr, 2);
+		putLE(cksum, 4, hdr, 4);
+		uint8_t *p = m_frames + m_dataLen;
+		unsigned len = 0;
+		p[len++] = SLIP_END;
+		len += SlipEncode(hdr, sizeof(hdr), p + len);
+		len += SlipEncode(blk, 16, p + len);
+		len += SlipEncode(blkData, blkSize, p + len);
+		p[len++] = SLIP_END;
+		m_dataLen += len;
+		m_ofst[++m_frameCnt] = m_dataLen;
+	}
+	return(0);
+}
+
+//
+// Ensure that the arrays have room for the given numbers of entries,
+// enlarging them geometrically.  The return value is zero on success,
+// non-zero otherwise.
+//
+int PacketCache::
+grow(uint32_t segCnt, uint32_t frameCnt, uint32_t dataLen)
+{
+	if (segCnt > m_segSize)
+	{
+		uint32_t newSize = (segCnt < 2 * m_segSize) ? 2 * m_segSize : segCnt;
+		PacketSeg_t *seg = (PacketSeg_t *)realloc(m_seg, newSize * sizeof(m_seg[0]));
+		if (seg == NULL)
+			return(-1);
+		m_seg = seg;
+		m_segSize = newSize;
+	}
+	if (frameCnt + 1 > m_ofstSize)
+	{
+		uint32_t newSize = (frameCnt + 1 < 2 * m_ofstSize) ? 2 * m_ofstSize : frameCnt + 1;
+		uint32_t *ofst = (uint32_t *)realloc(m_ofst, newSize * sizeof(m_ofst[0]));
+		if (ofst == NULL)
+			return(-1);
+		if (m_ofst == NULL)
+			ofst[0] = 0;
+		m_ofst = ofst;
+		m_ofstSize = newSize;
+	}
+	if (dataLen > m_frameSize)
+	{
+		uint32_t newSize = (dataLen < 2 * m_frameSize) ? 2 * m_frameSize : dataLen;
+		uint8_t *frames = (uint8_t *)realloc(m_frames, newSize);
+		if (frames == NULL)
+			return(-1);
+		m_frames = frames;
+		m_frameSize = newSize;
+	}
+	return(0);
+}
+
+PacketPatch::
+PacketPatch()
+{
+	m_frame = NULL;
+	m_frameCnt = 0;
+	m_frameSize = 0;
+	m_frames = NULL;
+	m_dataLen = 0;
+	m_dataSize = 0;
+}
+
+PacketPatch::
+~PacketPatch()
+{
+	free(m_frame);
+	free(m_frames);
+}
+
+//
+// Replace the content of a region of Flash written by the frames of a
+// cache.  Parts of the region that the cache doesn't write are ignored.
+// The return value is zero on success, non-zero otherwise.
+//
+int PacketPatch::
+Apply(const PacketCache& cache, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+	int stat;
+
+	for (unsigned segIdx = 0; segIdx < cache.SegmentCount(); segIdx++)
+	{
+		const PacketSeg_t& seg = cache.Segment(segIdx);
+		uint32_t start = (addr > seg.addr) ? addr : seg.addr;
+		uint32_t end = ((addr + size) < (seg.addr + seg.size)) ? addr + size : seg.addr + seg.size;
+		while (start < end)
+		{
+			uint32_t blkIdx = (start - seg.addr) / blkSize;
+			uint32_t blkOfst = (start - seg.addr) % blkSize;
+			uint32_t cnt = (end - start < blkSize - blkOfst) ? end - start : blkSize - blkOfst;
+			if ((stat = patchBlock(cache, seg.frameIdx + blkIdx, blkOfst, data + (start - addr), cnt)) != 0)
+				return(stat);
+			start += cnt;
+		}
+	}
+	return(0);
+}
+
+//
+// Get a frame, either the replacement for it or the frame in the cache.
+//
+const uint8_t *PacketPatch::
+Frame(const PacketCache& cache, uint32_t idx, unsigned& len) const
+{
+	for (uint32_t i = 0; i < m_frameCnt; i++)
+	{
+		if (m_frame[i].idx == idx)
+		{
+			len = m_frame[i].len;
+			return(m_frames + m_frame[i].ofst);
+		}
+	}
+	return(cache.Frame(idx, len));
+}
+
+//
+// Replace part of the data in a block, encoding the frame again if the
+// content changes.  The return value is zero on success, non-zero
+// otherwise.
+//
+int PacketPatch::
+patchBlock(const PacketCache& cache, uint32_t idx, uint32_t blkOfst, const uint8_t *data, uint32_t size)
+{
+	// recover the command from the current frame
+	SlipDecoder dec;
+	unsigned len;
+	const uint8_t *frame = Frame(cache, idx, len);
+	int res = SLIP_MORE;
+	for (unsigned i = 0; (i < len) && (res == SLIP_MORE); i++)
+		res = dec.Put(frame[i]);
+	if ((res != SLIP_FRAME) || (dec.Length() != 8 + 16 + ESP_FLASH_BLK_SIZE))
+		return(ESP_ERROR_SLIP_FRAME);
+	uint8_t cmd[8 + 16 + ESP_FLASH_BLK_SIZE];
+	memcpy(cmd, dec.Frame(), sizeof(cmd));
+
+	// apply the changes, adjusting the checksum for each byte
+	uint8_t *blkData = cmd + 8 + 16 + blkOfst;
+	uint32_t diff = 0;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		diff |= blkData[i] ^ data[i];
+		cmd[4] ^= blkData[i] ^ data[i];
+		blkData[i] = data[i];
+	}
+	if (diff == 0)
+		return(0);
+
+	// find or add the entry for the frame
+	uint32_t entry;
+	for (entry = 0; (entry < m_frameCnt) && (m_frame[entry].idx != idx); entry++)
+		;
+	if (entry == m_frameSize)
+	{
+		uint32_t newSize = m_frameSize ? 2 * m_frameSize : 8;
+		PatchFrame_t *newFrame = (PatchFrame_t *)realloc(m_frame, newSize * sizeof(m_frame[0]));
+		if (newFrame == NULL)
+			return(ESP_ERROR_ALLOC);
+		m_frame = newFrame;
+		m_frameSize = newSize;
+	}
+	if (m_dataLen + PACKET_FRAME_MAX > m_dataSize)
+	{
+		uint32_t newSize = (m_dataLen + PACKET_FRAME_MAX < 2 * m_dataSize) ? 2 * m_dataSize : m_dataLen + PACKET_FRAME_MAX;
+		uint8_t *frames = (uint8_t *)realloc(m_frames, newSize);
+		if (frames == NULL)
+			return(ESP_ERROR_ALLOC);
+		m_frames = frames;
+		m_dataSize = newSize;
+	}
+	if (entry == m_frameCnt)
+		m_frameCnt++;
+
+	// the replaced frame's space isn't reused, a block is rarely patched twice
+	uint8_t *p = m_frames + m_dataLen;
+	len = 0;
+	p[len++] = SLIP_END;
+	len += SlipEncode(cmd, sizeof(cmd), p + len);
+	p[len++] = SLIP_END;
+	m_frame[entry].idx = idx;
+	m_frame[entry].ofst = m_dataLen;
+	m_frame[entry].len = len;
+	m_dataLen += len;
+	return(0);
+}
+
+/** internal functions **/
+
+//
+// Continue an FNV-1a hash over a block of data.
+//
+static uint32_t
+hashBytes(const uint8_t *data, uint32_t size, uint32_t key)
+{
+	while (size--)
+		key = (key ^ *data++) * 0x01000193;
+	return(key);
+}
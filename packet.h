@@ -0,0 +1,130 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(PACKET_H__)
+#define PACKET_H__
+
+#include "esp.h"
+
+#define PACKET_FRAME_MAX			(2 * (8 + 16 + ESP_FLASH_BLK_SIZE) + 2)	// the longest encoded frame
+#define PACKET_KEY_INIT				0x811c9dc5	// the initial value of a content key
+
+// the frames for one contiguous region of Flash
+typedef struct
+{
+	uint32_t addr;				// the Flash address
+	uint32_t size;				// the number of bytes of image data
+	uint32_t blkCnt;			// the number of blocks (and frames)
+	uint32_t frameIdx;			// the index of the first frame
+} PacketSeg_t;
+
+//
+// A class holding the complete SLIP-encoded ESP_FLASH_DATA command frames
+// for a set of images so that the same images may be sent to many devices
+// without preparing each block again.  The frames are identical for every
+// device: the block headers, checksums and Flash parameters are fixed by
+// the images.  Once built, a cache is read-only and may be shared by any
+// number of threads.
+//
+// A cache may be saved to a file and mapped from it later, allowing
+// several processes to share one copy.  The file is in the byte order of
+// the host and carries a key computed from the source images so that a
+// stale file can be recognized.
+//
+class PacketCache
+{
+public:
+	PacketCache();
+	~PacketCache() { Close(); }
+
+	int Add(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int Save(const char *file) const;
+	int Map(const char *file);
+	void Close();
+
+	unsigned SegmentCount() const { return(m_segCnt); }
+	const PacketSeg_t& Segment(unsigned idx) const { return(m_seg[idx]); }
+	const uint8_t *Frame(uint32_t idx, unsigned& len) const { len = m_ofst[idx + 1] - m_ofst[idx]; return(m_frames + m_ofst[idx]); }
+	uint32_t Key() const { return(m_key); }
+	size_t Size() const { return(m_dataLen); }
+
+	static uint32_t KeyOf(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal,
+			uint16_t flashParmMask, uint32_t key = PACKET_KEY_INIT);
+
+private:
+	PacketCache(const PacketCache&);
+	PacketCache& operator=(const PacketCache&);
+
+	int addSegment(const uint8_t *data, uint32_t size, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int grow(uint32_t segCnt, uint32_t frameCnt, uint32_t dataLen);
+
+	PacketSeg_t *m_seg;				// the segments
+	uint32_t m_segCnt;
+	uint32_t *m_ofst;				// the offset of each frame, with one more giving the end
+	uint32_t m_frameCnt;
+	uint8_t *m_frames;				// the encoded frames
+	uint32_t m_dataLen;				// the total length of the frames
+	uint32_t m_segSize;				// the allocated sizes of the arrays
+	uint32_t m_ofstSize;
+	uint32_t m_frameSize;
+	uint32_t m_key;					// identifies the content of the source images
+	void *m_map;					// the mapped file, NULL if built in memory
+	size_t m_mapSize;
+};
+
+//
+// A class holding the frames of a packet cache that differ for one device,
+// e.g. for a region of Flash holding its serial number or MAC address.
+// Only the blocks in which the content differs are encoded again; the
+// checksum of each is adjusted for the bytes that changed.  The other
+// frames are taken from the cache.
+//
+class PacketPatch
+{
+public:
+	PacketPatch();
+	~PacketPatch();
+
+	void Clear() { m_frameCnt = 0; m_dataLen = 0; }
+	int Apply(const PacketCache& cache, uint32_t addr, const uint8_t *data, uint32_t size);
+	const uint8_t *Frame(const PacketCache& cache, uint32_t idx, unsigned& len) const;
+	unsigned FrameCount() const { return(m_frameCnt); }
+
+private:
+	PacketPatch(const PacketPatch&);
+	PacketPatch& operator=(const PacketPatch&);
+
+	// a replacement for a frame of the cache
+	typedef struct
+	{
+		uint32_t idx;				// the index of the frame replaced
+		uint32_t ofst;				// the offset of the frame in m_frames
+		uint32_t len;				// the length of the frame
+	} PatchFrame_t;
+
+	int patchBlock(const PacketCache& cache, uint32_t idx, uint32_t blkOfst, const uint8_t *data, uint32_t size);
+
+	PatchFrame_t *m_frame;			// the replacement frames
+	uint32_t m_frameCnt;
+	uint32_t m_frameSize;
+	uint8_t *m_frames;				// the encoded frames
+	uint32_t m_dataLen;
+	uint32_t m_dataSize;
+};
+
+#endif	// defined(PACKET_H__)
@@ -0,0 +1,321 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "profile.h"
+#include <string.h>
+#include <stdlib.h>
+
+/** local definitions **/
+
+#define MAX_PROFILE_LINE			300
+
+/** internal functions **/
+static char *dupString(const char *s);
+static char *trimString(char *s);
+
+/** class implementations **/
+
+Profile::
+Profile()
+{
+	m_file = NULL;
+	m_head = NULL;
+	m_tail = NULL;
+	m_modified = false;
+}
+
+Profile::
+~Profile()
+{
+	clear();
+}
+
+//
+// Discard all entries and the associated filename.
+//
+void Profile::
+Clear()
+{
+	MutexLock lock(m_mutex);
+	clear();
+}
+
+//
+// Load the content of a profile file.  If the 'file' parameter is NULL, the
+// filename is taken from the environment variable ESP_TOOL_PROFILE or, if
+// that isn't set, a default name in the user's home directory is used.  A
+// profile file that does not exist is not an error; it will be created
+// when changes are saved.  The return value is zero on success, non-zero
+// otherwise.
+//
+int Profile::
+Load(const char *file)
+{
+	char nameBuf[MAX_PROFILE_LINE];
+
+	MutexLock lock(m_mutex);
+	clear();
+	if ((file == NULL) || (*file == '\0'))
+	{
+		const char *dir;
+		if ((file = getenv(PROFILE_ENV_VAR)) == NULL)
+		{
+			if (((dir = getenv(PROFILE_HOME_VAR)) == NULL) ||
+					((strlen(dir) + strlen(PROFILE_DEF_NAME) + 2) > sizeof(nameBuf)))
+				return(-1);
+#if defined(WIN32)
+			sprintf(nameBuf, "%s\\%s", dir, PROFILE_DEF_NAME);
+#else
+			sprintf(nameBuf, "%s/%s", dir, PROFILE_DEF_NAME);
+#endif
+			file = nameBuf;
+		}
+	}
+	m_file = dupString(file);
+
+	FILE *fp;
+	if ((fp = fopen(m_file, "r")) == NULL)
+		return(0);
+
+	char line[MAX_PROFILE_LINE];
+	char *section = NULL;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *p = trimString(line);
+		if ((*p == '\0') || (*p == '#') || (*p == ';'))
+			continue;
+		if (*p == '[')
+		{
+			// the beginning of a section
+			char *end;
+			if ((end = strchr(++p, ']')) != NULL)
+			{
+				*end = '\0';
+				delete[] section;
+				section = dupString(trimString(p));
+			}
+			continue;
+		}
+
+		// a key-value pair, ignored if not in a section
+		char *eq;
+		if ((section != NULL) && ((eq = strchr(p, '=')) != NULL))
+		{
+			*eq++ = '\0';
+			add(section, trimString(p), trimString(eq));
+		}
+	}
+	delete[] section;
+	fclose(fp);
+	m_modified = false;
+	return(0);
+}
+
+//
+// Write the profile entries to the associated file, grouped by section.
+// The return value is zero on success, non-zero otherwise.
+//
+int Profile::
+Save()
+{
+	MutexLock lock(m_mutex);
+	if (m_file == NULL)
+		return(-1);
+
+	FILE *fp;
+	if ((fp = fopen(m_file, "w")) == NULL)
+		return(-1);
+	fprintf(fp, "# esp_tool profile - values learned about adapters and devices\n");
+	for (ProfileEntry_t *pe = m_head; pe != NULL; pe = pe->next)
+	{
+		// skip entries belonging to a section that has already been written
+		ProfileEntry_t *prev;
+		for (prev = m_head; prev != pe; prev = prev->next)
+		{
+			if (strcmp(prev->section, pe->section) == 0)
+				break;
+		}
+		if (prev != pe)
+			continue;
+
+		// write all of the entries of this section
+		fprintf(fp, "\n[%s]\n", pe->section);
+		for (ProfileEntry_t *se = pe; se != NULL; se = se->next)
+		{
+			if (strcmp(se->section, pe->section) == 0)
+				fprintf(fp, "%s=%s\n", se->key, se->value);
+		}
+	}
+	int stat = ferror(fp) ? -1 : 0;
+	if (fclose(fp) != 0)
+		stat = -1;
+	if (stat == 0)
+		m_modified = false;
+	return(stat);
+}
+
+//
+// Get the value associated with a key in a section.  The return value
+// is NULL if no such entry exists.
+//
+const char *Profile::
+Get(const char *section, const char *key) const
+{
+	MutexLock lock(m_mutex);
+	ProfileEntry_t *pe = find(section, key);
+	return(pe ? pe->value : NULL);
+}
+
+//
+// Get the numeric value associated with a key in a section.  Decimal and
+// hexadecimal (with a 0x prefix) values are supported.  Return true if
+// the entry exists and contains a valid value.
+//
+bool Profile::
+GetVal(const char *section, const char *key, uint32_t& val) const
+{
+	ProfileEntry_t *pe;
+	char *end;
+	MutexLock lock(m_mutex);
+	if (((pe = find(section, key)) == NULL) || (*pe->value == '\0'))
+		return(false);
+	unsigned long v = strtoul(pe->value, &end, 0);
+	if (*end != '\0')
+		return(false);
+	val = (uint32_t)v;
+	return(true);
+}
+
+//
+// Set the value associated with a key in a section, adding the entry if
+// it doesn't exist.
+//
+void Profile::
+Set(const char *section, const char *key, const char *value)
+{
+	if ((section == NULL) || (key == NULL) || (*section == '\0') || (*key == '\0'))
+		return;
+	if (value == NULL)
+		value = "";
+
+	MutexLock lock(m_mutex);
+	ProfileEntry_t *pe;
+	if ((pe = find(section, key)) == NULL)
+		add(section, key, value);
+	else if (strcmp(pe->value, value) != 0)
+	{
+		delete[] pe->value;
+		pe->value = dupString(value);
+	}
+	else
+		return;
+	m_modified = true;
+}
+
+void Profile::
+SetVal(const char *section, const char *key, uint32_t val)
+{
+	char valStr[20];
+	sprintf(valStr, "%lu", (unsigned long)val);
+	Set(section, key, valStr);
+}
+
+/** private functions **/
+
+//
+// Discard all entries and the associated filename, the lock being held.
+//
+void Profile::
+clear()
+{
+	ProfileEntry_t *pe;
+	while ((pe = m_head) != NULL)
+	{
+		m_head = pe->next;
+		delete[] pe->section;
+		delete[] pe->key;
+		delete[] pe->value;
+		delete pe;
+	}
+	m_tail = NULL;
+	delete[] m_file;
+	m_file = NULL;
+	m_modified = false;
+}
+
+//
+// Locate the entry for a key in a section.
+//
+Profile::ProfileEntry_t *Profile::
+find(const char *section, const char *key) const
+{
+	if ((section == NULL) || (key == NULL))
+		return(NULL);
+	for (ProfileEntry_t *pe = m_head; pe != NULL; pe = pe->next)
+	{
+		if ((strcmp(pe->section, section) == 0) && (strcmp(pe->key, key) == 0))
+			return(pe);
+	}
+	return(NULL);
+}
+
+//
+// Append an entry to the list.
+//
+void Profile::
+add(const char *section, const char *key, const char *value)
+{
+	ProfileEntry_t *pe = new ProfileEntry_t;
+	pe->section = dupString(section);
+	pe->key = dupString(key);
+	pe->value = dupString(value);
+	pe->next = NULL;
+	if (m_tail != NULL)
+		m_tail->next = pe;
+	else
+		m_head = pe;
+	m_tail = pe;
+}
+
+//
+// Make an allocated copy of a string.
+//
+static char *
+dupString(const char *s)
+{
+	char *p = new char[strlen(s) + 1];
+	strcpy(p, s);
+	return(p);
+}
+
+//
+// Remove leading and trailing whitespace from a string, returning a
+// pointer to the first non-whitespace character.
+//
+static char *
+trimString(char *s)
+{
+	while ((*s == ' ') || (*s == '\t'))
+		s++;
+	char *end = s + strlen(s);
+	while ((end > s) && ((end[-1] == ' ') || (end[-1] == '\t') || (end[-1] == '\n') || (end[-1] == '\r')))
+		*--end = '\0';
+	return(s);
+}
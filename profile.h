@@ -0,0 +1,92 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(PROFILE_H__)
+#define PROFILE_H__
+
+#include "sysdep.h"
+#include "thread.h"
+#include <stdio.h>
+#if defined(HAVE_STDINT_H)
+  #include <stdint.h>
+#endif
+
+#define PROFILE_ENV_VAR				"ESP_TOOL_PROFILE"
+#if defined(WIN32)
+#define PROFILE_HOME_VAR			"APPDATA"
+#define PROFILE_DEF_NAME			"esp_tool.prof"
+#else
+#define PROFILE_HOME_VAR			"HOME"
+#define PROFILE_DEF_NAME			".esp_tool_profile"
+#endif
+
+//
+// A class representing a persistent collection of values that are learned
+// about serial adapters and devices, e.g. the reset timing that works for a
+// particular USB adapter.  The values are organized into named sections and
+// are stored in a text file having the form:
+//
+//	[section]
+//	key=value
+//
+// The methods may be used concurrently by multiple threads.  Note, however,
+// that the string returned by Get() remains valid only until the value is
+// next changed.
+//
+class Profile
+{
+public:
+	Profile();
+	~Profile();
+
+	int Load(const char *file = NULL);
+	int Save();
+	void Clear();
+	bool IsLoaded() const { return(m_file != NULL); }
+	bool IsModified() const { return(m_modified); }
+	const char *Filename() const { return(m_file ? m_file : ""); }
+
+	const char *Get(const char *section, const char *key) const;
+	bool GetVal(const char *section, const char *key, uint32_t& val) const;
+	void Set(const char *section, const char *key, const char *value);
+	void SetVal(const char *section, const char *key, uint32_t val);
+
+private:
+	Profile(const Profile&);
+	Profile& operator=(const Profile&);
+
+	typedef struct ProfileEntry_tag
+	{
+		char *section;				// the section to which the entry belongs
+		char *key;					// the key for the entry
+		char *value;				// the value of the entry
+		struct ProfileEntry_tag *next;
+	} ProfileEntry_t;
+
+	ProfileEntry_t *find(const char *section, const char *key) const;
+	void add(const char *section, const char *key, const char *value);
+	void clear();
+
+	char *m_file;					// the name of the associated file
+	ProfileEntry_t *m_head;			// the first entry
+	ProfileEntry_t *m_tail;			// the last entry
+	bool m_modified;				// if changes have been made since loading
+	mutable Mutex m_mutex;			// serializes access to the entries
+};
+
+#endif	// defined(PROFILE_H__)
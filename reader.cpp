@@ -0,0 +1,206 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "reader.h"
+#include <string.h>
+
+/** local definitions **/
+
+/** class implementations **/
+
+BlockReader::
+BlockReader()
+{
+	m_vf = NULL;
+	m_blkCnt = 0;
+	m_addr = 0;
+	m_flashParmVal = 0;
+	m_flashParmMask = 0;
+	m_filled = 0;
+	m_taken = 0;
+	m_consumed = 0;
+	m_stop = false;
+	m_threaded = false;
+	m_stalls = 0;
+	m_msStall = 0;
+}
+
+//
+// Begin reading the blocks of an image from the current position of a
+// file.  The return value is zero on success, non-zero otherwise.
+//
+int BlockReader::
+Start(VFile& vf, uint32_t blkCnt, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask)
+{
+	Stop();
+	m_vf = &vf;
+	m_blkCnt = blkCnt;
+	m_addr = addr;
+	m_flashParmVal = flashParmVal;
+	m_flashParmMask = flashParmMask;
+	m_filled = 0;
+	m_taken = 0;
+	m_consumed = 0;
+	m_stop = false;
+	m_stalls = 0;
+	m_msStall = 0;
+
+	// if the thread can't be started, the blocks are read as needed
+	m_threaded = (!vf.IsVirtual() && (blkCnt > 1) && (m_thread.Start(reader, this) == 0));
+	return(0);
+}
+
+//
+// Get the next block, waiting for it to be read if necessary, as a pair of
+// data blocks: the command header and the block data.  The block remains
+// valid until it is released.  The return value is zero on success,
+// non-zero otherwise.
+//
+int BlockReader::
+Next(DataBlock_t blk[2], uint16_t& cksum)
+{
+	if (m_taken >= m_blkCnt)
+		return(ESP_ERROR_PARAM);
+	Slot_t& slot = m_slot[m_taken % READER_DEPTH];
+	if (!m_threaded)
+		slot.stat = readBlock(slot, m_taken);
+	else
+	{
+		unsigned tickStart = 0;
+		bool stalled = false;
+		for ( ; ; )
+		{
+			{
+				MutexLock lock(m_mutex);
+				if (m_filled > m_taken)
+					break;
+			}
+			if (!stalled)
+			{
+				stalled = true;
+				tickStart = getTickCount();
+				m_stalls++;
+			}
+			m_ready.Wait();
+		}
+		if (stalled)
+			m_msStall += getTickCount() - tickStart;
+	}
+	blk[0].data = slot.blk;
+	blk[0].dataLen = 16;
+	blk[1].data = slot.data;
+	blk[1].dataLen = ESP_FLASH_BLK_SIZE;
+	cksum = slot.cksum;
+	m_taken++;
+	return(slot.stat);
+}
+
+//
+// Release the oldest block obtained by Next(), making room for another.
+// A block may be held until the command that sends it completes.
+//
+void BlockReader::
+Release()
+{
+	{
+		MutexLock lock(m_mutex);
+		m_consumed++;
+	}
+	if (m_threaded)
+		m_space.Set();
+}
+
+//
+// Stop reading, waiting for the reader thread to finish.
+//
+void BlockReader::
+Stop()
+{
+	if (!m_threaded)
+		return;
+	{
+		MutexLock lock(m_mutex);
+		m_stop = true;
+	}
+	m_space.Set();
+	m_thread.Join();
+	m_threaded = false;
+}
+
+/** private functions **/
+
+//
+// The function executed by the reader thread, filling the free slots until
+// all of the blocks have been read, an error occurs or it is stopped.
+//
+void BlockReader::
+reader(void *arg)
+{
+	BlockReader *br = (BlockReader *)arg;
+
+	for (uint32_t blkIdx = 0; blkIdx < br->m_blkCnt; blkIdx++)
+	{
+		for ( ; ; )
+		{
+			{
+				MutexLock lock(br->m_mutex);
+				if (br->m_stop)
+					return;
+				if (blkIdx - br->m_consumed < READER_DEPTH)
+					break;
+			}
+			br->m_space.Wait();
+		}
+
+		Slot_t& slot = br->m_slot[blkIdx % READER_DEPTH];
+		slot.stat = br->readBlock(slot, blkIdx);
+		{
+			MutexLock lock(br->m_mutex);
+			br->m_filled = blkIdx + 1;
+		}
+		br->m_ready.Set();
+		if (slot.stat != 0)
+			break;
+	}
+}
+
+//
+// Read a block and prepare it as the data of a FLASH_DATA command.  The
+// return value is zero on success, non-zero otherwise.
+//
+int BlockReader::
+readBlock(Slot_t& slot, uint32_t blkIdx)
+{
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+	uint8_t *blkData = slot.blk + 16;
+
+	// use the data of a file in memory in place if possible
+	size_t cnt = blkSize;
+	const uint8_t *data;
+	if ((data = m_vf->Span(cnt)) == NULL)
+	{
+		data = blkData;
+		if (((cnt = m_vf->Read(blkData, 1, blkSize)) != blkSize) && !m_vf->EndOfFile())
+			return(ESP_ERROR_FILE_READ);
+	}
+	slot.data = ESP::FlashBlock(slot.blk, blkIdx, data, (uint32_t)cnt,
+			m_addr, m_flashParmVal, m_flashParmMask, slot.cksum);
+	return(0);
+}
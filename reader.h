@@ -0,0 +1,93 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(READER_H__)
+#define READER_H__
+
+#include "esp.h"
+#include "thread.h"
+
+#define READER_DEPTH				16			// the number of blocks read ahead
+#define READER_BLK_SIZE				(16 + ESP_FLASH_BLK_SIZE)	// a block with its command header
+
+// the blocks held by the commands in flight must leave a slot to read into
+#if (READER_DEPTH <= ESP_MAX_INFLIGHT)
+  #error READER_DEPTH must exceed ESP_MAX_INFLIGHT
+#endif
+
+//
+// A class that reads the blocks of an image for the FLASH_DATA commands
+// ahead of their being sent.  For a file on disk, a separate thread keeps
+// up to READER_DEPTH blocks read, padded and checksummed so that the
+// latency of the file system is hidden behind the exchanges with the
+// device.  The number and duration of the waits for a block that wasn't
+// yet read are recorded.  A file in memory is read as each block is
+// needed and, apart from a padded or patched block, its data is used in
+// place rather than being copied.  A block stays valid until released, so
+// it may be sent without being copied while its command is in flight.
+//
+class BlockReader
+{
+public:
+	BlockReader();
+	~BlockReader() { Stop(); }
+
+	int Start(VFile& vf, uint32_t blkCnt, uint32_t addr, uint16_t flashParmVal, uint16_t flashParmMask);
+	int Next(DataBlock_t blk[2], uint16_t& cksum);
+	void Release();
+	void Stop();
+
+	uint32_t Stalls() const { return(m_stalls); }
+	uint32_t StallTime() const { return(m_msStall); }
+
+private:
+	BlockReader(const BlockReader&);
+	BlockReader& operator=(const BlockReader&);
+
+	// a block that has been read
+	typedef struct
+	{
+		int stat;					// the result of reading the block
+		uint16_t cksum;				// the checksum of the block data
+		const uint8_t *data;		// the block data, in blk or in the file
+		uint8_t blk[READER_BLK_SIZE];	// the command header and block data
+	} Slot_t;
+
+	static void reader(void *arg);
+	int readBlock(Slot_t& slot, uint32_t blkIdx);
+
+	VFile *m_vf;
+	uint32_t m_blkCnt;
+	uint32_t m_addr;
+	uint16_t m_flashParmVal;
+	uint16_t m_flashParmMask;
+	Slot_t m_slot[READER_DEPTH];
+	uint32_t m_filled;				// the number of blocks read
+	uint32_t m_taken;				// the number of blocks obtained by Next()
+	uint32_t m_consumed;			// the number of blocks released
+	bool m_stop;					// if the reader thread is to stop
+	bool m_threaded;				// if the blocks are read by the thread
+	uint32_t m_stalls;				// times that a block wasn't ready when needed
+	uint32_t m_msStall;				// the time spent waiting for blocks
+	Mutex m_mutex;
+	Event m_ready;					// set when a block has been read
+	Event m_space;					// set when a block has been released
+	Thread m_thread;
+};
+
+#endif	// defined(READER_H__)
@@ -0,0 +1,833 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "scheduler.h"
+#include <string.h>
+#include <ctype.h>
+
+/** local definitions **/
+
+#define MAX_TOKENS					(2 + 2 * GANG_MAX_IMAGES)
+
+static const char *opName[] = { "write", "read", "mac" };
+
+/** internal functions **/
+static char *dupString(const char *s);
+static int splitLine(char *line, char **token, unsigned maxTokens);
+static int getNum(const char *s, uint32_t& val);
+static bool canRetry(int stat);
+
+/** class implementations **/
+
+Scheduler::
+Scheduler()
+{
+	m_portCnt = 0;
+	m_retHead = NULL;
+	m_retTail = NULL;
+	m_pendHead = NULL;
+	m_pendTail = NULL;
+	m_image = NULL;
+	m_jobCnt = 0;
+	m_queued = 0;
+	m_running = 0;
+	m_jobsOK = 0;
+	m_jobsFailed = 0;
+	m_retries = 0;
+	m_lineNum = 0;
+	m_tickStart = 0;
+	m_msElapsed = 0;
+	m_finishing = false;
+	m_stop = false;
+	m_parm.dlSpeed = 115200;
+	m_parm.highSpeed = 0;
+	m_parm.resetMode = ResetNone;
+	m_parm.flags = 0;
+	m_parm.profile = NULL;
+	m_flashParmVal = 0;
+	m_flashParmMask = 0;
+}
+
+Scheduler::
+~Scheduler()
+{
+	unsigned i;
+
+	if (!m_stop)
+		Finish();
+	for (i = 0; i < m_portCnt; i++)
+	{
+		delete[] m_port[i]->name;
+		delete[] m_port[i]->portClass;
+		delete m_port[i];
+	}
+	while (m_retHead != NULL)
+	{
+		SchedPort_t *next = m_retHead->next;
+		delete[] m_retHead->name;
+		delete[] m_retHead->portClass;
+		delete m_retHead;
+		m_retHead = next;
+	}
+	while (m_image != NULL)
+	{
+		SchedImage_t *next = m_image->next;
+		GangFreeImage(m_image->image);
+		delete m_image;
+		m_image = next;
+	}
+}
+
+//
+// Add a port, starting its worker thread.  Jobs waiting for a suitable
+// port are dispatched again.  The return value is zero on success,
+// non-zero otherwise.
+//
+int Scheduler::
+AddPort(const char *name, const char *portClass)
+{
+	MutexLock lock(m_mutex);
+
+	reap();
+	if ((name == NULL) || (*name == '\0') || m_finishing || (findPort(name) != NULL) || (m_portCnt >= SCHED_MAX_PORTS))
+		return(ESP_ERROR_PARAM);
+
+	SchedPort_t *port = new SchedPort_t;
+	port->sched = this;
+	port->name = dupString(name);
+	port->portClass = ((portClass != NULL) && (*portClass != '\0')) ? dupString(portClass) : NULL;
+	port->removing = false;
+	port->head = NULL;
+	port->tail = NULL;
+	port->queued = 0;
+	port->busy = false;
+	port->jobsOK = 0;
+	port->jobsFailed = 0;
+	port->steals = 0;
+	port->msBusy = 0;
+	port->tickAdded = getTickCount();
+	port->tickRemoved = 0;
+	port->exited = false;
+	port->next = NULL;
+	if (port->thread.Start(worker, port) != 0)
+	{
+		delete[] port->name;
+		delete[] port->portClass;
+		delete port;
+		return(ESP_ERROR_GENERAL);
+	}
+	if ((m_portCnt == 0) && (m_retHead == NULL))
+		m_tickStart = port->tickAdded;
+	m_port[m_portCnt++] = port;
+
+	// give the waiting jobs another chance
+	SchedJob_t *job = m_pendHead;
+	m_pendHead = m_pendTail = NULL;
+	while (job != NULL)
+	{
+		SchedJob_t *next = job->next;
+		dispatch(job);
+		job = next;
+	}
+	return(0);
+}
+
+//
+// Remove a port.  The jobs queued for the port are dispatched to other
+// ports and its worker thread exits after completing the current job.
+// The return value is zero on success, non-zero if the port is unknown.
+//
+int Scheduler::
+RemovePort(const char *name)
+{
+	MutexLock lock(m_mutex);
+	SchedPort_t *port;
+
+	if ((port = findPort(name)) == NULL)
+		return(ESP_ERROR_PARAM);
+	port->removing = true;
+	port->tickRemoved = getTickCount();
+	while (port->head != NULL)
+	{
+		SchedJob_t *job = port->head;
+		unlink(port, job);
+		m_queued--;
+		job->exclude = NULL;
+		dispatch(job);
+	}
+	port->wake.Set();
+	return(0);
+}
+
+//
+// Process one line of a job file.  The return value is zero on success,
+// non-zero otherwise (an error message having been output).
+//
+int Scheduler::
+ProcessLine(const char *line)
+{
+	char buf[SCHED_MAX_LINE];
+	char *token[MAX_TOKENS + 1];
+	int cnt;
+	int stat = 0;
+
+	m_lineNum++;
+	strncpy(buf, line, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	if ((cnt = splitLine(buf, token, MAX_TOKENS + 1)) == 0)
+		return(0);
+	if (cnt > MAX_TOKENS)
+	{
+		fprintf(stderr, "Job line %u: too many fields.\n", m_lineNum);
+		return(ESP_ERROR_PARAM);
+	}
+
+	const char *cmd = token[0];
+	if (strcmp(cmd, "port") == 0)
+	{
+		if ((cnt < 2) || (cnt > 3))
+			stat = ESP_ERROR_PARAM;
+		else if ((stat = AddPort(token[1], (cnt > 2) ? token[2] : NULL)) != 0)
+		{
+			fprintf(stderr, "Job line %u: can't add port \"%s\".\n", m_lineNum, token[1]);
+			return(stat);
+		}
+	}
+	else if (strcmp(cmd, "remove") == 0)
+	{
+		if (cnt != 2)
+			stat = ESP_ERROR_PARAM;
+		else if ((stat = RemovePort(token[1])) != 0)
+		{
+			fprintf(stderr, "Job line %u: unknown port \"%s\".\n", m_lineNum, token[1]);
+			return(stat);
+		}
+	}
+	else if ((strcmp(cmd, "write") == 0) || (strcmp(cmd, "read") == 0) || (strcmp(cmd, "mac") == 0))
+	{
+		SchedJob_t *job = new SchedJob_t;
+		memset(job, 0, sizeof(*job));
+		job->id = m_jobCnt + 1;
+
+		// determine the target
+		if ((cnt > 1) && (strcmp(token[1], "*") != 0))
+		{
+			if (strncmp(token[1], "class:", 6) == 0)
+				job->portClass = dupString(token[1] + 6);
+			else
+				job->port = dupString(token[1]);
+		}
+
+		switch (cmd[0])
+		{
+		case 'w':
+			job->op = SchedWrite;
+			if ((cnt < 4) || ((cnt & 1) != 0))
+				stat = ESP_ERROR_PARAM;
+			for (int i = 2; (stat == 0) && (i < cnt); i += 2)
+			{
+				uint32_t addr;
+				if ((getNum(token[i], addr) != 0) || ((addr & (ESP_FLASH_BLK_SIZE - 1)) != 0))
+					stat = ESP_ERROR_PARAM;
+				else if ((job->image[job->imageCnt] = loadImage(token[i + 1], addr)) == NULL)
+				{
+					fprintf(stderr, "Job line %u: can't read file \"%s\".\n", m_lineNum, token[i + 1]);
+					stat = ESP_ERROR_FILE_READ;
+				}
+				else
+					job->imageCnt++;
+			}
+			break;
+
+		case 'r':
+			job->op = SchedRead;
+			if ((cnt != 5) || (getNum(token[2], job->addr) != 0) || (getNum(token[3], job->size) != 0) || (job->size == 0))
+				stat = ESP_ERROR_PARAM;
+			else
+				job->file = dupString(token[4]);
+			break;
+
+		default:
+			job->op = SchedMAC;
+			if (cnt != 2)
+				stat = ESP_ERROR_PARAM;
+			break;
+		}
+		if (stat != 0)
+		{
+			freeJob(job);
+			if (stat == ESP_ERROR_PARAM)
+				fprintf(stderr, "Job line %u: invalid %s job.\n", m_lineNum, cmd);
+			return(stat);
+		}
+
+		MutexLock lock(m_mutex);
+		m_jobCnt++;
+		dispatch(job);
+		return(0);
+	}
+	else
+	{
+		fprintf(stderr, "Job line %u: unknown command \"%s\".\n", m_lineNum, cmd);
+		return(ESP_ERROR_PARAM);
+	}
+	if (stat == ESP_ERROR_PARAM)
+		fprintf(stderr, "Job line %u: invalid %s command.\n", m_lineNum, cmd);
+	return(stat);
+}
+
+//
+// Process the lines of a job file as they are read, so that a pipe may
+// be used to add ports and jobs while earlier jobs are performed.  The
+// return value is the number of lines that couldn't be processed.
+//
+int Scheduler::
+ProcessFile(FILE *fp)
+{
+	char line[SCHED_MAX_LINE];
+	int errCnt = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (ProcessLine(line) != 0)
+			errCnt++;
+	}
+	return(errCnt);
+}
+
+//
+// Wait for the submitted jobs to be completed and stop the workers.  The
+// return value is the number of jobs that failed.
+//
+unsigned Scheduler::
+Finish()
+{
+	unsigned i;
+
+	{
+		MutexLock lock(m_mutex);
+		m_finishing = true;
+		while (m_pendHead != NULL)
+		{
+			SchedJob_t *job = m_pendHead;
+			m_pendHead = job->next;
+			fail(job, "no suitable port");
+		}
+		m_pendTail = NULL;
+	}
+
+	while (1)
+	{
+		{
+			MutexLock lock(m_mutex);
+			if ((m_queued == 0) && (m_running == 0))
+			{
+				m_stop = true;
+				for (i = 0; i < m_portCnt; i++)
+					m_port[i]->wake.Set();
+				break;
+			}
+		}
+		m_drained.Wait();
+	}
+
+	for (i = 0; i < m_portCnt; i++)
+	{
+		m_port[i]->thread.Join();
+		if (!m_port[i]->removing)
+			m_port[i]->tickRemoved = getTickCount();
+	}
+	if ((m_portCnt != 0) || (m_retHead != NULL))
+		m_msElapsed = getTickCount() - m_tickStart;
+	return(m_jobsFailed);
+}
+
+//
+// Output a table giving the utilization of each port and the overall
+// throughput.
+//
+void Scheduler::
+Report(FILE *fp) const
+{
+	fprintf(fp, "\n%-20s %-10s %6s %6s %6s %8s %6s\n", "Port", "Class", "Jobs", "Failed", "Stolen", "Busy", "Util");
+	for (const SchedPort_t *port = m_retHead; port != NULL; port = port->next)
+		reportPort(fp, port);
+	for (unsigned i = 0; i < m_portCnt; i++)
+		reportPort(fp, m_port[i]);
+	double hours = m_msElapsed / 3600000.0;
+	fprintf(fp, "%u of %u jobs completed successfully in %.1f seconds (%u retried), %.0f jobs per hour.\n",
+			m_jobsOK, m_jobsOK + m_jobsFailed, m_msElapsed / 1000.0, m_retries,
+			(hours > 0.0) ? (m_jobsOK / hours) : 0.0);
+	fflush(fp);
+}
+
+/** private functions **/
+
+//
+// The function executed by the worker thread of each port, performing
+// jobs until the port is removed or the scheduler is stopped.
+//
+void Scheduler::
+worker(void *arg)
+{
+	SchedPort_t *port = (SchedPort_t *)arg;
+	Scheduler *sched = port->sched;
+
+	while (1)
+	{
+		SchedJob_t *job;
+		{
+			MutexLock lock(sched->m_mutex);
+			if (port->removing || sched->m_stop)
+			{
+				port->exited = true;
+				break;
+			}
+			if ((job = sched->take(port)) != NULL)
+			{
+				port->busy = true;
+				sched->m_running++;
+			}
+		}
+		if (job == NULL)
+			port->wake.Wait();
+		else
+			sched->perform(job, port);
+	}
+}
+
+//
+// Get the next job for a port, taking the oldest from its own queue or,
+// if that is empty, the newest eligible job from another port's queue.
+// This must be called with the mutex locked.
+//
+Scheduler::SchedJob_t *Scheduler::
+take(SchedPort_t *port)
+{
+	SchedJob_t *job;
+
+	if ((job = port->head) != NULL)
+	{
+		unlink(port, job);
+		m_queued--;
+		return(job);
+	}
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		SchedPort_t *victim = m_port[i];
+		if (victim == port)
+			continue;
+		for (job = victim->tail; job != NULL; job = job->prev)
+		{
+			// jobs for a specific port stay where they are
+			if ((job->port == NULL) && (job->exclude != port) && eligible(job, port))
+			{
+				unlink(victim, job);
+				m_queued--;
+				port->steals++;
+				return(job);
+			}
+		}
+	}
+	return(NULL);
+}
+
+//
+// Connect to the device on a port and perform a job.
+//
+void Scheduler::
+perform(SchedJob_t *job, SchedPort_t *port)
+{
+	unsigned tickStart = getTickCount();
+	char info[FILENAME_MAX + 10];
+	ESP esp;
+	int stat;
+
+	info[0] = '\0';
+	if ((stat = GangConnect(esp, port->name, m_parm)) == 0)
+	{
+		switch (job->op)
+		{
+		case SchedWrite:
+			for (unsigned i = 0; (stat == 0) && (i < job->imageCnt); i++)
+				stat = GangWriteImage(esp, *job->image[i]);
+			if (stat == 0)
+				stat = GangFinish(esp, m_parm);
+			break;
+
+		case SchedRead:
+			{
+				char file[FILENAME_MAX];
+				VFile vf;
+
+				GangFileName(file, sizeof(file), job->file, port->name, job->id);
+				if (vf.Open(file, "wb") != 0)
+					stat = ESP_ERROR_FILE_CREATE;
+				else if ((stat = esp.FlashRead(vf, job->addr, job->size)) == 0)
+					sprintf(info, "-> %s", file);
+				vf.Close();
+			}
+			break;
+
+		case SchedMAC:
+			{
+				uint8_t mac[12];
+				if ((stat = esp.ReadMAC(mac, sizeof(mac))) == 0)
+					sprintf(info, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+			}
+			break;
+		}
+	}
+	esp.CloseComm();
+
+	MutexLock lock(m_mutex);
+	port->busy = false;
+	port->msBusy += getTickCount() - tickStart;
+	m_running--;
+	complete(job, port, stat, info);
+	if (m_finishing && (m_queued == 0) && (m_running == 0))
+		m_drained.Set();
+}
+
+//
+// Record the result of performing a job, dispatching it again if it
+// failed and may be retried.  This must be called with the mutex locked.
+//
+void Scheduler::
+complete(SchedJob_t *job, SchedPort_t *port, int stat, const char *info)
+{
+	bool quiet = ((m_parm.flags & ESP_QUIET) != 0);
+
+	job->attempts++;
+	if (stat == 0)
+	{
+		port->jobsOK++;
+		m_jobsOK++;
+		if (!quiet)
+			fprintf(stdout, "job %u (%s) on %s: OK%s%s\n", job->id, opName[job->op], port->name, *info ? " " : "", info);
+		freeJob(job);
+	}
+	else
+	{
+		port->jobsFailed++;
+		if (!canRetry(stat) || (job->attempts >= SCHED_MAX_ATTEMPTS))
+		{
+			char reason[FILENAME_MAX + 30];
+			sprintf(reason, "failed on %.*s (%d)", FILENAME_MAX, port->name, stat);
+			fail(job, reason);
+			return;
+		}
+		if (!quiet)
+			fprintf(stdout, "job %u (%s) on %s: failed (%d), retrying.\n", job->id, opName[job->op], port->name, stat);
+		m_retries++;
+
+		// prefer another port for the next attempt
+		job->exclude = (job->port == NULL) ? port : NULL;
+		dispatch(job);
+	}
+	fflush(stdout);
+}
+
+//
+// Queue a job for the least loaded eligible port, avoiding the port on
+// which it last failed if there is an alternative.  If there is no
+// eligible port, the job waits for one to be added.  This must be called
+// with the mutex locked.
+//
+void Scheduler::
+dispatch(SchedJob_t *job)
+{
+	SchedPort_t *best = NULL;
+	unsigned bestLoad = 0;
+
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		SchedPort_t *port = m_port[i];
+		if ((port == job->exclude) || !eligible(job, port))
+			continue;
+		unsigned load = port->queued + (port->busy ? 1 : 0);
+		if ((best == NULL) || (load < bestLoad))
+		{
+			best = port;
+			bestLoad = load;
+		}
+	}
+	if ((best == NULL) && (job->exclude != NULL) && eligible(job, job->exclude))
+		best = job->exclude;
+
+	if (best != NULL)
+	{
+		enqueue(best, job);
+		m_queued++;
+		best->wake.Set();
+	}
+	else if (m_finishing)
+		fail(job, "no suitable port");
+	else
+	{
+		job->prev = m_pendTail;
+		job->next = NULL;
+		if (m_pendTail != NULL)
+			m_pendTail->next = job;
+		else
+			m_pendHead = job;
+		m_pendTail = job;
+	}
+}
+
+//
+// Determine if a job may be performed on a port.
+//
+bool Scheduler::
+eligible(const SchedJob_t *job, const SchedPort_t *port) const
+{
+	if (port->removing)
+		return(false);
+	if (job->port != NULL)
+		return(strcmp(job->port, port->name) == 0);
+	if (job->portClass != NULL)
+		return((port->portClass != NULL) && (strcmp(job->portClass, port->portClass) == 0));
+	return(true);
+}
+
+//
+// Find a port that hasn't been removed.
+//
+Scheduler::SchedPort_t *Scheduler::
+findPort(const char *name) const
+{
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		if (!m_port[i]->removing && (strcmp(m_port[i]->name, name) == 0))
+			return(m_port[i]);
+	}
+	return(NULL);
+}
+
+//
+// Move the removed ports whose workers have exited from the table to the
+// list of retired ports, so that their slots may be used again.  This
+// must be called with the mutex locked.
+//
+void Scheduler::
+reap()
+{
+	unsigned cnt = 0;
+
+	for (unsigned i = 0; i < m_portCnt; i++)
+	{
+		SchedPort_t *port = m_port[i];
+		if (!port->removing || !port->exited)
+		{
+			m_port[cnt++] = port;
+			continue;
+		}
+		port->thread.Join();
+		port->next = NULL;
+		if (m_retTail != NULL)
+			m_retTail->next = port;
+		else
+			m_retHead = port;
+		m_retTail = port;
+	}
+	m_portCnt = cnt;
+}
+
+//
+// Output the line of the utilization table for a port.
+//
+void Scheduler::
+reportPort(FILE *fp, const SchedPort_t *port) const
+{
+	unsigned msActive = port->tickRemoved - port->tickAdded;
+
+	fprintf(fp, "%-20s %-10s %6u %6u %6u %7.1fs %5.1f%%%s\n", port->name,
+			(port->portClass != NULL) ? port->portClass : "-", port->jobsOK, port->jobsFailed,
+			port->steals, port->msBusy / 1000.0, msActive ? (port->msBusy * 100.0 / msActive) : 0.0,
+			port->removing ? "  (removed)" : "");
+}
+
+//
+// Abandon a job.  This must be called with the mutex locked.
+//
+void Scheduler::
+fail(SchedJob_t *job, const char *reason)
+{
+	m_jobsFailed++;
+	fprintf(stderr, "job %u (%s): %s.\n", job->id, opName[job->op], reason);
+	fflush(stderr);
+	freeJob(job);
+}
+
+void Scheduler::
+freeJob(SchedJob_t *job)
+{
+	delete[] job->port;
+	delete[] job->portClass;
+	delete[] job->file;
+	delete job;
+}
+
+//
+// Add a job to the end of a port's queue.
+//
+void Scheduler::
+enqueue(SchedPort_t *port, SchedJob_t *job)
+{
+	job->next = NULL;
+	job->prev = port->tail;
+	if (port->tail != NULL)
+		port->tail->next = job;
+	else
+		port->head = job;
+	port->tail = job;
+	port->queued++;
+}
+
+//
+// Remove a job from a port's queue.
+//
+void Scheduler::
+unlink(SchedPort_t *port, SchedJob_t *job)
+{
+	if (job->prev != NULL)
+		job->prev->next = job->next;
+	else
+		port->head = job->next;
+	if (job->next != NULL)
+		job->next->prev = job->prev;
+	else
+		port->tail = job->prev;
+	job->prev = job->next = NULL;
+	port->queued--;
+}
+
+//
+// Get an image to be written, reading the file only once for all of the
+// jobs that use it.  The return value is NULL if the file can't be read.
+//
+const GangImage_t *Scheduler::
+loadImage(const char *file, uint32_t addr)
+{
+	SchedImage_t *img;
+
+	for (img = m_image; img != NULL; img = img->next)
+	{
+		if ((img->image.addr == addr) && (strcmp(img->image.name, file) == 0))
+			return(&img->image);
+	}
+	img = new SchedImage_t;
+	if (GangLoadImage(img->image, file, addr, m_flashParmVal, m_flashParmMask) != 0)
+	{
+		delete img;
+		return(NULL);
+	}
+	img->next = m_image;
+	m_image = img;
+	return(&img->image);
+}
+
+//
+// Make an allocated copy of a string.
+//
+static char *
+dupString(const char *s)
+{
+	char *p = new char[strlen(s) + 1];
+	strcpy(p, s);
+	return(p);
+}
+
+//
+// Split a line into whitespace-separated tokens, ignoring anything
+// following a '#'.  The return value is the number of tokens found, at
+// most maxTokens.
+//
+static int
+splitLine(char *line, char **token, unsigned maxTokens)
+{
+	unsigned cnt = 0;
+	char *p = line;
+
+	while (cnt < maxTokens)
+	{
+		while (isspace((unsigned char)*p))
+			p++;
+		if ((*p == '\0') || (*p == '#'))
+			break;
+		token[cnt++] = p;
+		while ((*p != '\0') && !isspace((unsigned char)*p))
+			p++;
+		if (*p != '\0')
+			*p++ = '\0';
+	}
+	return((int)cnt);
+}
+
+//
+// Convert a number, decimal or hexadecimal with a 0x prefix, optionally
+// followed by K or M.  The return value is zero on success, non-zero
+// otherwise.
+//
+static int
+getNum(const char *s, uint32_t& val)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return(-1);
+	val = (uint32_t)strtoul(s, &end, 0);
+	switch (toupper((unsigned char)*end))
+	{
+	case 'K':
+		val *= 1024;
+		end++;
+		break;
+
+	case 'M':
+		val *= 1024 * 1024;
+		end++;
+		break;
+	}
+	return((*end == '\0') ? 0 : -1);
+}
+
+//
+// Determine if a job that failed with a given status may succeed if
+// attempted again.  Errors involving local files won't be cured by using
+// another port.
+//
+static bool
+canRetry(int stat)
+{
+	switch (stat)
+	{
+	case ESP_ERROR_PARAM:
+	case ESP_ERROR_FILE_OPEN:
+	case ESP_ERROR_FILE_CREATE:
+	case ESP_ERROR_FILE_READ:
+	case ESP_ERROR_FILE_WRITE:
+	case ESP_ERROR_FILE_SEEK:
+	case ESP_ERROR_FILE_SIZE:
+	case ESP_ERROR_FILE_STAT:
+		return(false);
+	}
+	return(true);
+}
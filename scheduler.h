@@ -0,0 +1,168 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(SCHEDULER_H__)
+#define SCHEDULER_H__
+
+#include "esp.h"
+#include "gang.h"
+#include "thread.h"
+
+#define SCHED_MAX_PORTS				64			// the most ports that may be added
+#define SCHED_MAX_ATTEMPTS			3			// the most times a job is attempted
+#define SCHED_MAX_LINE				1024		// the longest job file line
+
+// the operations that a job may perform
+typedef enum
+{
+	SchedWrite,					// write one or more images to Flash
+	SchedRead,					// read Flash to a file
+	SchedMAC					// read the MAC address
+} SchedOp_t;
+
+//
+// A class that dispatches jobs to the devices on a changing set of serial
+// ports.  Each port has a worker thread with its own queue of jobs; a job
+// may be directed to a particular port, to any port of a named class or to
+// any port at all.  A worker whose queue is empty steals work from the tail
+// of another's queue and a job that fails is retried on a different port
+// when one is available.  An idle worker sleeps until a job is queued for
+// it, and the slot of a removed port is reused once its worker has exited.
+//
+// Jobs are described by lines of text:
+//   port <device> [<class>]       add a port, optionally giving its class
+//   remove <device>               remove a port after its current job
+//   write <target> <addr> <file> [<addr> <file>]...
+//   read <target> <addr> <size> <file>
+//   mac <target>
+// where <target> is a port, "class:<name>" or "*" for any port.  In the
+// name of the file for a read job, %p is replaced by the base name of the
+// port and %j by the job number.
+//
+class Scheduler
+{
+public:
+	Scheduler();
+	~Scheduler();
+
+	void SetSpeed(uint32_t dlSpeed, uint32_t highSpeed) { m_parm.dlSpeed = dlSpeed; m_parm.highSpeed = highSpeed; }
+	void SetReset(ResetMode_t resetMode) { m_parm.resetMode = resetMode; }
+	void SetFlags(unsigned flags) { m_parm.flags = flags; }
+	void SetProfile(Profile *profile) { m_parm.profile = profile; }
+	void SetFlashParm(uint16_t flashParmVal, uint16_t flashParmMask) { m_flashParmVal = flashParmVal; m_flashParmMask = flashParmMask; }
+
+	int AddPort(const char *name, const char *portClass = NULL);
+	int RemovePort(const char *name);
+	int ProcessLine(const char *line);
+	int ProcessFile(FILE *fp);
+	unsigned Finish();
+	void Report(FILE *fp = stdout) const;
+
+private:
+	Scheduler(const Scheduler&);
+	Scheduler& operator=(const Scheduler&);
+
+	typedef struct SchedImage_tag
+	{
+		GangImage_t image;
+		struct SchedImage_tag *next;
+	} SchedImage_t;
+
+	struct SchedPort_tag;
+
+	typedef struct SchedJob_tag
+	{
+		unsigned id;				// the job number
+		SchedOp_t op;				// the operation to perform
+		char *port;					// the port to use, NULL if not specific
+		char *portClass;			// the class of port to use, NULL for any
+		const GangImage_t *image[GANG_MAX_IMAGES];	// the images to write
+		unsigned imageCnt;
+		uint32_t addr;				// the Flash address to read
+		uint32_t size;				// the size to read
+		char *file;					// the file to which to write data read
+		unsigned attempts;			// the number of times the job was attempted
+		struct SchedPort_tag *exclude;	// a port on which the job failed
+		struct SchedJob_tag *prev;
+		struct SchedJob_tag *next;
+	} SchedJob_t;
+
+	typedef struct SchedPort_tag
+	{
+		Scheduler *sched;			// the scheduler to which the port belongs
+		char *name;					// the serial port designator
+		char *portClass;			// the class of the port, NULL if none
+		bool removing;				// if the port is being removed
+		SchedJob_t *head;			// the queue of jobs for the port
+		SchedJob_t *tail;
+		unsigned queued;			// the number of jobs in the queue
+		bool busy;					// if a job is being performed
+		unsigned jobsOK;			// jobs completed successfully
+		unsigned jobsFailed;		// job attempts that failed
+		unsigned steals;			// jobs taken from other queues
+		unsigned msBusy;			// the time spent performing jobs
+		unsigned tickAdded;			// the time at which the port was added
+		unsigned tickRemoved;		// the time at which the port was removed
+		bool exited;				// if the worker thread has exited
+		Event wake;					// set when the worker may have something to do
+		Thread thread;				// the worker thread for the port
+		struct SchedPort_tag *next;	// the next port removed from the table
+	} SchedPort_t;
+
+	static void worker(void *arg);
+	SchedJob_t *take(SchedPort_t *port);
+	void perform(SchedJob_t *job, SchedPort_t *port);
+	void complete(SchedJob_t *job, SchedPort_t *port, int stat, const char *info);
+	void dispatch(SchedJob_t *job);
+	bool eligible(const SchedJob_t *job, const SchedPort_t *port) const;
+	SchedPort_t *findPort(const char *name) const;
+	void reap();
+	void reportPort(FILE *fp, const SchedPort_t *port) const;
+	void fail(SchedJob_t *job, const char *reason);
+	void freeJob(SchedJob_t *job);
+	static void enqueue(SchedPort_t *port, SchedJob_t *job);
+	static void unlink(SchedPort_t *port, SchedJob_t *job);
+	const GangImage_t *loadImage(const char *file, uint32_t addr);
+
+	SchedPort_t *m_port[SCHED_MAX_PORTS];
+	unsigned m_portCnt;
+	SchedPort_t *m_retHead;			// removed ports whose workers have exited
+	SchedPort_t *m_retTail;
+	SchedJob_t *m_pendHead;			// jobs for which there is no eligible port
+	SchedJob_t *m_pendTail;
+	SchedImage_t *m_image;			// images read for write jobs
+	unsigned m_jobCnt;				// the number of jobs submitted
+	unsigned m_queued;				// jobs waiting in port queues
+	unsigned m_running;				// jobs being performed
+	unsigned m_jobsOK;				// jobs completed successfully
+	unsigned m_jobsFailed;			// jobs abandoned
+	unsigned m_retries;				// job attempts repeated after a failure
+	unsigned m_lineNum;				// the current job file line
+	unsigned m_tickStart;			// the time at which the first port was added
+	unsigned m_msElapsed;			// the total time taken
+	bool m_finishing;				// if no more jobs will be submitted
+	bool m_stop;					// if the workers should exit
+
+	GangParm_t m_parm;
+	uint16_t m_flashParmVal;
+	uint16_t m_flashParmMask;
+	Mutex m_mutex;					// serializes access to the queues and output
+	Event m_drained;				// set when the last job is completed while finishing
+};
+
+#endif	// defined(SCHEDULER_H__)
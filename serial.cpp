@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
 #if defined(WIN32)
   #include <memory.h>
   #include <io.h>
@@ -44,17 +45,63 @@
   #include <fcntl.h>
   #include <termios.h>
   #include <unistd.h>
+  #include <poll.h>
 #endif
 #include "serial.h"
 
 /** local definitions **/
 
+#define QUEUE_MIN_SIZE				1024		// the initial size of an unlimited queue
+
 /** private data **/
 #if defined(__linux__)
-static struct termios term;
+// correspondence between baud rates and the termios speed codes
+static const struct
+{
+	unsigned long baud;
+	speed_t code;
+} speedList[] =
+{
+	{ 1200,		B1200 },
+	{ 2400,		B2400 },
+	{ 4800,		B4800 },
+	{ 9600,		B9600 },
+	{ 19200,	B19200 },
+	{ 38400,	B38400 },
+	{ 57600,	B57600 },
+	{ 115200,	B115200 },
+	{ 230400,	B230400 },
+  #if defined(B460800)
+	{ 460800,	B460800 },
+  #endif
+  #if defined(B500000)
+	{ 500000,	B500000 },
+  #endif
+  #if defined(B576000)
+	{ 576000,	B576000 },
+  #endif
+  #if defined(B921600)
+	{ 921600,	B921600 },
+  #endif
+  #if defined(B1000000)
+	{ 1000000,	B1000000 },
+  #endif
+  #if defined(B1500000)
+	{ 1500000,	B1500000 },
+  #endif
+  #if defined(B2000000)
+	{ 2000000,	B2000000 },
+  #endif
+	{ 0,		B0 }
+};
 #endif
 
 /** internal functions **/
+#if defined(__linux__)
+static int termSpeed(struct termios *tp, unsigned long baud);
+static unsigned long termBaud(const struct termios *tp);
+static int readAttribute(const char *dir, const char *attr, char *buf, unsigned bufSize);
+#endif
 
 /** public functions **/
 
@@ -116,12 +163,13 @@ SerialOpen(const char *desc, unsigned long baud, unsigned flags)
   #endif
 		if ((hand = open(desc, dflags)) >= 0)
 		{
+			struct termios term;
   #ifdef __APPLE__
 			dflags = fcntl(hand, F_GETFL, 0);
 			fcntl(hand, F_SETFL, dflags & ~O_NONBLOCK);
   #endif
 			tcgetattr(hand, &term);
-			SerialSetSpeed(hand, baud);
+			termSpeed(&term, baud);
 
 			// configure the serial channel
 			term.c_cflag |= CLOCAL | CREAD;
@@ -331,6 +379,41 @@ SerialAvailable(SerialHandle_t hand)
 	return(count);
 }
 
+/*
+ ** SerialWait
+ *
+ * Wait until data is available to be read from a serial channel or the
+ * specified number of milliseconds has elapsed.  The return value is
+ * non-zero if data is available.
+ *
+ */
+int
+SerialWait(SerialHandle_t hand, unsigned msTimeout)
+{
+	int stat = 0;
+
+	if (IS_VALID_SERIAL_HANDLE(hand))
+	{
+#if defined(WIN32)
+		// yield the processor briefly rather than polling continuously
+		if ((stat = (SerialAvailable(hand) != 0)) == 0)
+		{
+			Sleep(msTimeout ? 1 : 0);
+			stat = (SerialAvailable(hand) != 0);
+		}
+#elif defined(__linux__)
+		struct pollfd pfd;
+		pfd.fd = hand;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		stat = (poll(&pfd, 1, (int)msTimeout) > 0) && (pfd.revents & POLLIN);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of SerialWait()
+#endif
+	}
+	return(stat);
+}
+
 /*
  ** SerialRead
  *
@@ -464,8 +547,10 @@ SerialSetSpeed(SerialHandle_t hand, unsigned long speed)
 				stat = 0;
 		}
 #elif defined(__linux__)
-		cfsetispeed(&term, speed);
-		cfsetospeed(&term, speed);
+		struct termios t;
+		if ((tcgetattr(hand, &t) == 0) && (termSpeed(&t, speed) == 0) &&
+				(tcsetattr(hand, TCSADRAIN, &t) == 0))
+			stat = 0;
 #elif defined(ERROR_MISSING_IMPLEMENTATION)
 	#error missing implementation of SerialSetSpeed()
 #endif
@@ -493,7 +578,9 @@ SerialGetSpeed(SerialHandle_t hand)
 		if (GetCommState(hand, &dcb))
 			speed = dcb.BaudRate;
 #elif defined(__linux__)
-		speed = cfgetispeed(&term);
+		struct termios t;
+		if (tcgetattr(hand, &t) == 0)
+			speed = termBaud(&t);
 #elif defined(ERROR_MISSING_IMPLEMENTATION)
 	#error missing implementation of SerialGetSpeed()
 #endif
@@ -501,6 +588,66 @@ SerialGetSpeed(SerialHandle_t hand)
 	return(speed);
 }
 
+/*
+ ** SerialAdapterID
+ *
+ * Compose a string that identifies the adapter underlying a serial channel
+ * described by the first parameter.  For a USB adapter on Linux, the vendor
+ * ID, product ID and, if available, the serial number are read from sysfs
+ * giving a string like "usb:0403:6001:A600xyz".  Otherwise, the string has
+ * the form "port:<desc>".  Return zero if successful, non-zero otherwise.
+ *
+ */
+int
+SerialAdapterID(const char *desc, char *idBuf, unsigned idBufSize)
+{
+	if ((desc == NULL) || (*desc == '\0') || (idBuf == NULL) || (idBufSize == 0))
+		return(-1);
+
+#if defined(__linux__) && !defined(__APPLE__)
+	// resolve symbolic links like /dev/serial/by-id/... to the device node
+	char devPath[PATH_MAX];
+	const char *base;
+	if (realpath(desc, devPath) == NULL)
+		strcpy(devPath, "");
+	if (((base = strrchr(devPath, '/')) != NULL) && (*++base != '\0'))
+	{
+		char sysPath[PATH_MAX];
+		char dir[PATH_MAX];
+		snprintf(sysPath, sizeof(sysPath), "/sys/class/tty/%s/device", base);
+		if (realpath(sysPath, dir) != NULL)
+		{
+			// ascend the device hierarchy looking for the USB device attributes
+			for (int level = 0; level < 5; level++)
+			{
+				char vid[10];
+				char pid[10];
+				char serial[80];
+				if ((readAttribute(dir, "idVendor", vid, sizeof(vid)) == 0) &&
+						(readAttribute(dir, "idProduct", pid, sizeof(pid)) == 0))
+				{
+					if (readAttribute(dir, "serial", serial, sizeof(serial)) == 0)
+						snprintf(idBuf, idBufSize, "usb:%s:%s:%s", vid, pid, serial);
+					else
+						snprintf(idBuf, idBufSize, "usb:%s:%s", vid, pid);
+					return(0);
+				}
+				char *p;
+				if (((p = strrchr(dir, '/')) == NULL) || (p == dir))
+					break;
+				*p = '\0';
+			}
+		}
+	}
+#endif
+
+	// not a recognizable USB adapter, identify it by the port name
+	if ((strlen(desc) + 6) > idBufSize)
+		return(-1);
+	sprintf(idBuf, "port:%s", desc);
+	return(0);
+}
+
 /** class implementations **/
 
 SerialChannel::
@@ -737,10 +884,13 @@ Refresh()
 		// more serial data is available, determine how much to read
 		if (m_maxSize == 0)
 		{
-			// grow the queue, if necessary, to accommodate the available data
+			// grow the queue, if necessary, to accommodate the available data;
+			// the size is doubled so that the queue is seldom reallocated
 			if ((part = count) > (m_curSize - m_count))
 			{
-				unsigned newSize = count + m_count;
+				unsigned newSize = m_curSize ? m_curSize : QUEUE_MIN_SIZE;
+				while (newSize < (count + m_count))
+					newSize *= 2;
 				unsigned char *p = new unsigned char[newSize];
 				if (m_count)
 					memcpy(p, m_data + m_head, m_count);
@@ -757,20 +907,36 @@ Refresh()
 			// no space left
 			part = 0;
 
-		// move the existing data to the beginning of the queue before adding more
-		if (m_count && m_head)
-			memcpy(m_data, m_data + m_head, m_count);
-		m_head = 0;
-
-		// add data to the queue
+		// add data to the queue, first moving the existing data to the
+		// beginning of the queue if there isn't enough space after it
 		if (part > count)
 			part = count;
+		if (m_count == 0)
+			m_head = 0;
+		else if (m_head && ((m_head + m_count + part) > m_curSize))
+		{
+			memmove(m_data, m_data + m_head, m_count);
+			m_head = 0;
+		}
 		if (part)
-			m_count += SerialRead(m_handle, m_data + m_count, part);
+			m_count += SerialRead(m_handle, m_data + m_head + m_count, part);
 	}
 	return(m_count);
 }
 
+//
+// Wait for additional data to arrive from the serial port.  Data already
+// waiting in the device driver is first moved to the queue so that only
+// the arrival of new data ends the wait.  The return value is non-zero if
+// new data is available.
+//
+int SerialQueue::
+Wait(unsigned msTimeout)
+{
+	Refresh();
+	return(SerialWait(m_handle, msTimeout));
+}
+
 //
 // Remove all characters from the input queue and the associated
 // serial channel.
@@ -788,3 +954,71 @@ Flush()
 }
 
 /** private functions **/
+
+#if defined(__linux__)
+//
+// Read the first line of a sysfs attribute file in the given directory,
+// removing trailing whitespace.  Return zero if successful.
+//
+static int
+readAttribute(const char *dir, const char *attr, char *buf, unsigned bufSize)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	if ((fp = fopen(path, "r")) == NULL)
+		return(-1);
+	int stat = -1;
+	if (fgets(buf, bufSize, fp) != NULL)
+	{
+		unsigned len = strlen(buf);
+		while (len && isspace((unsigned char)buf[len - 1]))
+			buf[--len] = '\0';
+		if (len)
+			stat = 0;
+	}
+	fclose(fp);
+	return(stat);
+}
+#endif
+
+#if defined(__linux__)
+//
+// Set the input and output speed in a termios structure.  Return zero if
+// successful, non-zero otherwise.
+//
+static int
+termSpeed(struct termios *tp, unsigned long baud)
+{
+	for (unsigned i = 0; speedList[i].baud != 0; i++)
+	{
+		if (speedList[i].baud == baud)
+		{
+			if ((cfsetispeed(tp, speedList[i].code) == 0) && (cfsetospeed(tp, speedList[i].code) == 0))
+				return(0);
+			return(-1);
+		}
+	}
+
+	// not a standard rate, some C libraries accept the value directly
+	if ((cfsetispeed(tp, (speed_t)baud) == 0) && (cfsetospeed(tp, (speed_t)baud) == 0))
+		return(0);
+	return(-1);
+}
+
+//
+// Get the baud rate represented by a termios structure.
+//
+static unsigned long
+termBaud(const struct termios *tp)
+{
+	speed_t code = cfgetispeed(tp);
+	for (unsigned i = 0; speedList[i].baud != 0; i++)
+	{
+		if (speedList[i].code == code)
+			return(speedList[i].baud);
+	}
+	return((unsigned long)code);
+}
+#endif
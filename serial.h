@@ -74,12 +74,14 @@ int SerialClose(SerialHandle_t hand);
 int SerialSetSpeed(SerialHandle_t hand, unsigned long speed);
 unsigned long SerialGetSpeed(SerialHandle_t hand);
 unsigned SerialAvailable(SerialHandle_t hand);
+int SerialWait(SerialHandle_t hand, unsigned msTimeout);
 unsigned SerialRead(SerialHandle_t hand, unsigned char *buf, unsigned count);
 unsigned SerialWrite(SerialHandle_t hand, const unsigned char *buf, unsigned count);
 unsigned SerialWriteByte(SerialHandle_t hand, unsigned char b);
 int SerialControl(SerialHandle_t hand, unsigned flags);
 int SerialBreak(SerialHandle_t hand, unsigned msBreakTime);
 int SerialFlush(SerialHandle_t hand);
+int SerialAdapterID(const char *desc, char *idBuf, unsigned idBufSize);
 
 /****************************************************************************/
 
@@ -99,6 +101,7 @@ public:
 	unsigned Count() const { return(m_count); }
 	SerialHandle_t GetHandle() const { return(m_handle); }
 	unsigned Refresh();
+	int Wait(unsigned msTimeout);
 	void Flush();
 	unsigned GetData(unsigned char *buf, unsigned count);
 
@@ -140,6 +143,7 @@ public:
 	int Control(unsigned flags) { return(SerialControl(m_handle, flags)); }
 
 	unsigned Available() { return(m_queue.Available()); }
+	int Wait(unsigned msTimeout) { return(m_queue.Wait(msTimeout)); }
 	void Flush() { m_queue.Flush(); }
 
 protected:
@@ -0,0 +1,1351 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "session.h"
+#include "slip.h"
+#include "packet.h"
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <unistd.h>
+#define USE_EPOLL
+#endif
+#endif
+
+/** local definitions **/
+
+// space for a SLIP encoded command with the largest data block
+#define SESSION_CMD_SIZE			(2 * (8 + 16 + ESP_FLASH_BLK_SIZE) + 2)
+
+// the interval at which the loop checks for input when it must poll
+#define SESSION_POLL_MS				1
+
+// the pause after a failed sync attempt
+#define SESSION_SYNC_PAUSE_MS		100
+
+/** internal functions **/
+static unsigned cpuTime();
+
+//
+// The state of the session with the device on one port.  Each method
+// returns promptly, leaving the session awaiting either a reply from the
+// device or the expiration of its timer.
+//
+class Session
+{
+public:
+	Session(SessionLoop& loop, GangPort_t& port);
+	~Session();
+
+	void Start();
+	void Receive();
+	void Expire();
+	bool IsDone() const { return(m_phase == PhaseDone); }
+	int Result() const { return(m_port.stat); }
+	bool TimerRunning() const { return(m_timerOn); }
+	unsigned TimerDue() const { return(m_tickDue); }
+	SerialHandle_t Handle() const { return(m_hand); }
+
+private:
+	Session(const Session&);
+	Session& operator=(const Session&);
+
+	typedef enum
+	{
+		PhaseReset,				// performing the reset sequence
+		PhaseSync,				// awaiting the reply to a sync command
+		PhaseSyncPause,			// pausing after a failed sync attempt
+		PhaseSyncDrain,			// discarding extra replies to a sync command
+		PhaseBaudRead,			// reading the UART divider
+		PhaseBaudSet,			// awaiting the new divider taking effect
+		PhaseBaudSettle,		// awaiting the link settling at the new speed
+		PhaseMAC,				// reading the MAC registers
+		PhasePrepare,			// awaiting the preparation of the images
+		PhaseErase,				// awaiting the erasure for an image segment
+		PhaseWrite,				// writing the blocks of an image segment
+		PhaseStub,				// downloading the Flash read stub
+		PhaseRead,				// receiving data from the Flash read stub
+		PhaseRun,				// telling the device to run the application
+		PhaseRunReset,			// performing the reset sequence to run the application
+		PhaseDone
+	} Phase_t;
+
+	void startReset(bool forApp);
+	void resetStep();
+	void startSync();
+	void syncFailed();
+	void connected();
+	void setDivider(uint32_t clkDiv);
+	void baudFailed();
+	void readReg(uint32_t addr);
+	void startWrite();
+	void nextSegment();
+	void sendBlock();
+	void startRead(unsigned readIdx);
+	void sendStub();
+	void readData(const uint8_t *data, unsigned dataLen);
+	void startRun();
+	void runStep();
+	void finish(int stat);
+
+	void send(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal, unsigned msTimeout);
+	void sendFrame(uint8_t op, const uint8_t *frame, unsigned frameLen, unsigned msTimeout);
+	void transmit();
+	void frame();
+	void reply(uint32_t val);
+	void error(int stat);
+	void setTimer(unsigned ms);
+
+	SessionLoop& m_loop;
+	GangPort_t& m_port;
+	SerialHandle_t m_hand;
+	SlipDecoder m_dec;
+	Phase_t m_phase;
+	unsigned m_step;				// the progress within the current phase
+	unsigned m_tickStart;
+
+	// connection
+	ResetStep_t m_resetStep[RESET_MAX_STEPS];
+	unsigned m_resetStepCnt;
+	unsigned m_resets;				// reset attempts
+	unsigned m_syncs;				// sync attempts since the last reset
+	bool m_baudSync;				// if syncing at a new speed
+	bool m_baudFailed;				// if the higher speed could not be used
+	uint32_t m_baud;				// the current link speed
+	uint32_t m_newBaud;				// the speed being changed to
+	uint32_t m_macReg[4];
+	unsigned m_tickWait;			// the time at which waiting for the images began
+
+	// writing and reading
+	PacketPatch m_patch;			// the frames for the overlays
+	unsigned m_segIdx;
+	uint32_t m_blkIdx;
+	uint32_t m_blkCnt;
+	unsigned m_readIdx;
+	uint32_t m_readBlkSize;
+	uint32_t m_readLeft;			// the bytes yet to be stored
+	VFile m_vf;
+
+	// the command awaiting a reply
+	uint8_t m_op;
+	bool m_await;					// if a reply to m_op is expected
+	bool m_resend;					// if the command is to be re-sent when the timer expires
+	bool m_flushed;					// if input was discarded while processing received data
+	bool m_dupWait;					// if awaiting a duplicate of the reply received
+	uint32_t m_dupVal;				// the value from the reply received
+	unsigned m_msLate;				// the time within which a duplicate reply may arrive
+	unsigned m_msTimeout;
+	unsigned m_retries;
+	const uint8_t *m_tx;			// the encoded command, m_cmd or a cached frame
+	unsigned m_txLen;
+	unsigned m_cmdLen;
+	uint8_t m_cmd[SESSION_CMD_SIZE];
+	uint8_t m_blk[16 + ESP_FLASH_BLK_SIZE];
+
+	// the timer
+	bool m_timerOn;
+	unsigned m_tickDue;
+};
+
+/** class implementations **/
+
+SessionLoop::
+SessionLoop(const GangParm_t& parm)
+{
+	m_parm = parm;
+	m_sessionCnt = 0;
+	m_seg = NULL;
+	m_segCnt = 0;
+	m_cache = NULL;
+	m_overlay = NULL;
+	m_overlayCnt = 0;
+	m_read = NULL;
+	m_readCnt = 0;
+	m_doneFunc = NULL;
+	m_doneArg = NULL;
+	m_readyFunc = NULL;
+	m_readyArg = NULL;
+	m_ready = true;
+	m_readyStat = 0;
+	m_msCPU = 0;
+	m_pollFD = -1;
+	m_esp.SetProfile(parm.profile);
+}
+
+SessionLoop::
+~SessionLoop()
+{
+	for (unsigned i = 0; i < m_sessionCnt; i++)
+		delete m_session[i];
+	delete[] m_seg;
+}
+
+//
+// Set the images to be written and the regions of Flash to be read back.
+// Combined image files are divided into their component images here so
+// that the sessions deal only with contiguous segments.  The images and
+// read descriptors must remain valid while the loop runs.  The return
+// value is zero on success, non-zero if a combined image is truncated.
+//
+int SessionLoop::
+SetWork(const GangImage_t *image, unsigned imageCnt, const GangRead_t *read, unsigned readCnt,
+		const PacketCache *cache)
+{
+	unsigned i;
+
+	delete[] m_seg;
+	m_seg = NULL;
+	m_segCnt = 0;
+	m_read = read;
+	m_readCnt = readCnt;
+	m_cache = cache;
+	if (cache != NULL)
+	{
+		// the segments are those of the cache
+		m_segCnt = cache->SegmentCount();
+		m_seg = new Segment_t[m_segCnt ? m_segCnt : 1];
+		for (i = 0; i < m_segCnt; i++)
+		{
+			const PacketSeg_t& ps = cache->Segment(i);
+			memset(&m_seg[i], 0, sizeof(m_seg[i]));
+			m_seg[i].size = ps.size;
+			m_seg[i].addr = ps.addr;
+			m_seg[i].frameIdx = ps.frameIdx;
+		}
+		return(0);
+	}
+
+	// count the segments, then fill them in
+	for (int pass = 0; pass < 2; pass++)
+	{
+		unsigned segCnt = 0;
+		for (i = 0; i < imageCnt; i++)
+		{
+			const GangImage_t& img = image[i];
+			if ((img.size < 4) || (memcmp(img.data, COMPOSITE_SIG, 3) != 0))
+			{
+				if (m_seg != NULL)
+				{
+					Segment_t& seg = m_seg[segCnt];
+					seg.data = img.data;
+					seg.size = img.size;
+					seg.addr = img.addr;
+					seg.flashParmVal = img.flashParmVal;
+					seg.flashParmMask = img.flashParmMask;
+					seg.frameIdx = 0;
+				}
+				segCnt++;
+				continue;
+			}
+
+			// a combined image file, each component has an 8-byte header
+			uint32_t pos = 4;
+			for (unsigned j = 0; j < img.data[3]; j++)
+			{
+				if (pos + 8 > img.size)
+					return(ESP_ERROR_IMAGE_SIZE);
+				uint32_t addr = getLE(4, img.data, pos);
+				uint32_t len = getLE(4, img.data, pos + 4);
+				pos += 8;
+				if (len > img.size - pos)
+					return(ESP_ERROR_IMAGE_SIZE);
+				if (m_seg != NULL)
+				{
+					Segment_t& seg = m_seg[segCnt];
+					seg.data = img.data + pos;
+					seg.size = len;
+					seg.addr = addr;
+					seg.flashParmVal = img.flashParmVal;
+					seg.flashParmMask = img.flashParmMask;
+					seg.frameIdx = 0;
+				}
+				segCnt++;
+				pos += len;
+			}
+		}
+		if ((segCnt == 0) || (m_seg != NULL))
+		{
+			m_segCnt = segCnt;
+			break;
+		}
+		m_seg = new Segment_t[segCnt];
+	}
+	return(0);
+}
+
+//
+// Add a port to be processed.  The port structure is updated with the
+// result and must remain valid while the loop runs.  The return value is
+// zero on success, non-zero otherwise.
+//
+int SessionLoop::
+Add(GangPort_t& port)
+{
+	if (m_sessionCnt >= SESSION_MAX)
+		return(ESP_ERROR_PARAM);
+	m_session[m_sessionCnt++] = new Session(*this, port);
+	return(0);
+}
+
+//
+// Perform the sessions for all of the ports, returning when each has either
+// completed or failed.  On Linux the thread sleeps in epoll_wait() until
+// input arrives on one of the ports or the nearest timer expires; elsewhere
+// the ports are polled.  The return value is the number of ports for which
+// the process failed.
+//
+unsigned SessionLoop::
+Run()
+{
+	unsigned cpuStart = cpuTime();
+	unsigned failCnt = 0;
+	unsigned i;
+
+#if defined(USE_EPOLL)
+	m_pollFD = epoll_create(SESSION_MAX);
+#endif
+	for (i = 0; i < m_sessionCnt; i++)
+		m_session[i]->Start();
+
+	for ( ; ; )
+	{
+		if (!m_ready)
+			m_ready = (*m_readyFunc)(m_readyArg, *this, m_readyStat);
+
+		// find the nearest timer expiration
+		unsigned now = getTickCount();
+		int msWait = -1;
+		bool active = false;
+		for (i = 0; i < m_sessionCnt; i++)
+		{
+			Session *session = m_session[i];
+			if (session->IsDone())
+				continue;
+			active = true;
+			if (session->TimerRunning())
+			{
+				int ms = (int)(session->TimerDue() - now);
+				if (ms < 0)
+					ms = 0;
+				if ((msWait < 0) || (ms < msWait))
+					msWait = ms;
+			}
+		}
+		if (!active)
+			break;
+
+		// process the input that has arrived
+#if defined(USE_EPOLL)
+		if (m_pollFD >= 0)
+		{
+			struct epoll_event event[SESSION_MAX];
+			int eventCnt = epoll_wait(m_pollFD, event, SESSION_MAX, msWait);
+			for (int j = 0; j < eventCnt; j++)
+			{
+				Session *session = (Session *)event[j].data.ptr;
+				if (!session->IsDone())
+					session->Receive();
+			}
+		}
+		else
+#endif
+		{
+			bool input = false;
+			for (i = 0; i < m_sessionCnt; i++)
+			{
+				Session *session = m_session[i];
+				if (!session->IsDone() && SerialAvailable(session->Handle()))
+				{
+					session->Receive();
+					input = true;
+				}
+			}
+			if (!input && (msWait != 0))
+				msDelay(SESSION_POLL_MS);
+		}
+
+		// advance the sessions whose timers have expired
+		now = getTickCount();
+		for (i = 0; i < m_sessionCnt; i++)
+		{
+			Session *session = m_session[i];
+			if (!session->IsDone() && session->TimerRunning() && ((int)(now - session->TimerDue()) >= 0))
+				session->Expire();
+		}
+	}
+
+#if defined(USE_EPOLL)
+	if (m_pollFD >= 0)
+		close(m_pollFD);
+	m_pollFD = -1;
+#endif
+	m_msCPU = cpuTime() - cpuStart;
+	for (i = 0; i < m_sessionCnt; i++)
+	{
+		if (m_session[i]->Result() != 0)
+			failCnt++;
+	}
+	return(failCnt);
+}
+
+/** private functions **/
+
+//
+// Begin or end waiting for input on the port of a session.
+//
+void SessionLoop::
+watch(Session *session)
+{
+#if defined(USE_EPOLL)
+	if (m_pollFD >= 0)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = session;
+		if (epoll_ctl(m_pollFD, EPOLL_CTL_ADD, session->Handle(), &event) != 0)
+		{
+			// fall back to polling all of the ports
+			close(m_pollFD);
+			m_pollFD = -1;
+		}
+	}
+#endif
+}
+
+void SessionLoop::
+unwatch(Session *session)
+{
+#if defined(USE_EPOLL)
+	if (m_pollFD >= 0)
+		epoll_ctl(m_pollFD, EPOLL_CTL_DEL, session->Handle(), NULL);
+#endif
+}
+
+//
+// Report the completion of a session.
+//
+void SessionLoop::
+done(GangPort_t& port)
+{
+	if (m_doneFunc != NULL)
+		(*m_doneFunc)(m_doneArg, port);
+}
+
+Session::
+Session(SessionLoop& loop, GangPort_t& port) :
+	m_loop(loop), m_port(port)
+{
+	m_hand = INVALID_SERIAL_HANDLE;
+	m_phase = PhaseDone;
+	m_step = 0;
+	m_tickStart = 0;
+	m_tickWait = 0;
+	m_resetStepCnt = 0;
+	m_resets = 0;
+	m_syncs = 0;
+	m_baudSync = false;
+	m_baudFailed = false;
+	m_baud = 0;
+	m_newBaud = 0;
+	m_segIdx = 0;
+	m_blkIdx = 0;
+	m_blkCnt = 0;
+	m_readIdx = 0;
+	m_readBlkSize = 0;
+	m_readLeft = 0;
+	m_op = 0;
+	m_await = false;
+	m_resend = false;
+	m_flushed = false;
+	m_dupWait = false;
+	m_dupVal = 0;
+	m_msLate = 0;
+	m_msTimeout = 0;
+	m_retries = 0;
+	m_tx = m_cmd;
+	m_txLen = 0;
+	m_cmdLen = 0;
+	m_timerOn = false;
+	m_tickDue = 0;
+}
+
+Session::
+~Session()
+{
+	if (IS_VALID_SERIAL_HANDLE(m_hand))
+		SerialClose(m_hand);
+}
+
+//
+// Open the port and begin connecting to the device.
+//
+void Session::
+Start()
+{
+	const GangParm_t& parm = m_loop.m_parm;
+
+	m_tickStart = getTickCount();
+	m_port.stat = 0;
+	m_port.stage = "connect";
+	m_port.haveMAC = false;
+	m_port.retries = 0;
+	m_baud = parm.dlSpeed;
+	m_port.baud = m_baud;
+	m_hand = SerialOpen(m_port.name, m_baud, m_loop.m_esp.ResetFlags(parm.resetMode));
+	if (!IS_VALID_SERIAL_HANDLE(m_hand))
+	{
+		finish(ESP_ERROR_COMM_OPEN);
+		return;
+	}
+	m_loop.watch(this);
+	startReset(false);
+}
+
+//
+// Process the input that has arrived on the port.
+//
+void Session::
+Receive()
+{
+	uint8_t buf[256];
+	unsigned avail;
+
+	while ((avail = SerialAvailable(m_hand)) != 0)
+	{
+		if (avail > sizeof(buf))
+			avail = sizeof(buf);
+		unsigned cnt = SerialRead(m_hand, buf, avail);
+		if (cnt == 0)
+			break;
+
+		// a command sent while processing a frame discards the remaining input
+		m_flushed = false;
+		for (unsigned i = 0; (i < cnt) && !m_flushed && !IsDone(); i++)
+		{
+			if (m_dec.Put(buf[i]) == SLIP_FRAME)
+				frame();
+		}
+		if (IsDone())
+			break;
+	}
+}
+
+//
+// Advance the session when its timer expires.
+//
+void Session::
+Expire()
+{
+	m_timerOn = false;
+	if (m_dupWait)
+	{
+		m_dupWait = false;
+		reply(m_dupVal);
+		return;
+	}
+	if (m_resend)
+	{
+		m_resend = false;
+		transmit();
+		return;
+	}
+	switch (m_phase)
+	{
+	case PhaseReset:
+	case PhaseRunReset:
+		resetStep();
+		break;
+
+	case PhaseSyncPause:
+		SerialFlush(m_hand);
+		m_dec.Reset();
+		if (!m_baudSync && (m_syncs >= SESSION_SYNC_TRIES))
+		{
+			m_syncs = 0;
+			m_resets++;
+			startReset(false);
+		}
+		else
+			startSync();
+		break;
+
+	case PhaseSyncDrain:
+		connected();
+		break;
+
+	case PhasePrepare:
+		startWrite();
+		break;
+
+	case PhaseBaudSet:
+		// the reply to the divider change has had time to arrive
+		if (SerialSetSpeed(m_hand, m_newBaud) != 0)
+		{
+			baudFailed();
+			break;
+		}
+		m_baud = m_newBaud;
+		m_phase = PhaseBaudSettle;
+		setTimer(5);
+		break;
+
+	case PhaseBaudSettle:
+		SerialFlush(m_hand);
+		m_dec.Reset();
+		m_baudSync = true;
+		m_syncs = 0;
+		startSync();
+		break;
+
+	case PhaseRead:
+		m_vf.Close();
+		finish(ESP_ERROR_TIMEOUT);
+		break;
+
+	default:
+		if (m_await)
+			error(ESP_ERROR_TIMEOUT);
+		break;
+	}
+}
+
+//
+// Begin a reset sequence, either to enter the bootloader or to run the
+// application.  Each step that requires a delay is timed by the loop.
+//
+void Session::
+startReset(bool forApp)
+{
+	m_resetStepCnt = m_loop.m_esp.ResetSteps(m_loop.m_parm.resetMode, forApp, m_resetStep);
+	m_step = 0;
+	m_await = false;
+	m_phase = forApp ? PhaseRunReset : PhaseReset;
+	resetStep();
+}
+
+void Session::
+resetStep()
+{
+	while (m_step < m_resetStepCnt)
+	{
+		const ResetStep_t& step = m_resetStep[m_step++];
+		if (step.control)
+			SerialControl(m_hand, step.control);
+		if (step.msBreak)
+			SerialBreak(m_hand, step.msBreak);
+		if (step.usDelay)
+		{
+			setTimer((step.usDelay + 999) / 1000);
+			return;
+		}
+	}
+	if (m_phase == PhaseReset)
+		startSync();
+	else
+		finish(0);
+}
+
+//
+// Send a sync command, either to connect or to confirm a new speed.
+//
+void Session::
+startSync()
+{
+	uint8_t buf[36];
+
+	memset(buf, 0x55, sizeof(buf));
+	buf[0] = 0x07;
+	buf[1] = 0x07;
+	buf[2] = 0x12;
+	buf[3] = 0x20;
+	m_phase = PhaseSync;
+	send(ESP_SYNC, buf, sizeof(buf), 0, DEF_TIMEOUT);
+}
+
+//
+// Handle the failure of a sync attempt by pausing, then trying again or
+// resetting the device again.
+//
+void Session::
+syncFailed()
+{
+	m_syncs++;
+	if (m_baudSync)
+	{
+		if (m_syncs >= SESSION_BAUD_SYNC_TRIES)
+		{
+			baudFailed();
+			return;
+		}
+	}
+	else if ((m_syncs >= SESSION_SYNC_TRIES) && (m_resets + 1 >= SESSION_RESETS))
+	{
+		finish(ESP_ERROR_CONNECT);
+		return;
+	}
+	m_phase = PhaseSyncPause;
+	setTimer(SESSION_SYNC_PAUSE_MS);
+}
+
+//
+// The device is synchronized, change the speed if requested and not yet
+// done, otherwise proceed to read the MAC address.
+//
+void Session::
+connected()
+{
+	uint32_t highSpeed = m_loop.m_parm.highSpeed;
+
+	m_await = false;
+	m_baudSync = false;
+	if (highSpeed && !m_baudFailed && (m_baud != highSpeed))
+	{
+		// confirm that the speed is supported on this end before changing the device
+		if (SerialSetSpeed(m_hand, highSpeed) != 0)
+		{
+			SerialSetSpeed(m_hand, m_baud);
+			m_baudFailed = true;
+		}
+		else
+		{
+			SerialSetSpeed(m_hand, m_baud);
+			m_newBaud = highSpeed;
+			m_phase = PhaseBaudRead;
+			readReg(UART0_CLKDIV_REG);
+			return;
+		}
+	}
+	m_port.baud = m_baud;
+	m_phase = PhaseMAC;
+	m_step = 0;
+	readReg(ESP_OTP_MAC0);
+}
+
+//
+// Set the UART divider for the new speed.  The reply is sent at the old
+// speed so it is not awaited.
+//
+void Session::
+setDivider(uint32_t clkDiv)
+{
+	uint8_t buf[16];
+
+	clkDiv &= UART_CLKDIV_MASK;
+	uint32_t newDiv = (uint32_t)(((double)clkDiv * m_baud / m_newBaud) + 0.5);
+	if ((clkDiv == 0) || (newDiv == 0) || (newDiv > UART_CLKDIV_MASK))
+	{
+		m_baudFailed = true;
+		connected();
+		return;
+	}
+	putLE(UART0_CLKDIV_REG, 4, buf, 0);
+	putLE(newDiv, 4, buf, 4);
+	putLE(UART_CLKDIV_MASK, 4, buf, 8);
+	putLE(0, 4, buf, 12);
+	m_phase = PhaseBaudSet;
+	send(ESP_WRITE_REG, buf, sizeof(buf), 0, 0);
+	m_await = false;
+	setTimer(10);
+}
+
+//
+// The device did not respond at the new speed.  Rather than attempting to
+// restore the divider, the device is reset and reconnected at the original
+// speed, which is then kept.
+//
+void Session::
+baudFailed()
+{
+	m_baud = m_loop.m_parm.dlSpeed;
+	SerialSetSpeed(m_hand, m_baud);
+	m_baudFailed = true;
+	m_baudSync = false;
+	m_syncs = 0;
+	m_resets = 0;
+	startReset(false);
+}
+
+//
+// Send a command to read a register.
+//
+void Session::
+readReg(uint32_t addr)
+{
+	uint8_t buf[4];
+
+	putLE(addr, 4, buf);
+	send(ESP_READ_REG, buf, sizeof(buf), 0, DEF_TIMEOUT);
+}
+
+//
+// Once the images have been prepared, prepare the frames for the overlays,
+// if any, and begin writing.
+//
+void Session::
+startWrite()
+{
+	if (m_phase != PhasePrepare)
+	{
+		m_phase = PhasePrepare;
+		m_port.stage = "prepare";
+		m_tickWait = getTickCount();
+	}
+	if (!m_loop.m_ready)
+	{
+		setTimer(GANG_PREP_POLL_MS);
+		return;
+	}
+	m_port.msPrepWait = getTickCount() - m_tickWait;
+	if (m_loop.m_readyStat != 0)
+	{
+		finish(m_loop.m_readyStat);
+		return;
+	}
+
+	if (m_loop.m_cache != NULL)
+	{
+		int stat;
+		m_port.stage = "overlay";
+		if ((stat = GangPatch(m_patch, *m_loop.m_cache, m_loop.m_overlay, m_loop.m_overlayCnt, m_port)) != 0)
+		{
+			finish(stat);
+			return;
+		}
+	}
+	m_segIdx = 0;
+	nextSegment();
+}
+
+//
+// Begin writing the next non-empty image segment or, if all have been
+// written, proceed to reading.
+//
+void Session::
+nextSegment()
+{
+	while ((m_segIdx < m_loop.m_segCnt) && (m_loop.m_seg[m_segIdx].size == 0))
+		m_segIdx++;
+	if (m_segIdx >= m_loop.m_segCnt)
+	{
+		startRead(0);
+		return;
+	}
+
+	const SessionLoop::Segment_t& seg = m_loop.m_seg[m_segIdx];
+	uint8_t buf[16];
+	m_port.stage = "write";
+	m_blkIdx = 0;
+	m_blkCnt = (seg.size + ESP_FLASH_BLK_SIZE - 1) / ESP_FLASH_BLK_SIZE;
+	uint32_t eraseSize = m_blkCnt * ESP_FLASH_BLK_SIZE;
+	putLE(eraseSize, 4, buf, 0);
+	putLE(m_blkCnt, 4, buf, 4);
+	putLE(ESP_FLASH_BLK_SIZE, 4, buf, 8);
+	putLE(seg.addr & ~(ESP_FLASH_BLK_SIZE - 1), 4, buf, 12);
+	m_phase = PhaseErase;
+	send(ESP_FLASH_BEGIN, buf, sizeof(buf), 0, ESP::CmdTimeout(m_baud, sizeof(buf), eraseSize));
+}
+
+//
+// Send the current block of the current image segment.
+//
+void Session::
+sendBlock()
+{
+	const SessionLoop::Segment_t& seg = m_loop.m_seg[m_segIdx];
+	const uint32_t blkSize = ESP_FLASH_BLK_SIZE;
+	m_phase = PhaseWrite;
+	if (m_loop.m_cache != NULL)
+	{
+		// the block is ready to send
+		unsigned frameLen;
+		const uint8_t *frame = m_patch.Frame(*m_loop.m_cache, seg.frameIdx + m_blkIdx, frameLen);
+		sendFrame(ESP_FLASH_DATA, frame, frameLen, ESP::CmdTimeout(m_baud, sizeof(m_blk)));
+		return;
+	}
+
+	uint32_t ofst = m_blkIdx * blkSize;
+	uint32_t cnt = (seg.size - ofst < blkSize) ? seg.size - ofst : blkSize;
+	uint16_t cksum;
+	const uint8_t *data = ESP::FlashBlock(m_blk, m_blkIdx, seg.data + ofst, cnt,
+			seg.addr, seg.flashParmVal, seg.flashParmMask, cksum);
+
+	// the command is sent from one buffer
+	if (data != m_blk + 16)
+		memcpy(m_blk + 16, data, blkSize);
+	send(ESP_FLASH_DATA, m_blk, sizeof(m_blk), cksum, ESP::CmdTimeout(m_baud, sizeof(m_blk)));
+}
+
+//
+// Begin reading a region of Flash or, if all have been read, proceed to
+// running the application.
+//
+void Session::
+startRead(unsigned readIdx)
+{
+	m_readIdx = readIdx;
+	if (m_readIdx >= m_loop.m_readCnt)
+	{
+		startRun();
+		return;
+	}
+
+	const GangRead_t& read = m_loop.m_read[m_readIdx];
+	char file[FILENAME_MAX];
+	m_port.stage = "read";
+	GangFileName(file, sizeof(file), read.file, m_port.name, m_readIdx + 1);
+	if (m_vf.Open(file, "wb") != 0)
+	{
+		finish(ESP_ERROR_FILE_CREATE);
+		return;
+	}
+	m_readLeft = read.size;
+	m_readBlkSize = (read.size <= ESP_FLASH_BLK_SIZE) ? read.size : ESP_FLASH_BLK_SIZE;
+	m_step = 0;
+	m_phase = PhaseStub;
+	sendStub();
+}
+
+//
+// Send the next command of the sequence that downloads and runs the Flash
+// read stub.
+//
+void Session::
+sendStub()
+{
+	const GangRead_t& read = m_loop.m_read[m_readIdx];
+	uint8_t buf[16];
+	uint8_t *stub = m_blk + 16;
+	uint32_t blkCnt = (read.size + m_readBlkSize - 1) / m_readBlkSize;
+	unsigned stubLen = ESP::FlashReadStub(stub, read.addr, m_readBlkSize, blkCnt);
+
+	switch (m_step)
+	{
+	case 0:		// FLASH_BEGIN with no erasure
+		putLE(0, 4, buf, 0);
+		putLE(0, 4, buf, 4);
+		putLE(ESP_FLASH_BLK_SIZE, 4, buf, 8);
+		putLE(0, 4, buf, 12);
+		send(ESP_FLASH_BEGIN, buf, sizeof(buf), 0, ESP::CmdTimeout(m_baud, sizeof(buf)));
+		break;
+
+	case 1:		// MEM_BEGIN
+		putLE(stubLen, 4, buf, 0);
+		putLE(1, 4, buf, 4);
+		putLE(stubLen, 4, buf, 8);
+		putLE(IRAM_ADDR, 4, buf, 12);
+		send(ESP_MEM_BEGIN, buf, sizeof(buf), 0, DEF_TIMEOUT);
+		break;
+
+	case 2:		// MEM_DATA
+		putLE(stubLen, 4, m_blk, 0);
+		putLE(0, 4, m_blk, 4);
+		putLE(0, 4, m_blk, 8);
+		putLE(0, 4, m_blk, 12);
+		send(ESP_MEM_DATA, m_blk, 16 + stubLen, ESP::Checksum(stub, stubLen), DEF_TIMEOUT);
+		break;
+
+	case 3:		// MEM_END, running the stub
+		putLE(0, 4, buf, 0);
+		putLE(FLASH_READ_STUB_BEGIN, 4, buf, 4);
+		send(ESP_MEM_END, buf, 8, 0, DEF_TIMEOUT);
+		break;
+
+	default:
+		// the stub is running, the data follows in frames of one block each
+		m_phase = PhaseRead;
+		m_await = false;
+		setTimer(DEF_TIMEOUT);
+		break;
+	}
+}
+
+//
+// Store a block of data sent by the Flash read stub.
+//
+void Session::
+readData(const uint8_t *data, unsigned dataLen)
+{
+	if (dataLen != m_readBlkSize)
+	{
+		m_vf.Close();
+		finish(ESP_ERROR_SLIP_FRAME);
+		return;
+	}
+	uint32_t cnt = (m_readLeft < dataLen) ? m_readLeft : dataLen;
+	if (m_vf.Write(data, 1, cnt) != cnt)
+	{
+		m_vf.Close();
+		finish(ESP_ERROR_FILE_WRITE);
+		return;
+	}
+	m_readLeft -= cnt;
+	if (m_readLeft == 0)
+	{
+		m_vf.Close();
+		m_timerOn = false;
+		startRead(m_readIdx + 1);
+	}
+	else
+		setTimer(DEF_TIMEOUT);
+}
+
+//
+// Run the application if requested, otherwise conclude the session.
+//
+void Session::
+startRun()
+{
+	const GangParm_t& parm = m_loop.m_parm;
+
+	if ((parm.flags & ESP_AUTO_RUN) == 0)
+	{
+		finish(0);
+		return;
+	}
+	m_port.stage = "run";
+	if (parm.resetMode != ResetNone)
+	{
+		startReset(true);
+		return;
+	}
+	m_phase = PhaseRun;
+	m_step = 0;
+	runStep();
+}
+
+//
+// Send the next command of the sequence that runs the application without
+// a reset: FLASH_BEGIN, then FLASH_END requesting a reboot.
+//
+void Session::
+runStep()
+{
+	uint8_t buf[16];
+
+	if (m_step == 0)
+	{
+		putLE(0, 4, buf, 0);
+		putLE(0, 4, buf, 4);
+		putLE(ESP_FLASH_BLK_SIZE, 4, buf, 8);
+		putLE(0, 4, buf, 12);
+		send(ESP_FLASH_BEGIN, buf, sizeof(buf), 0, ESP::CmdTimeout(m_baud, sizeof(buf)));
+	}
+	else
+	{
+		// FLASH_END with a zero value reboots
+		putLE(0, 4, buf);
+		send(ESP_FLASH_END, buf, 4, 0, DEF_TIMEOUT);
+	}
+}
+
+//
+// Conclude the session, recording the result.
+//
+void Session::
+finish(int stat)
+{
+	m_phase = PhaseDone;
+	m_timerOn = false;
+	m_await = false;
+	m_resend = false;
+	m_dupWait = false;
+	m_port.stat = stat;
+	m_port.msElapsed = getTickCount() - m_tickStart;
+	if (IS_VALID_SERIAL_HANDLE(m_hand))
+	{
+		m_loop.unwatch(this);
+		SerialClose(m_hand);
+		m_hand = INVALID_SERIAL_HANDLE;
+	}
+	m_loop.done(m_port);
+}
+
+//
+// Compose and send a command, retaining it in case it must be re-sent.
+//
+void Session::
+send(uint8_t op, const uint8_t *data, unsigned dataLen, uint32_t checkVal, unsigned msTimeout)
+{
+	uint8_t hdr[8];
+
+	hdr[0] = 0;
+	hdr[1] = op;
+	putLE(dataLen, 2, hdr, 2);
+	putLE(checkVal, 4, hdr, 4);
+	m_cmdLen = 0;
+	m_cmd[m_cmdLen++] = SLIP_END;
+	m_cmdLen += SlipEncode(hdr, sizeof(hdr), m_cmd + m_cmdLen);
+	m_cmdLen += SlipEncode(data, dataLen, m_cmd + m_cmdLen);
+	m_cmd[m_cmdLen++] = SLIP_END;
+	m_tx = m_cmd;
+	m_txLen = m_cmdLen;
+
+	m_op = op;
+	m_msTimeout = msTimeout ? msTimeout : DEF_TIMEOUT;
+	m_retries = 0;
+	m_resend = false;
+	m_msLate = 0;
+	transmit();
+}
+
+//
+// Send a command already encoded, e.g. a frame from a packet cache.  The
+// frame must remain valid until the command completes.
+//
+void Session::
+sendFrame(uint8_t op, const uint8_t *frame, unsigned frameLen, unsigned msTimeout)
+{
+	m_tx = frame;
+	m_txLen = frameLen;
+	m_op = op;
+	m_msTimeout = msTimeout ? msTimeout : DEF_TIMEOUT;
+	m_retries = 0;
+	m_resend = false;
+	m_msLate = 0;
+	transmit();
+}
+
+//
+// Send the composed command after discarding any pending input, as the
+// ESP class does, and await the reply.
+//
+void Session::
+transmit()
+{
+	SerialFlush(m_hand);
+	m_dec.Reset();
+	m_flushed = true;
+	if (SerialWrite(m_hand, m_tx, m_txLen) != m_txLen)
+	{
+		finish(ESP_ERROR_COMM_WRITE);
+		return;
+	}
+	m_await = true;
+	setTimer(m_msTimeout);
+}
+
+//
+// Process a frame received from the device.  Frames that aren't a reply to
+// the outstanding command are stale and are ignored.
+//
+void Session::
+frame()
+{
+	const uint8_t *data = m_dec.Frame();
+	unsigned len = m_dec.Length();
+
+	if (m_phase == PhaseRead)
+	{
+		readData(data, len);
+		return;
+	}
+	if ((len < 8) || (data[0] != 0x01) || (data[1] != m_op))
+		return;
+	if (m_phase == PhaseSyncDrain)
+	{
+		// extend the quiet period for each additional reply
+		setTimer(ESP::CmdTimeout(m_baud, 0));
+		return;
+	}
+	if (m_dupWait)
+	{
+		// the reply to the first transmission was late, both have now arrived
+		m_dupWait = false;
+		m_timerOn = false;
+		reply(m_dupVal);
+		return;
+	}
+	if (!m_await)
+		return;
+
+	unsigned bodyLen = getLE(2, data, 2);
+	int stat = (len == 8 + bodyLen) ? ESP::ReplyStatus(data + 8, bodyLen) : ESP_ERROR_RESP_HDR;
+	if (stat != 0)
+		error(stat);
+	else if (m_msLate != 0)
+	{
+		// Replies carry no sequence number so, after re-sending a command
+		// whose reply was late rather than lost, a second reply may follow.
+		// It must not be taken as the reply to the next command.
+		m_await = false;
+		m_dupWait = true;
+		m_dupVal = getLE(4, data, 4);
+		setTimer(m_msLate);
+	}
+	else
+		reply(getLE(4, data, 4));
+}
+
+//
+// Advance the session on receiving a successful reply.
+//
+void Session::
+reply(uint32_t val)
+{
+	m_await = false;
+	m_timerOn = false;
+	switch (m_phase)
+	{
+	case PhaseSync:
+		m_phase = PhaseSyncDrain;
+		setTimer(ESP::CmdTimeout(m_baud, 0));
+		break;
+
+	case PhaseBaudRead:
+		setDivider(val);
+		break;
+
+	case PhaseMAC:
+		m_macReg[m_step++] = val;
+		if (m_step < 4)
+			readReg(ESP_OTP_MAC0 + (4 * m_step));
+		else
+		{
+			m_port.haveMAC = (ESP::DecodeMAC(m_macReg, m_port.mac, sizeof(m_port.mac)) == 0);
+			startWrite();
+		}
+		break;
+
+	case PhaseErase:
+		sendBlock();
+		break;
+
+	case PhaseWrite:
+		if (++m_blkIdx < m_blkCnt)
+			sendBlock();
+		else
+		{
+			m_segIdx++;
+			nextSegment();
+		}
+		break;
+
+	case PhaseStub:
+		m_step++;
+		sendStub();
+		break;
+
+	case PhaseRun:
+		if (m_step++ == 0)
+			runStep();
+		else
+			finish(0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+//
+// Handle an error reply or the lack of a reply, re-sending the command as
+// the retry policy of the ESP class allows.
+//
+void Session::
+error(int stat)
+{
+	m_await = false;
+	int msRetry = ESP::RetryDelay(m_op, stat, m_retries);
+	if (msRetry >= 0)
+	{
+		m_retries++;
+		m_port.retries++;
+
+		// a slow reply may be late rather than lost, allow more time
+		if (stat == ESP_ERROR_TIMEOUT)
+		{
+			m_msLate = m_msTimeout;
+			m_msTimeout += m_msTimeout / 2;
+		}
+		if (msRetry)
+		{
+			m_resend = true;
+			setTimer(msRetry);
+		}
+		else
+			transmit();
+		return;
+	}
+
+	switch (m_phase)
+	{
+	case PhaseSync:
+		syncFailed();
+		break;
+
+	case PhaseBaudRead:
+		// keep the current speed
+		m_baudFailed = true;
+		connected();
+		break;
+
+	case PhaseMAC:
+		// the MAC address is needed only by an overlay
+		startWrite();
+		break;
+
+	default:
+		if (m_phase == PhaseStub)
+			m_vf.Close();
+		finish(stat);
+		break;
+	}
+}
+
+//
+// Arrange for Expire() to be called after the given time.
+//
+void Session::
+setTimer(unsigned ms)
+{
+	m_tickDue = getTickCount() + ms;
+	m_timerOn = true;
+}
+
+/** internal functions **/
+
+//
+// Get the processor time used by the process in milliseconds.
+//
+static unsigned
+cpuTime()
+{
+#if defined(WIN32)
+	FILETIME timeCreate, timeExit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &timeCreate, &timeExit, &kernel, &user))
+		return(0);
+	unsigned __int64 t = ((unsigned __int64)kernel.dwHighDateTime << 32) + kernel.dwLowDateTime +
+			((unsigned __int64)user.dwHighDateTime << 32) + user.dwLowDateTime;
+	return((unsigned)(t / 10000));
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return(0);
+	return((unsigned)((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+			(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000));
+#endif
+}
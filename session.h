@@ -0,0 +1,108 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(SESSION_H__)
+#define SESSION_H__
+
+#include "esp.h"
+#include "gang.h"
+
+#define SESSION_MAX					GANG_MAX_PORTS	// the most sessions driven by one loop
+#define SESSION_MAX_RETRIES			3			// times that a command is re-sent after an error
+#define SESSION_RESETS				4			// resets attempted when connecting
+#define SESSION_SYNC_TRIES			4			// sync attempts following each reset
+#define SESSION_BAUD_SYNC_TRIES		3			// sync attempts after changing speed
+
+// the function called when a session completes
+typedef void (*SessionDone_t)(void *arg, GangPort_t& port);
+
+// the function called to learn if the work is ready, supplying it if so
+typedef bool (*SessionReady_t)(void *arg, SessionLoop& loop, int& stat);
+
+class Session;
+class SessionLoop;
+class PacketCache;
+
+//
+// A class that drives the sessions for several ports from a single thread.
+// Each session is a state machine that advances when a reply frame arrives
+// or when its timer expires, so no session ever blocks waiting for its
+// device.  The sessions perform the same steps as a Gang worker: connect,
+// optionally raise the link speed, read the MAC address, write the images,
+// read back regions of Flash and run the application.  If the work is
+// supplied by a function set with SetReady(), the sessions connect while
+// it is being prepared and wait for it before writing.
+//
+class SessionLoop
+{
+public:
+	SessionLoop(const GangParm_t& parm);
+	~SessionLoop();
+
+	int SetWork(const GangImage_t *image, unsigned imageCnt, const GangRead_t *read, unsigned readCnt,
+			const PacketCache *cache = NULL);
+	void SetOverlays(const GangOverlay_t *overlay, unsigned overlayCnt) { m_overlay = overlay; m_overlayCnt = overlayCnt; }
+	void SetDone(SessionDone_t func, void *arg) { m_doneFunc = func; m_doneArg = arg; }
+	void SetReady(SessionReady_t func, void *arg) { m_readyFunc = func; m_readyArg = arg; m_ready = false; }
+	int Add(GangPort_t& port);
+	unsigned Run();
+	unsigned CPUTime() const { return(m_msCPU); }
+
+private:
+	SessionLoop(const SessionLoop&);
+	SessionLoop& operator=(const SessionLoop&);
+
+	friend class Session;
+
+	// a contiguous region of an image to be written to Flash
+	typedef struct
+	{
+		const uint8_t *data;		// the content of the segment
+		uint32_t size;				// the size of the segment
+		uint32_t addr;				// the Flash address of the segment
+		uint16_t flashParmVal;		// Flash parameters to apply
+		uint16_t flashParmMask;
+		uint32_t frameIdx;			// the first frame of the segment in the packet cache
+	} Segment_t;
+
+	void watch(Session *session);
+	void unwatch(Session *session);
+	void done(GangPort_t& port);
+
+	Session *m_session[SESSION_MAX];
+	unsigned m_sessionCnt;
+	Segment_t *m_seg;				// the segments of all images
+	unsigned m_segCnt;
+	const PacketCache *m_cache;		// the prepared frames, NULL to prepare each block
+	const GangOverlay_t *m_overlay;	// the regions produced for each device
+	unsigned m_overlayCnt;
+	const GangRead_t *m_read;		// the regions to read back
+	unsigned m_readCnt;
+	GangParm_t m_parm;
+	ESP m_esp;						// supplies the reset sequences
+	SessionDone_t m_doneFunc;
+	void *m_doneArg;
+	SessionReady_t m_readyFunc;		// supplies the work once it is prepared
+	void *m_readyArg;
+	bool m_ready;					// if the work has been supplied
+	int m_readyStat;				// the result of preparing the work
+	unsigned m_msCPU;				// the processor time used by Run()
+	int m_pollFD;					// the event notification descriptor, if used
+};
+
+#endif	// defined(SESSION_H__)
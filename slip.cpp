@@ -0,0 +1,115 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "slip.h"
+
+/** class implementations **/
+
+//
+// Process the next byte of input.  The return value is SLIP_FRAME if the
+// byte completes a frame, SLIP_ERROR if the frame was malformed and is
+// being discarded, SLIP_MORE otherwise.  A completed frame remains
+// available until the next byte is processed.
+//
+int SlipDecoder::
+Put(uint8_t c)
+{
+	switch (m_state)
+	{
+	case StateIdle:
+		if (c == SLIP_END)
+		{
+			m_state = StateFrame;
+			m_len = 0;
+		}
+		break;
+
+	case StateFrame:
+		if (c == SLIP_END)
+		{
+			// a delimiter with no data is taken as the start of a frame
+			if (m_len == 0)
+				break;
+			m_state = StateIdle;
+			return(SLIP_FRAME);
+		}
+		if (c == SLIP_ESC)
+		{
+			m_state = StateEscape;
+			break;
+		}
+		if (m_len >= SLIP_MAX_FRAME)
+		{
+			m_state = StateDiscard;
+			return(SLIP_ERROR);
+		}
+		m_frame[m_len++] = c;
+		break;
+
+	case StateEscape:
+		if (((c != SLIP_ESC_END) && (c != SLIP_ESC_ESC)) || (m_len >= SLIP_MAX_FRAME))
+		{
+			// an invalid escape sequence, a delimiter begins a new frame
+			m_state = (c == SLIP_END) ? StateFrame : StateDiscard;
+			m_len = 0;
+			return(SLIP_ERROR);
+		}
+		m_frame[m_len++] = (c == SLIP_ESC_END) ? SLIP_END : SLIP_ESC;
+		m_state = StateFrame;
+		break;
+
+	case StateDiscard:
+		if (c == SLIP_END)
+			m_state = StateIdle;
+		break;
+	}
+	return(SLIP_MORE);
+}
+
+/** public functions **/
+
+//
+// Encode data for transmission, escaping the special characters.  The
+// buffer must have space for twice the length of the data.  The frame
+// delimiters are not added.  The return value is the encoded length.
+//
+unsigned
+SlipEncode(const uint8_t *data, unsigned dataLen, uint8_t *buf)
+{
+	unsigned len = 0;
+
+	while (dataLen--)
+	{
+		uint8_t c = *data++;
+		if (c == SLIP_END)
+		{
+			buf[len++] = SLIP_ESC;
+			buf[len++] = SLIP_ESC_END;
+		}
+		else if (c == SLIP_ESC)
+		{
+			buf[len++] = SLIP_ESC;
+			buf[len++] = SLIP_ESC_ESC;
+		}
+		else
+			buf[len++] = c;
+	}
+	return(len);
+}
@@ -0,0 +1,71 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(SLIP_H__)
+#define SLIP_H__
+
+#include "sysdep.h"
+
+#if defined(HAVE_STDINT_H)
+  #include <stdint.h>
+#endif
+
+#define SLIP_END					0xc0		// frame delimiter
+#define SLIP_ESC					0xdb		// escape introducer
+#define SLIP_ESC_END				0xdc		// escaped frame delimiter
+#define SLIP_ESC_ESC				0xdd		// escaped escape introducer
+
+#define SLIP_MAX_FRAME				2048		// the longest frame accepted
+
+// results from SlipDecoder::Put()
+#define SLIP_MORE					0			// the frame is incomplete
+#define SLIP_FRAME					1			// a frame is complete
+#define SLIP_ERROR					-1			// a malformed frame was discarded
+
+//
+// A class that decodes SLIP frames a byte at a time so that data may be
+// processed as it arrives rather than by waiting for each frame.  Data
+// outside of a frame is ignored.
+//
+class SlipDecoder
+{
+public:
+	SlipDecoder() { Reset(); }
+
+	void Reset() { m_state = StateIdle; m_len = 0; }
+	int Put(uint8_t c);
+	const uint8_t *Frame() const { return(m_frame); }
+	unsigned Length() const { return(m_len); }
+
+private:
+	typedef enum
+	{
+		StateIdle,					// awaiting the start of a frame
+		StateFrame,					// within a frame
+		StateEscape,				// following an escape introducer
+		StateDiscard				// discarding a malformed frame
+	} State_t;
+
+	State_t m_state;
+	unsigned m_len;					// the length of the frame so far
+	uint8_t m_frame[SLIP_MAX_FRAME];	// the decoded frame
+};
+
+unsigned SlipEncode(const uint8_t *data, unsigned dataLen, uint8_t *buf);
+
+#endif	// defined(SLIP_H__)
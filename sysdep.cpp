@@ -0,0 +1,169 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ *
+ * This code implements the operating system dependent functions used by the
+ * library and the applications built on it.
+ *
+ */
+
+/** include files **/
+#include "esp.h"
+#if defined(__linux__)
+  #include <time.h>
+#endif
+
+/** public data **/
+uint16_t diagCode = 0;
+
+/** public functions **/
+
+/*
+ ** usDelay
+ *
+ * Delay for a specified number of microseconds.
+ *
+ */
+void
+usDelay(uint32_t us)
+{
+#if defined(WIN32)
+	__int64 end;
+
+	if (QueryPerformanceCounter((LARGE_INTEGER *)&end))
+	{
+		__int64 freq, tick;
+
+		// compute the number of counts to equal the requested delay
+		QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
+		end += ((__int64)us * freq / 1000000);
+
+		// implement the delay
+		do
+		{
+			QueryPerformanceCounter((LARGE_INTEGER *)&tick);
+		}
+		while (tick <= end);
+	}
+#elif defined(__linux__)
+	// perhaps nanosleep() should be used
+    usleep(us);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of isDelay()
+#endif
+}
+
+/*
+ ** msDelay
+ *
+ * Delay for a specified number of milliseconds.
+ *
+ */
+void
+msDelay(unsigned ms)
+{
+#if defined(WIN32)
+	if (ms > 65)
+	{
+		for (unsigned tick = GetTickCount() + ms; GetTickCount() < tick; )
+			;
+	}
+	else
+		// for smaller values, to get better resolution
+		usDelay(ms * 1000);
+#elif defined(__linux__)
+    usleep(ms * 1000);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of msDelay()
+#endif
+}
+
+/*
+ ** getTickCount
+ *
+ * Retrieve a tick count from the OS representing elapsed milliseconds.
+ *
+ */
+unsigned
+getTickCount(void)
+{
+	unsigned tick = 0;
+
+#if defined(WIN32)
+	tick = GetTickCount();
+#elif defined(__linux__)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tick = (ts.tv_sec * 1000) + ((ts.tv_nsec + 500000) / 1000000);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of getTickCount()
+#endif
+	return(tick);
+}
+
+#if defined(NEED_MEMICMP)
+//
+// Case-insensitive memory block comparison.
+//
+int
+_memicmp(const void *_p1, const void *_p2, unsigned len)
+{
+	const uint8_t *p1 = (const uint8_t *)_p1;
+	const uint8_t *p2 = (const uint8_t *)_p2;
+
+	while (len--)
+	{
+		unsigned char c1, c2;
+
+		// fetch the next byte, change to upper case if alphabetic
+		c1 = *p1++;
+		if (isalpha(c1) && islower(c1))
+			c1 = toupper(c1);
+		c2 = *p2++;
+		if (isalpha(c2) && islower(c2))
+			c2 = toupper(c2);
+		if (c1 != c2)
+			return((int)c1 - (int)c2);
+	}
+	return(0);
+}
+#endif
+
+#if defined(NEED_STRICMP)
+//
+// Case-insensitive string comparison.
+//
+int
+_stricmp(const char *s1, const char *s2)
+{
+	int len1, len2;
+
+	// guard against null pointers, compute string lengths (including the trailing null)
+	if (s1 == NULL)
+		s1 = "";
+	len1 = strlen(s1) + 1;
+	if (s2 == NULL)
+		s2 = "";
+	len2 = strlen(s2) + 1;
+
+	// do the comparison
+	return(_memicmp(s1, s2, (len1 < len2) ? len1 : len2));
+}
+#endif
@@ -25,6 +25,9 @@
 
 #if defined(WIN32)
   #define _CRT_SECURE_NO_WARNINGS
+  #if (defined(_MSC_VER) && (_MSC_VER < 1900))
+	#define vsnprintf _vsnprintf
+  #endif
   #if (defined(_MSC_VER) && (_MSC_VER <= 1200))
 	// stdint.h not available on VC6, provide what's needed
 	typedef unsigned char uint8_t;
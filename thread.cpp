@@ -0,0 +1,199 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/** include files **/
+#include "thread.h"
+#include <stdlib.h>
+
+/** class implementations **/
+
+Thread::
+Thread()
+{
+	m_func = NULL;
+	m_arg = NULL;
+	m_started = false;
+}
+
+Thread::
+~Thread()
+{
+	Join();
+}
+
+//
+// Begin executing a function on a new thread.  The return value is zero
+// on success, non-zero otherwise.
+//
+int Thread::
+Start(ThreadFunc_t func, void *arg)
+{
+	if (m_started || (func == NULL))
+		return(-1);
+	m_func = func;
+	m_arg = arg;
+#if defined(WIN32)
+	if ((m_handle = CreateThread(NULL, 0, entry, this, 0, NULL)) == NULL)
+		return(-1);
+#elif defined(__linux__)
+	if (pthread_create(&m_handle, NULL, entry, this) != 0)
+		return(-1);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of Thread::Start()
+#endif
+	m_started = true;
+	return(0);
+}
+
+//
+// Wait for the thread to finish executing.  The return value is zero on
+// success, non-zero otherwise.
+//
+int Thread::
+Join()
+{
+	if (!m_started)
+		return(-1);
+	m_started = false;
+#if defined(WIN32)
+	WaitForSingleObject(m_handle, INFINITE);
+	CloseHandle(m_handle);
+#elif defined(__linux__)
+	if (pthread_join(m_handle, NULL) != 0)
+		return(-1);
+#elif defined(ERROR_MISSING_IMPLEMENTATION)
+	#error missing implementation of Thread::Join()
+#endif
+	return(0);
+}
+
+//
+// The entry point of a new thread.
+//
+#if defined(WIN32)
+DWORD WINAPI Thread::
+entry(LPVOID arg)
+{
+	Thread *thread = (Thread *)arg;
+	thread->m_func(thread->m_arg);
+	return(0);
+}
+#elif defined(__linux__)
+void *Thread::
+entry(void *arg)
+{
+	Thread *thread = (Thread *)arg;
+	thread->m_func(thread->m_arg);
+	return(NULL);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+
+Mutex::
+Mutex()
+{
+#if defined(WIN32)
+	InitializeCriticalSection(&m_mutex);
+#elif defined(__linux__)
+	pthread_mutex_init(&m_mutex, NULL);
+#endif
+}
+
+Mutex::
+~Mutex()
+{
+#if defined(WIN32)
+	DeleteCriticalSection(&m_mutex);
+#elif defined(__linux__)
+	pthread_mutex_destroy(&m_mutex);
+#endif
+}
+
+void Mutex::
+Lock()
+{
+#if defined(WIN32)
+	EnterCriticalSection(&m_mutex);
+#elif defined(__linux__)
+	pthread_mutex_lock(&m_mutex);
+#endif
+}
+
+void Mutex::
+Unlock()
+{
+#if defined(WIN32)
+	LeaveCriticalSection(&m_mutex);
+#elif defined(__linux__)
+	pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+Event::
+Event()
+{
+#if defined(WIN32)
+	m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	m_signaled = false;
+#endif
+}
+
+Event::
+~Event()
+{
+#if defined(WIN32)
+	CloseHandle(m_event);
+#elif defined(__linux__)
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+#endif
+}
+
+void Event::
+Set()
+{
+#if defined(WIN32)
+	SetEvent(m_event);
+#elif defined(__linux__)
+	pthread_mutex_lock(&m_mutex);
+	m_signaled = true;
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+void Event::
+Wait()
+{
+#if defined(WIN32)
+	WaitForSingleObject(m_event, INFINITE);
+#elif defined(__linux__)
+	pthread_mutex_lock(&m_mutex);
+	while (!m_signaled)
+		pthread_cond_wait(&m_cond, &m_mutex);
+	m_signaled = false;
+	pthread_mutex_unlock(&m_mutex);
+#endif
+}
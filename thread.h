@@ -0,0 +1,126 @@
+// $Id$
+
+/*
+ * Copyright 2015 Don Kinzer
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#if	!defined(THREAD_H__)
+#define THREAD_H__
+
+#include "sysdep.h"
+#if defined(WIN32)
+  #include <windows.h>
+#elif defined(__linux__)
+  #include <pthread.h>
+#endif
+
+// the function executed by a thread
+typedef void (*ThreadFunc_t)(void *arg);
+
+//
+// A class representing a thread of execution.
+//
+class Thread
+{
+public:
+	Thread();
+	~Thread();
+
+	int Start(ThreadFunc_t func, void *arg);
+	int Join();
+	bool IsStarted() const { return(m_started); }
+
+private:
+	Thread(const Thread&);
+	Thread& operator=(const Thread&);
+
+#if defined(WIN32)
+	static DWORD WINAPI entry(LPVOID arg);
+	HANDLE m_handle;
+#elif defined(__linux__)
+	static void *entry(void *arg);
+	pthread_t m_handle;
+#endif
+	ThreadFunc_t m_func;			// the function to execute
+	void *m_arg;					// the parameter for the function
+	bool m_started;					// if the thread has been started
+};
+
+//
+// A class representing a mutual exclusion lock.
+//
+class Mutex
+{
+public:
+	Mutex();
+	~Mutex();
+
+	void Lock();
+	void Unlock();
+
+private:
+	Mutex(const Mutex&);
+	Mutex& operator=(const Mutex&);
+
+#if defined(WIN32)
+	CRITICAL_SECTION m_mutex;
+#elif defined(__linux__)
+	pthread_mutex_t m_mutex;
+#endif
+};
+
+//
+// A class representing an event on which a thread may wait.  Setting the
+// event releases one waiting thread or, if none is waiting, the next one
+// to wait; the event is then reset.
+//
+class Event
+{
+public:
+	Event();
+	~Event();
+
+	void Set();
+	void Wait();
+
+private:
+	Event(const Event&);
+	Event& operator=(const Event&);
+
+#if defined(WIN32)
+	HANDLE m_event;
+#elif defined(__linux__)
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	bool m_signaled;
+#endif
+};
+
+//
+// A class that holds a lock on a mutex for the duration of a scope.
+//
+class MutexLock
+{
+public:
+	MutexLock(Mutex& mutex) : m_mutex(mutex) { m_mutex.Lock(); }
+	~MutexLock() { m_mutex.Unlock(); }
+
+private:
+	MutexLock(const MutexLock&);
+	MutexLock& operator=(const MutexLock&);
+	Mutex& m_mutex;
+};
+
+#endif	// defined(THREAD_H__)